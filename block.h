@@ -0,0 +1,61 @@
+/* ----------------------------------------------------------------------------
+ *         Block device interface
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Interface between storage drivers (SD card, RAM disk) and their users (USB
+** mass storage, file systems). Devices are made of 512-byte blocks and are
+** accessed asynchronously: read() and write() start the operation and the
+** callback reports its end, possibly before they return (RAM disk), so users
+** must not rely on the order.
+*/
+
+#ifndef BLOCK_H
+#define BLOCK_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Size of a block, in bytes.
+#define BLOCK_SIZE              512
+
+/// Operation status.
+#define BLOCK_STATUS_OK         0
+#define BLOCK_STATUS_ERROR      1
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Called at the end of a read or a write, with its status.
+typedef void (*BlockCallback)(void *arg, unsigned char status);
+
+/// Block device, filled in by the initialization of its driver.
+typedef struct _BlockDevice {
+
+    /// Starts reading or writing count blocks from block onwards. Return 1 if
+    /// the operation has started; 0 if the device is busy or not ready, or
+    /// if the range is invalid (the callback is then not called).
+    unsigned char (*read)(struct _BlockDevice *device,
+                          unsigned int block,
+                          void *buffer,
+                          unsigned int count,
+                          BlockCallback callback,
+                          void *arg);
+    unsigned char (*write)(struct _BlockDevice *device,
+                           unsigned int block,
+                           const void *buffer,
+                           unsigned int count,
+                           BlockCallback callback,
+                           void *arg);
+    /// Number of blocks; 0 if there is no medium.
+    unsigned int numBlocks;
+    unsigned char writeProtected;
+    /// Driver data.
+    void *context;
+
+} BlockDevice;
+
+#endif //#ifndef BLOCK_H
@@ -32,11 +32,10 @@
 //------------------------------------------------------------------------------
 #include "exceptions.h"
 #include "AT91SAM3U4.h"
-
-//------------------------------------------------------------------------------
-//         Types
-//------------------------------------------------------------------------------
-typedef union { IntFunc __fun; void * __ptr; } IntVector;
+#include "clock.h"
+#include "dwt.h"
+#include "startup.h"
+#include "irq.h"
 
 //------------------------------------------------------------------------------
 //         ProtoTypes
@@ -62,8 +61,8 @@ extern unsigned int __ICFEDIT_vector_start__;
 // it is where the SP start value is found, and the NVIC vector
 // table register (VTOR) is initialized to this address if != 0.
 
-#pragma section = ".vectors"
-#pragma location = ".vectors"
+#pragma section = ".intvec"
+#pragma location = ".intvec"
 const IntVector __vector_table[] =
 {
     { .__ptr = __sfe( "CSTACK" ) },
@@ -121,13 +120,23 @@ const IntVector __vector_table[] =
 
 //------------------------------------------------------------------------------
 /// This is the code that gets called on processor reset. To initialize the
-/// device.
+/// device. The clocks are brought up here, before the data sections are
+/// initialized, so that the copy-down already runs at full speed. The data
+/// sections are then set up by STARTUP_InitSections() instead of the IAR
+/// runtime.
 //------------------------------------------------------------------------------
 int __low_level_init( void )
 {
-    unsigned int * src = __section_begin(".vectors");
+    unsigned int * src = __section_begin(".intvec");
 
     AT91C_BASE_NVIC->NVIC_VTOFFR = ((unsigned int)(src)) | (0x0 << 7);
-    
-    return 1; // if return 0, the data sections will not be initialized.
+    IRQ_RelocateVectors();
+
+    DWT_EnableCycleCounter();
+    CLOCK_Configure(CLOCK_BOOT_OPERATING_POINT);
+    STARTUP_MarkClock();
+
+    STARTUP_InitSections();
+
+    return 0; // data sections already initialized by STARTUP_InitSections()
 }
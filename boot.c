@@ -0,0 +1,359 @@
+/* ----------------------------------------------------------------------------
+ *         Bootloader
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Separate image (boot.ewp, boot_flash.icf) in the first lock region of the
+** flash, at __ICFEDIT_intvec_start__. At each reset it carries out the update
+** state of image.h, checks the application in slot A against its trailer,
+** then moves NVIC_VTOFFR to the application vectors and starts it:
+**
+**     PENDING    slot B is checked, then swapped with slot A: TRIAL
+**     SWAP       a swap cut by a reset is finished
+**     TRIAL      the trial is counted; after IMAGE_MAX_TRIALS boots without
+**                UPDATE_Confirm(), the slots are swapped back: CONFIRMED
+**
+** If slot A is corrupt while slot B holds a valid image, they are swapped
+** too. A slot A without a trailer (written by the debugger) is adopted as a
+** whole slot. Reflashing slot A with the debugger keeps the trailer of the
+** previous image, though, and the bootloader takes the new image for a
+** corrupt one: it recovers slot B. Program the output of "mkimage.py slot"
+** at slot A instead, which brings its own trailer, or erase the trailer
+** with "mkimage.py blank" (tools/mkimage.py).
+**
+** The swap moves a page at a time through the scratch page and records each
+** page done, so that it resumes after a power loss; the page CRCs of both
+** trailers, copied to the journal first, tell which of the three writes of a
+** page had completed.
+**
+** Interrupts stay disabled, and the watchdog mode (write-once) is left to
+** the application: the bootloader only restarts it during a swap. When a
+** swap fails or slot A is still invalid, the bootloader halts rather than
+** start it, in a busy loop (the reset mode of the watchdog halts it in WFI):
+** the watchdog, enabled out of reset, then resets the core after about 16 s
+** and the next boot resumes the swap or tries again. A fault does the same.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "image.h"
+#include "crc.h"
+#include "clock.h"
+#include "exceptions.h"
+#include "AT91SAM3U4.h"
+
+#include <intrinsics.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// RAM range of a valid initial stack pointer (sam3u2c_flash.icf).
+#define RAM_START               0x2007C000
+#define RAM_END                 0x20084000
+
+#define WDT_KEY                 (0xA5 << 24)
+
+/// Trailer copies in the journal.
+#define JOURNAL_A               ((const ImageTrailer *) IMAGE_JOURNAL)
+#define JOURNAL_B               ((const ImageTrailer *) (IMAGE_JOURNAL + IMAGE_TRAILER_SIZE))
+
+//------------------------------------------------------------------------------
+//         Prototypes
+//------------------------------------------------------------------------------
+
+extern void __iar_program_start(void);
+
+static void Halt(void);
+
+//------------------------------------------------------------------------------
+//         Exception table
+//------------------------------------------------------------------------------
+
+#pragma language=extended
+#pragma segment="CSTACK"
+
+#pragma section = ".intvec"
+#pragma location = ".intvec"
+const IntVector __vector_table[] =
+{
+    { .__ptr = __sfe( "CSTACK" ) },
+    __iar_program_start,
+
+    Halt,                   // NMI
+    Halt,                   // Hard fault
+    Halt,                   // Memory management
+    Halt,                   // Bus fault
+    Halt,                   // Usage fault
+    0, 0, 0, 0,             // Reserved
+    Halt,                   // SVC
+    Halt,                   // Debug monitor
+    0,                      // Reserved
+    Halt,                   // PendSV
+    Halt                    // SysTick
+};
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Waits for the watchdog to reset the core. The loop keeps the core busy:
+/// WDT_MR keeps its reset value here, whose WDIDLEHLT would stop the counter
+/// in WFI.
+//------------------------------------------------------------------------------
+static void Halt(void)
+{
+    while (1);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the CRC-32 of a flash page.
+//------------------------------------------------------------------------------
+static unsigned int PageCrc(unsigned int address)
+{
+    return CRC_Compute32(0, (const void *) address, IAP_PAGE_SIZE);
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if a range of flash is erased.
+//------------------------------------------------------------------------------
+static unsigned char IsErased(unsigned int address, unsigned int size)
+{
+    const unsigned int *word = (const unsigned int *) address;
+
+    for (size /= 4; size; size--) {
+
+        if (*word++ != 0xFFFFFFFF) {
+
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the number of pages of a journal trailer, 0 if it is invalid.
+//------------------------------------------------------------------------------
+static unsigned int JournalPages(const ImageTrailer *trailer)
+{
+    return IMAGE_CheckTrailer(trailer) ? IMAGE_NUM_PAGES(trailer->size) : 0;
+}
+
+//------------------------------------------------------------------------------
+/// Saves both trailers to the journal and clears the swap progress, then logs
+/// the swap: from there on, it is resumed after a reset.
+//------------------------------------------------------------------------------
+static unsigned char StartSwap(unsigned char reason)
+{
+    const ImageTrailer *trailerA = IMAGE_GetTrailer(IMAGE_SLOT_A);
+    const ImageTrailer *trailerB = IMAGE_GetTrailer(IMAGE_SLOT_B);
+
+    return IAP_Erase(IMAGE_JOURNAL, 2 * IMAGE_TRAILER_SIZE)
+           && (!trailerA
+               || IAP_Program((unsigned int) JOURNAL_A, trailerA,
+                              sizeof(ImageTrailer)))
+           && (!trailerB
+               || IAP_Program((unsigned int) JOURNAL_B, trailerB,
+                              sizeof(ImageTrailer)))
+           && IAP_Erase(IMAGE_SWAP_PAGE, IAP_PAGE_SIZE)
+           && IMAGE_SetState(IMAGE_STATE_SWAP, reason);
+}
+
+//------------------------------------------------------------------------------
+/// Swaps one page of the slots: A to scratch, B to A, scratch to B. Each step
+/// is skipped when the page CRCs show that it has completed, or that its page
+/// is not part of the image.
+//------------------------------------------------------------------------------
+static unsigned char SwapPage(unsigned int page,
+                              unsigned int pagesA,
+                              unsigned int pagesB)
+{
+    unsigned int pageA = IMAGE_SLOT_A + page * IAP_PAGE_SIZE;
+    unsigned int pageB = IMAGE_SLOT_B + page * IAP_PAGE_SIZE;
+
+    if ((page < pagesA)
+        && (PageCrc(IMAGE_SCRATCH_PAGE) != JOURNAL_A->pageCrcs[page])) {
+
+        // Slot A is only written once its page is safe in the scratch page
+        if ((PageCrc(pageA) != JOURNAL_A->pageCrcs[page])
+            || !IAP_Write(IMAGE_SCRATCH_PAGE, (const void *) pageA,
+                          IAP_PAGE_SIZE)) {
+
+            return 0;
+        }
+    }
+
+    // Slot B is only written once slot A holds its page
+    if ((page < pagesB) && (PageCrc(pageA) != JOURNAL_B->pageCrcs[page])
+        && !IAP_Write(pageA, (const void *) pageB, IAP_PAGE_SIZE)) {
+
+        return 0;
+    }
+
+    return (page >= pagesA)
+           || IAP_Write(pageB, (const void *) IMAGE_SCRATCH_PAGE, IAP_PAGE_SIZE);
+}
+
+//------------------------------------------------------------------------------
+/// Runs or resumes the logged swap, then logs the state that follows it.
+//------------------------------------------------------------------------------
+static unsigned char Swap(unsigned char reason)
+{
+    const unsigned int *done = (const unsigned int *) IMAGE_SWAP_PAGE;
+    unsigned int pagesA = JournalPages(JOURNAL_A);
+    unsigned int pagesB = JournalPages(JOURNAL_B);
+    unsigned int pages = (pagesA > pagesB) ? pagesA : pagesB;
+    unsigned int page;
+    unsigned int mark;
+
+    for (page = 0; page < pages; page++) {
+
+        // Cleared bit: page done
+        if (!(done[page / 32] & (1 << (page % 32)))) {
+
+            continue;
+        }
+        AT91C_BASE_WDTC->WDTC_WDCR = WDT_KEY | AT91C_WDTC_WDRSTT;
+
+        mark = ~(1 << (page % 32));
+        if (!SwapPage(page, pagesA, pagesB)
+            || !IAP_Program(IMAGE_SWAP_PAGE + (page / 32) * 4, &mark, 4)) {
+
+            return 0;
+        }
+    }
+
+    // Trailers last: until then, the journal holds them
+    if (!(pagesB ? IAP_Write(IMAGE_SLOT_A + IMAGE_MAX_SIZE, JOURNAL_B,
+                             sizeof(ImageTrailer))
+                 : IAP_Erase(IMAGE_SLOT_A + IMAGE_MAX_SIZE, IMAGE_TRAILER_SIZE))
+        || !(pagesA ? IAP_Write(IMAGE_SLOT_B + IMAGE_MAX_SIZE, JOURNAL_A,
+                                sizeof(ImageTrailer))
+                    : IAP_Erase(IMAGE_SLOT_B + IMAGE_MAX_SIZE, IMAGE_TRAILER_SIZE))) {
+
+        return 0;
+    }
+
+    return IMAGE_SetState((reason == IMAGE_SWAP_INSTALL) ? IMAGE_STATE_TRIAL
+                                                         : IMAGE_STATE_CONFIRMED,
+                          0);
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if a slot holds a valid image.
+//------------------------------------------------------------------------------
+static unsigned char IsValid(unsigned int slot)
+{
+    const ImageTrailer *trailer = IMAGE_GetTrailer(slot);
+
+    return trailer && IMAGE_Verify(slot, trailer);
+}
+
+//------------------------------------------------------------------------------
+/// Carries out the update state.
+/// Returns 0 if a swap has failed; otherwise 1.
+//------------------------------------------------------------------------------
+static unsigned char Update(void)
+{
+    ImageState state;
+
+    IMAGE_GetState(&state);
+    switch (state.state) {
+
+    case IMAGE_STATE_SWAP:
+        return Swap(state.value);
+
+    case IMAGE_STATE_PENDING:
+        if (!IsValid(IMAGE_SLOT_B)) {
+
+            IMAGE_SetState(IMAGE_STATE_CONFIRMED, 0);
+        }
+        else {
+
+            return StartSwap(IMAGE_SWAP_INSTALL) && Swap(IMAGE_SWAP_INSTALL);
+        }
+        break;
+
+    case IMAGE_STATE_TRIAL:
+        if (state.trials < IMAGE_MAX_TRIALS) {
+
+            IMAGE_SetState(IMAGE_STATE_TRIAL, 0);
+        }
+        else if (!IsValid(IMAGE_SLOT_B)) {
+
+            // Nothing to roll back to: the new image stays
+            IMAGE_SetState(IMAGE_STATE_CONFIRMED, 0);
+        }
+        else {
+
+            return StartSwap(IMAGE_SWAP_ROLLBACK) && Swap(IMAGE_SWAP_ROLLBACK);
+        }
+        break;
+    }
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Moves the vectors to the application and jumps to its reset handler, with
+/// its initial stack pointer.
+//------------------------------------------------------------------------------
+static void Start(unsigned int slot)
+{
+    const IntVector *vectors = (const IntVector *) slot;
+    unsigned int stack = (unsigned int) vectors[0].__ptr;
+
+    if ((stack <= RAM_START) || (stack > RAM_END)) {
+
+        Halt();
+    }
+
+    AT91C_BASE_NVIC->NVIC_VTOFFR = slot;
+    __DSB();
+    __ISB();
+    __set_MSP(stack);
+    vectors[1].__fun();
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Bootloader entry point.
+//------------------------------------------------------------------------------
+void main(void)
+{
+    CLOCK_Configure(CLOCK_OP_96MHZ);
+    if (!Update()) {
+
+        Halt();
+    }
+
+    if (!IsValid(IMAGE_SLOT_A)) {
+
+        if (IsErased(IMAGE_SLOT_A + IMAGE_MAX_SIZE, IMAGE_TRAILER_SIZE)) {
+
+            IMAGE_WriteTrailer(IMAGE_SLOT_A, IMAGE_MAX_SIZE, 0,
+                               CRC_Compute32(0, (const void *) IMAGE_SLOT_A,
+                                             IMAGE_MAX_SIZE));
+        }
+        else if (IsValid(IMAGE_SLOT_B)
+                 && !(StartSwap(IMAGE_SWAP_RECOVER) && Swap(IMAGE_SWAP_RECOVER))) {
+
+            Halt();
+        }
+
+        // Nothing that can be trusted to run
+        if (!IsValid(IMAGE_SLOT_A)) {
+
+            Halt();
+        }
+    }
+
+    Start(IMAGE_SLOT_A);
+}
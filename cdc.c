@@ -0,0 +1,304 @@
+/* ----------------------------------------------------------------------------
+ *         USB CDC-ACM serial port
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "cdc.h"
+#include "ustream.h"
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Class requests.
+#define SET_LINE_CODING         0x20
+#define GET_LINE_CODING         0x21
+#define SET_CONTROL_LINE_STATE  0x22
+
+/// Size of the line coding structure on the bus.
+#define LINE_CODING_SIZE        7
+
+/// Bulk packet size in high speed and in full speed.
+#define HS_BULK_SIZE            512
+#define FS_BULK_SIZE            64
+
+#define NOTIFICATION_SIZE       64
+
+#define WORD(value)             ((value) & 0xFF), ((value) >> 8)
+
+/// Configuration descriptor of one speed.
+#define CONFIGURATION(bulkSize, interval) \
+    /* Configuration */ \
+    9, USB_DESC_CONFIGURATION, WORD(91), 3, 1, 0, 0xC0, 50, \
+    /* Association of the two CDC interfaces */ \
+    8, USB_DESC_ASSOCIATION, 0, 2, 0x02, 0x02, 0x01, 0, \
+    /* Communication interface */ \
+    9, USB_DESC_INTERFACE, 0, 0, 1, 0x02, 0x02, 0x01, 0, \
+    /* Header, call management, ACM and union functional descriptors */ \
+    5, 0x24, 0x00, WORD(0x0110), \
+    5, 0x24, 0x01, 0x00, 1, \
+    4, 0x24, 0x02, 0x02, \
+    5, 0x24, 0x06, 0, 1, \
+    /* Notification endpoint */ \
+    7, USB_DESC_ENDPOINT, USB_DIR_IN | CDC_EP_NOTIFICATION, USBD_INTERRUPT, \
+    WORD(NOTIFICATION_SIZE), interval, \
+    /* Data interface */ \
+    9, USB_DESC_INTERFACE, 1, 0, 2, 0x0A, 0x00, 0x00, 0, \
+    /* Data endpoints */ \
+    7, USB_DESC_ENDPOINT, CDC_EP_DATA_OUT, USBD_BULK, WORD(bulkSize), 0, \
+    7, USB_DESC_ENDPOINT, USB_DIR_IN | CDC_EP_DATA_IN, USBD_BULK, \
+    WORD(bulkSize), 0, \
+    /* Vendor stream interface */ \
+    9, USB_DESC_INTERFACE, 2, 0, 1, 0xFF, 0x00, 0x00, 0, \
+    7, USB_DESC_ENDPOINT, USB_DIR_IN | USTREAM_EP, USBD_BULK, \
+    WORD(bulkSize), 0
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static const unsigned char deviceDescriptor[] = {
+
+    18, USB_DESC_DEVICE, WORD(0x0200),
+    0xEF, 0x02, 0x01, USBD_EP0_SIZE,
+    WORD(CDC_VENDOR_ID), WORD(CDC_PRODUCT_ID), WORD(0x0100),
+    1, 2, 3, 1
+};
+
+static const unsigned char qualifierDescriptor[] = {
+
+    10, USB_DESC_QUALIFIER, WORD(0x0200),
+    0xEF, 0x02, 0x01, USBD_EP0_SIZE, 1, 0
+};
+
+/// Notification interval: 16 ms in both speeds (2^(8-1) microframes).
+static const unsigned char fullSpeedConfiguration[] = {
+
+    CONFIGURATION(FS_BULK_SIZE, 16)
+};
+
+static const unsigned char highSpeedConfiguration[] = {
+
+    CONFIGURATION(HS_BULK_SIZE, 8)
+};
+
+static const unsigned char languages[] = {
+
+    4, USB_DESC_STRING, WORD(0x0409)
+};
+
+static const unsigned char manufacturer[] = {
+
+    8, USB_DESC_STRING, 'E', 0, 'I', 0, 'E', 0
+};
+
+static const unsigned char product[] = {
+
+    22, USB_DESC_STRING,
+    'E', 0, 'I', 0, 'E', 0, ' ', 0, 'S', 0, 'e', 0, 'r', 0, 'i', 0, 'a', 0,
+    'l', 0
+};
+
+static const unsigned char serialNumber[] = {
+
+    10, USB_DESC_STRING, '0', 0, '0', 0, '0', 0, '1', 0
+};
+
+static const unsigned char * const strings[] = {
+
+    languages, manufacturer, product, serialNumber
+};
+
+static const UsbDescriptors descriptors = {
+
+    deviceDescriptor,
+    qualifierDescriptor,
+    fullSpeedConfiguration,
+    highSpeedConfiguration,
+    strings,
+    sizeof(strings) / sizeof(strings[0])
+};
+
+/// Line coding as sent by the host, decoded into lineCoding once received.
+static unsigned char lineCodingBuffer[LINE_CODING_SIZE];
+
+static CdcLineCoding lineCoding = { 115200, 0, 0, 8 };
+
+static volatile unsigned char controlLines;
+
+static volatile unsigned char configured;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// End of the SET_LINE_CODING data stage.
+//------------------------------------------------------------------------------
+static void LineCodingReceived(void)
+{
+    lineCoding.baudrate = lineCodingBuffer[0]
+                          | (lineCodingBuffer[1] << 8)
+                          | (lineCodingBuffer[2] << 16)
+                          | ((unsigned int) lineCodingBuffer[3] << 24);
+    lineCoding.stopBits = lineCodingBuffer[4];
+    lineCoding.parity = lineCodingBuffer[5];
+    lineCoding.dataBits = lineCodingBuffer[6];
+}
+
+//------------------------------------------------------------------------------
+/// Class requests sent to the communication interface.
+//------------------------------------------------------------------------------
+static void ClassRequest(const UsbSetup *setup, UsbReply *reply)
+{
+    if (((setup->bmRequestType & USB_TYPE_MASK) != USB_TYPE_CLASS)
+        || (setup->wIndex != 0)) {
+
+        return;
+    }
+
+    switch (setup->bRequest) {
+
+        case SET_LINE_CODING:
+            if (setup->wLength == LINE_CODING_SIZE) {
+
+                reply->action = USBCTL_DATA_OUT;
+                reply->data = lineCodingBuffer;
+                reply->size = LINE_CODING_SIZE;
+                reply->complete = LineCodingReceived;
+            }
+            break;
+
+        case GET_LINE_CODING:
+            lineCodingBuffer[0] = lineCoding.baudrate & 0xFF;
+            lineCodingBuffer[1] = (lineCoding.baudrate >> 8) & 0xFF;
+            lineCodingBuffer[2] = (lineCoding.baudrate >> 16) & 0xFF;
+            lineCodingBuffer[3] = lineCoding.baudrate >> 24;
+            lineCodingBuffer[4] = lineCoding.stopBits;
+            lineCodingBuffer[5] = lineCoding.parity;
+            lineCodingBuffer[6] = lineCoding.dataBits;
+            reply->action = USBCTL_DATA_IN;
+            reply->data = lineCodingBuffer;
+            reply->size = (setup->wLength < LINE_CODING_SIZE) ?
+                          setup->wLength : LINE_CODING_SIZE;
+            break;
+
+        case SET_CONTROL_LINE_STATE:
+            controlLines = setup->wValue & (CDC_DTR | CDC_RTS);
+            reply->action = USBCTL_STATUS;
+            break;
+
+        default:
+            break;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Sets up the endpoints of the configuration, at the speed of the bus.
+//------------------------------------------------------------------------------
+static void Configured(unsigned char configuration)
+{
+    unsigned short bulkSize = USBD_IsHighSpeed() ? HS_BULK_SIZE : FS_BULK_SIZE;
+
+    configured = 0;
+    controlLines = 0;
+    if (configuration == 0) {
+
+        USTREAM_Configure(0);
+        return;
+    }
+
+    if (USBD_ConfigureEndpoint(CDC_EP_DATA_OUT, USBD_BULK, bulkSize, 2)
+        && USBD_ConfigureEndpoint(USB_DIR_IN | CDC_EP_DATA_IN, USBD_BULK,
+                                  bulkSize, 2)
+        && USBD_ConfigureEndpoint(USB_DIR_IN | CDC_EP_NOTIFICATION,
+                                  USBD_INTERRUPT, NOTIFICATION_SIZE, 1)) {
+
+        configured = 1;
+    }
+    USTREAM_Configure(bulkSize);
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Starts the USB device with the CDC-ACM descriptors. The port appears on
+/// the host once USBD_Connect() has been called.
+//------------------------------------------------------------------------------
+void CDC_Initialize(void)
+{
+    USBD_Initialize(&descriptors, ClassRequest, Configured);
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the host has configured the port.
+//------------------------------------------------------------------------------
+unsigned char CDC_IsConfigured(void)
+{
+    return configured;
+}
+
+//------------------------------------------------------------------------------
+/// Sends data to the host in a single DMA transfer.
+/// Returns 1 if the transfer has started; 0 if the port is not configured or
+/// the previous write is not over.
+/// \param data  Data to send, which must stay valid until the callback.
+/// \param size  Number of bytes.
+/// \param callback  Called at the end of the transfer, or 0.
+/// \param arg  Argument of the callback.
+//------------------------------------------------------------------------------
+unsigned char CDC_Write(const void *data,
+                        unsigned int size,
+                        UsbdCallback callback,
+                        void *arg)
+{
+    if (!configured) {
+
+        return 0;
+    }
+    return USBD_Transfer(CDC_EP_DATA_IN, (void *) data, size, callback, arg);
+}
+
+//------------------------------------------------------------------------------
+/// Receives data from the host: the transfer ends when the buffer is full or
+/// the host sends a short packet. size should be a multiple of 512.
+/// Returns 1 if the transfer has started; 0 if the port is not configured or
+/// the previous read is not over.
+/// \param buffer  Receive buffer.
+/// \param size  Size of the buffer.
+/// \param callback  Called with the number of bytes received, or 0.
+/// \param arg  Argument of the callback.
+//------------------------------------------------------------------------------
+unsigned char CDC_Read(void *buffer,
+                       unsigned int size,
+                       UsbdCallback callback,
+                       void *arg)
+{
+    if (!configured) {
+
+        return 0;
+    }
+    return USBD_Transfer(CDC_EP_DATA_OUT, buffer, size, callback, arg);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the line coding last set by the host.
+//------------------------------------------------------------------------------
+const CdcLineCoding * CDC_GetLineCoding(void)
+{
+    return &lineCoding;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the control line state (CDC_DTR, CDC_RTS) last set by the host.
+//------------------------------------------------------------------------------
+unsigned char CDC_GetControlLines(void)
+{
+    return controlLines;
+}
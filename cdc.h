@@ -0,0 +1,87 @@
+/* ----------------------------------------------------------------------------
+ *         USB CDC-ACM serial port
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Virtual serial port (CDC Abstract Control Model) on top of usbd.c, bound
+** by the standard drivers of the host operating systems. The data interface
+** has one bulk endpoint per direction, 512 bytes and double-banked in high
+** speed, moved by the UDPHS DMA: a write or a read of any size is a single
+** transfer, and the line coding set by the host is only reported to the
+** application, since no UART sits behind the port.
+**
+** The configuration also carries the vendor interface of ustream.c, so the
+** device is a composite one: an interface association groups the two CDC
+** interfaces for the host.
+*/
+
+#ifndef CDC_H
+#define CDC_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "usbd.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Vendor and product identifiers.
+#ifndef CDC_VENDOR_ID
+#define CDC_VENDOR_ID           0x03EB
+#endif
+#ifndef CDC_PRODUCT_ID
+#define CDC_PRODUCT_ID          0x6119
+#endif
+
+/// Endpoints.
+#define CDC_EP_DATA_OUT         1
+#define CDC_EP_DATA_IN          2
+#define CDC_EP_NOTIFICATION     3
+
+/// Control line state bits set by the host.
+#define CDC_DTR                 (1 << 0)
+#define CDC_RTS                 (1 << 1)
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Line coding requested by the host.
+typedef struct {
+
+    unsigned int baudrate;
+    /// 0: 1 stop bit, 1: 1.5 stop bits, 2: 2 stop bits.
+    unsigned char stopBits;
+    /// 0: none, 1: odd, 2: even, 3: mark, 4: space.
+    unsigned char parity;
+    unsigned char dataBits;
+
+} CdcLineCoding;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void CDC_Initialize(void);
+
+extern unsigned char CDC_IsConfigured(void);
+
+extern unsigned char CDC_Write(const void *data,
+                               unsigned int size,
+                               UsbdCallback callback,
+                               void *arg);
+
+extern unsigned char CDC_Read(void *buffer,
+                              unsigned int size,
+                              UsbdCallback callback,
+                              void *arg);
+
+extern const CdcLineCoding * CDC_GetLineCoding(void);
+
+extern unsigned char CDC_GetControlLines(void);
+
+#endif //#ifndef CDC_H
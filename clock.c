@@ -0,0 +1,292 @@
+/* ----------------------------------------------------------------------------
+ *         Clock configuration (PMC / CKGR / EFC)
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "clock.h"
+#include "dbgu.h"
+#include "dwt.h"
+#include "AT91SAM3U4.h"
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Write protection key of CKGR_MOR.
+#define MOR_KEY             (0x37 << 16)
+
+/// Crystal start-up time, in units of 8 slow clock cycles.
+#define MOR_MOSCXTST        (0x8 << 8)
+
+/// PLLA lock time, in slow clock cycles.
+#define PLLAR_PLLACOUNT     (0x3F << 8)
+
+//------------------------------------------------------------------------------
+//         Exported variables
+//------------------------------------------------------------------------------
+
+/// Selectable operating points. PLLA accepts 8 to 16 MHz and outputs 96 to
+/// 192 MHz, so every PLL based point runs PLLA at 96 MHz and divides MCK down
+/// with the prescaler.
+const ClockOperatingPoint clockOperatingPoints[CLOCK_NUM_OPERATING_POINTS] = {
+
+    // CLOCK_OP_4MHZ_RC: reset configuration
+    {CLOCK_MAINCK_RC, AT91C_PMC_CSS_MAIN_CLK, 0, 0, 0,
+     AT91C_PMC_PRES_CLK, AT91C_EFC_FWS_0WS},
+    // CLOCK_OP_12MHZ_XTAL
+    {CLOCK_MAINCK_XTAL, AT91C_PMC_CSS_MAIN_CLK, AT91C_CKGR_MOSCSEL, 0, 0,
+     AT91C_PMC_PRES_CLK, AT91C_EFC_FWS_0WS},
+    // CLOCK_OP_24MHZ
+    {24000000, AT91C_PMC_CSS_PLLA_CLK, AT91C_CKGR_MOSCSEL, 7, 1,
+     AT91C_PMC_PRES_CLK_4, AT91C_EFC_FWS_0WS},
+    // CLOCK_OP_48MHZ
+    {48000000, AT91C_PMC_CSS_PLLA_CLK, AT91C_CKGR_MOSCSEL, 7, 1,
+     AT91C_PMC_PRES_CLK_2, AT91C_EFC_FWS_1WS},
+    // CLOCK_OP_96MHZ
+    {96000000, AT91C_PMC_CSS_PLLA_CLK, AT91C_CKGR_MOSCSEL, 7, 1,
+     AT91C_PMC_PRES_CLK, AT91C_EFC_FWS_3WS}
+};
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Cycles spent in the last CLOCK_Configure() call. Not initialized so that it
+/// survives the .data / .bss initialization following __low_level_init().
+static __no_init unsigned int switchCycles;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Waits until all bits of mask are set in PMC_SR.
+/// Returns 1 if they did before CLOCK_TIMEOUT; otherwise 0.
+//------------------------------------------------------------------------------
+static unsigned char WaitStatus(unsigned int mask)
+{
+    unsigned int timeout = 0;
+
+    while ((AT91C_BASE_PMC->PMC_SR & mask) != mask) {
+
+        if (++timeout >= CLOCK_TIMEOUT) {
+
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Programs the flash wait states, keeping the other EFC_FMR fields. The
+/// SAM3U2 only has the EFC0 bank.
+//------------------------------------------------------------------------------
+static void SetFlashWaitStates(unsigned int fws)
+{
+    AT91C_BASE_EFC0->EFC_FMR = (AT91C_BASE_EFC0->EFC_FMR & ~AT91C_EFC_FWS) | fws;
+}
+
+//------------------------------------------------------------------------------
+/// Writes one field of PMC_MCKR and waits for the master clock to settle.
+//------------------------------------------------------------------------------
+static unsigned char WriteMckr(unsigned int mask, unsigned int value)
+{
+    AT91C_BASE_PMC->PMC_MCKR = (AT91C_BASE_PMC->PMC_MCKR & ~mask) | value;
+    return WaitStatus(AT91C_PMC_MCKRDY);
+}
+
+//------------------------------------------------------------------------------
+/// Selects the crystal or the RC oscillator as MAINCK. Both oscillators are
+/// kept running across the switch as required by the PMC.
+//------------------------------------------------------------------------------
+static unsigned char SelectMainOscillator(unsigned int moscsel)
+{
+    unsigned int mor = AT91C_BASE_PMC->PMC_MOR;
+
+    if ((mor & AT91C_CKGR_MOSCSEL) == moscsel) {
+
+        return 1;
+    }
+
+    if (moscsel) {
+
+        // Start the crystal, then switch over once it is stable
+        AT91C_BASE_PMC->PMC_MOR = MOR_KEY | MOR_MOSCXTST
+                                  | AT91C_CKGR_MOSCRCEN | AT91C_CKGR_MOSCXTEN;
+        if (!WaitStatus(AT91C_PMC_MOSCXTS)) {
+
+            return 0;
+        }
+        AT91C_BASE_PMC->PMC_MOR = MOR_KEY | MOR_MOSCXTST | AT91C_CKGR_MOSCRCEN
+                                  | AT91C_CKGR_MOSCXTEN | AT91C_CKGR_MOSCSEL;
+    }
+    else {
+
+        AT91C_BASE_PMC->PMC_MOR = MOR_KEY | MOR_MOSCXTST
+                                  | AT91C_CKGR_MOSCRCEN | AT91C_CKGR_MOSCXTEN;
+    }
+
+    return WaitStatus(AT91C_PMC_MOSCSELS);
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Switches the master clock to the given entry of clockOperatingPoints[].
+/// The flash wait states are raised before and lowered after the frequency
+/// change, so flash is never read with too few wait states.
+/// Returns 1 on success; 0 if the index is invalid or a clock did not start.
+/// \param index  Operating point (CLOCK_OP_xxx).
+//------------------------------------------------------------------------------
+unsigned char CLOCK_Configure(unsigned int index)
+{
+    const ClockOperatingPoint *op;
+    unsigned int start;
+
+    if (index >= CLOCK_NUM_OPERATING_POINTS) {
+
+        return 0;
+    }
+    op = &clockOperatingPoints[index];
+    start = DWT_GetCycles();
+
+    if (op->fws > (AT91C_BASE_EFC0->EFC_FMR & AT91C_EFC_FWS)) {
+
+        SetFlashWaitStates(op->fws);
+    }
+
+    // Fall back to MAINCK while the oscillator and PLLA are reprogrammed
+    if ((AT91C_BASE_PMC->PMC_MCKR & AT91C_PMC_CSS) != AT91C_PMC_CSS_MAIN_CLK) {
+
+        if (!WriteMckr(AT91C_PMC_CSS, AT91C_PMC_CSS_MAIN_CLK)) {
+
+            return 0;
+        }
+    }
+    if (!WriteMckr(AT91C_PMC_PRES, AT91C_PMC_PRES_CLK)) {
+
+        return 0;
+    }
+
+    if (!SelectMainOscillator(op->moscsel)) {
+
+        return 0;
+    }
+
+    if (op->css == AT91C_PMC_CSS_PLLA_CLK) {
+
+        AT91C_BASE_PMC->PMC_PLLAR = AT91C_CKGR_SRC | (op->mula << 16)
+                                    | PLLAR_PLLACOUNT | op->diva;
+        if (!WaitStatus(AT91C_PMC_LOCKA)) {
+
+            return 0;
+        }
+
+        // Prescaler first, then the source
+        if (!WriteMckr(AT91C_PMC_PRES, op->pres)
+            || !WriteMckr(AT91C_PMC_CSS, AT91C_PMC_CSS_PLLA_CLK)) {
+
+            return 0;
+        }
+    }
+    else {
+
+        // Stop PLLA (MULA = 0)
+        AT91C_BASE_PMC->PMC_PLLAR = AT91C_CKGR_SRC;
+        if (!WriteMckr(AT91C_PMC_PRES, op->pres)) {
+
+            return 0;
+        }
+    }
+
+    // Stop the crystal when running from the RC
+    if (!op->moscsel) {
+
+        AT91C_BASE_PMC->PMC_MOR = MOR_KEY | AT91C_CKGR_MOSCRCEN;
+    }
+
+    SetFlashWaitStates(op->fws);
+
+    switchCycles = DWT_GetCycles() - start;
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the current master clock frequency in Hz, decoded from the PMC
+/// registers so it is valid even before the C runtime is initialized.
+//------------------------------------------------------------------------------
+unsigned int CLOCK_GetMck(void)
+{
+    unsigned int mckr = AT91C_BASE_PMC->PMC_MCKR;
+    unsigned int pres = (mckr & AT91C_PMC_PRES) >> 4;
+    unsigned int mainck;
+    unsigned int clock;
+
+    if (AT91C_BASE_PMC->PMC_MOR & AT91C_CKGR_MOSCSEL) {
+
+        mainck = CLOCK_MAINCK_XTAL;
+    }
+    else {
+
+        mainck = CLOCK_MAINCK_RC;
+    }
+
+    switch (mckr & AT91C_PMC_CSS) {
+
+        case AT91C_PMC_CSS_MAIN_CLK:
+            clock = mainck;
+            break;
+
+        case AT91C_PMC_CSS_PLLA_CLK:
+            clock = AT91C_BASE_PMC->PMC_PLLAR;
+            if ((clock & AT91C_CKGR_DIVA) == 0) {
+
+                return 0;
+            }
+            clock = mainck / (clock & AT91C_CKGR_DIVA)
+                    * (((clock & AT91C_CKGR_MULA) >> 16) + 1);
+            break;
+
+        case AT91C_PMC_CSS_UPLL_CLK:
+            clock = 480000000 / 2;
+            break;
+
+        default:
+            clock = 32768;
+            break;
+    }
+
+    if (pres == 7) {
+
+        return clock / 6;
+    }
+    return clock >> pres;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the number of core cycles the last CLOCK_Configure() call took,
+/// including oscillator start-up and PLL lock time.
+//------------------------------------------------------------------------------
+unsigned int CLOCK_GetSwitchCycles(void)
+{
+    return switchCycles;
+}
+
+//------------------------------------------------------------------------------
+/// Prints the master clock frequency and the duration of the boot switch on
+/// the DBGU, which must be configured (polled output).
+//------------------------------------------------------------------------------
+void CLOCK_Report(void)
+{
+    DBGU_PutString("-I- MCK ");
+    DBGU_PutHex(CLOCK_GetMck());
+    DBGU_PutString(" Hz, switched in ");
+    DBGU_PutHex(switchCycles);
+    DBGU_PutString(" cycles\n");
+}
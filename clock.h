@@ -0,0 +1,88 @@
+/* ----------------------------------------------------------------------------
+ *         Clock configuration (PMC / CKGR / EFC)
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Switches the master clock between a small set of operating points and keeps
+** the embedded flash wait states in step with the selected frequency.
+**
+** CLOCK_Configure() does not touch any initialized RAM so it can be called from
+** __low_level_init(), before the .data copy-down.
+*/
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Frequency of the main crystal fitted on the board.
+#ifndef CLOCK_MAINCK_XTAL
+#define CLOCK_MAINCK_XTAL       12000000
+#endif
+
+/// Frequency of the internal fast RC oscillator selected out of reset.
+#define CLOCK_MAINCK_RC         4000000
+
+/// Operating point applied by __low_level_init().
+#ifndef CLOCK_BOOT_OPERATING_POINT
+#define CLOCK_BOOT_OPERATING_POINT  CLOCK_OP_96MHZ
+#endif
+
+/// Indexes into clockOperatingPoints[].
+#define CLOCK_OP_4MHZ_RC        0
+#define CLOCK_OP_12MHZ_XTAL     1
+#define CLOCK_OP_24MHZ          2
+#define CLOCK_OP_48MHZ          3
+#define CLOCK_OP_96MHZ          4
+#define CLOCK_NUM_OPERATING_POINTS  5
+
+/// Number of status polls before an oscillator, PLL or MCK switch is
+/// considered failed.
+#define CLOCK_TIMEOUT           0x100000
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// One selectable master clock configuration.
+typedef struct {
+
+    /// Resulting master clock frequency in Hz.
+    unsigned int mck;
+    /// Master clock source (AT91C_PMC_CSS_xxx).
+    unsigned int css;
+    /// AT91C_CKGR_MOSCSEL to run MAINCK from the crystal, 0 for the RC.
+    unsigned int moscsel;
+    /// PLLA multiplier field value (MULA, i.e. multiplier - 1); 0 if unused.
+    unsigned int mula;
+    /// PLLA divider field value (DIVA); 0 if unused.
+    unsigned int diva;
+    /// Master clock prescaler (AT91C_PMC_PRES_xxx).
+    unsigned int pres;
+    /// Flash wait states (AT91C_EFC_FWS_xWS) required at this frequency.
+    unsigned int fws;
+
+} ClockOperatingPoint;
+
+//------------------------------------------------------------------------------
+//         Exported variables
+//------------------------------------------------------------------------------
+
+extern const ClockOperatingPoint clockOperatingPoints[CLOCK_NUM_OPERATING_POINTS];
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned char CLOCK_Configure(unsigned int index);
+
+extern unsigned int CLOCK_GetMck(void);
+
+extern unsigned int CLOCK_GetSwitchCycles(void);
+
+extern void CLOCK_Report(void);
+
+#endif //#ifndef CLOCK_H
@@ -0,0 +1,50 @@
+/* ----------------------------------------------------------------------------
+ *         CRC-32
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "crc.h"
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// CRC of the 16 values of a nibble.
+static const unsigned int crcTable[16] = {
+
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+    0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+    0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Updates a CRC-32 with a block of data and returns the new value.
+/// \param crc  CRC of the previous blocks, 0 for the first one.
+/// \param data  Data to add.
+/// \param size  Size of the data in bytes.
+//------------------------------------------------------------------------------
+unsigned int CRC_Compute32(unsigned int crc,
+                           const void *data,
+                           unsigned int size)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+
+    crc = ~crc;
+    while (size--) {
+
+        crc ^= *bytes++;
+        crc = (crc >> 4) ^ crcTable[crc & 0xF];
+        crc = (crc >> 4) ^ crcTable[crc & 0xF];
+    }
+
+    return ~crc;
+}
@@ -0,0 +1,24 @@
+/* ----------------------------------------------------------------------------
+ *         CRC-32
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** CRC-32 as used by zlib and Ethernet (reflected polynomial 0xEDB88320),
+** computed a nibble at a time with a 64-byte table. Blocks can be chained:
+**     crc = CRC_Compute32(0, first, sizeof(first));
+**     crc = CRC_Compute32(crc, second, sizeof(second));
+*/
+
+#ifndef CRC_H
+#define CRC_H
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned int CRC_Compute32(unsigned int crc,
+                                  const void *data,
+                                  unsigned int size);
+
+#endif //#ifndef CRC_H
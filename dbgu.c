@@ -0,0 +1,418 @@
+/* ----------------------------------------------------------------------------
+ *         Debug unit (DBGU) console
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "dbgu.h"
+#include "irq.h"
+#include "sections.h"
+#include "AT91SAM3U4.h"
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Transmit ring, read by the PDC.
+DMABUF static __no_init unsigned char txBuffer[DBGU_TX_BUFFER_SIZE];
+
+// Ring indexes, in 0..DBGU_TX_BUFFER_SIZE. Bytes go from send to write, or,
+// when write < send, from send to watermark and then from 0 to write. The
+// bytes between the PDC pointer and send are in flight.
+
+/// End of the committed bytes (producer).
+static volatile unsigned int write;
+
+/// End of the valid bytes before the producer wrapped to 0 (producer).
+static volatile unsigned int watermark;
+
+/// End of the bytes handed to the PDC (DBGU_IrqHandler / critical section).
+static volatile unsigned int send;
+
+/// Start and size of the pending reservation, and whether it wrapped.
+static unsigned int reserved;
+static unsigned int reservedSize;
+static unsigned char reservedWrapped;
+
+/// Reservations that did not fit.
+static unsigned int dropped;
+
+/// Set by DBGU_StartTx().
+static unsigned char txStarted;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns the ring index the PDC has sent up to. The value may be late but
+/// never early, so the producer never overwrites a byte not sent yet.
+//------------------------------------------------------------------------------
+static unsigned int ReadIndex(void)
+{
+    unsigned int handed = send;
+
+    // All the bytes handed so far have gone once the counter is 0
+    if (AT91C_BASE_PDC_DBGU->PDC_TCR == 0) {
+
+        return handed;
+    }
+
+    return AT91C_BASE_PDC_DBGU->PDC_TPR - (unsigned int) txBuffer;
+}
+
+//------------------------------------------------------------------------------
+/// Hands the next contiguous run of committed bytes to the PDC, in the
+/// current buffer if it is idle, otherwise in the next one. Interrupt
+/// context or critical section only.
+//------------------------------------------------------------------------------
+static void Kick(void)
+{
+    AT91PS_PDC pdc = AT91C_BASE_PDC_DBGU;
+    unsigned int start;
+    unsigned int end;
+
+    while (pdc->PDC_TNCR == 0) {
+
+        start = send;
+        end = write;
+        if (end < start) {
+
+            // The producer has wrapped: finish the tail first
+            if (start == watermark) {
+
+                start = 0;
+            }
+            else {
+
+                end = watermark;
+            }
+        }
+        if (end == start) {
+
+            break;
+        }
+
+        if (pdc->PDC_TCR == 0) {
+
+            pdc->PDC_TPR = (unsigned int) &txBuffer[start];
+            pdc->PDC_TCR = end - start;
+        }
+        else {
+
+            pdc->PDC_TNPR = (unsigned int) &txBuffer[start];
+            pdc->PDC_TNCR = end - start;
+        }
+        send = end;
+    }
+
+    // ENDTX stays set until a count is written: only listen to it when
+    // there is something left to hand over
+    if (send != write) {
+
+        AT91C_BASE_DBGU->DBGU_IER = AT91C_DBGU_ENDTX;
+    }
+    else {
+
+        AT91C_BASE_DBGU->DBGU_IDR = AT91C_DBGU_ENDTX;
+    }
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Configures the DBGU pins and the DBGU for the given mode and baud rate,
+/// and enables the receiver and transmitter.
+/// \param mode  Parity and channel mode (DBGU_MR value).
+/// \param baudrate  Baud rate.
+/// \param mck  Master clock frequency.
+//------------------------------------------------------------------------------
+void DBGU_Configure(unsigned int mode,
+                    unsigned int baudrate,
+                    unsigned int mck)
+{
+    // DRXD and DTXD on peripheral A
+    AT91C_BASE_PIOA->PIO_ABSR &= ~(AT91C_PA11_DRXD | AT91C_PA12_DTXD);
+    AT91C_BASE_PIOA->PIO_PDR = AT91C_PA11_DRXD | AT91C_PA12_DTXD;
+    AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_DBGU;
+
+    AT91C_BASE_DBGU->DBGU_CR = AT91C_DBGU_RSTRX | AT91C_DBGU_RSTTX
+                               | AT91C_DBGU_RXDIS | AT91C_DBGU_TXDIS;
+    AT91C_BASE_DBGU->DBGU_IDR = 0xFFFFFFFF;
+
+    AT91C_BASE_DBGU->DBGU_BRGR = (mck + 8 * baudrate) / (16 * baudrate);
+    AT91C_BASE_DBGU->DBGU_MR = mode;
+
+    AT91C_BASE_DBGU->DBGU_PTCR = AT91C_PDC_RXTDIS | AT91C_PDC_TXTDIS;
+    AT91C_BASE_DBGU->DBGU_CR = AT91C_DBGU_RXEN | AT91C_DBGU_TXEN;
+}
+
+//------------------------------------------------------------------------------
+/// Sends a character, waiting for the transmitter to be ready.
+//------------------------------------------------------------------------------
+void DBGU_PutChar(unsigned char c)
+{
+    while ((AT91C_BASE_DBGU->DBGU_CSR & AT91C_DBGU_TXRDY) == 0);
+    AT91C_BASE_DBGU->DBGU_THR = c;
+}
+
+//------------------------------------------------------------------------------
+/// Sends a zero-terminated string; "\n" is sent as "\r\n".
+//------------------------------------------------------------------------------
+void DBGU_PutString(const char *string)
+{
+    while (*string) {
+
+        if (*string == '\n') {
+
+            DBGU_PutChar('\r');
+        }
+        DBGU_PutChar(*string++);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Sends a value as 8 hexadecimal digits.
+//------------------------------------------------------------------------------
+void DBGU_PutHex(unsigned int value)
+{
+    unsigned char digits[8];
+    unsigned int i;
+
+    DBGU_FormatHex(digits, value);
+    for (i = 0; i < sizeof(digits); i++) {
+
+        DBGU_PutChar(digits[i]);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Writes a value as 8 hexadecimal digits, without terminating zero; meant to
+/// format in place in a reservation.
+/// Returns the end of the digits.
+//------------------------------------------------------------------------------
+unsigned char * DBGU_FormatHex(unsigned char *buffer, unsigned int value)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    int shift;
+
+    for (shift = 28; shift >= 0; shift -= 4) {
+
+        *buffer++ = digits[(value >> shift) & 0xF];
+    }
+
+    return buffer;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if a character has been received; otherwise 0.
+//------------------------------------------------------------------------------
+unsigned int DBGU_IsRxReady(void)
+{
+    return (AT91C_BASE_DBGU->DBGU_CSR & AT91C_DBGU_RXRDY) != 0;
+}
+
+//------------------------------------------------------------------------------
+/// Waits for a character and returns it.
+//------------------------------------------------------------------------------
+unsigned char DBGU_GetChar(void)
+{
+    while ((AT91C_BASE_DBGU->DBGU_CSR & AT91C_DBGU_RXRDY) == 0);
+    return AT91C_BASE_DBGU->DBGU_RHR;
+}
+
+//------------------------------------------------------------------------------
+/// Switches the transmitter to the PDC ring. DBGU_Configure() must have been
+/// called; the polled output functions must not be used afterwards.
+//------------------------------------------------------------------------------
+void DBGU_StartTx(void)
+{
+    write = 0;
+    watermark = 0;
+    send = 0;
+    reservedSize = 0;
+    dropped = 0;
+
+    AT91C_BASE_PDC_DBGU->PDC_TCR = 0;
+    AT91C_BASE_PDC_DBGU->PDC_TNCR = 0;
+    AT91C_BASE_DBGU->DBGU_PTCR = AT91C_PDC_TXTEN;
+
+    txStarted = 1;
+    IRQ_Enable(AT91C_ID_DBGU);
+}
+
+//------------------------------------------------------------------------------
+/// Reserves size contiguous bytes in the transmit ring if they are free.
+/// Returns the reserved space, or 0.
+//------------------------------------------------------------------------------
+static unsigned char * Claim(unsigned int size)
+{
+    unsigned int read = ReadIndex();
+    unsigned int start = write;
+
+    reservedWrapped = 0;
+    if (start >= read) {
+
+        if ((DBGU_TX_BUFFER_SIZE - start) < size) {
+
+            // Wrap, keeping write != read once committed
+            if (read <= size) {
+
+                return 0;
+            }
+            start = 0;
+            reservedWrapped = 1;
+        }
+    }
+    else if ((read - start) <= size) {
+
+        return 0;
+    }
+
+    reserved = start;
+    reservedSize = size;
+
+    return &txBuffer[start];
+}
+
+//------------------------------------------------------------------------------
+/// Reserves size contiguous bytes in the transmit ring. Single producer: the
+/// reservation must be committed before the next one.
+/// Returns the reserved space, or 0 if it does not fit right now.
+/// \param size  Number of bytes to reserve (> 0).
+//------------------------------------------------------------------------------
+unsigned char * DBGU_Reserve(unsigned int size)
+{
+    unsigned char *buffer;
+
+    if (!txStarted || (size == 0)) {
+
+        return 0;
+    }
+
+    buffer = Claim(size);
+    if (buffer == 0) {
+
+        dropped++;
+    }
+
+    return buffer;
+}
+
+//------------------------------------------------------------------------------
+/// Same as DBGU_Reserve(), but waits for the ring to drain instead of
+/// dropping; for reports that must come out whole. Needs the DBGU interrupt,
+/// so must not be called from an interrupt handler or a critical section.
+/// Returns the reserved space, or 0 if size is over half the ring.
+/// \param size  Number of bytes to reserve (> 0).
+//------------------------------------------------------------------------------
+unsigned char * DBGU_ReserveWait(unsigned int size)
+{
+    unsigned char *buffer;
+
+    if (!txStarted || (size == 0) || (size > DBGU_TX_BUFFER_SIZE / 2)) {
+
+        return 0;
+    }
+
+    do {
+
+        buffer = Claim(size);
+    } while (buffer == 0);
+
+    return buffer;
+}
+
+//------------------------------------------------------------------------------
+/// Publishes the first size bytes of the pending reservation and starts
+/// sending them. The rest of the reservation is given back.
+/// \param size  Number of bytes written, at most the reserved size.
+//------------------------------------------------------------------------------
+void DBGU_Commit(unsigned int size)
+{
+    IrqState state;
+
+    if (size > reservedSize) {
+
+        size = reservedSize;
+    }
+    reservedSize = 0;
+    if (size == 0) {
+
+        return;
+    }
+
+    // The watermark must be in place before the consumer sees write wrap
+    if (reservedWrapped) {
+
+        watermark = write;
+    }
+    write = reserved + size;
+
+    state = IRQ_EnterCritical();
+    Kick();
+    IRQ_ExitCritical(state);
+}
+
+//------------------------------------------------------------------------------
+/// Copies data into the transmit ring and starts sending it.
+/// Returns 1 on success; 0 if it does not fit (nothing is queued then).
+//------------------------------------------------------------------------------
+unsigned char DBGU_Write(const void *data, unsigned int size)
+{
+    const unsigned char *source = (const unsigned char *) data;
+    unsigned char *buffer = DBGU_Reserve(size);
+    unsigned int i;
+
+    if (buffer == 0) {
+
+        return 0;
+    }
+    for (i = 0; i < size; i++) {
+
+        buffer[i] = source[i];
+    }
+    DBGU_Commit(size);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Queues a zero-terminated string, as is.
+/// Returns 1 on success; 0 if it does not fit.
+//------------------------------------------------------------------------------
+unsigned char DBGU_Print(const char *string)
+{
+    unsigned int size = 0;
+
+    while (string[size]) {
+
+        size++;
+    }
+
+    return DBGU_Write(string, size);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the number of reservations that did not fit so far.
+//------------------------------------------------------------------------------
+unsigned int DBGU_GetDropped(void)
+{
+    return dropped;
+}
+
+//------------------------------------------------------------------------------
+/// DBGU interrupt: the PDC has finished a buffer, hand it the next run.
+//------------------------------------------------------------------------------
+void DBGU_IrqHandler(void)
+{
+    if (AT91C_BASE_DBGU->DBGU_CSR & AT91C_DBGU_ENDTX) {
+
+        Kick();
+    }
+}
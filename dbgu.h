@@ -0,0 +1,74 @@
+/* ----------------------------------------------------------------------------
+ *         Debug unit (DBGU) console
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Console on the DBGU (PA11 DRXD, PA12 DTXD).
+**
+** DBGU_PutChar() and friends are polled. They are meant for boot and crash
+** reports, where interrupts cannot be relied upon, and must not be mixed with
+** the ring below once it is started.
+**
+** DBGU_StartTx() switches the transmitter to a ring sent by the PDC. A single
+** producer reserves contiguous space in the ring with DBGU_Reserve(), formats
+** in place and publishes the bytes with DBGU_Commit(): there is no second copy
+** and no waiting; a reservation that does not fit fails and is counted as
+** dropped. DBGU_IrqHandler() keeps the PDC next-buffer registers loaded, so
+** consecutive chunks go out back to back. Reservations of up to half the ring
+** always succeed once the ring has drained: reports that must come out whole
+** wait for the room with DBGU_ReserveWait() instead, from a thread.
+*/
+
+#ifndef DBGU_H
+#define DBGU_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Console baud rate.
+#ifndef DBGU_BAUDRATE
+#define DBGU_BAUDRATE           115200
+#endif
+
+/// Size of the transmit ring (power of two).
+#ifndef DBGU_TX_BUFFER_SIZE
+#define DBGU_TX_BUFFER_SIZE     1024
+#endif
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void DBGU_Configure(unsigned int mode,
+                           unsigned int baudrate,
+                           unsigned int mck);
+
+extern void DBGU_PutChar(unsigned char c);
+
+extern void DBGU_PutString(const char *string);
+
+extern void DBGU_PutHex(unsigned int value);
+
+extern unsigned char * DBGU_FormatHex(unsigned char *buffer, unsigned int value);
+
+extern unsigned int DBGU_IsRxReady(void);
+
+extern unsigned char DBGU_GetChar(void);
+
+extern void DBGU_StartTx(void);
+
+extern unsigned char * DBGU_Reserve(unsigned int size);
+
+extern unsigned char * DBGU_ReserveWait(unsigned int size);
+
+extern void DBGU_Commit(unsigned int size);
+
+extern unsigned char DBGU_Write(const void *data, unsigned int size);
+
+extern unsigned char DBGU_Print(const char *string);
+
+extern unsigned int DBGU_GetDropped(void);
+
+#endif //#ifndef DBGU_H
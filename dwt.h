@@ -0,0 +1,60 @@
+/* ----------------------------------------------------------------------------
+ *         Cortex-M3 Data Watchpoint and Trace unit
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** AT91SAM3U4.h does not describe the DWT block, so the registers needed for
+** cycle counting are declared here in the same style.
+*/
+
+#ifndef DWT_H
+#define DWT_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "AT91SAM3U4.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+typedef struct _AT91S_DWT {
+	AT91_REG	 DWT_CTRL; 	// Control Register
+	AT91_REG	 DWT_CYCCNT; 	// Cycle Count Register
+	AT91_REG	 DWT_CPICNT; 	// CPI Count Register
+	AT91_REG	 DWT_EXCCNT; 	// Exception Overhead Count Register
+	AT91_REG	 DWT_SLEEPCNT; 	// Sleep Count Register
+	AT91_REG	 DWT_LSUCNT; 	// LSU Count Register
+	AT91_REG	 DWT_FOLDCNT; 	// Folded-instruction Count Register
+	AT91_REG	 DWT_PCSR; 	// Program Counter Sample Register
+} AT91S_DWT, *AT91PS_DWT;
+
+// -------- DWT_CTRL : (DWT Offset: 0x0) Control Register --------
+#define AT91C_DWT_CYCCNTENA   (0x1 <<  0) // (DWT) Enable the cycle counter
+
+#define AT91C_BASE_DWT        (AT91_CAST(AT91PS_DWT) 0xE0001000) // (DWT) Base Address
+
+// -------- DEMCR : Debug Exception and Monitor Control Register --------
+#define AT91C_CM3_DEMCR       (*(AT91_REG *) 0xE000EDFC) // (CM3) Debug Exception and Monitor Control
+#define AT91C_CM3_TRCENA      (0x1 << 24) // (CM3) Enable DWT and ITM blocks
+
+//------------------------------------------------------------------------------
+//         Macros
+//------------------------------------------------------------------------------
+
+/// Starts the free running core cycle counter. Safe to call before the C
+/// runtime is initialized.
+#define DWT_EnableCycleCounter() \
+    do { \
+        AT91C_CM3_DEMCR |= AT91C_CM3_TRCENA; \
+        AT91C_BASE_DWT->DWT_CYCCNT = 0; \
+        AT91C_BASE_DWT->DWT_CTRL |= AT91C_DWT_CYCCNTENA; \
+    } while (0)
+
+/// Returns the current core cycle count (wraps every 2^32 cycles).
+#define DWT_GetCycles()   (AT91C_BASE_DWT->DWT_CYCCNT)
+
+#endif //#ifndef DWT_H
@@ -0,0 +1,425 @@
+/* ----------------------------------------------------------------------------
+ *         Binary event log
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "evlog.h"
+#include "crc.h"
+#include "dwt.h"
+#include "scheduler.h"
+#include "sections.h"
+
+#include <intrinsics.h>
+#include <string.h>
+
+#if EVLOG_STAGING_SIZE & (EVLOG_STAGING_SIZE - 1)
+#error "EVLOG_STAGING_SIZE must be a power of 2"
+#endif
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Records of a block, between its header and its CRC.
+#define RECORDS_START           sizeof(BlockHeader)
+#define RECORDS_END             (BLOCK_SIZE - 4)
+
+/// Longest record: three varints of 32, 16 and 32 bits.
+#define MAX_RECORD              (5 + 3 + 5)
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Event in the staging ring. Published once its sequence number (its ring
+/// position + 1) is written.
+typedef struct {
+
+    volatile unsigned int sequence;
+    unsigned int cycles;
+    unsigned int value;
+    unsigned short id;
+
+} EvlogEvent;
+
+/// Block header.
+typedef struct {
+
+    unsigned int magic;
+    unsigned int sequence;
+    unsigned int tick;
+    unsigned int cycles;
+    unsigned short size;
+    unsigned short count;
+
+} BlockHeader;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static EvlogEvent staging[EVLOG_STAGING_SIZE];
+
+/// Ring positions: next reserved by the producers, next taken by the flush.
+static volatile unsigned long head;
+static volatile unsigned int tail;
+
+/// Events dropped by the producers, and those already recorded.
+static volatile unsigned long dropped;
+static unsigned int reported;
+
+/// Block buffers: one being filled, the other possibly being written.
+DMABUF static __no_init unsigned int blocks[2][BLOCK_SIZE / 4];
+static unsigned char filling;
+static unsigned int used;
+static unsigned int previousCycles;
+/// The block being filled is full, and waits for the other to be written.
+static unsigned char sealed;
+static volatile unsigned char busy;
+/// EVLOG_Flush() is running, and must not be entered again by EVLOG_Sync()
+/// from a fault or stall that interrupted it.
+static volatile unsigned char flushing;
+
+/// Range of the device, next block to write and its sequence number.
+static BlockDevice *logDevice;
+static unsigned int logFirst;
+static unsigned int logCount;
+static unsigned int next;
+static unsigned int sequence;
+
+static volatile unsigned char reading;
+static unsigned char readStatus;
+
+static EvlogStats evlogStats;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Encodes an unsigned LEB128 number and returns its size.
+//------------------------------------------------------------------------------
+static unsigned int PutVarint(unsigned char *buffer, unsigned int value)
+{
+    unsigned int size = 0;
+
+    while (value >= 0x80) {
+
+        buffer[size++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    buffer[size++] = value;
+
+    return size;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the header of the block being filled.
+//------------------------------------------------------------------------------
+static BlockHeader * Header(void)
+{
+    return (BlockHeader *) blocks[filling];
+}
+
+//------------------------------------------------------------------------------
+/// Encodes a record into the block being filled.
+/// Returns 1 on success; 0 if the block is full.
+//------------------------------------------------------------------------------
+static unsigned char Append(unsigned int cycles,
+                            unsigned short id,
+                            unsigned int value)
+{
+    BlockHeader *header = Header();
+    unsigned char record[MAX_RECORD];
+    unsigned int delta;
+    unsigned int size;
+
+    if (used == RECORDS_START) {
+
+        header->tick = SCHED_GetTicks();
+        header->cycles = cycles;
+        header->count = 0;
+        previousCycles = cycles;
+    }
+
+    // Zigzag, so that an event published late costs a byte or two
+    delta = cycles - previousCycles;
+    delta = (delta << 1) ^ (unsigned int) ((int) delta >> 31);
+
+    size = PutVarint(record, delta);
+    size += PutVarint(&record[size], id);
+    size += PutVarint(&record[size], value);
+    if (used + size > RECORDS_END) {
+
+        return 0;
+    }
+
+    memcpy((unsigned char *) blocks[filling] + used, record, size);
+    used += size;
+    header->count++;
+    previousCycles = cycles;
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Completes the block being filled: header, padding and CRC.
+//------------------------------------------------------------------------------
+static void Seal(void)
+{
+    BlockHeader *header = Header();
+    unsigned char *block = (unsigned char *) blocks[filling];
+
+    header->magic = EVLOG_MAGIC;
+    header->sequence = sequence;
+    header->size = used - RECORDS_START;
+    memset(block + used, 0xFF, RECORDS_END - used);
+    blocks[filling][RECORDS_END / 4] = CRC_Compute32(0, block, RECORDS_END);
+    sealed = 1;
+}
+
+//------------------------------------------------------------------------------
+/// BlockCallback of the writes.
+//------------------------------------------------------------------------------
+static void WriteDone(void *arg, unsigned char status)
+{
+    if (status != BLOCK_STATUS_OK) {
+
+        evlogStats.writeErrors++;
+    }
+    busy = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Starts writing the sealed block, once the previous write has ended, and
+/// starts filling the other buffer.
+//------------------------------------------------------------------------------
+static void StartWrite(void)
+{
+    unsigned int *block = blocks[filling];
+    unsigned int index = logFirst + next;
+
+    if (!sealed || busy) {
+
+        return;
+    }
+
+    filling ^= 1;
+    used = RECORDS_START;
+    sealed = 0;
+    next = (next + 1) % logCount;
+    sequence++;
+    evlogStats.blocks++;
+
+    busy = 1;
+    if (!logDevice->write(logDevice, index, block, 1, WriteDone, 0)) {
+
+        busy = 0;
+        evlogStats.writeErrors++;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// BlockCallback of the reads.
+//------------------------------------------------------------------------------
+static void ReadDone(void *arg, unsigned char status)
+{
+    readStatus = status;
+    reading = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Reads a block of the range into the first buffer and returns its sequence
+/// number, or 0 if it does not hold a valid block.
+//------------------------------------------------------------------------------
+static unsigned int ReadSequence(BlockDevice *device, unsigned int index)
+{
+    const BlockHeader *header = (const BlockHeader *) blocks[0];
+
+    reading = 1;
+    if (!device->read(device, logFirst + index, blocks[0], 1, ReadDone, 0)) {
+
+        return 0;
+    }
+    while (reading);
+
+    if ((readStatus != BLOCK_STATUS_OK) || (header->magic != EVLOG_MAGIC)
+        || (CRC_Compute32(0, blocks[0], RECORDS_END)
+            != blocks[0][RECORDS_END / 4])) {
+
+        return 0;
+    }
+    return header->sequence;
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Starts logging to a range of a block device, after its newest block. Every
+/// block is read: a torn or unreadable one, the first included, does not hide
+/// the blocks after it.
+/// \param device  Block device.
+/// \param first  First block of the range.
+/// \param count  Number of blocks of the range.
+//------------------------------------------------------------------------------
+void EVLOG_Initialize(BlockDevice *device,
+                      unsigned int first,
+                      unsigned int count)
+{
+    unsigned int newest = 0;
+    unsigned int found;
+    unsigned int index;
+
+    logDevice = 0;
+    logFirst = first;
+    logCount = count;
+    if (count == 0) {
+
+        return;
+    }
+
+    next = 0;
+    sequence = 1;
+    for (index = 0; index < count; index++) {
+
+        // Serial comparison, in case the sequence numbers wrap around
+        found = ReadSequence(device, index);
+        if (found && (!newest || ((int) (found - newest) > 0))) {
+
+            newest = found;
+            next = (index + 1) % count;
+        }
+    }
+    if (newest) {
+
+        sequence = newest + 1;
+    }
+
+    filling = 0;
+    used = RECORDS_START;
+    sealed = 0;
+    busy = 0;
+    logDevice = device;
+}
+
+//------------------------------------------------------------------------------
+/// Records an event. Can be called from any task or interrupt.
+/// \param id  Event identifier, other than EVLOG_ID_DROPPED.
+/// \param value  Event value.
+//------------------------------------------------------------------------------
+void EVLOG_Write(unsigned short id, unsigned int value)
+{
+    EvlogEvent *event;
+    unsigned long slot;
+    unsigned long count;
+
+    // An exception between the two clears the reservation: the store fails
+    do {
+
+        slot = __LDREX((unsigned long *) &head);
+        if (slot - tail >= EVLOG_STAGING_SIZE) {
+
+            __CLREX();
+            do {
+
+                count = __LDREX((unsigned long *) &dropped);
+            }
+            while (__STREX(count + 1, (unsigned long *) &dropped));
+            return;
+        }
+    }
+    while (__STREX(slot + 1, (unsigned long *) &head));
+
+    event = &staging[slot & (EVLOG_STAGING_SIZE - 1)];
+    event->cycles = DWT_GetCycles();
+    event->id = id;
+    event->value = value;
+    __DMB();
+    event->sequence = slot + 1;
+}
+
+//------------------------------------------------------------------------------
+/// Encodes the published events and writes the full blocks. To be run by a
+/// background task; an event still being written by a preempted producer
+/// holds the ones after it until the next call.
+//------------------------------------------------------------------------------
+void EVLOG_Flush(void)
+{
+    const EvlogEvent *event;
+    unsigned int count;
+
+    if (!logDevice || flushing) {
+
+        return;
+    }
+
+    flushing = 1;
+    StartWrite();
+    while (!sealed) {
+
+        count = dropped;
+        if (count != reported) {
+
+            if (!Append(DWT_GetCycles(), EVLOG_ID_DROPPED, count - reported)) {
+
+                Seal();
+                StartWrite();
+                continue;
+            }
+            reported = count;
+        }
+
+        event = &staging[tail & (EVLOG_STAGING_SIZE - 1)];
+        if ((tail == head) || (event->sequence != tail + 1)) {
+
+            break;
+        }
+        __DMB();
+        if (!Append(event->cycles, event->id, event->value)) {
+
+            Seal();
+            StartWrite();
+            continue;
+        }
+        tail++;
+        evlogStats.events++;
+    }
+    flushing = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Flushes the events, then writes the block being filled even if it is not
+/// full (before a reset, or to read the log). With a device that completes
+/// writes later, the block may still be waiting when this returns. It writes
+/// to the device: call it from a task, never from a fault or an interrupt.
+/// Called while EVLOG_Flush() runs, it does nothing.
+//------------------------------------------------------------------------------
+void EVLOG_Sync(void)
+{
+    if (flushing) {
+
+        return;
+    }
+    EVLOG_Flush();
+    if (logDevice && !sealed && (used > RECORDS_START)) {
+
+        Seal();
+        StartWrite();
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Returns the event counters.
+//------------------------------------------------------------------------------
+const EvlogStats * EVLOG_GetStats(void)
+{
+    evlogStats.dropped = dropped;
+
+    return &evlogStats;
+}
@@ -0,0 +1,122 @@
+/* ----------------------------------------------------------------------------
+ *         Binary event log
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Black-box recorder. EVLOG_Write() stamps an event (16-bit identifier,
+** 32-bit value) with the cycle counter and stores it in a RAM staging ring,
+** from any task or interrupt: a slot is reserved with LDREX/STREX, filled,
+** then published by its sequence number, with no lock and no formatting. A
+** full ring drops the event and counts it.
+**
+** EVLOG_Flush(), run by a background task, takes the published events in
+** order and encodes them into 512-byte blocks: each event is the zigzag
+** varint of its cycle delta from the previous one (producers may publish
+** slightly out of order), then the varints of its identifier and value. Full
+** blocks are written in rotation to a range of a block device (block.h): the
+** flash disk on the internal flash, or an SD card. Two block buffers let a
+** write run while the next block is filled.
+**
+** Block layout (little-endian):
+**     magic, sequence, tick (SCHED_GetTicks()), cycles   4 x 32 bits
+**     records size, record count                         2 x 16 bits
+**     records, padded with 0xFF
+**     CRC-32 of the bytes above                          32 bits
+** The cycles of the header are those of the first record. Dropped events
+** are reported by an EVLOG_ID_DROPPED record holding their number.
+** tools/evlog2csv.py turns a dump of the range into CSV.
+**
+** Mounting reads every block of the range once and resumes after the one
+** with the newest sequence, so a block lost or torn anywhere in the range
+** costs only its own records.
+**
+** Wear: each block of the range is rewritten once per turn. The internal
+** flash (8 KB, 16 blocks, through flashdisk.h) is rated for 10000 cycles,
+** so it takes some 160000 blocks: about 6 million events of 12 bytes, or
+** 18 hours at 100 events/s. EVLOG_Sync() also writes part-filled blocks.
+** That suits a log of rare events (resets, errors); sustained logging
+** belongs on the NAND flash (MAIN_NAND_LOG in main.c) or an SD card.
+*/
+
+#ifndef EVLOG_H
+#define EVLOG_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "block.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Events in the staging ring (power of two), 16 bytes each.
+#ifndef EVLOG_STAGING_SIZE
+#define EVLOG_STAGING_SIZE      128
+#endif
+
+/// Block magic ("ELOG").
+#define EVLOG_MAGIC             0x474F4C45
+
+/// Identifier reserved for the count of dropped events.
+#define EVLOG_ID_DROPPED        0xFFFF
+
+/// Events of the firmware, and their values.
+/// Boot: reset status (RSTC_SR).
+#define EVLOG_ID_BOOT           0x0001
+/// Fault that reset the core, logged at the next boot: faulting PC.
+#define EVLOG_ID_FAULT          0x0002
+/// Watchdog stall that reset the core, logged at the next boot: stalled
+/// clients (bit mask).
+#define EVLOG_ID_STALL          0x0003
+/// Scheduler task released while still pending, or run past its deadline:
+/// task index.
+#define EVLOG_ID_TASK_OVERRUN   0x0010
+#define EVLOG_ID_TASK_LATE      0x0011
+/// USB bus reset: 1 in high speed.
+#define EVLOG_ID_USB_RESET      0x0020
+/// USB stream data refused for lack of space: byte count.
+#define EVLOG_ID_USTREAM_LOST   0x0021
+/// Mass storage command: operation code; failed command: sense key.
+#define EVLOG_ID_MSC_COMMAND    0x0022
+#define EVLOG_ID_MSC_FAILED     0x0023
+/// SD card transfer error: 0.
+#define EVLOG_ID_SDCARD_ERROR   0x0030
+/// USART receive error: port << 16 | channel status bits.
+#define EVLOG_ID_USART_ERROR    0x0040
+/// TWI transaction failed: port << 16 | transaction status.
+#define EVLOG_ID_TWI_FAILED     0x0041
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Event counters.
+typedef struct {
+
+    unsigned int events;
+    unsigned int dropped;
+    unsigned int blocks;
+    unsigned int writeErrors;
+
+} EvlogStats;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void EVLOG_Initialize(BlockDevice *device,
+                             unsigned int first,
+                             unsigned int count);
+
+extern void EVLOG_Write(unsigned short id, unsigned int value);
+
+extern void EVLOG_Flush(void);
+
+extern void EVLOG_Sync(void);
+
+extern const EvlogStats * EVLOG_GetStats(void);
+
+#endif //#ifndef EVLOG_H
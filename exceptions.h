@@ -32,6 +32,9 @@
 ** and exception table.
 */
 
+#ifndef EXCEPTIONS_H
+#define EXCEPTIONS_H
+
 //------------------------------------------------------------------------------
 //         Types
 //------------------------------------------------------------------------------
@@ -40,6 +43,9 @@
 //typedef void( *IrqHandler )( void );
 typedef void( *IntFunc )( void );
 
+/// Exception table item: initial stack pointer or handler.
+typedef union { IntFunc __fun; void * __ptr; } IntVector;
+
 /// Weak attribute
 
 #if defined   ( __CC_ARM   )
@@ -50,6 +56,13 @@ typedef void( *IntFunc )( void );
     #define WEAK __attribute__ ((weak))
 #endif
 
+//------------------------------------------------------------------------------
+//         Global variables
+//------------------------------------------------------------------------------
+
+/// Exception table in flash (board_cstartup_iar.c).
+extern const IntVector __vector_table[];
+
 //------------------------------------------------------------------------------
 //         Global functions
 //------------------------------------------------------------------------------
@@ -133,3 +146,4 @@ extern WEAK void HDMA_IrqHandler(void);
 // USB Device High Speed UDP_HS
 extern WEAK void UDPD_IrqHandler(void);
 
+#endif //#ifndef EXCEPTIONS_H
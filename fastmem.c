@@ -0,0 +1,378 @@
+/* ----------------------------------------------------------------------------
+ *         Block copy and fill
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "fastmem.h"
+#include "dbgu.h"
+#include "dwt.h"
+
+#include <intrinsics.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Smallest block measured by FASTMEM_Calibrate().
+#define CALIBRATION_MIN_SIZE    16
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Copies a block with the CPU, four words per iteration when the source and
+/// the destination are aligned alike.
+//------------------------------------------------------------------------------
+static void CpuCopy(unsigned char *dst, const unsigned char *src,
+                    unsigned int size)
+{
+    unsigned int *wordDst;
+    const unsigned int *wordSrc;
+
+    if ((((unsigned int) dst ^ (unsigned int) src) & 3) == 0) {
+
+        while (((unsigned int) dst & 3) && size) {
+
+            *dst++ = *src++;
+            size--;
+        }
+
+        wordDst = (unsigned int *) dst;
+        wordSrc = (const unsigned int *) src;
+        while (size >= 16) {
+
+            wordDst[0] = wordSrc[0];
+            wordDst[1] = wordSrc[1];
+            wordDst[2] = wordSrc[2];
+            wordDst[3] = wordSrc[3];
+            wordDst += 4;
+            wordSrc += 4;
+            size -= 16;
+        }
+        while (size >= 4) {
+
+            *wordDst++ = *wordSrc++;
+            size -= 4;
+        }
+        dst = (unsigned char *) wordDst;
+        src = (const unsigned char *) wordSrc;
+    }
+
+    while (size--) {
+
+        *dst++ = *src++;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Fills a block with the CPU, four words per iteration.
+//------------------------------------------------------------------------------
+static void CpuSet(unsigned char *dst, unsigned char value, unsigned int size)
+{
+    unsigned int pattern = value * 0x01010101u;
+    unsigned int *wordDst;
+
+    while (((unsigned int) dst & 3) && size) {
+
+        *dst++ = value;
+        size--;
+    }
+
+    wordDst = (unsigned int *) dst;
+    while (size >= 16) {
+
+        wordDst[0] = pattern;
+        wordDst[1] = pattern;
+        wordDst[2] = pattern;
+        wordDst[3] = pattern;
+        wordDst += 4;
+        size -= 16;
+    }
+    while (size >= 4) {
+
+        *wordDst++ = pattern;
+        size -= 4;
+    }
+
+    dst = (unsigned char *) wordDst;
+    while (size--) {
+
+        *dst++ = value;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the caller may wait for the HDMA interrupt: thread mode with
+/// no interrupt masked.
+//------------------------------------------------------------------------------
+static unsigned char CanWait(void)
+{
+    return (__get_IPSR() == 0)
+           && ((__get_PRIMASK() & 1) == 0)
+           && (__get_BASEPRI() == 0);
+}
+
+//------------------------------------------------------------------------------
+/// Hands size bytes (a multiple of 4, at word-aligned addresses) to the HDMA.
+/// Returns 1 if the transfer is started or queued; 0 if it is too large.
+//------------------------------------------------------------------------------
+static unsigned char Submit(FastmemRequest *request,
+                            unsigned char type,
+                            const void *src,
+                            void *dst,
+                            unsigned int size,
+                            HdmaCallback callback,
+                            void *arg)
+{
+    HDMA_Prepare(&request->transfer, type, 0, HDMA_WIDTH_WORD,
+                 &request->descriptor, 1);
+    if (!HDMA_AddBuffer(&request->transfer, src, dst, size)) {
+
+        return 0;
+    }
+
+    return HDMA_Submit(&request->transfer, FASTMEM_DMA_PRIORITY,
+                       callback, arg);
+}
+
+//------------------------------------------------------------------------------
+/// Starts a copy: the unaligned ends are copied by the CPU, the words in
+/// between by the HDMA.
+/// Returns 1 if the HDMA is in charge of part of the block; 0 if the whole
+/// block has been copied by the CPU.
+//------------------------------------------------------------------------------
+static unsigned char StartCopy(FastmemRequest *request,
+                               unsigned char *dst,
+                               const unsigned char *src,
+                               unsigned int size,
+                               HdmaCallback callback,
+                               void *arg)
+{
+    unsigned int head;
+    unsigned int words;
+
+    request->transfer.status = HDMA_STATUS_IDLE;
+
+#if FASTMEM_DMA_THRESHOLD
+    if ((size >= FASTMEM_DMA_THRESHOLD)
+        && ((((unsigned int) dst ^ (unsigned int) src) & 3) == 0)) {
+
+        head = (0 - (unsigned int) dst) & 3;
+        words = (size - head) & ~3u;
+        CpuCopy(dst, src, head);
+        if (Submit(request, HDMA_MEM2MEM, src + head, dst + head, words,
+                   callback, arg)) {
+
+            CpuCopy(dst + head + words, src + head + words,
+                    size - head - words);
+            return 1;
+        }
+        dst += head;
+        src += head;
+        size -= head;
+    }
+#endif
+
+    CpuCopy(dst, src, size);
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+/// Starts a fill; see StartCopy().
+//------------------------------------------------------------------------------
+static unsigned char StartSet(FastmemRequest *request,
+                              unsigned char *dst,
+                              unsigned char value,
+                              unsigned int size,
+                              HdmaCallback callback,
+                              void *arg)
+{
+    unsigned int head;
+    unsigned int words;
+
+    request->transfer.status = HDMA_STATUS_IDLE;
+
+#if FASTMEM_DMA_THRESHOLD
+    if (size >= FASTMEM_DMA_THRESHOLD) {
+
+        head = (0 - (unsigned int) dst) & 3;
+        words = (size - head) & ~3u;
+        request->pattern = value * 0x01010101u;
+        CpuSet(dst, value, head);
+        if (Submit(request, HDMA_FILL, &request->pattern, dst + head, words,
+                   callback, arg)) {
+
+            CpuSet(dst + head + words, value, size - head - words);
+            return 1;
+        }
+        dst += head;
+        size -= head;
+    }
+#endif
+
+    CpuSet(dst, value, size);
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Copies a block and returns when done. In interrupt handlers and critical
+/// sections the whole block is copied by the CPU.
+/// \param dst  Destination, in SRAM.
+/// \param src  Source.
+/// \param size  Number of bytes.
+//------------------------------------------------------------------------------
+void FASTMEM_Copy(void *dst, const void *src, unsigned int size)
+{
+    FastmemRequest request;
+
+    if (!CanWait()) {
+
+        CpuCopy(dst, src, size);
+    }
+    else if (StartCopy(&request, dst, src, size, 0, 0)) {
+
+        FASTMEM_Wait(&request);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Fills a block and returns when done; see FASTMEM_Copy().
+/// \param dst  Destination, in SRAM.
+/// \param value  Fill byte.
+/// \param size  Number of bytes.
+//------------------------------------------------------------------------------
+void FASTMEM_Set(void *dst, unsigned char value, unsigned int size)
+{
+    FastmemRequest request;
+
+    if (!CanWait()) {
+
+        CpuSet(dst, value, size);
+    }
+    else if (StartSet(&request, dst, value, size, 0, 0)) {
+
+        FASTMEM_Wait(&request);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Starts a copy and returns without waiting for the HDMA.
+/// Returns 1 if the copy is in progress: callback is then called from the
+/// HDMA interrupt at the end. Returns 0 if the block has already been copied
+/// by the CPU, in which case callback is not called.
+/// \param request  Request, owned by the caller until done.
+/// \param dst  Destination, in SRAM.
+/// \param src  Source.
+/// \param size  Number of bytes.
+/// \param callback  Called at the end of the HDMA transfer, or 0.
+/// \param arg  Argument of the callback.
+//------------------------------------------------------------------------------
+unsigned char FASTMEM_CopyAsync(FastmemRequest *request,
+                                void *dst,
+                                const void *src,
+                                unsigned int size,
+                                HdmaCallback callback,
+                                void *arg)
+{
+    return StartCopy(request, dst, src, size, callback, arg);
+}
+
+//------------------------------------------------------------------------------
+/// Starts a fill and returns without waiting for the HDMA; see
+/// FASTMEM_CopyAsync().
+//------------------------------------------------------------------------------
+unsigned char FASTMEM_SetAsync(FastmemRequest *request,
+                               void *dst,
+                               unsigned char value,
+                               unsigned int size,
+                               HdmaCallback callback,
+                               void *arg)
+{
+    return StartSet(request, dst, value, size, callback, arg);
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 once the HDMA part of a request is over, or if it had none.
+//------------------------------------------------------------------------------
+unsigned char FASTMEM_IsDone(const FastmemRequest *request)
+{
+    unsigned char status = HDMA_GetStatus(&request->transfer);
+
+    return (status != HDMA_STATUS_QUEUED) && (status != HDMA_STATUS_BUSY);
+}
+
+//------------------------------------------------------------------------------
+/// Waits for the end of a request. Needs the HDMA interrupt, so must not be
+/// called from an interrupt handler or a critical section.
+//------------------------------------------------------------------------------
+void FASTMEM_Wait(const FastmemRequest *request)
+{
+    while (!FASTMEM_IsDone(request));
+}
+
+//------------------------------------------------------------------------------
+/// Times CPU and HDMA copies of 16 bytes up to maxSize bytes, doubling the
+/// size at each step, and prints one "-I- fastmem <size> <cpu> <hdma>" line
+/// per size (hexadecimal, core cycles) on the DBGU ring, for
+/// tools/gen_fastmem_threshold.py. Must be called from a thread, like
+/// FASTMEM_Wait(), once DBGU_StartTx() has been called.
+/// \param dst  Word-aligned destination of maxSize bytes, in SRAM.
+/// \param src  Word-aligned source of maxSize bytes.
+/// \param maxSize  Largest size measured.
+//------------------------------------------------------------------------------
+void FASTMEM_Calibrate(void *dst, const void *src, unsigned int maxSize)
+{
+    static const char prefix[] = "-I- fastmem ";
+    FastmemRequest request;
+    unsigned char *line;
+    unsigned char *end;
+    unsigned int size;
+    unsigned int i;
+    unsigned int start;
+    unsigned int cpuCycles;
+    unsigned int dmaCycles;
+
+    for (size = CALIBRATION_MIN_SIZE; size <= maxSize; size <<= 1) {
+
+        start = DWT_GetCycles();
+        CpuCopy(dst, src, size);
+        cpuCycles = DWT_GetCycles() - start;
+
+        start = DWT_GetCycles();
+        if (!Submit(&request, HDMA_MEM2MEM, src, dst, size, 0, 0)) {
+
+            break;
+        }
+        FASTMEM_Wait(&request);
+        dmaCycles = DWT_GetCycles() - start;
+
+        line = DBGU_ReserveWait(sizeof(prefix) - 1 + 3 * 9 + 1);
+        if (line == 0) {
+
+            break;
+        }
+        for (i = 0; i < sizeof(prefix) - 1; i++) {
+
+            line[i] = prefix[i];
+        }
+        end = DBGU_FormatHex(line + i, size);
+        *end++ = ' ';
+        end = DBGU_FormatHex(end, cpuCycles);
+        *end++ = ' ';
+        end = DBGU_FormatHex(end, dmaCycles);
+        *end++ = '\r';
+        *end++ = '\n';
+        DBGU_Commit(end - line);
+    }
+}
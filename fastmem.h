@@ -0,0 +1,82 @@
+/* ----------------------------------------------------------------------------
+ *         Block copy and fill
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** memcpy() and memset() replacements that pick the CPU or the HDMA for each
+** block. Blocks below FASTMEM_DMA_THRESHOLD bytes, and blocks whose source
+** and destination are not aligned alike, are handled by an unrolled word
+** loop; larger blocks go to an HDMA channel for their word-aligned part.
+**
+** FASTMEM_Copy() and FASTMEM_Set() return once the block is done. The
+** asynchronous variants return as soon as the HDMA is started, so that the
+** caller can overlap the copy with other work, and report the end through a
+** callback or FASTMEM_Wait().
+**
+** The threshold comes from fastmem_threshold.h, generated from the output of
+** FASTMEM_Calibrate() on the target by tools/gen_fastmem_threshold.py.
+*/
+
+#ifndef FASTMEM_H
+#define FASTMEM_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "hdma.h"
+#include "fastmem_threshold.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// HDMA queue priority of the copies and fills.
+#ifndef FASTMEM_DMA_PRIORITY
+#define FASTMEM_DMA_PRIORITY    8
+#endif
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Asynchronous copy or fill. Must stay in SRAM and untouched until done.
+typedef struct {
+
+    HdmaTransfer transfer;
+    HdmaDescriptor descriptor;
+    /// Source of the HDMA fills.
+    unsigned int pattern;
+
+} FastmemRequest;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void FASTMEM_Copy(void *dst, const void *src, unsigned int size);
+
+extern void FASTMEM_Set(void *dst, unsigned char value, unsigned int size);
+
+extern unsigned char FASTMEM_CopyAsync(FastmemRequest *request,
+                                       void *dst,
+                                       const void *src,
+                                       unsigned int size,
+                                       HdmaCallback callback,
+                                       void *arg);
+
+extern unsigned char FASTMEM_SetAsync(FastmemRequest *request,
+                                      void *dst,
+                                      unsigned char value,
+                                      unsigned int size,
+                                      HdmaCallback callback,
+                                      void *arg);
+
+extern unsigned char FASTMEM_IsDone(const FastmemRequest *request);
+
+extern void FASTMEM_Wait(const FastmemRequest *request);
+
+extern void FASTMEM_Calibrate(void *dst, const void *src, unsigned int maxSize);
+
+#endif //#ifndef FASTMEM_H
@@ -0,0 +1,20 @@
+/* ----------------------------------------------------------------------------
+ *         Block copy CPU/HDMA cutover
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Generated by tools/gen_fastmem_threshold.py; do not edit.
+** Source: not measured yet, default value.
+*/
+
+#ifndef FASTMEM_THRESHOLD_H
+#define FASTMEM_THRESHOLD_H
+
+/// Smallest block, in bytes, handed to the HDMA; 0 keeps every block on the
+/// CPU.
+#ifndef FASTMEM_DMA_THRESHOLD
+#define FASTMEM_DMA_THRESHOLD   1024
+#endif
+
+#endif //#ifndef FASTMEM_THRESHOLD_H
@@ -0,0 +1,245 @@
+/* ----------------------------------------------------------------------------
+ *         Fault capture
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "fault.h"
+#include "crc.h"
+#include "dbgu.h"
+#include "kernel.h"
+#include "sections.h"
+#include "AT91SAM3U4.h"
+
+#include <intrinsics.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Range a stacked frame must lie in to be read: SRAM0 to the end of SRAM1.
+/// Reading a wild stack pointer would fault again and lock the core up.
+#define RAM_START               0x20000000
+#define RAM_END                 0x20084000
+
+/// Size of the frame stacked by the hardware.
+#define FRAME_SIZE              (8 * 4)
+
+/// AIRCR write key and priority grouping field.
+#define AIRCR_VECTKEY           (0x05FA << 16)
+#define AIRCR_PRIGROUP          (0x7 << 8)
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static NOINIT FaultRecord faultRecord;
+
+/// Fault names indexed by exception number.
+static const char * const faultNames[] = {
+
+    "", "", "", "HardFault", "MemManage", "BusFault", "UsageFault"
+};
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns the CRC of a record, its crc field excluded.
+//------------------------------------------------------------------------------
+static unsigned int RecordCrc(const FaultRecord *record)
+{
+    return CRC_Compute32(0, record,
+                         (unsigned int) &record->crc - (unsigned int) record);
+}
+
+//------------------------------------------------------------------------------
+/// Sends "  name value" on the DBGU.
+//------------------------------------------------------------------------------
+static void PutRegister(const char *name, unsigned int value)
+{
+    DBGU_PutString("  ");
+    DBGU_PutString(name);
+    DBGU_PutChar(' ');
+    DBGU_PutHex(value);
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Enables the MemManage, BusFault and UsageFault handlers, so that these
+/// faults are reported as such instead of escalating to HardFault, and the
+/// trap on division by zero.
+//------------------------------------------------------------------------------
+void FAULT_Initialize(void)
+{
+    AT91C_BASE_NVIC->NVIC_CCR |= AT91C_NVIC_DIV_0_TRP;
+    AT91C_BASE_NVIC->NVIC_HANDCSR |= AT91C_NVIC_MEMFAULTENA
+                                     | AT91C_NVIC_BUSFAULTENA
+                                     | AT91C_NVIC_USGFAULTENA;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the crash record left by the last fault, or 0 if there is none
+/// (cleared, or lost with the RAM contents on power-up).
+//------------------------------------------------------------------------------
+const FaultRecord * FAULT_GetRecord(void)
+{
+    if ((faultRecord.magic != FAULT_MAGIC)
+        || (faultRecord.crc != RecordCrc(&faultRecord))) {
+
+        return 0;
+    }
+
+    return &faultRecord;
+}
+
+//------------------------------------------------------------------------------
+/// Discards the crash record.
+//------------------------------------------------------------------------------
+void FAULT_Clear(void)
+{
+    faultRecord.magic = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Prints the crash record on the DBGU, which must be configured.
+/// Returns 1 if there was a record to print; otherwise 0.
+//------------------------------------------------------------------------------
+unsigned char FAULT_Report(void)
+{
+    const FaultRecord *record = FAULT_GetRecord();
+    const char *name;
+
+    if (record == 0) {
+
+        return 0;
+    }
+
+    DBGU_PutString("\n-F- ");
+    if (record->exception < sizeof(faultNames) / sizeof(faultNames[0])) {
+
+        DBGU_PutString(faultNames[record->exception]);
+    }
+    DBGU_PutString(" in ");
+    if (record->thread == FAULT_NO_THREAD) {
+
+        DBGU_PutString("main");
+    }
+    else {
+
+        name = KERNEL_GetThreadName(record->thread);
+        DBGU_PutString(name ? name : "thread");
+        DBGU_PutString(" (priority ");
+        DBGU_PutHex(record->thread);
+        DBGU_PutString(")");
+    }
+    DBGU_PutString(", fault #");
+    DBGU_PutHex(record->count);
+    DBGU_PutString("\n");
+
+    PutRegister("R0  ", record->r0);
+    PutRegister("R1  ", record->r1);
+    PutRegister("R2  ", record->r2);
+    PutRegister("R3  ", record->r3);
+    DBGU_PutString("\n");
+    PutRegister("R12 ", record->r12);
+    PutRegister("LR  ", record->lr);
+    PutRegister("PC  ", record->pc);
+    PutRegister("xPSR", record->xpsr);
+    DBGU_PutString("\n");
+    PutRegister("SP  ", record->sp);
+    PutRegister("EXC ", record->excReturn);
+    PutRegister("CFSR", record->cfsr);
+    PutRegister("HFSR", record->hfsr);
+    DBGU_PutString("\n");
+    PutRegister("MMAR", record->mmar);
+    PutRegister("BFAR", record->bfar);
+    DBGU_PutString("\n");
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// C part of the fault handlers: fills the crash record and resets the core.
+/// \param frame  Stack pointer the hardware pushed the fault frame on.
+/// \param excReturn  EXC_RETURN value of the handler.
+/// \param exception  Exception number (IPSR).
+//------------------------------------------------------------------------------
+void FAULT_Capture(unsigned int *frame,
+                   unsigned int excReturn,
+                   unsigned int exception)
+{
+    FaultRecord *record = &faultRecord;
+    unsigned int count;
+    unsigned int address = (unsigned int) frame;
+    unsigned int thread = (unsigned int) kernelCurrent;
+
+    __disable_interrupt();
+
+    count = FAULT_GetRecord() ? record->count + 1 : 1;
+
+    record->magic = FAULT_MAGIC;
+    record->exception = exception;
+    record->excReturn = excReturn;
+    record->sp = address;
+
+    if (((address & 3) == 0)
+        && (address >= RAM_START)
+        && (address <= RAM_END - FRAME_SIZE)) {
+
+        record->r0 = frame[0];
+        record->r1 = frame[1];
+        record->r2 = frame[2];
+        record->r3 = frame[3];
+        record->r12 = frame[4];
+        record->lr = frame[5];
+        record->pc = frame[6];
+        record->xpsr = frame[7];
+    }
+    else {
+
+        record->r0 = record->r1 = record->r2 = record->r3 = 0;
+        record->r12 = record->lr = record->pc = record->xpsr = 0;
+    }
+
+    record->cfsr = AT91C_BASE_NVIC->NVIC_CFSR;
+    record->hfsr = AT91C_BASE_NVIC->NVIC_HFSR;
+    record->mmar = AT91C_BASE_NVIC->NVIC_MMAR;
+    record->bfar = AT91C_BASE_NVIC->NVIC_BFAR;
+    if (((thread & 3) == 0)
+        && (thread >= RAM_START)
+        && (thread <= RAM_END - sizeof(KernelThread))) {
+
+        record->thread = kernelCurrent->priority;
+    }
+    else {
+
+        record->thread = FAULT_NO_THREAD;
+    }
+    record->count = count;
+    record->crc = RecordCrc(record);
+
+    FAULT_Reset();
+}
+
+//------------------------------------------------------------------------------
+/// Resets the core and the peripherals through AIRCR.SYSRESETREQ. The RAM,
+/// and with it the NOINIT block, is kept.
+//------------------------------------------------------------------------------
+void FAULT_Reset(void)
+{
+    __disable_interrupt();
+    __DSB();
+    AT91C_BASE_CM3->CM3_AIRCR = AIRCR_VECTKEY
+                                | (AT91C_BASE_CM3->CM3_AIRCR & AIRCR_PRIGROUP)
+                                | AT91C_CM3_SYSRESETREQ;
+    __DSB();
+    while (1);
+}
@@ -0,0 +1,89 @@
+/* ----------------------------------------------------------------------------
+ *         Fault capture
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** HardFault, MemManage, BusFault and UsageFault all enter the same stub
+** (fault_iar.s), which picks the stack the fault frame was pushed on (MSP or
+** PSP) and calls FAULT_Capture(). The frame, the fault status and address
+** registers and the priority of the running thread are saved in a
+** CRC-protected record in the NOINIT block, then the core is reset through
+** AIRCR.SYSRESETREQ. Nothing reached through a pointer is saved: the thread
+** control block may be what got corrupted.
+**
+** After the reset, FAULT_GetRecord() returns the record if its CRC is valid,
+** and FAULT_Report() prints it on the DBGU, with the name of the thread if
+** it has been created again by then.
+*/
+
+#ifndef FAULT_H
+#define FAULT_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// FaultRecord.magic of a captured record.
+#define FAULT_MAGIC             0xFA017C4D
+
+/// FaultRecord.thread outside of the kernel threads.
+#define FAULT_NO_THREAD         0xFFFFFFFF
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Crash record, kept across the reset.
+typedef struct {
+
+    unsigned int magic;
+    /// Exception number (3 HardFault, 4 MemManage, 5 BusFault, 6 UsageFault).
+    unsigned int exception;
+    /// EXC_RETURN value of the fault handler.
+    unsigned int excReturn;
+    /// Stack pointer the frame was pushed on.
+    unsigned int sp;
+    /// Stacked R0-R3, R12, LR, PC and xPSR; zero if sp was out of RAM.
+    unsigned int r0;
+    unsigned int r1;
+    unsigned int r2;
+    unsigned int r3;
+    unsigned int r12;
+    unsigned int lr;
+    unsigned int pc;
+    unsigned int xpsr;
+    /// Fault status and address registers.
+    unsigned int cfsr;
+    unsigned int hfsr;
+    unsigned int mmar;
+    unsigned int bfar;
+    /// Priority of the running kernel thread; FAULT_NO_THREAD before
+    /// KERNEL_Start() or if its control block was out of RAM.
+    unsigned int thread;
+    /// Faults captured since the record was last cleared.
+    unsigned int count;
+    /// CRC-32 of the fields above.
+    unsigned int crc;
+
+} FaultRecord;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void FAULT_Initialize(void);
+
+extern const FaultRecord * FAULT_GetRecord(void);
+
+extern void FAULT_Clear(void);
+
+extern unsigned char FAULT_Report(void);
+
+extern void FAULT_Reset(void);
+
+extern void FAULT_Capture(unsigned int *frame,
+                          unsigned int excReturn,
+                          unsigned int exception);
+
+#endif //#ifndef FAULT_H
@@ -0,0 +1,36 @@
+;------------------------------------------------------------------------------
+;         Fault capture - fault handler entry
+;------------------------------------------------------------------------------
+;
+; All the fault handlers share one stub. It runs before any C code touches the
+; stack, and passes the stack pointer the hardware pushed the fault frame on,
+; EXC_RETURN and the exception number to FAULT_Capture(), which never returns.
+;------------------------------------------------------------------------------
+
+        MODULE  ?fault_iar
+
+        EXTERN  FAULT_Capture
+
+        SECTION .text:CODE:NOROOT(2)
+        THUMB
+
+;------------------------------------------------------------------------------
+; EXC_RETURN bit 2 tells whether the frame is on MSP (0) or PSP (1).
+;------------------------------------------------------------------------------
+        PUBLIC  HardFault_Handler
+        PUBLIC  MemManage_Handler
+        PUBLIC  BusFault_Handler
+        PUBLIC  UsageFault_Handler
+HardFault_Handler:
+MemManage_Handler:
+BusFault_Handler:
+UsageFault_Handler:
+        TST     LR, #4
+        ITE     EQ
+        MRSEQ   R0, MSP
+        MRSNE   R0, PSP
+        MOV     R1, LR
+        MRS     R2, IPSR
+        B       FAULT_Capture
+
+        END
@@ -0,0 +1,99 @@
+/* ----------------------------------------------------------------------------
+ *         Flash disk
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "flashdisk.h"
+#include "iap.h"
+
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the range of blocks is inside the device.
+//------------------------------------------------------------------------------
+static unsigned char IsInside(const BlockDevice *device,
+                              unsigned int block,
+                              unsigned int count)
+{
+    return (count != 0) && (block < device->numBlocks)
+           && (count <= device->numBlocks - block);
+}
+
+//------------------------------------------------------------------------------
+/// BlockDevice.read
+//------------------------------------------------------------------------------
+static unsigned char Read(BlockDevice *device,
+                          unsigned int block,
+                          void *buffer,
+                          unsigned int count,
+                          BlockCallback callback,
+                          void *arg)
+{
+    if (!IsInside(device, block, count)) {
+
+        return 0;
+    }
+    memcpy(buffer,
+           (const unsigned char *) device->context + block * BLOCK_SIZE,
+           count * BLOCK_SIZE);
+    if (callback) {
+
+        callback(arg, BLOCK_STATUS_OK);
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// BlockDevice.write
+//------------------------------------------------------------------------------
+static unsigned char Write(BlockDevice *device,
+                           unsigned int block,
+                           const void *buffer,
+                           unsigned int count,
+                           BlockCallback callback,
+                           void *arg)
+{
+    unsigned char ok;
+
+    if (!IsInside(device, block, count)) {
+
+        return 0;
+    }
+    ok = IAP_Write((unsigned int) device->context + block * BLOCK_SIZE,
+                   buffer,
+                   count * BLOCK_SIZE);
+    if (callback) {
+
+        callback(arg, ok ? BLOCK_STATUS_OK : BLOCK_STATUS_ERROR);
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Sets up a flash disk. IAP_Initialize() must have been called.
+/// \param device  Block device to fill in.
+/// \param address  Start of the flash range, on a page boundary.
+/// \param numBlocks  Size of the disk, in blocks.
+//------------------------------------------------------------------------------
+void FLASHDISK_Initialize(BlockDevice *device,
+                          unsigned int address,
+                          unsigned int numBlocks)
+{
+    device->read = Read;
+    device->write = Write;
+    device->numBlocks = numBlocks;
+    device->writeProtected = 0;
+    device->context = (void *) address;
+}
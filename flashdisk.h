@@ -0,0 +1,31 @@
+/* ----------------------------------------------------------------------------
+ *         Flash disk
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Block device on a range of the internal flash, written through iap.h.
+** Operations complete before read() and write() return; a write takes a few
+** milliseconds per flash page, so the users must call it from a task, never
+** from an interrupt. Unlike the SD card, each write erases its pages: keep
+** the device for data written in rotation (logs), not for a file system.
+*/
+
+#ifndef FLASHDISK_H
+#define FLASHDISK_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "block.h"
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void FLASHDISK_Initialize(BlockDevice *device,
+                                 unsigned int address,
+                                 unsigned int numBlocks);
+
+#endif //#ifndef FLASHDISK_H
@@ -0,0 +1,421 @@
+/* ----------------------------------------------------------------------------
+ *         HDMA transfer service
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "hdma.h"
+#include "exceptions.h"
+#include "irq.h"
+#include "AT91SAM3U4.h"
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Position of the width fields in CTRLA.
+#define SRC_WIDTH_SHIFT         24
+#define DST_WIDTH_SHIFT         28
+
+/// Position of the destination handshaking interface in CFG.
+#define DST_PER_SHIFT           4
+
+/// Interrupts of channel 0; shifted left by the channel number for the others.
+#define CHANNEL_INTERRUPTS      (AT91C_HDMA_CBTC0 | AT91C_HDMA_ERR0)
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Transfer running on each channel.
+static HdmaTransfer *running[HDMA_NUM_CHANNELS];
+
+/// Transfers waiting for a channel, by priority then submission order.
+static HdmaTransfer *pending;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Starts a transfer on a free channel. Must be called in a critical section
+/// or from HDMA_IrqHandler().
+//------------------------------------------------------------------------------
+static void Start(unsigned int channel, HdmaTransfer *transfer)
+{
+    AT91PS_HDMA_CH registers = &AT91C_BASE_HDMA->HDMA_CH[channel];
+
+    running[channel] = transfer;
+    transfer->status = HDMA_STATUS_BUSY;
+
+    // The first descriptor is fetched on enable, the others when the
+    // previous one is done
+    registers->HDMA_CFG = transfer->cfg;
+    registers->HDMA_CTRLB = transfer->ctrlb;
+    registers->HDMA_DSCR = (unsigned int) transfer->descriptors;
+    AT91C_BASE_HDMA->HDMA_CHER = AT91C_HDMA_ENA0 << channel;
+}
+
+//------------------------------------------------------------------------------
+/// Gives a channel that has become free to the first waiting transfer.
+//------------------------------------------------------------------------------
+static void StartPending(unsigned int channel)
+{
+    HdmaTransfer *transfer = pending;
+
+    if (transfer) {
+
+        pending = transfer->next;
+        transfer->next = 0;
+        Start(channel, transfer);
+    }
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Enables the controller and its interrupt.
+//------------------------------------------------------------------------------
+void HDMA_Initialize(void)
+{
+    unsigned int channel;
+
+    AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_HDMA;
+    AT91C_BASE_HDMA->HDMA_EN = AT91C_HDMA_ENABLE_ENABLE;
+    AT91C_BASE_HDMA->HDMA_GCFG = AT91C_HDMA_ARB_CFG_ROUND_ROBIN;
+
+    AT91C_BASE_HDMA->HDMA_EBCIDR = 0xFFFFFFFF;
+    AT91C_BASE_HDMA->HDMA_EBCISR;
+    for (channel = 0; channel < HDMA_NUM_CHANNELS; channel++) {
+
+        AT91C_BASE_HDMA->HDMA_EBCIER = CHANNEL_INTERRUPTS << channel;
+    }
+
+    IRQ_ClearPending(AT91C_ID_HDMA);
+    IRQ_Enable(AT91C_ID_HDMA);
+}
+
+//------------------------------------------------------------------------------
+/// Sets up an empty transfer.
+/// \param transfer  Transfer to set up; must not be queued or running.
+/// \param type  HDMA_MEM2MEM, HDMA_MEM2PER, HDMA_PER2MEM or HDMA_FILL, with
+///              HDMA_FIXED_MEMORY for the peripheral types.
+/// \param peripheral  Handshaking interface (HDMA_PER_xxx); ignored for
+///                    memory-to-memory transfers.
+/// \param width  Single transfer width (HDMA_WIDTH_xxx); for peripherals,
+///               the width of their data register.
+/// \param descriptors  Storage for the descriptor chain.
+/// \param maxDescriptors  Number of descriptors in the storage.
+//------------------------------------------------------------------------------
+void HDMA_Prepare(HdmaTransfer *transfer,
+                  unsigned char type,
+                  unsigned char peripheral,
+                  unsigned char width,
+                  HdmaDescriptor *descriptors,
+                  unsigned int maxDescriptors)
+{
+    transfer->descriptors = descriptors;
+    transfer->maxDescriptors = maxDescriptors;
+    transfer->count = 0;
+    transfer->width = width;
+    transfer->status = HDMA_STATUS_IDLE;
+    transfer->next = 0;
+
+    // Descriptors are always fetched from memory (SRC_DSCR = DST_DSCR = 0)
+    transfer->ctrla = (width << SRC_WIDTH_SHIFT) | (width << DST_WIDTH_SHIFT);
+    switch (type & ~HDMA_FIXED_MEMORY) {
+
+        case HDMA_MEM2PER:
+            transfer->ctrlb = AT91C_HDMA_FC_MEM2PER
+                              | AT91C_HDMA_SRC_ADDRESS_MODE_INCR
+                              | AT91C_HDMA_DST_ADDRESS_MODE_FIXED;
+            transfer->cfg = AT91C_HDMA_DST_H2SEL_HW
+                            | (peripheral << DST_PER_SHIFT);
+            break;
+
+        case HDMA_PER2MEM:
+            transfer->ctrlb = AT91C_HDMA_FC_PER2MEM
+                              | AT91C_HDMA_SRC_ADDRESS_MODE_FIXED
+                              | AT91C_HDMA_DST_ADDRESS_MODE_INCR;
+            transfer->cfg = AT91C_HDMA_SRC_H2SEL_HW | peripheral;
+            break;
+
+        case HDMA_FILL:
+            transfer->ctrla |= AT91C_HDMA_SCSIZE_4 | AT91C_HDMA_DCSIZE_4;
+            transfer->ctrlb = AT91C_HDMA_FC_MEM2MEM
+                              | AT91C_HDMA_SRC_ADDRESS_MODE_FIXED
+                              | AT91C_HDMA_DST_ADDRESS_MODE_INCR;
+            transfer->cfg = AT91C_HDMA_FIFOCFG_LARGESTBURST;
+            break;
+
+        default:
+            transfer->ctrla |= AT91C_HDMA_SCSIZE_4 | AT91C_HDMA_DCSIZE_4;
+            transfer->ctrlb = AT91C_HDMA_FC_MEM2MEM
+                              | AT91C_HDMA_SRC_ADDRESS_MODE_INCR
+                              | AT91C_HDMA_DST_ADDRESS_MODE_INCR;
+            transfer->cfg = AT91C_HDMA_FIFOCFG_LARGESTBURST;
+            break;
+    }
+
+    if (type & HDMA_FIXED_MEMORY) {
+
+        transfer->ctrlb = (transfer->ctrlb & AT91C_HDMA_FC)
+                          | AT91C_HDMA_SRC_ADDRESS_MODE_FIXED
+                          | AT91C_HDMA_DST_ADDRESS_MODE_FIXED;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Appends a buffer to a transfer, over several descriptors if it is larger
+/// than HDMA_MAX_BTSIZE single transfers. The peripheral side address (dst
+/// for HDMA_MEM2PER, src for HDMA_PER2MEM) is that of its data register.
+/// Returns 1 on success; 0 if the size or an address is not a multiple of
+/// the width, if the descriptors are exhausted, or if the transfer is queued
+/// or running (the transfer is then left unchanged).
+/// \param transfer  Transfer set up with HDMA_Prepare().
+/// \param src  Source address.
+/// \param dst  Destination address.
+/// \param size  Size in bytes (non-zero).
+//------------------------------------------------------------------------------
+unsigned char HDMA_AddBuffer(HdmaTransfer *transfer,
+                             const void *src,
+                             void *dst,
+                             unsigned int size)
+{
+    unsigned int mask = (1 << transfer->width) - 1;
+    unsigned int saddr = (unsigned int) src;
+    unsigned int daddr = (unsigned int) dst;
+    unsigned int units = size >> transfer->width;
+    unsigned int count = transfer->count;
+    unsigned int chunk;
+    HdmaDescriptor *descriptor;
+
+    if ((transfer->status == HDMA_STATUS_QUEUED)
+        || (transfer->status == HDMA_STATUS_BUSY)
+        || (units == 0) || ((size | saddr | daddr) & mask)
+        || ((count + (units + HDMA_MAX_BTSIZE - 1) / HDMA_MAX_BTSIZE)
+            > transfer->maxDescriptors)) {
+
+        return 0;
+    }
+
+    while (units) {
+
+        chunk = (units > HDMA_MAX_BTSIZE) ? HDMA_MAX_BTSIZE : units;
+
+        descriptor = &transfer->descriptors[count];
+        descriptor->saddr = saddr;
+        descriptor->daddr = daddr;
+        descriptor->ctrla = transfer->ctrla | chunk;
+        descriptor->ctrlb = transfer->ctrlb;
+        descriptor->next = 0;
+        if (count) {
+
+            transfer->descriptors[count - 1].next = descriptor;
+        }
+        count++;
+
+        if ((transfer->ctrlb & AT91C_HDMA_SRC_ADDRESS_MODE)
+            != AT91C_HDMA_SRC_ADDRESS_MODE_FIXED) {
+
+            saddr += chunk << transfer->width;
+        }
+        if ((transfer->ctrlb & AT91C_HDMA_DST_ADDRESS_MODE)
+            != AT91C_HDMA_DST_ADDRESS_MODE_FIXED) {
+
+            daddr += chunk << transfer->width;
+        }
+        units -= chunk;
+    }
+    transfer->count = count;
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Starts a transfer on a free channel, or queues it until one is free.
+/// Can be called from threads and from interrupt handlers of preemption level
+/// IRQ_CRITICAL_LEVEL or lower.
+/// Returns 1 on success; 0 if the transfer is empty, queued or running.
+/// \param transfer  Transfer with at least one buffer.
+/// \param priority  Queue priority; lower values are started first.
+/// \param callback  Called at the end of the transfer, or 0.
+/// \param arg  Argument of the callback.
+//------------------------------------------------------------------------------
+unsigned char HDMA_Submit(HdmaTransfer *transfer,
+                          unsigned char priority,
+                          HdmaCallback callback,
+                          void *arg)
+{
+    HdmaTransfer **link;
+    unsigned int channel;
+    IrqState state;
+
+    if ((transfer->count == 0)
+        || (transfer->status == HDMA_STATUS_QUEUED)
+        || (transfer->status == HDMA_STATUS_BUSY)) {
+
+        return 0;
+    }
+    transfer->priority = priority;
+    transfer->callback = callback;
+    transfer->arg = arg;
+    transfer->next = 0;
+
+    state = IRQ_EnterCritical();
+
+    for (channel = 0; channel < HDMA_NUM_CHANNELS; channel++) {
+
+        if (running[channel] == 0) {
+
+            Start(channel, transfer);
+            IRQ_ExitCritical(state);
+            return 1;
+        }
+    }
+
+    // Behind the transfers of the same or a better priority
+    link = &pending;
+    while (*link && ((*link)->priority <= priority)) {
+
+        link = &(*link)->next;
+    }
+    transfer->next = *link;
+    *link = transfer;
+    transfer->status = HDMA_STATUS_QUEUED;
+
+    IRQ_ExitCritical(state);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Removes a transfer from the queue, or stops it if it is running; the data
+/// in the channel FIFO is then lost. The callback is not called.
+/// Returns 1 if the transfer was queued or running; otherwise 0.
+//------------------------------------------------------------------------------
+unsigned char HDMA_Cancel(HdmaTransfer *transfer)
+{
+    HdmaTransfer **link;
+    unsigned int channel;
+    unsigned char cancelled = 0;
+    IrqState state = IRQ_EnterCritical();
+
+    if (transfer->status == HDMA_STATUS_QUEUED) {
+
+        link = &pending;
+        while (*link != transfer) {
+
+            link = &(*link)->next;
+        }
+        *link = transfer->next;
+        transfer->next = 0;
+        cancelled = 1;
+    }
+    else if (transfer->status == HDMA_STATUS_BUSY) {
+
+        for (channel = 0; channel < HDMA_NUM_CHANNELS; channel++) {
+
+            if (running[channel] == transfer) {
+
+                AT91C_BASE_HDMA->HDMA_CHDR = AT91C_HDMA_ENA0 << channel;
+                while (AT91C_BASE_HDMA->HDMA_CHSR
+                       & (AT91C_HDMA_ENA0 << channel));
+
+                running[channel] = 0;
+                StartPending(channel);
+                cancelled = 1;
+                break;
+            }
+        }
+    }
+    if (cancelled) {
+
+        transfer->status = HDMA_STATUS_IDLE;
+    }
+
+    IRQ_ExitCritical(state);
+
+    return cancelled;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the status of a transfer (HDMA_STATUS_xxx).
+//------------------------------------------------------------------------------
+unsigned char HDMA_GetStatus(const HdmaTransfer *transfer)
+{
+    return transfer->status;
+}
+
+//------------------------------------------------------------------------------
+/// HDMA interrupt: completes the transfers that have reached the end of their
+/// chain, or stopped on a bus error, and starts the waiting ones. Every
+/// channel is settled before the first callback, so that a callback can
+/// submit again a transfer whose own completion is reported next; that
+/// completion is then stale and dropped, as is that of a transfer cancelled
+/// by an earlier callback.
+//------------------------------------------------------------------------------
+void HDMA_IrqHandler(void)
+{
+    unsigned int status = AT91C_BASE_HDMA->HDMA_EBCISR
+                          & AT91C_BASE_HDMA->HDMA_EBCIMR;
+    HdmaTransfer *completed[HDMA_NUM_CHANNELS];
+    unsigned char results[HDMA_NUM_CHANNELS];
+    unsigned int channel;
+    HdmaTransfer *transfer;
+
+    for (channel = 0; channel < HDMA_NUM_CHANNELS; channel++) {
+
+        completed[channel] = 0;
+        transfer = running[channel];
+        if (((status & (CHANNEL_INTERRUPTS << channel)) == 0)
+            || (transfer == 0)) {
+
+            continue;
+        }
+
+        if (status & (AT91C_HDMA_ERR0 << channel)) {
+
+            AT91C_BASE_HDMA->HDMA_CHDR = AT91C_HDMA_ENA0 << channel;
+            results[channel] = HDMA_STATUS_ERROR;
+        }
+        else if (AT91C_BASE_HDMA->HDMA_CHSR & (AT91C_HDMA_ENA0 << channel)) {
+
+            // Left over from a transfer cancelled just before its end, while
+            // its successor already runs
+            continue;
+        }
+        else {
+
+            results[channel] = HDMA_STATUS_DONE;
+        }
+        transfer->status = results[channel];
+        running[channel] = 0;
+        completed[channel] = transfer;
+    }
+
+    for (channel = 0; channel < HDMA_NUM_CHANNELS; channel++) {
+
+        if (running[channel] == 0) {
+
+            StartPending(channel);
+        }
+    }
+
+    for (channel = 0; channel < HDMA_NUM_CHANNELS; channel++) {
+
+        // Submitted again or cancelled by an earlier callback: the status
+        // no longer is the one settled above
+        transfer = completed[channel];
+        if (transfer && transfer->callback
+            && (transfer->status == results[channel])) {
+
+            transfer->callback(transfer->arg, results[channel]);
+        }
+    }
+}
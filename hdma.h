@@ -0,0 +1,130 @@
+/* ----------------------------------------------------------------------------
+ *         HDMA transfer service
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Shares the four HDMA channels between clients. A transfer is a chain of
+** linked-list descriptors built by the client in its own memory, then
+** submitted with a priority: it starts at once on a free channel, or waits in
+** a queue ordered by priority until a channel completes. The controller
+** walks the chain on its own and interrupts once at the end, when the
+** transfer callback is called from HDMA_IrqHandler().
+**
+** Descriptors and buffers must stay untouched until the callback, and must
+** lie in SRAM or in the peripheral space; the HDMA has no access to the
+** core-coupled memories.
+*/
+
+#ifndef HDMA_H
+#define HDMA_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Number of channels.
+#define HDMA_NUM_CHANNELS       4
+
+/// Transfer types.
+#define HDMA_MEM2MEM            0
+#define HDMA_MEM2PER            1
+#define HDMA_PER2MEM            2
+/// Memory fill: the source address of each buffer is that of the fill word.
+#define HDMA_FILL               3
+/// Flag for HDMA_MEM2PER and HDMA_PER2MEM: the memory side address stays
+/// fixed, to send the same word repeatedly or to discard what is received.
+#define HDMA_FIXED_MEMORY       0x80
+
+/// Width of the single transfers.
+#define HDMA_WIDTH_BYTE         0
+#define HDMA_WIDTH_HALFWORD     1
+#define HDMA_WIDTH_WORD         2
+
+/// Hardware handshaking interfaces.
+#define HDMA_PER_MCI0           0
+#define HDMA_PER_SPI0_TX        1
+#define HDMA_PER_SPI0_RX        2
+#define HDMA_PER_SSC0_TX        3
+#define HDMA_PER_SSC0_RX        4
+
+/// Transfer status.
+#define HDMA_STATUS_IDLE        0
+#define HDMA_STATUS_QUEUED      1
+#define HDMA_STATUS_BUSY        2
+#define HDMA_STATUS_DONE        3
+#define HDMA_STATUS_ERROR       4
+
+/// Largest number of single transfers per descriptor (CTRLA.BTSIZE).
+#define HDMA_MAX_BTSIZE         0xFFFF
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Linked-list descriptor, in the layout fetched by the controller. Must be
+/// word aligned.
+typedef struct _HdmaDescriptor {
+
+    unsigned int saddr;
+    unsigned int daddr;
+    unsigned int ctrla;
+    unsigned int ctrlb;
+    struct _HdmaDescriptor *next;
+
+} HdmaDescriptor;
+
+/// Called from HDMA_IrqHandler() when a transfer ends, with its status
+/// (HDMA_STATUS_DONE or HDMA_STATUS_ERROR).
+typedef void (*HdmaCallback)(void *arg, unsigned char status);
+
+/// Transfer. Set up with HDMA_Prepare() and HDMA_AddBuffer().
+typedef struct _HdmaTransfer {
+
+    HdmaDescriptor *descriptors;
+    unsigned int maxDescriptors;
+    unsigned int count;
+    /// Channel configuration (HDMA_CFG) and descriptor flags.
+    unsigned int cfg;
+    unsigned int ctrla;
+    unsigned int ctrlb;
+    /// Single transfer width, as a shift.
+    unsigned char width;
+    /// Lower values are started first.
+    unsigned char priority;
+    volatile unsigned char status;
+    HdmaCallback callback;
+    void *arg;
+    /// Next transfer in the waiting queue.
+    struct _HdmaTransfer *next;
+
+} HdmaTransfer;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void HDMA_Initialize(void);
+
+extern void HDMA_Prepare(HdmaTransfer *transfer,
+                         unsigned char type,
+                         unsigned char peripheral,
+                         unsigned char width,
+                         HdmaDescriptor *descriptors,
+                         unsigned int maxDescriptors);
+
+extern unsigned char HDMA_AddBuffer(HdmaTransfer *transfer,
+                                    const void *src,
+                                    void *dst,
+                                    unsigned int size);
+
+extern unsigned char HDMA_Submit(HdmaTransfer *transfer,
+                                 unsigned char priority,
+                                 HdmaCallback callback,
+                                 void *arg);
+
+extern unsigned char HDMA_Cancel(HdmaTransfer *transfer);
+
+extern unsigned char HDMA_GetStatus(const HdmaTransfer *transfer);
+
+#endif //#ifndef HDMA_H
@@ -0,0 +1,411 @@
+/* ----------------------------------------------------------------------------
+ *         In-application flash programming
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "iap.h"
+#include "irq.h"
+#include "sections.h"
+
+#include <intrinsics.h>
+#include <string.h>
+
+#if IAP_RUN_LEVEL >= IRQ_CRITICAL_LEVEL
+#error "IAP_RUN_LEVEL must be below IRQ_CRITICAL_LEVEL"
+#endif
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Vectors and the ready handler are fetched from SRAM, so the levels up to
+/// IAP_RUN_LEVEL may run during a command. Otherwise (vectors in flash, or
+/// the handlers wrapped by irqstats.c), every interrupt is masked.
+#if IRQ_RAM_VECTORS && !IRQ_INSTRUMENT
+#define RUN_INTERRUPTS          1
+#else
+#define RUN_INTERRUPTS          0
+#endif
+
+/// BASEPRI value during a command.
+#define COMMAND_BASEPRI         IRQ_PRIORITY(IAP_RUN_LEVEL + 1, 0)
+
+/// EFC_FCR fields.
+#define FCR_KEY                 (0x5Au << 24)
+#define FCR(command, argument)  (FCR_KEY | ((argument) << 8) | (command))
+
+/// Errors reported by EFC_FSR.
+#define FSR_ERRORS              (AT91C_EFC_FCMDE | AT91C_EFC_LOCKE)
+
+/// Pages per lock region.
+#define PAGES_PER_REGION        (IAP_LOCK_REGION_SIZE / IAP_PAGE_SIZE)
+
+/// Address of a page.
+#define PAGE_ADDRESS(page)      (IAP_FLASH_START + (page) * IAP_PAGE_SIZE)
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Content of the page being programmed, copied into the latch.
+static unsigned int pageBuffer[IAP_PAGE_SIZE / 4];
+
+/// EFC0 is at a level that wakes the wait of a command.
+static unsigned char useInterrupt;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// EFC0 ready interrupt: the ready flag is a level, so the interrupt is
+/// disabled until the next command.
+//------------------------------------------------------------------------------
+RAMFUNC static void ReadyHandler(void)
+{
+    AT91C_BASE_EFC0->EFC_FMR &= ~AT91C_EFC_FRDY;
+}
+
+//------------------------------------------------------------------------------
+/// Issues a command and waits for its end, entirely from SRAM: only
+/// intrinsics and register accesses, no call and no constant from flash.
+/// Returns the error flags of EFC_FSR.
+/// \param fcr  Value of EFC_FCR.
+/// \param sleep  1 to wait for the ready interrupt, 0 to poll.
+//------------------------------------------------------------------------------
+RAMFUNC static unsigned int RunCommand(unsigned int fcr, unsigned char sleep)
+{
+    AT91PS_EFC efc = AT91C_BASE_EFC0;
+    __istate_t state = __get_interrupt_state();
+    unsigned int basepri = __get_BASEPRI();
+    unsigned int errors = 0;
+    unsigned int status;
+
+#if RUN_INTERRUPTS
+    if ((basepri == 0) || (basepri > COMMAND_BASEPRI)) {
+
+        __set_BASEPRI(COMMAND_BASEPRI);
+    }
+#else
+    __disable_interrupt();
+#endif
+
+    efc->EFC_FCR = fcr;
+    if (sleep) {
+
+        efc->EFC_FMR |= AT91C_EFC_FRDY;
+    }
+
+    // Errors are cleared when read, so they are gathered along the wait
+    do {
+
+        if (sleep) {
+
+            // Masked between the check and the sleep, so that the ready
+            // interrupt cannot slip in unnoticed; the sleep still ends on it
+            __disable_interrupt();
+            status = efc->EFC_FSR;
+            errors |= status;
+            if (!(status & AT91C_EFC_FRDY_S)) {
+
+                __WFI();
+            }
+            __enable_interrupt();
+        }
+        else {
+
+            status = efc->EFC_FSR;
+            errors |= status;
+        }
+    }
+    while (!(status & AT91C_EFC_FRDY_S));
+
+    __set_BASEPRI(basepri);
+    __set_interrupt_state(state);
+
+    return errors & FSR_ERRORS;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the ready interrupt can end the wait of a command: thread
+/// mode, with the levels up to IAP_RUN_LEVEL unmasked.
+//------------------------------------------------------------------------------
+static unsigned char CanSleep(void)
+{
+    unsigned int basepri = __get_BASEPRI();
+
+    return RUN_INTERRUPTS && useInterrupt
+           && (__get_IPSR() == 0)
+           && ((__get_PRIMASK() & 1) == 0)
+           && ((basepri == 0) || (basepri > COMMAND_BASEPRI));
+}
+
+//------------------------------------------------------------------------------
+/// Runs a command. Returns 1 on success; 0 on a command or lock error.
+//------------------------------------------------------------------------------
+static unsigned char Execute(unsigned char command, unsigned int argument)
+{
+    return RunCommand(FCR(command, argument), CanSleep()) == 0;
+}
+
+//------------------------------------------------------------------------------
+/// Copies pageBuffer into the latch and writes it to a page.
+//------------------------------------------------------------------------------
+static unsigned char ProgramBuffer(unsigned int page, unsigned char erase)
+{
+    volatile unsigned int *latch = (volatile unsigned int *) PAGE_ADDRESS(page);
+    unsigned int i;
+
+    // Any write in the flash area lands in the latch, at its page offset
+    for (i = 0; i < IAP_PAGE_SIZE / 4; i++) {
+
+        latch[i] = pageBuffer[i];
+    }
+    return Execute(erase ? AT91C_EFC_FCMD_EWP : AT91C_EFC_FCMD_WP, page);
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if [address, address + size) is a non-empty range of the flash.
+//------------------------------------------------------------------------------
+static unsigned char IsInFlash(unsigned int address, unsigned int size)
+{
+    return (size != 0) && (address >= IAP_FLASH_START)
+           && (address - IAP_FLASH_START < IAP_FLASH_SIZE)
+           && (size <= IAP_FLASH_SIZE - (address - IAP_FLASH_START));
+}
+
+//------------------------------------------------------------------------------
+/// Programs or rewrites a range page by page.
+/// \param erase  0: the bytes around the range are left erased (0xFF) in
+///               the latch, so that programming does not change them.
+///               1: they are read back from the flash, and each page is
+///               erased and written.
+//------------------------------------------------------------------------------
+static unsigned char WriteRange(unsigned int address,
+                                const unsigned char *data,
+                                unsigned int size,
+                                unsigned char erase)
+{
+    unsigned int offset = address - IAP_FLASH_START;
+    unsigned int page;
+    unsigned int start;
+    unsigned int count;
+
+    if (!IsInFlash(address, size)) {
+
+        return 0;
+    }
+
+    while (size) {
+
+        page = offset / IAP_PAGE_SIZE;
+        start = offset % IAP_PAGE_SIZE;
+        count = IAP_PAGE_SIZE - start;
+        if (count > size) {
+
+            count = size;
+        }
+
+        if (erase) {
+
+            memcpy(pageBuffer, (const void *) PAGE_ADDRESS(page), IAP_PAGE_SIZE);
+        }
+        else {
+
+            memset(pageBuffer, 0xFF, IAP_PAGE_SIZE);
+        }
+        memcpy((unsigned char *) pageBuffer + start, data, count);
+
+        // A page that already holds the data is not worn out again
+        if ((!erase
+             || memcmp(pageBuffer, (const void *) PAGE_ADDRESS(page),
+                       IAP_PAGE_SIZE))
+            && !ProgramBuffer(page, erase)) {
+
+            return 0;
+        }
+
+        offset += count;
+        data += count;
+        size -= count;
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Installs the ready handler in the SRAM vector table. Must be called after
+/// IRQ_ConfigurePriorities(), which sets the level of EFC0.
+//------------------------------------------------------------------------------
+void IAP_Initialize(void)
+{
+    AT91C_BASE_EFC0->EFC_FMR &= ~AT91C_EFC_FRDY;
+    useInterrupt = (IRQ_GetPriority(AT91C_ID_EFC0).level <= IAP_RUN_LEVEL);
+#if RUN_INTERRUPTS
+    IRQ_Attach(AT91C_ID_EFC0, ReadyHandler);
+    IRQ_Enable(AT91C_ID_EFC0);
+#endif
+}
+
+//------------------------------------------------------------------------------
+/// Writes a whole page.
+/// Returns 1 on success; 0 if the page does not exist or is locked.
+/// \param page  Page number, 0 to IAP_NUM_PAGES - 1.
+/// \param data  IAP_PAGE_SIZE bytes, at any alignment.
+/// \param erase  1 to erase the page first; 0 to program an erased page.
+//------------------------------------------------------------------------------
+unsigned char IAP_WritePage(unsigned int page,
+                            const void *data,
+                            unsigned char erase)
+{
+    if (page >= IAP_NUM_PAGES) {
+
+        return 0;
+    }
+    memcpy(pageBuffer, data, IAP_PAGE_SIZE);
+    return ProgramBuffer(page, erase);
+}
+
+//------------------------------------------------------------------------------
+/// Programs a range of erased flash without erasing it: bits can only go
+/// from 1 to 0, and the other bytes of the pages are not changed.
+/// Returns 1 on success; 0 if the range is outside the flash or locked.
+/// \param address  Flash address.
+/// \param data  Data to program.
+/// \param size  Number of bytes.
+//------------------------------------------------------------------------------
+unsigned char IAP_Program(unsigned int address,
+                          const void *data,
+                          unsigned int size)
+{
+    return WriteRange(address, data, size, 0);
+}
+
+//------------------------------------------------------------------------------
+/// Writes a range of flash of any content: each page is read, updated, then
+/// erased and written; the pages that already hold the data are skipped.
+/// Returns 1 on success; 0 if the range is outside the flash or locked.
+/// \param address  Flash address.
+/// \param data  Data to write, which must not be in the pages written.
+/// \param size  Number of bytes.
+//------------------------------------------------------------------------------
+unsigned char IAP_Write(unsigned int address,
+                        const void *data,
+                        unsigned int size)
+{
+    return WriteRange(address, data, size, 1);
+}
+
+//------------------------------------------------------------------------------
+/// Erases the pages that hold a range (the EFC has no plain page erase: they
+/// are erased and written with 0xFF); the pages already erased are skipped.
+/// Returns 1 on success; 0 if the range is outside the flash or locked.
+/// \param address  Flash address.
+/// \param size  Number of bytes.
+//------------------------------------------------------------------------------
+unsigned char IAP_Erase(unsigned int address, unsigned int size)
+{
+    const unsigned int *flash;
+    unsigned int page;
+    unsigned int last;
+    unsigned int i;
+
+    if (!IsInFlash(address, size)) {
+
+        return 0;
+    }
+
+    memset(pageBuffer, 0xFF, IAP_PAGE_SIZE);
+    page = (address - IAP_FLASH_START) / IAP_PAGE_SIZE;
+    last = (address - IAP_FLASH_START + size - 1) / IAP_PAGE_SIZE;
+    for (; page <= last; page++) {
+
+        flash = (const unsigned int *) PAGE_ADDRESS(page);
+        for (i = 0; (i < IAP_PAGE_SIZE / 4) && (flash[i] == 0xFFFFFFFF); i++);
+        if ((i < IAP_PAGE_SIZE / 4) && !ProgramBuffer(page, 1)) {
+
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Locks or unlocks the lock regions that hold a range.
+/// Returns 1 on success; 0 if the range is outside the flash.
+/// \param address  Flash address.
+/// \param size  Number of bytes.
+/// \param lock  1 to lock, 0 to unlock.
+//------------------------------------------------------------------------------
+unsigned char IAP_Lock(unsigned int address,
+                       unsigned int size,
+                       unsigned char lock)
+{
+    unsigned int region;
+    unsigned int last;
+
+    if (!IsInFlash(address, size)) {
+
+        return 0;
+    }
+
+    region = (address - IAP_FLASH_START) / IAP_LOCK_REGION_SIZE;
+    last = (address - IAP_FLASH_START + size - 1) / IAP_LOCK_REGION_SIZE;
+    for (; region <= last; region++) {
+
+        if (!Execute(lock ? AT91C_EFC_FCMD_SLB : AT91C_EFC_FCMD_CLB,
+                     region * PAGES_PER_REGION)) {
+
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the lock region of a flash address is locked.
+//------------------------------------------------------------------------------
+unsigned char IAP_IsLocked(unsigned int address)
+{
+    if (!IsInFlash(address, 1) || !Execute(AT91C_EFC_FCMD_GLB, 0)) {
+
+        return 0;
+    }
+    return (AT91C_BASE_EFC0->EFC_FRR
+            >> ((address - IAP_FLASH_START) / IAP_LOCK_REGION_SIZE)) & 1;
+}
+
+//------------------------------------------------------------------------------
+/// Sets or clears a GPNVM bit. The security bit can only be cleared by a full
+/// erase through the ERASE pin.
+/// Returns 1 on success; 0 if the bit does not exist.
+/// \param bit  IAP_GPNVM_xxx.
+/// \param value  New value.
+//------------------------------------------------------------------------------
+unsigned char IAP_SetGpnvm(unsigned char bit, unsigned char value)
+{
+    if (bit >= IAP_NUM_GPNVM) {
+
+        return 0;
+    }
+    return Execute(value ? AT91C_EFC_FCMD_SFB : AT91C_EFC_FCMD_CFB, bit);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the value of a GPNVM bit (0 if it does not exist).
+//------------------------------------------------------------------------------
+unsigned char IAP_GetGpnvm(unsigned char bit)
+{
+    if ((bit >= IAP_NUM_GPNVM) || !Execute(AT91C_EFC_FCMD_GFB, 0)) {
+
+        return 0;
+    }
+    return (AT91C_BASE_EFC0->EFC_FRR >> bit) & 1;
+}
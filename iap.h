@@ -0,0 +1,88 @@
+/* ----------------------------------------------------------------------------
+ *         In-application flash programming
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Programs the internal flash (EFC0) from the running application: page
+** writes with or without erase, lock regions and GPNVM bits. The SAM3U2 has
+** a single flash bank, so no instruction may be fetched from flash while a
+** command runs. The command sequence lives in the RAMFUNC block: it fills
+** the page latch, issues the command, and waits for the EFC ready interrupt
+** with WFI, while BASEPRI masks the preemption levels after IAP_RUN_LEVEL.
+**
+** Interrupts of levels 0 to IAP_RUN_LEVEL (the control loops) keep running
+** during a command, provided that their handlers are RAMFUNC functions and
+** that the vectors are fetched from SRAM (IRQ_RAM_VECTORS). Their DMA
+** transfers must not read the flash either. EFC0 itself must be in that
+** range in the priority table of irq.c; otherwise, and when called from an
+** interrupt or a critical section, the command is polled.
+**
+** Programming only clears bits: IAP_Program() writes erased flash (records,
+** logs), IAP_Write() erases and rewrites whole pages, keeping the bytes
+** around the range. A page takes a few milliseconds.
+*/
+
+#ifndef IAP_H
+#define IAP_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "AT91SAM3U4.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Flash geometry.
+#define IAP_FLASH_START         AT91C_IFLASH0
+#define IAP_FLASH_SIZE          AT91C_IFLASH0_SIZE
+#define IAP_PAGE_SIZE           AT91C_IFLASH0_PAGE_SIZE
+#define IAP_NUM_PAGES           AT91C_IFLASH0_NB_OF_PAGES
+#define IAP_LOCK_REGION_SIZE    AT91C_IFLASH0_LOCK_REGION_SIZE
+
+/// GPNVM bits: security (cleared only by a full erase), boot from flash
+/// rather than ROM, boot bank.
+#define IAP_GPNVM_SECURITY      0
+#define IAP_GPNVM_BOOT_FLASH    1
+#define IAP_GPNVM_BOOT_BANK     2
+#define IAP_NUM_GPNVM           3
+
+/// Preemption levels 0 to IAP_RUN_LEVEL keep running during a command.
+#ifndef IAP_RUN_LEVEL
+#define IAP_RUN_LEVEL           0
+#endif
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void IAP_Initialize(void);
+
+extern unsigned char IAP_WritePage(unsigned int page,
+                                   const void *data,
+                                   unsigned char erase);
+
+extern unsigned char IAP_Program(unsigned int address,
+                                 const void *data,
+                                 unsigned int size);
+
+extern unsigned char IAP_Write(unsigned int address,
+                               const void *data,
+                               unsigned int size);
+
+extern unsigned char IAP_Erase(unsigned int address, unsigned int size);
+
+extern unsigned char IAP_Lock(unsigned int address,
+                              unsigned int size,
+                              unsigned char lock);
+
+extern unsigned char IAP_IsLocked(unsigned int address);
+
+extern unsigned char IAP_SetGpnvm(unsigned char bit, unsigned char value);
+
+extern unsigned char IAP_GetGpnvm(unsigned char bit);
+
+#endif //#ifndef IAP_H
@@ -0,0 +1,205 @@
+/* ----------------------------------------------------------------------------
+ *         Firmware images and update state
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "image.h"
+#include "crc.h"
+
+#include <stddef.h>
+
+#if (IMAGE_SLOT_SIZE % IAP_PAGE_SIZE) || ((IMAGE_MAX_PAGES + 5) * 4 > IMAGE_TRAILER_SIZE)
+#error "IMAGE_SLOT_SIZE must be a multiple of the page, and hold the trailer"
+#endif
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define STATE_ENTRIES           (IAP_PAGE_SIZE / 4)
+
+/// Free entries a new update needs: pending, swap, trials, rollback swap and
+/// confirmation. The log is erased before the update when fewer are left.
+#define STATE_RESERVE           (IMAGE_MAX_TRIALS + 4)
+
+#define TRAILER_WORDS           (sizeof(ImageTrailer) / 4)
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns 1 if a trailer, in its slot or elsewhere, is complete and valid.
+//------------------------------------------------------------------------------
+unsigned char IMAGE_CheckTrailer(const ImageTrailer *trailer)
+{
+    return (trailer->magic == IMAGE_MAGIC)
+           && (trailer->size != 0) && (trailer->size <= IMAGE_MAX_SIZE)
+           && (CRC_Compute32(0, trailer, offsetof(ImageTrailer, trailerCrc))
+               == trailer->trailerCrc);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the trailer of a slot, or 0 if it is erased or invalid.
+/// \param slot  IMAGE_SLOT_A or IMAGE_SLOT_B.
+//------------------------------------------------------------------------------
+const ImageTrailer * IMAGE_GetTrailer(unsigned int slot)
+{
+    const ImageTrailer *trailer = (const ImageTrailer *) (slot + IMAGE_MAX_SIZE);
+
+    return IMAGE_CheckTrailer(trailer) ? trailer : 0;
+}
+
+//------------------------------------------------------------------------------
+/// Checks each page of an image against its trailer.
+/// Returns 1 if they all match.
+/// \param slot  IMAGE_SLOT_A or IMAGE_SLOT_B.
+/// \param trailer  Trailer of the image (not necessarily the one of the slot).
+//------------------------------------------------------------------------------
+unsigned char IMAGE_Verify(unsigned int slot, const ImageTrailer *trailer)
+{
+    unsigned int page;
+
+    for (page = 0; page < IMAGE_NUM_PAGES(trailer->size); page++) {
+
+        if (CRC_Compute32(0, (const void *) (slot + page * IAP_PAGE_SIZE),
+                          IAP_PAGE_SIZE) != trailer->pageCrcs[page]) {
+
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Computes the page CRCs of the image held by a slot and writes its trailer,
+/// a page at a time. The trailer CRC is written last.
+/// Returns 1 on success; 0 if the size is invalid or the flash write fails.
+/// \param slot  IMAGE_SLOT_A or IMAGE_SLOT_B.
+/// \param size  Image size, with the rest of its last page erased.
+/// \param version  Image version.
+/// \param crc  CRC-32 of the image.
+//------------------------------------------------------------------------------
+unsigned char IMAGE_WriteTrailer(unsigned int slot,
+                                 unsigned int size,
+                                 unsigned int version,
+                                 unsigned int crc)
+{
+    unsigned int address = slot + IMAGE_MAX_SIZE;
+    unsigned int words[IAP_PAGE_SIZE / 4];
+    unsigned int trailerCrc = 0;
+    unsigned int value;
+    unsigned int word;
+    unsigned int page;
+
+    if ((size == 0) || (size > IMAGE_MAX_SIZE)
+        || !IAP_Erase(address, IMAGE_TRAILER_SIZE)) {
+
+        return 0;
+    }
+
+    for (word = 0; word < TRAILER_WORDS; word++) {
+
+        page = word - offsetof(ImageTrailer, pageCrcs) / 4;
+        if (word == 0) {
+
+            value = IMAGE_MAGIC;
+        }
+        else if (word == 1) {
+
+            value = size;
+        }
+        else if (word == 2) {
+
+            value = version;
+        }
+        else if (word == 3) {
+
+            value = crc;
+        }
+        else if (word == TRAILER_WORDS - 1) {
+
+            value = trailerCrc;
+        }
+        else if (page < IMAGE_NUM_PAGES(size)) {
+
+            value = CRC_Compute32(0, (const void *) (slot + page * IAP_PAGE_SIZE),
+                                  IAP_PAGE_SIZE);
+        }
+        else {
+
+            value = 0xFFFFFFFF;
+        }
+        trailerCrc = CRC_Compute32(trailerCrc, &value, 4);
+
+        words[word % (IAP_PAGE_SIZE / 4)] = value;
+        if (((word % (IAP_PAGE_SIZE / 4)) == (IAP_PAGE_SIZE / 4) - 1)
+            || (word == TRAILER_WORDS - 1)) {
+
+            if (!IAP_Program(address + (word / (IAP_PAGE_SIZE / 4)) * IAP_PAGE_SIZE,
+                             words, (word % (IAP_PAGE_SIZE / 4) + 1) * 4)) {
+
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Reads the update state from the log.
+//------------------------------------------------------------------------------
+void IMAGE_GetState(ImageState *state)
+{
+    const unsigned int *log = (const unsigned int *) IMAGE_STATE_PAGE;
+    unsigned int entry;
+
+    state->state = IMAGE_STATE_NONE;
+    state->value = 0;
+    state->trials = 0;
+    for (entry = 0; (entry < STATE_ENTRIES) && (log[entry] != 0xFFFFFFFF); entry++) {
+
+        state->state = log[entry] >> 8;
+        state->value = log[entry] & 0xFF;
+        if (state->state == IMAGE_STATE_SWAP) {
+
+            state->trials = 0;
+        }
+        else if (state->state == IMAGE_STATE_TRIAL) {
+
+            state->trials++;
+        }
+    }
+    state->entries = entry;
+}
+
+//------------------------------------------------------------------------------
+/// Appends an entry to the update state log. The log is erased first when it
+/// is full, or before a new update when it could fill up during it.
+/// Returns 1 on success; 0 if the flash write fails.
+/// \param state  IMAGE_STATE_xxx.
+/// \param value  Value of the entry.
+//------------------------------------------------------------------------------
+unsigned char IMAGE_SetState(unsigned char state, unsigned char value)
+{
+    ImageState current;
+    unsigned int entry = (state << 8) | value;
+
+    IMAGE_GetState(&current);
+    if ((current.entries == STATE_ENTRIES)
+        || ((state == IMAGE_STATE_PENDING)
+            && (current.entries > STATE_ENTRIES - STATE_RESERVE))) {
+
+        if (!IAP_Erase(IMAGE_STATE_PAGE, IAP_PAGE_SIZE)) {
+
+            return 0;
+        }
+        current.entries = 0;
+    }
+
+    return IAP_Program(IMAGE_STATE_PAGE + current.entries * 4, &entry, 4);
+}
@@ -0,0 +1,145 @@
+/* ----------------------------------------------------------------------------
+ *         Firmware images and update state
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Flash layout shared by the bootloader (boot.c) and the application:
+**
+**     IMAGE_BOOT_SIZE     bootloader, at __ICFEDIT_intvec_start__
+**     IMAGE_SLOT_SIZE     slot A: the application that runs
+**     IMAGE_SLOT_SIZE     slot B: staging, then the previous application
+**     IMAGE_META_SIZE     update state, swap journal and scratch page
+**     IMAGE_LOG_SIZE      event log (evlog.h, through flashdisk.h)
+**     KVSTORE_SIZE        key-value store (kvstore.h)
+**
+** The application is linked for slot A (sam3u2c_flash.icf) and only ever
+** runs from there: an update is written to slot B, then the bootloader swaps
+** the two slots, which keeps the previous image for a rollback.
+**
+** Each slot ends with a trailer of IMAGE_TRAILER_SIZE bytes holding the image
+** size, version, CRC-32, and the CRC-32 of each of its pages. The page CRCs
+** are computed once, as the image is written, and checked at each boot (a
+** few milliseconds at 96 MHz); they also tell the bootloader which pages a
+** swap cut by a power loss had already moved.
+**
+** The update state is a log of words in the first meta page, only ever
+** appended (programmed) between two erases:
+**     PENDING    slot B holds a verified image to install (application)
+**     SWAP       the slots are being swapped (bootloader)
+**     TRIAL      one boot of a new image that has not confirmed its health
+**     CONFIRMED  the image of slot A is the good one (either side)
+*/
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "iap.h"
+#include "kvstore.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Flash layout. The application region of sam3u2c_flash.icf (slot A but its
+/// trailer) and the ROM region of boot_flash.icf must match.
+#define IMAGE_BOOT_SIZE         IAP_LOCK_REGION_SIZE
+#define IMAGE_META_SIZE         0x1000
+#define IMAGE_LOG_SIZE          0x2000
+#define IMAGE_LOG_START         (KVSTORE_START - IMAGE_LOG_SIZE)
+#define IMAGE_META_START        (IMAGE_LOG_START - IMAGE_META_SIZE)
+#define IMAGE_SLOT_A            (IAP_FLASH_START + IMAGE_BOOT_SIZE)
+#define IMAGE_SLOT_SIZE         ((IMAGE_META_START - IMAGE_SLOT_A) / 2)
+#define IMAGE_SLOT_B            (IMAGE_SLOT_A + IMAGE_SLOT_SIZE)
+
+/// Trailer at the end of each slot, and what is left for the image.
+#define IMAGE_TRAILER_SIZE      0x400
+#define IMAGE_MAX_SIZE          (IMAGE_SLOT_SIZE - IMAGE_TRAILER_SIZE)
+#define IMAGE_MAX_PAGES         (IMAGE_MAX_SIZE / IAP_PAGE_SIZE)
+#define IMAGE_NUM_PAGES(size)   (((size) + IAP_PAGE_SIZE - 1) / IAP_PAGE_SIZE)
+
+/// Meta pages: state log, swap progress (one bit per page), scratch page,
+/// and copies of both trailers while a swap runs.
+#define IMAGE_STATE_PAGE        IMAGE_META_START
+#define IMAGE_SWAP_PAGE         (IMAGE_META_START + IAP_PAGE_SIZE)
+#define IMAGE_SCRATCH_PAGE      (IMAGE_META_START + 2 * IAP_PAGE_SIZE)
+#define IMAGE_JOURNAL           (IMAGE_META_START + 4 * IAP_PAGE_SIZE)
+
+/// Trailer magic ("EIMG").
+#define IMAGE_MAGIC             0x474D4945
+
+/// Update states (erased log: none).
+#define IMAGE_STATE_NONE        0xFF
+#define IMAGE_STATE_PENDING     0x50
+#define IMAGE_STATE_SWAP        0x53
+#define IMAGE_STATE_TRIAL       0x54
+#define IMAGE_STATE_CONFIRMED   0x43
+
+/// Reasons for a swap.
+#define IMAGE_SWAP_INSTALL      0
+#define IMAGE_SWAP_ROLLBACK     1
+#define IMAGE_SWAP_RECOVER      2
+
+/// Boots a new image gets to confirm its health before it is rolled back.
+#ifndef IMAGE_MAX_TRIALS
+#define IMAGE_MAX_TRIALS        3
+#endif
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Slot trailer, at the slot address + IMAGE_MAX_SIZE.
+typedef struct {
+
+    unsigned int magic;
+    /// Image size in bytes, version, and CRC-32 of those bytes.
+    unsigned int size;
+    unsigned int version;
+    unsigned int crc;
+    /// CRC-32 of each page of the image, the last one padded with 0xFF.
+    unsigned int pageCrcs[IMAGE_MAX_PAGES];
+    /// CRC-32 of the fields above.
+    unsigned int trailerCrc;
+
+} ImageTrailer;
+
+/// Update state, from the log.
+typedef struct {
+
+    /// IMAGE_STATE_xxx of the last entry.
+    unsigned char state;
+    /// Its value (IMAGE_SWAP_xxx for a swap).
+    unsigned char value;
+    /// Trial boots since the last swap.
+    unsigned char trials;
+    /// Entries in the log.
+    unsigned char entries;
+
+} ImageState;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned char IMAGE_CheckTrailer(const ImageTrailer *trailer);
+
+extern const ImageTrailer * IMAGE_GetTrailer(unsigned int slot);
+
+extern unsigned char IMAGE_Verify(unsigned int slot,
+                                  const ImageTrailer *trailer);
+
+extern unsigned char IMAGE_WriteTrailer(unsigned int slot,
+                                        unsigned int size,
+                                        unsigned int version,
+                                        unsigned int crc);
+
+extern void IMAGE_GetState(ImageState *state);
+
+extern unsigned char IMAGE_SetState(unsigned char state, unsigned char value);
+
+#endif //#ifndef IMAGE_H
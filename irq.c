@@ -0,0 +1,324 @@
+/* ----------------------------------------------------------------------------
+ *         Interrupt vector management
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "irq.h"
+#include "startup.h"
+#include "irqstats.h"
+#include "AT91SAM3U4.h"
+
+#include <intrinsics.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// AIRCR write key.
+#define AIRCR_VECTKEY           (0x05FA << 16)
+
+/// BASEPRI value of IRQ_EnterCritical().
+#define CRITICAL_BASEPRI        IRQ_PRIORITY(IRQ_CRITICAL_LEVEL, 0)
+
+/// Priority bytes of the peripheral interrupts and of the system handlers
+/// (exception 4 onwards).
+#define PERIPHERAL_PRIORITIES \
+    ((volatile unsigned char *) AT91C_BASE_NVIC->NVIC_IPR)
+#define SYSTEM_PRIORITIES \
+    ((volatile unsigned char *) &AT91C_BASE_NVIC->NVIC_HAND4PR)
+
+#define NUM_SYSTEM_PRIORITIES \
+    (sizeof(systemPriorities) / sizeof(systemPriorities[0]))
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Priority of a system handler.
+typedef struct {
+
+    /// Exception number (4 to 15).
+    unsigned char exception;
+    IrqPriority priority;
+
+} SystemPriority;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Priorities of the peripheral interrupts, applied by
+/// IRQ_ConfigurePriorities(). Level 0 is kept for the control loops (PWM, ADC,
+/// their timer), which IRQ_EnterCritical() never masks, and for the flash
+/// ready interrupt, which ends the wait of iap.c commands.
+static const IrqPriority irqPriorities[IRQ_NUM_PERIPHERALS] = {
+
+    /* level, sub */
+    { 5, 0 },   // AT91C_ID_SUPC
+    { 5, 0 },   // AT91C_ID_RSTC
+    { 5, 1 },   // AT91C_ID_RTC
+    { 5, 1 },   // AT91C_ID_RTT
+    { 5, 0 },   // AT91C_ID_WDG
+    { 5, 0 },   // AT91C_ID_PMC
+    { 0, 1 },   // AT91C_ID_EFC0
+    { 5, 1 },   // AT91C_ID_EFC1
+    { 4, 1 },   // AT91C_ID_DBGU
+    { 3, 1 },   // AT91C_ID_HSMC4
+    { 4, 0 },   // AT91C_ID_PIOA
+    { 4, 0 },   // AT91C_ID_PIOB
+    { 4, 0 },   // AT91C_ID_PIOC
+    { 3, 0 },   // AT91C_ID_US0
+    { 3, 0 },   // AT91C_ID_US1
+    { 3, 0 },   // AT91C_ID_US2
+    { 3, 0 },   // AT91C_ID_US3
+    { 2, 1 },   // AT91C_ID_MCI0
+    { 3, 1 },   // AT91C_ID_TWI0
+    { 3, 1 },   // AT91C_ID_TWI1
+    { 2, 1 },   // AT91C_ID_SPI0
+    { 2, 1 },   // AT91C_ID_SSC0
+    { 0, 0 },   // AT91C_ID_TC0
+    { 1, 0 },   // AT91C_ID_TC1
+    { 1, 0 },   // AT91C_ID_TC2
+    { 0, 0 },   // AT91C_ID_PWMC
+    { 0, 1 },   // AT91C_ID_ADC12B
+    { 0, 1 },   // AT91C_ID_ADC
+    { 2, 0 },   // AT91C_ID_HDMA
+    { 2, 0 },   // AT91C_ID_UDPHS
+    { 7, 0 },   // unused
+};
+
+/// Priorities of the system handlers. Faults keep the reset priority (0);
+/// SVC and PendSV are set by KERNEL_Start().
+static const SystemPriority systemPriorities[] = {
+
+    { 15, { 6, 0 } },   // SysTick
+};
+
+
+#if IRQ_RAM_VECTORS
+/// Exception table used once IRQ_RelocateVectors() has run. Not initialized
+/// since it is filled before the data sections are. Placed first in SRAM by
+/// the RAMVECTORS block of the .icf file.
+#pragma data_alignment = 256  // IRQ_VECTORS_ALIGNMENT
+#pragma location = ".ramvectors"
+static __no_init IntVector ramVectors[IRQ_NUM_VECTORS];
+#endif
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Copies __vector_table to SRAM and points NVIC_VTOFFR at the copy. Does not
+/// rely on initialized data, so it can be called from __low_level_init().
+/// Does nothing when IRQ_RAM_VECTORS is 0.
+//------------------------------------------------------------------------------
+void IRQ_RelocateVectors(void)
+{
+#if IRQ_INSTRUMENT
+    unsigned int id;
+#endif
+
+#if IRQ_RAM_VECTORS
+    STARTUP_CopyBlock(ramVectors, __vector_table, sizeof(ramVectors));
+
+#if IRQ_INSTRUMENT
+    for (id = 0; id < IRQSTATS_NUM_IRQS; id++) {
+
+        IRQSTATS_SetHandler(id, ramVectors[IRQ_NUM_SYSTEM_VECTORS + id].__fun);
+        ramVectors[IRQ_NUM_SYSTEM_VECTORS + id].__fun = IRQSTATS_Handler;
+    }
+#endif
+
+    __DSB();
+    AT91C_BASE_NVIC->NVIC_VTOFFR = (unsigned int) ramVectors;
+    __DSB();
+    __ISB();
+#endif
+}
+
+//------------------------------------------------------------------------------
+/// Installs a handler for a peripheral interrupt. The vector is a single word
+/// store, so this is safe even while the interrupt is enabled.
+/// Returns the previous handler, or 0 if the table is in flash or the
+/// identifier is out of range.
+/// \param id  Peripheral identifier (AT91C_ID_xxx).
+/// \param handler  New interrupt handler.
+//------------------------------------------------------------------------------
+IntFunc IRQ_Attach(unsigned int id, IntFunc handler)
+{
+#if IRQ_RAM_VECTORS
+    IntFunc previous;
+
+    if (id >= IRQ_NUM_PERIPHERALS) {
+
+        return 0;
+    }
+
+#if IRQ_INSTRUMENT
+    if (id < IRQSTATS_NUM_IRQS) {
+
+        return IRQSTATS_SetHandler(id, handler);
+    }
+#endif
+
+    previous = ramVectors[IRQ_NUM_SYSTEM_VECTORS + id].__fun;
+    ramVectors[IRQ_NUM_SYSTEM_VECTORS + id].__fun = handler;
+    __DSB();
+
+    return previous;
+#else
+    return 0;
+#endif
+}
+
+//------------------------------------------------------------------------------
+/// Restores the link-time handler of a peripheral interrupt.
+/// \param id  Peripheral identifier (AT91C_ID_xxx).
+//------------------------------------------------------------------------------
+void IRQ_Detach(unsigned int id)
+{
+    if (id < IRQ_NUM_PERIPHERALS) {
+
+        IRQ_Attach(id, __vector_table[IRQ_NUM_SYSTEM_VECTORS + id].__fun);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Sets the NVIC priority grouping to IRQ_PREEMPT_BITS preemption bits, then
+/// applies the central priority tables. Call before enabling interrupts.
+//------------------------------------------------------------------------------
+void IRQ_ConfigurePriorities(void)
+{
+    unsigned int id;
+    unsigned int i;
+
+    AT91C_BASE_NVIC->NVIC_AIRCR = AIRCR_VECTKEY
+                                  | ((7 - IRQ_PREEMPT_BITS) << 8);
+
+    for (id = 0; id < IRQ_NUM_PERIPHERALS; id++) {
+
+        IRQ_SetPriority(id, irqPriorities[id]);
+    }
+    for (i = 0; i < NUM_SYSTEM_PRIORITIES; i++) {
+
+        IRQ_SetSystemPriority(systemPriorities[i].exception,
+                              systemPriorities[i].priority);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Sets the priority of a peripheral interrupt.
+/// \param id  Peripheral identifier (AT91C_ID_xxx).
+/// \param priority  Preemption level and sub-priority.
+//------------------------------------------------------------------------------
+void IRQ_SetPriority(unsigned int id, IrqPriority priority)
+{
+    if (id < IRQ_NUM_PERIPHERALS) {
+
+        PERIPHERAL_PRIORITIES[id] = IRQ_PRIORITY(priority.level, priority.sub);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Returns the priority of a peripheral interrupt.
+/// \param id  Peripheral identifier (AT91C_ID_xxx).
+//------------------------------------------------------------------------------
+IrqPriority IRQ_GetPriority(unsigned int id)
+{
+    IrqPriority priority = { 0, 0 };
+    unsigned int value;
+
+    if (id < IRQ_NUM_PERIPHERALS) {
+
+        value = PERIPHERAL_PRIORITIES[id] >> (8 - IRQ_PRIORITY_BITS);
+        priority.level = value >> (IRQ_PRIORITY_BITS - IRQ_PREEMPT_BITS);
+        priority.sub = value & (IRQ_NUM_SUBPRIORITIES - 1);
+    }
+
+    return priority;
+}
+
+//------------------------------------------------------------------------------
+/// Sets the priority of a system handler.
+/// \param exception  Exception number (4 MemManage to 15 SysTick).
+/// \param priority  Preemption level and sub-priority.
+//------------------------------------------------------------------------------
+void IRQ_SetSystemPriority(unsigned int exception, IrqPriority priority)
+{
+    if ((exception >= 4) && (exception < IRQ_NUM_SYSTEM_VECTORS)) {
+
+        SYSTEM_PRIORITIES[exception - 4] = IRQ_PRIORITY(priority.level,
+                                                        priority.sub);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Enables a peripheral interrupt in the NVIC.
+/// \param id  Peripheral identifier (AT91C_ID_xxx).
+//------------------------------------------------------------------------------
+void IRQ_Enable(unsigned int id)
+{
+    AT91C_BASE_NVIC->NVIC_ISER[id >> 5] = 1u << (id & 0x1F);
+}
+
+//------------------------------------------------------------------------------
+/// Disables a peripheral interrupt in the NVIC. The handler may still run
+/// once if it was being entered.
+/// \param id  Peripheral identifier (AT91C_ID_xxx).
+//------------------------------------------------------------------------------
+void IRQ_Disable(unsigned int id)
+{
+    AT91C_BASE_NVIC->NVIC_ICER[id >> 5] = 1u << (id & 0x1F);
+    __DSB();
+    __ISB();
+}
+
+//------------------------------------------------------------------------------
+/// Sets a peripheral interrupt pending.
+/// \param id  Peripheral identifier (AT91C_ID_xxx).
+//------------------------------------------------------------------------------
+void IRQ_SetPending(unsigned int id)
+{
+    AT91C_BASE_NVIC->NVIC_ISPR[id >> 5] = 1u << (id & 0x1F);
+}
+
+//------------------------------------------------------------------------------
+/// Clears the pending state of a peripheral interrupt.
+/// \param id  Peripheral identifier (AT91C_ID_xxx).
+//------------------------------------------------------------------------------
+void IRQ_ClearPending(unsigned int id)
+{
+    AT91C_BASE_NVIC->NVIC_ICPR[id >> 5] = 1u << (id & 0x1F);
+}
+
+//------------------------------------------------------------------------------
+/// Masks the interrupts of preemption level IRQ_CRITICAL_LEVEL and below
+/// through BASEPRI; higher levels keep running. Never lowers the current
+/// mask, so critical sections can nest.
+/// Returns the mask to give back to IRQ_ExitCritical().
+//------------------------------------------------------------------------------
+IrqState IRQ_EnterCritical(void)
+{
+    IrqState state = __get_BASEPRI();
+
+    if ((state == 0) || (state > CRITICAL_BASEPRI)) {
+
+        __set_BASEPRI(CRITICAL_BASEPRI);
+    }
+
+    return state;
+}
+
+//------------------------------------------------------------------------------
+/// Ends a critical section started by IRQ_EnterCritical().
+/// \param state  Value returned by IRQ_EnterCritical().
+//------------------------------------------------------------------------------
+void IRQ_ExitCritical(IrqState state)
+{
+    __set_BASEPRI(state);
+}
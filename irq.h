@@ -0,0 +1,139 @@
+/* ----------------------------------------------------------------------------
+ *         Interrupt vector management
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** With IRQ_RAM_VECTORS enabled, the exception table is copied to SRAM at boot
+** and NVIC_VTOFFR points at the copy. Peripheral handlers can then be
+** replaced at run time with IRQ_Attach() / IRQ_Detach(), keyed by the
+** AT91C_ID_xxx peripheral identifiers.
+**
+** With IRQ_INSTRUMENT also enabled, the peripheral entries of the SRAM table
+** all point at IRQSTATS_Handler(), which times the real handlers; IRQ_Attach()
+** then replaces the real handler behind it.
+**
+** IRQ_ConfigurePriorities() sets the NVIC priority grouping and gives every
+** peripheral interrupt the preemption and sub-priority listed in the central
+** table of irq.c. IRQ_EnterCritical() / IRQ_ExitCritical() mask interrupts
+** through BASEPRI: handlers whose preemption level is below
+** IRQ_CRITICAL_LEVEL are never masked, and must therefore not call the
+** kernel, the scheduler or any other code protected this way.
+*/
+
+#ifndef IRQ_H
+#define IRQ_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "exceptions.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Set to 0 to keep fetching vectors from the table in flash.
+#ifndef IRQ_RAM_VECTORS
+#define IRQ_RAM_VECTORS         1
+#endif
+
+/// Set to 1 to time every peripheral interrupt handler (see irqstats.h).
+/// Requires IRQ_RAM_VECTORS.
+#ifndef IRQ_INSTRUMENT
+#define IRQ_INSTRUMENT          0
+#endif
+
+#if IRQ_INSTRUMENT && !IRQ_RAM_VECTORS
+#error "IRQ_INSTRUMENT requires IRQ_RAM_VECTORS"
+#endif
+
+/// Initial stack pointer, reset and the 14 system exception entries.
+#define IRQ_NUM_SYSTEM_VECTORS  16
+
+/// Configurable interrupts (AT91C_ID_SUPC to AT91C_ID_UDPHS, plus one unused).
+#define IRQ_NUM_PERIPHERALS     31
+
+/// Total number of entries in __vector_table.
+#define IRQ_NUM_VECTORS         (IRQ_NUM_SYSTEM_VECTORS + IRQ_NUM_PERIPHERALS)
+
+/// NVIC_VTOFFR requires the table to be aligned on its size rounded up to the
+/// next power of two (47 words -> 256 bytes).
+#define IRQ_VECTORS_ALIGNMENT   256
+
+/// Priority bits implemented by the SAM3U NVIC (the upper 4 bits of a byte).
+#define IRQ_PRIORITY_BITS       4
+
+/// Bits of the priority used for the preemption level; the others are the
+/// sub-priority, which only orders pending interrupts of the same level.
+#ifndef IRQ_PREEMPT_BITS
+#define IRQ_PREEMPT_BITS        3
+#endif
+
+/// Number of preemption levels (0 is the highest) and of sub-priorities.
+#define IRQ_NUM_LEVELS          (1 << IRQ_PREEMPT_BITS)
+#define IRQ_NUM_SUBPRIORITIES   (1 << (IRQ_PRIORITY_BITS - IRQ_PREEMPT_BITS))
+
+/// NVIC priority byte of a preemption level and sub-priority.
+#define IRQ_PRIORITY(level, sub) \
+    ((((level) << (IRQ_PRIORITY_BITS - IRQ_PREEMPT_BITS)) | (sub)) \
+     << (8 - IRQ_PRIORITY_BITS))
+
+/// Highest preemption level masked by IRQ_EnterCritical().
+#ifndef IRQ_CRITICAL_LEVEL
+#define IRQ_CRITICAL_LEVEL      1
+#endif
+
+#if (IRQ_CRITICAL_LEVEL < 1) || (IRQ_CRITICAL_LEVEL >= IRQ_NUM_LEVELS)
+#error "IRQ_CRITICAL_LEVEL must be between 1 and IRQ_NUM_LEVELS - 1"
+#endif
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Priority of an interrupt.
+typedef struct {
+
+    /// Preemption level, 0 to IRQ_NUM_LEVELS - 1 (0 is the highest).
+    unsigned char level;
+    /// Sub-priority, 0 to IRQ_NUM_SUBPRIORITIES - 1 (0 is the highest).
+    unsigned char sub;
+
+} IrqPriority;
+
+/// Interrupt mask saved by IRQ_EnterCritical().
+typedef unsigned int IrqState;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void IRQ_RelocateVectors(void);
+
+extern IntFunc IRQ_Attach(unsigned int id, IntFunc handler);
+
+extern void IRQ_Detach(unsigned int id);
+
+extern void IRQ_ConfigurePriorities(void);
+
+extern void IRQ_SetPriority(unsigned int id, IrqPriority priority);
+
+extern IrqPriority IRQ_GetPriority(unsigned int id);
+
+extern void IRQ_SetSystemPriority(unsigned int exception, IrqPriority priority);
+
+extern void IRQ_Enable(unsigned int id);
+
+extern void IRQ_Disable(unsigned int id);
+
+extern void IRQ_SetPending(unsigned int id);
+
+extern void IRQ_ClearPending(unsigned int id);
+
+extern IrqState IRQ_EnterCritical(void);
+
+extern void IRQ_ExitCritical(IrqState state);
+
+#endif //#ifndef IRQ_H
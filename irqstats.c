@@ -0,0 +1,188 @@
+/* ----------------------------------------------------------------------------
+ *         Interrupt handler timing
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "irqstats.h"
+#include "irq.h"
+#include "dbgu.h"
+#include "dwt.h"
+#include "startup.h"
+
+#include <intrinsics.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Size of a line of IRQSTATS_Dump(): five values and the bins, each 8 digits
+/// and a separator.
+#define IRQSTATS_LINE_SIZE      ((5 + IRQSTATS_NUM_BINS) * 9 + 1)
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Real handlers. Not initialized since IRQ_RelocateVectors() fills them
+/// before the data sections are.
+static __no_init IntFunc handlers[IRQSTATS_NUM_IRQS];
+
+static IrqStats irqStats[IRQSTATS_NUM_IRQS];
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Common entry of all the peripheral interrupts: runs the real handler of
+/// the active interrupt and records its duration.
+//------------------------------------------------------------------------------
+void IRQSTATS_Handler(void)
+{
+    unsigned int id = __get_IPSR() - IRQ_NUM_SYSTEM_VECTORS;
+    IrqStats *stats;
+    unsigned int start;
+    unsigned int cycles;
+    unsigned int bin;
+
+    if (id >= IRQSTATS_NUM_IRQS) {
+
+        return;
+    }
+
+    start = DWT_GetCycles();
+    handlers[id]();
+    cycles = DWT_GetCycles() - start;
+
+    stats = &irqStats[id];
+    if ((stats->count == 0) || (cycles < stats->min)) {
+
+        stats->min = cycles;
+    }
+    if (cycles > stats->max) {
+
+        stats->max = cycles;
+    }
+    stats->total += cycles;
+    stats->count++;
+
+    bin = 32 - __CLZ(cycles);
+    if (bin >= IRQSTATS_NUM_BINS) {
+
+        bin = IRQSTATS_NUM_BINS - 1;
+    }
+    stats->histogram[bin]++;
+}
+
+//------------------------------------------------------------------------------
+/// Sets the real handler called for an interrupt.
+/// Returns the previous one, or 0 if the identifier is out of range.
+/// \param id  Peripheral identifier (AT91C_ID_xxx).
+/// \param handler  Interrupt handler.
+//------------------------------------------------------------------------------
+IntFunc IRQSTATS_SetHandler(unsigned int id, IntFunc handler)
+{
+    IntFunc previous;
+
+    if (id >= IRQSTATS_NUM_IRQS) {
+
+        return 0;
+    }
+
+    previous = handlers[id];
+    handlers[id] = handler;
+    __DSB();
+
+    return previous;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the statistics of an interrupt, or 0 if the identifier is out of
+/// range.
+//------------------------------------------------------------------------------
+const IrqStats * IRQSTATS_Get(unsigned int id)
+{
+    if (id >= IRQSTATS_NUM_IRQS) {
+
+        return 0;
+    }
+
+    return &irqStats[id];
+}
+
+//------------------------------------------------------------------------------
+/// Clears the statistics of all interrupts.
+//------------------------------------------------------------------------------
+void IRQSTATS_Reset(void)
+{
+    __istate_t state = __get_interrupt_state();
+
+    __disable_interrupt();
+    STARTUP_ZeroBlock(irqStats, sizeof(irqStats));
+    __set_interrupt_state(state);
+}
+
+//------------------------------------------------------------------------------
+/// Prints the statistics of the interrupts taken so far on the DBGU ring, one
+/// line per interrupt: identifier, count, min, max and mean cycles, then the
+/// histogram. All values are in hexadecimal. Waits for room in the ring, so
+/// must be called from a thread.
+//------------------------------------------------------------------------------
+void IRQSTATS_Dump(void)
+{
+    static const char header[] = "\r\nIRQ count min max mean histogram\r\n";
+    IrqStats copy;
+    unsigned char *line;
+    unsigned char *end;
+    unsigned int id;
+    unsigned int bin;
+    __istate_t state;
+
+    line = DBGU_ReserveWait(sizeof(header) - 1);
+    if (line == 0) {
+
+        return;
+    }
+    for (bin = 0; bin < sizeof(header) - 1; bin++) {
+
+        line[bin] = header[bin];
+    }
+    DBGU_Commit(sizeof(header) - 1);
+
+    for (id = 0; id < IRQSTATS_NUM_IRQS; id++) {
+
+        // Consistent snapshot, the handler may run meanwhile
+        state = __get_interrupt_state();
+        __disable_interrupt();
+        copy = irqStats[id];
+        __set_interrupt_state(state);
+
+        if (copy.count == 0) {
+
+            continue;
+        }
+
+        line = DBGU_ReserveWait(IRQSTATS_LINE_SIZE);
+        end = DBGU_FormatHex(line, id);
+        *end++ = ' ';
+        end = DBGU_FormatHex(end, copy.count);
+        *end++ = ' ';
+        end = DBGU_FormatHex(end, copy.min);
+        *end++ = ' ';
+        end = DBGU_FormatHex(end, copy.max);
+        *end++ = ' ';
+        end = DBGU_FormatHex(end, (unsigned int) (copy.total / copy.count));
+        for (bin = 0; bin < IRQSTATS_NUM_BINS; bin++) {
+
+            *end++ = ' ';
+            end = DBGU_FormatHex(end, copy.histogram[bin]);
+        }
+        *end++ = '\r';
+        *end++ = '\n';
+        DBGU_Commit(end - line);
+    }
+}
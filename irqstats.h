@@ -0,0 +1,66 @@
+/* ----------------------------------------------------------------------------
+ *         Interrupt handler timing
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Built when IRQ_INSTRUMENT is set (irq.h). IRQ_RelocateVectors() then points
+** every peripheral entry of the SRAM vector table (AT91C_ID_SUPC to
+** AT91C_ID_UDPHS) at IRQSTATS_Handler(), and keeps the real handlers here.
+** IRQSTATS_Handler() finds the interrupt in IPSR, calls the real handler and
+** times it with the DWT cycle counter.
+**
+** Durations are in core cycles and include the time spent in nested, higher
+** priority handlers. Histogram bin n counts the runs of 2^(n-1) to 2^n - 1
+** cycles; the last bin also counts all the longer ones.
+*/
+
+#ifndef IRQSTATS_H
+#define IRQSTATS_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "exceptions.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Instrumented interrupts: AT91C_ID_SUPC to AT91C_ID_UDPHS.
+#define IRQSTATS_NUM_IRQS       30
+
+/// Histogram bins.
+#define IRQSTATS_NUM_BINS       16
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Run-time statistics of one interrupt.
+typedef struct {
+
+    unsigned int count;
+    unsigned int min;
+    unsigned int max;
+    unsigned long long total;
+    unsigned int histogram[IRQSTATS_NUM_BINS];
+
+} IrqStats;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void IRQSTATS_Handler(void);
+
+extern IntFunc IRQSTATS_SetHandler(unsigned int id, IntFunc handler);
+
+extern const IrqStats * IRQSTATS_Get(unsigned int id);
+
+extern void IRQSTATS_Reset(void);
+
+extern void IRQSTATS_Dump(void);
+
+#endif //#ifndef IRQSTATS_H
@@ -0,0 +1,400 @@
+/* ----------------------------------------------------------------------------
+ *         Preemptive priority kernel
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "kernel.h"
+#include "dbgu.h"
+#include "dwt.h"
+#include "irq.h"
+#include "AT91SAM3U4.h"
+
+#include <intrinsics.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Ready bitmap bit of a priority level: level 0 is the MSB so that CLZ
+/// returns the highest ready level.
+#define PRIORITY_BIT(priority)  (0x80000000u >> (priority))
+
+/// Initial xPSR of a thread (Thumb state).
+#define INITIAL_XPSR            0x01000000
+
+/// Lowest exception priority with the 4 priority bits of the SAM3U.
+#define LOWEST_PRIORITY         0xF0
+
+//------------------------------------------------------------------------------
+//         Exported variables
+//------------------------------------------------------------------------------
+
+KernelThread * volatile kernelCurrent;
+KernelThread * volatile kernelNext;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Threads indexed by priority level.
+static KernelThread *threads[KERNEL_NUM_PRIORITIES];
+
+/// Ready threads, one bit per priority level.
+static volatile unsigned int readyThreads;
+
+/// Set once KERNEL_Start() has been called.
+static unsigned char started;
+
+/// Cycle counter when the pending switch was requested; 0 if none is.
+static volatile unsigned int switchStart;
+
+static KernelSwitchStats switchStats;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Picks the highest priority ready thread and pends PendSV if it is not the
+/// running one. Must be called with interrupts disabled.
+//------------------------------------------------------------------------------
+static void Schedule(void)
+{
+    KernelThread *next;
+
+    if (!started || (readyThreads == 0)) {
+
+        return;
+    }
+
+    // A switch already pending keeps its start; one that is no longer
+    // needed is cancelled, so that its start does not go stale
+    next = threads[__CLZ(readyThreads)];
+    kernelNext = next;
+    if (next != kernelCurrent) {
+
+        if (switchStart == 0) {
+
+            switchStart = DWT_GetCycles() | 1;
+        }
+        AT91C_BASE_NVIC->NVIC_ICSR = AT91C_NVIC_PENDSVSET;
+    }
+    else {
+
+        AT91C_BASE_NVIC->NVIC_ICSR = AT91C_NVIC_PENDSVCLR;
+        switchStart = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Return address of every thread: terminates the caller.
+//------------------------------------------------------------------------------
+static void ThreadExit(void)
+{
+    // An SVC with interrupts masked would escalate to HardFault
+    __set_BASEPRI(0);
+    __enable_interrupt();
+    KERNEL_SvcExit();
+    while (1);
+}
+
+//------------------------------------------------------------------------------
+/// Builds the initial context of a thread and makes it ready (SVC context).
+/// Returns 1 on success; 0 if the parameters are invalid or the priority
+/// level is taken.
+//------------------------------------------------------------------------------
+static unsigned int CreateThread(KernelThread *thread,
+                                 const KernelThreadParams *params)
+{
+    unsigned int *sp;
+    unsigned int i;
+
+    if ((params->priority >= KERNEL_NUM_PRIORITIES)
+        || threads[params->priority]
+        || (params->stackSize < KERNEL_MIN_STACK_SIZE)) {
+
+        return 0;
+    }
+
+    // Full descending stack, 8-byte aligned as required by the AAPCS
+    sp = (unsigned int *) (((unsigned int) params->stack + params->stackSize) & ~7u);
+
+    // Frame popped by the hardware on exception return
+    *(--sp) = INITIAL_XPSR;
+    *(--sp) = (unsigned int) params->entry & ~1u;  // PC
+    *(--sp) = (unsigned int) ThreadExit;           // LR
+    *(--sp) = 0;                                   // R12
+    *(--sp) = 0;                                   // R3
+    *(--sp) = 0;                                   // R2
+    *(--sp) = 0;                                   // R1
+    *(--sp) = (unsigned int) params->arg;          // R0
+
+    // R11 to R4, restored by PendSV_Handler
+    for (i = 0; i < 8; i++) {
+
+        *(--sp) = 0;
+    }
+
+    thread->sp = sp;
+    thread->priority = params->priority;
+    thread->events = 0;
+    thread->waitMask = 0;
+    thread->name = params->name;
+
+    threads[params->priority] = thread;
+    readyThreads |= PRIORITY_BIT(params->priority);
+    Schedule();
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Creates a thread through SVC. Can be called before KERNEL_Start(), from
+/// main(), from a thread or inside a critical section.
+/// Returns 1 on success; otherwise 0.
+//------------------------------------------------------------------------------
+unsigned int KERNEL_CreateThread(KernelThread *thread,
+                                 const KernelThreadParams *params)
+{
+    unsigned int result;
+    IrqState state;
+
+    if ((__get_IPSR() == 0)
+        && ((__get_PRIMASK() & 1) == 0)
+        && (__get_BASEPRI() == 0)) {
+
+        return KERNEL_SvcCreate(thread, params);
+    }
+
+    // An SVC that cannot be taken at once escalates to HardFault: the caller
+    // is privileged here anyway
+    state = IRQ_EnterCritical();
+    result = CreateThread(thread, params);
+    IRQ_ExitCritical(state);
+
+    return result;
+}
+
+//------------------------------------------------------------------------------
+/// Switches to the highest priority thread. The caller's context is dropped,
+/// so this never returns; main() typically creates its threads, including a
+/// background thread at KERNEL_IDLE_PRIORITY, and ends here.
+//------------------------------------------------------------------------------
+void KERNEL_Start(void)
+{
+    // SVC and PendSV at the lowest priority so they never preempt an ISR
+    AT91C_BASE_NVIC->NVIC_HAND8PR = (AT91C_BASE_NVIC->NVIC_HAND8PR & 0x00FFFFFF)
+                                    | (LOWEST_PRIORITY << 24);
+    AT91C_BASE_NVIC->NVIC_HAND12PR = (AT91C_BASE_NVIC->NVIC_HAND12PR & 0xFF00FFFF)
+                                     | (LOWEST_PRIORITY << 16);
+
+    __disable_interrupt();
+    kernelCurrent = 0;
+    started = 1;
+    Schedule();
+    __enable_interrupt();
+
+    // PendSV is taken here and never comes back
+    while (1);
+}
+
+//------------------------------------------------------------------------------
+/// Gives the processor to a ready thread of higher priority, if any.
+//------------------------------------------------------------------------------
+void KERNEL_Yield(void)
+{
+    IrqState state = IRQ_EnterCritical();
+
+    Schedule();
+    IRQ_ExitCritical(state);
+}
+
+//------------------------------------------------------------------------------
+/// Blocks the calling thread until at least one of the events in mask has
+/// been posted, then consumes and returns the posted events of mask.
+/// \param mask  Events to wait for (non-zero).
+//------------------------------------------------------------------------------
+unsigned int KERNEL_Wait(unsigned int mask)
+{
+    KernelThread *self = kernelCurrent;
+    unsigned int events;
+    IrqState state;
+
+    while (1) {
+
+        state = IRQ_EnterCritical();
+
+        events = self->events & mask;
+        if (events) {
+
+            self->events &= ~events;
+            self->waitMask = 0;
+            IRQ_ExitCritical(state);
+            return events;
+        }
+
+        self->waitMask = mask;
+        readyThreads &= ~PRIORITY_BIT(self->priority);
+        Schedule();
+        IRQ_ExitCritical(state);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Posts events to a thread and wakes it up if it waits for one of them.
+/// Can be called from threads and from interrupt handlers of preemption level
+/// IRQ_CRITICAL_LEVEL or lower.
+//------------------------------------------------------------------------------
+void KERNEL_Signal(KernelThread *thread, unsigned int events)
+{
+    IrqState state = IRQ_EnterCritical();
+
+    thread->events |= events;
+    if (thread->events & thread->waitMask) {
+
+        thread->waitMask = 0;
+        readyThreads |= PRIORITY_BIT(thread->priority);
+        Schedule();
+    }
+    IRQ_ExitCritical(state);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the running thread (0 before KERNEL_Start()).
+//------------------------------------------------------------------------------
+KernelThread * KERNEL_GetCurrent(void)
+{
+    return kernelCurrent;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the name of the thread of a priority level, or 0 if there is none
+/// (or the level is out of range).
+//------------------------------------------------------------------------------
+const char * KERNEL_GetThreadName(unsigned int priority)
+{
+    if ((priority >= KERNEL_NUM_PRIORITIES) || (threads[priority] == 0)) {
+
+        return 0;
+    }
+    return threads[priority]->name;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the switch latency measured so far: from the request of a switch
+/// (KERNEL_Signal(), KERNEL_Wait(), thread creation or exit) until the new
+/// thread is resumed by PendSV_Handler.
+//------------------------------------------------------------------------------
+const KernelSwitchStats * KERNEL_GetSwitchStats(void)
+{
+    return &switchStats;
+}
+
+//------------------------------------------------------------------------------
+/// Prints the switch latency on the DBGU ring, in hexadecimal core cycles:
+/// number of switches, min, max and mean. Waits for room in the ring, so must
+/// be called from a thread.
+//------------------------------------------------------------------------------
+void KERNEL_Report(void)
+{
+    static const char prefix[] = "-I- kernel switches ";
+    KernelSwitchStats copy;
+    unsigned char *line;
+    unsigned char *end;
+    unsigned int i;
+    IrqState state;
+
+    // Consistent snapshot, PendSV may record a switch meanwhile
+    state = IRQ_EnterCritical();
+    copy = switchStats;
+    IRQ_ExitCritical(state);
+
+    line = DBGU_ReserveWait(sizeof(prefix) - 1 + 4 * 9 + 1);
+    if (line == 0) {
+
+        return;
+    }
+    for (i = 0; i < sizeof(prefix) - 1; i++) {
+
+        line[i] = prefix[i];
+    }
+    end = DBGU_FormatHex(line + i, copy.count);
+    *end++ = ' ';
+    end = DBGU_FormatHex(end, copy.min);
+    *end++ = ' ';
+    end = DBGU_FormatHex(end, copy.max);
+    *end++ = ' ';
+    end = DBGU_FormatHex(end, copy.count ? copy.total / copy.count : 0);
+    *end++ = '\r';
+    *end++ = '\n';
+    DBGU_Commit(end - line);
+}
+
+//------------------------------------------------------------------------------
+/// Records the latency of the switch PendSV_Handler has just made. Called
+/// with interrupts disabled.
+//------------------------------------------------------------------------------
+void KERNEL_RecordSwitch(void)
+{
+    unsigned int cycles;
+
+    if (switchStart == 0) {
+
+        return;
+    }
+    cycles = DWT_GetCycles() - switchStart;
+    switchStart = 0;
+
+    if ((switchStats.count == 0) || (cycles < switchStats.min)) {
+
+        switchStats.min = cycles;
+    }
+    if (cycles > switchStats.max) {
+
+        switchStats.max = cycles;
+    }
+    switchStats.total += cycles;
+    switchStats.count++;
+}
+
+//------------------------------------------------------------------------------
+/// C part of SVC_Handler. frame points to the stacked R0-R3, R12, LR, PC,
+/// xPSR of the caller; the SVC number is read from the instruction before
+/// the stacked PC and the result is returned in the stacked R0.
+//------------------------------------------------------------------------------
+void KERNEL_SvcHandler(unsigned int *frame)
+{
+    unsigned char number = ((unsigned char *) frame[6])[-2];
+    KernelThread *self;
+    IrqState state = IRQ_EnterCritical();
+
+    switch (number) {
+
+        case KERNEL_SVC_CREATE:
+            frame[0] = CreateThread((KernelThread *) frame[0],
+                                    (const KernelThreadParams *) frame[1]);
+            break;
+
+        case KERNEL_SVC_EXIT:
+            self = kernelCurrent;
+            if (self) {
+
+                threads[self->priority] = 0;
+                readyThreads &= ~PRIORITY_BIT(self->priority);
+                Schedule();
+            }
+            break;
+
+        default:
+            break;
+    }
+    IRQ_ExitCritical(state);
+}
@@ -0,0 +1,127 @@
+/* ----------------------------------------------------------------------------
+ *         Preemptive priority kernel
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Small preemptive kernel with one thread per priority level (0 = highest,
+** 31 = lowest). The ready threads are kept in a bitmap, so the next thread is
+** found with a single CLZ. Threads run on the process stack (PSP); exception
+** handlers keep using the main stack (CSTACK).
+**
+** Threads are created through SVC, and context switches happen in PendSV
+** (kernel_iar.s), which only saves R4-R11 on top of the frame stacked by the
+** hardware.
+**
+** Threads block in KERNEL_Wait() until another thread or an ISR posts one of
+** the awaited events with KERNEL_Signal().
+*/
+
+#ifndef KERNEL_H
+#define KERNEL_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Number of priority levels, and therefore of threads.
+#define KERNEL_NUM_PRIORITIES   32
+
+/// Priority of the background thread, which must always be ready.
+#define KERNEL_IDLE_PRIORITY    (KERNEL_NUM_PRIORITIES - 1)
+
+/// Smallest accepted thread stack, in bytes (context frame plus margin).
+#define KERNEL_MIN_STACK_SIZE   256
+
+/// SVC numbers.
+#define KERNEL_SVC_CREATE       0
+#define KERNEL_SVC_EXIT         1
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Thread control block.
+typedef struct {
+
+    /// Saved process stack pointer. Must stay the first member (kernel_iar.s).
+    unsigned int *sp;
+    /// Priority level, also the index of the thread in the ready bitmap.
+    unsigned int priority;
+    /// Events posted and not consumed yet.
+    volatile unsigned int events;
+    /// Events the thread is blocked on; 0 when not blocked.
+    unsigned int waitMask;
+    /// Name shown in dumps.
+    const char *name;
+
+} KernelThread;
+
+/// Thread creation parameters.
+typedef struct {
+
+    /// Thread body. Returning from it terminates the thread.
+    void (*entry)(void *arg);
+    /// Argument passed to entry.
+    void *arg;
+    /// Priority level, unique among threads.
+    unsigned int priority;
+    /// Stack memory, 8-byte aligned, and its size in bytes.
+    unsigned int *stack;
+    unsigned int stackSize;
+    /// Thread name.
+    const char *name;
+
+} KernelThreadParams;
+
+/// Switch request to resume latency, in core cycles.
+typedef struct {
+
+    unsigned int count;
+    unsigned int min;
+    unsigned int max;
+    unsigned int total;
+
+} KernelSwitchStats;
+
+//------------------------------------------------------------------------------
+//         Exported variables
+//------------------------------------------------------------------------------
+
+/// Running thread and thread to switch to (used by PendSV_Handler).
+extern KernelThread * volatile kernelCurrent;
+extern KernelThread * volatile kernelNext;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned int KERNEL_CreateThread(KernelThread *thread,
+                                        const KernelThreadParams *params);
+
+extern void KERNEL_Start(void);
+
+extern void KERNEL_Yield(void);
+
+extern unsigned int KERNEL_Wait(unsigned int mask);
+
+extern void KERNEL_Signal(KernelThread *thread, unsigned int events);
+
+extern KernelThread * KERNEL_GetCurrent(void);
+
+extern const char * KERNEL_GetThreadName(unsigned int priority);
+
+extern const KernelSwitchStats * KERNEL_GetSwitchStats(void);
+
+extern void KERNEL_Report(void);
+
+extern void KERNEL_SvcHandler(unsigned int *frame);
+
+extern void KERNEL_RecordSwitch(void);
+
+// kernel_iar.s
+extern unsigned int KERNEL_SvcCreate(KernelThread *thread,
+                                     const KernelThreadParams *params);
+extern void KERNEL_SvcExit(void);
+
+#endif //#ifndef KERNEL_H
@@ -0,0 +1,74 @@
+;------------------------------------------------------------------------------
+;         Preemptive kernel - exception handlers and SVC stubs
+;------------------------------------------------------------------------------
+;
+; Threads run on PSP. On a switch the hardware has already stacked R0-R3, R12,
+; LR, PC and xPSR on the outgoing thread's stack, so PendSV_Handler only saves
+; the callee-saved R4-R11 there and restores them from the incoming one.
+;------------------------------------------------------------------------------
+
+        MODULE  ?kernel_iar
+
+        EXTERN  kernelCurrent
+        EXTERN  kernelNext
+        EXTERN  KERNEL_SvcHandler
+        EXTERN  KERNEL_RecordSwitch
+
+        SECTION .text:CODE:NOROOT(2)
+        THUMB
+
+;------------------------------------------------------------------------------
+; Context switch from kernelCurrent to kernelNext. kernelCurrent is 0 on the
+; first switch, from KERNEL_Start(), and nothing is saved then.
+;------------------------------------------------------------------------------
+        PUBLIC  PendSV_Handler
+PendSV_Handler:
+        CPSID   I
+        LDR     R2, =kernelCurrent
+        LDR     R1, [R2]
+        CBZ     R1, pendsv_restore
+        MRS     R0, PSP
+        STMDB   R0!, {R4-R11}
+        STR     R0, [R1]                ; kernelCurrent->sp
+pendsv_restore:
+        LDR     R3, =kernelNext
+        LDR     R1, [R3]
+        STR     R1, [R2]                ; kernelCurrent = kernelNext
+        LDR     R0, [R1]                ; kernelNext->sp
+        LDMIA   R0!, {R4-R11}
+        MSR     PSP, R0
+        BL      KERNEL_RecordSwitch     ; R4-R11 are preserved
+        CPSIE   I
+        MVN     LR, #2                  ; EXC_RETURN 0xFFFFFFFD: thread mode, PSP
+        BX      LR
+
+;------------------------------------------------------------------------------
+; Passes the stacked frame of the caller (MSP before KERNEL_Start(), PSP
+; afterwards) to KERNEL_SvcHandler().
+;------------------------------------------------------------------------------
+        PUBLIC  SVC_Handler
+SVC_Handler:
+        TST     LR, #4
+        ITE     EQ
+        MRSEQ   R0, MSP
+        MRSNE   R0, PSP
+        B       KERNEL_SvcHandler
+
+;------------------------------------------------------------------------------
+; unsigned int KERNEL_SvcCreate(KernelThread *thread,
+;                               const KernelThreadParams *params)
+;------------------------------------------------------------------------------
+        PUBLIC  KERNEL_SvcCreate
+KERNEL_SvcCreate:
+        SVC     #0                      ; KERNEL_SVC_CREATE
+        BX      LR
+
+;------------------------------------------------------------------------------
+; void KERNEL_SvcExit(void)
+;------------------------------------------------------------------------------
+        PUBLIC  KERNEL_SvcExit
+KERNEL_SvcExit:
+        SVC     #1                      ; KERNEL_SVC_EXIT
+        BX      LR
+
+        END
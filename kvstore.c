@@ -0,0 +1,632 @@
+/* ----------------------------------------------------------------------------
+ *         Key-value store in flash
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "kvstore.h"
+#include "crc.h"
+
+#include <string.h>
+
+#if (KVSTORE_NUM_SECTORS < 2) || (KVSTORE_SIZE / 4 >= 0xFFFF)
+#error "KVSTORE_NUM_SECTORS must be at least 2, and the store below 256 KB"
+#endif
+
+#if KVSTORE_MAX_KEYS & (KVSTORE_MAX_KEYS - 1)
+#error "KVSTORE_MAX_KEYS must be a power of 2"
+#endif
+
+#if (KVSTORE_MAX_VALUE < 1) || (KVSTORE_MAX_VALUE > 64)
+#error "KVSTORE_MAX_VALUE must be between 1 and 64"
+#endif
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define PAGES_PER_SECTOR        (KVSTORE_SECTOR_SIZE / IAP_PAGE_SIZE)
+
+/// Record bytes of a page, before its CRC.
+#define PAGE_PAYLOAD            (IAP_PAGE_SIZE - 4)
+
+/// Records: key (2 bytes), value size, type, then the value padded to a
+/// word. An erased key ends the records of a page.
+#define RECORD_HEADER           4
+#define RECORD_SIZE(size)       (RECORD_HEADER + (((size) + 3) & ~3u))
+#define MAX_RECORD              RECORD_SIZE(KVSTORE_MAX_VALUE)
+#define RECORD_VALUE            0x56
+#define RECORD_DELETED          0x44
+
+/// Sector header page: magic, sequence number (0 is never used).
+#define SECTOR_MAGIC            0x5356454B
+
+/// Live bytes that fit in the sectors other than the erased one, closing each
+/// page when a record of the largest size does not fit, with room for the
+/// record that starts a collection.
+#define CAPACITY                ((KVSTORE_NUM_SECTORS - 1) * (PAGES_PER_SECTOR - 1) \
+                                 * (PAGE_PAYLOAD - MAX_RECORD + 4) - MAX_RECORD)
+
+/// Hash table of the index, at most half full.
+#define INDEX_SIZE              (2 * KVSTORE_MAX_KEYS)
+
+/// Index location of a key whose records have all been collected.
+#define NO_RECORD               0xFFFF
+
+#define SECTOR_ADDRESS(sector)  (KVSTORE_START + (sector) * KVSTORE_SECTOR_SIZE)
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Index entry: key and location (store offset / 4) of its newest record.
+typedef struct {
+
+    unsigned short key;
+    unsigned short location;
+
+} IndexEntry;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static IndexEntry keyIndex[INDEX_SIZE];
+
+/// Sequence number of each sector; 0 if it is erased.
+static unsigned int sequences[KVSTORE_NUM_SECTORS];
+
+/// Sector of the log head, and its next page to program.
+static unsigned int headSector;
+static unsigned int headPage;
+
+/// Records not programmed yet, and their size.
+static unsigned int openPage[IAP_PAGE_SIZE / 4];
+static unsigned int openUsed;
+
+/// A collection is in progress: the head must not move again.
+static unsigned char collecting;
+
+static KvstoreStats kvstoreStats;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns the index entry of a key, or a free entry for it if create is 1.
+/// Returns 0 if the key is unknown (or the index is full).
+//------------------------------------------------------------------------------
+static IndexEntry * Find(unsigned short key, unsigned char create)
+{
+    unsigned int slot = ((key * 0x9E3779B1u) >> 16) & (INDEX_SIZE - 1);
+
+    while (keyIndex[slot].key != KVSTORE_INVALID_KEY) {
+
+        if (keyIndex[slot].key == key) {
+
+            return &keyIndex[slot];
+        }
+        slot = (slot + 1) & (INDEX_SIZE - 1);
+    }
+
+    if (!create || (kvstoreStats.keys >= KVSTORE_MAX_KEYS)) {
+
+        return 0;
+    }
+    kvstoreStats.keys++;
+    keyIndex[slot].key = key;
+    keyIndex[slot].location = NO_RECORD;
+
+    return &keyIndex[slot];
+}
+
+//------------------------------------------------------------------------------
+/// Returns the record at a location, in flash or in the open page.
+//------------------------------------------------------------------------------
+static const unsigned char * RecordAt(unsigned short location)
+{
+    unsigned int offset = location << 2;
+    unsigned int open = headSector * KVSTORE_SECTOR_SIZE
+                        + headPage * IAP_PAGE_SIZE;
+
+    if ((offset >= open) && (offset < open + IAP_PAGE_SIZE)) {
+
+        return (const unsigned char *) openPage + (offset - open);
+    }
+    return (const unsigned char *) (KVSTORE_START + offset);
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if a range of flash is erased.
+//------------------------------------------------------------------------------
+static unsigned char IsErased(unsigned int address, unsigned int size)
+{
+    const unsigned int *word = (const unsigned int *) address;
+
+    for (size /= 4; size; size--) {
+
+        if (*word++ != 0xFFFFFFFF) {
+
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if a programmed page holds a valid CRC.
+//------------------------------------------------------------------------------
+static unsigned char IsValid(unsigned int address)
+{
+    return CRC_Compute32(0, (const void *) address, PAGE_PAYLOAD)
+           == *(const unsigned int *) (address + PAGE_PAYLOAD);
+}
+
+//------------------------------------------------------------------------------
+/// Seals a page buffer with its CRC and programs it (the page is erased).
+//------------------------------------------------------------------------------
+static unsigned char ProgramPage(unsigned int sector,
+                                 unsigned int page,
+                                 unsigned int *buffer)
+{
+    buffer[PAGE_PAYLOAD / 4] = CRC_Compute32(0, buffer, PAGE_PAYLOAD);
+    kvstoreStats.pagesWritten++;
+
+    return IAP_Program(SECTOR_ADDRESS(sector) + page * IAP_PAGE_SIZE,
+                       buffer, IAP_PAGE_SIZE);
+}
+
+//------------------------------------------------------------------------------
+/// Erases a sector, header first: a sector cut by a power loss is then seen
+/// as dirty rather than as holding old records.
+//------------------------------------------------------------------------------
+static unsigned char EraseSector(unsigned int sector)
+{
+    sequences[sector] = 0;
+    kvstoreStats.sectorsErased++;
+
+    return IAP_Erase(SECTOR_ADDRESS(sector), IAP_PAGE_SIZE)
+           && IAP_Erase(SECTOR_ADDRESS(sector) + IAP_PAGE_SIZE,
+                        KVSTORE_SECTOR_SIZE - IAP_PAGE_SIZE);
+}
+
+//------------------------------------------------------------------------------
+/// Empties the open page.
+//------------------------------------------------------------------------------
+static void ResetOpenPage(void)
+{
+    memset(openPage, 0xFF, sizeof(openPage));
+    openUsed = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Makes an erased sector the head of the log.
+//------------------------------------------------------------------------------
+static unsigned char Activate(unsigned int sector, unsigned int sequence)
+{
+    ResetOpenPage();
+    openPage[0] = SECTOR_MAGIC;
+    openPage[1] = sequence;
+    if (!ProgramPage(sector, 0, openPage)) {
+
+        return 0;
+    }
+    sequences[sector] = sequence;
+    headSector = sector;
+    headPage = 1;
+    ResetOpenPage();
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the sector with the lowest sequence number, or -1 if all are
+/// erased.
+//------------------------------------------------------------------------------
+static int Oldest(void)
+{
+    int oldest = -1;
+    unsigned int sector;
+
+    for (sector = 0; sector < KVSTORE_NUM_SECTORS; sector++) {
+
+        if (sequences[sector]
+            && ((oldest < 0) || (sequences[sector] < sequences[oldest]))) {
+
+            oldest = sector;
+        }
+    }
+    return oldest;
+}
+
+static unsigned char Collect(unsigned int victim);
+
+//------------------------------------------------------------------------------
+/// Moves the head to the next sector of the ring, which is erased, then
+/// collects the oldest sector if no erased one is left.
+//------------------------------------------------------------------------------
+static unsigned char Advance(void)
+{
+    unsigned int next = (headSector + 1) % KVSTORE_NUM_SECTORS;
+    unsigned int sector;
+
+    if (collecting || sequences[next]
+        || !Activate(next, sequences[headSector] + 1)) {
+
+        return 0;
+    }
+
+    for (sector = 0; sector < KVSTORE_NUM_SECTORS; sector++) {
+
+        if (sequences[sector] == 0) {
+
+            return 1;
+        }
+    }
+    return Collect(Oldest());
+}
+
+//------------------------------------------------------------------------------
+/// Programs the open page, if it holds records. This is the commit point.
+//------------------------------------------------------------------------------
+static unsigned char Flush(void)
+{
+    if (openUsed == 0) {
+
+        return 1;
+    }
+    if (!ProgramPage(headSector, headPage, openPage)) {
+
+        return 0;
+    }
+    headPage++;
+    ResetOpenPage();
+
+    return (headPage < PAGES_PER_SECTOR) || Advance();
+}
+
+//------------------------------------------------------------------------------
+/// Appends a record to the open page and points the index entry at it.
+//------------------------------------------------------------------------------
+static unsigned char Append(IndexEntry *entry,
+                            unsigned char type,
+                            const void *data,
+                            unsigned int size)
+{
+    unsigned char *record;
+
+    if ((openUsed + RECORD_SIZE(size) > PAGE_PAYLOAD) && !Flush()) {
+
+        return 0;
+    }
+
+    record = (unsigned char *) openPage + openUsed;
+    record[0] = entry->key & 0xFF;
+    record[1] = entry->key >> 8;
+    record[2] = size;
+    record[3] = type;
+    memcpy(&record[RECORD_HEADER], data, size);
+
+    entry->location = (headSector * KVSTORE_SECTOR_SIZE
+                       + headPage * IAP_PAGE_SIZE + openUsed) >> 2;
+    openUsed += RECORD_SIZE(size);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Copies the live records of a sector to the head, commits them, then
+/// erases the sector. Deletions are dropped: no older record is left.
+//------------------------------------------------------------------------------
+static unsigned char Collect(unsigned int victim)
+{
+    unsigned int address;
+    unsigned int offset;
+    unsigned int page;
+    const unsigned char *record;
+    IndexEntry *entry;
+    unsigned char ok = 1;
+
+    collecting = 1;
+    for (page = 1; ok && (page < PAGES_PER_SECTOR); page++) {
+
+        address = SECTOR_ADDRESS(victim) + page * IAP_PAGE_SIZE;
+        if (IsErased(address, IAP_PAGE_SIZE) || !IsValid(address)) {
+
+            continue;
+        }
+
+        for (offset = 0; ok && (offset + RECORD_HEADER <= PAGE_PAYLOAD);
+             offset += RECORD_SIZE(record[2])) {
+
+            record = (const unsigned char *) address + offset;
+            if ((record[0] == 0xFF) && (record[1] == 0xFF)) {
+
+                break;
+            }
+            entry = Find(record[0] | (record[1] << 8), 0);
+            if (!entry || (RecordAt(entry->location) != record)) {
+
+                continue;
+            }
+            if (record[3] == RECORD_VALUE) {
+
+                ok = Append(entry, RECORD_VALUE, &record[RECORD_HEADER],
+                            record[2]);
+            }
+            else {
+
+                kvstoreStats.liveBytes -= RECORD_SIZE(0);
+                entry->location = NO_RECORD;
+            }
+        }
+    }
+    ok = ok && Flush();
+    collecting = 0;
+
+    return ok && EraseSector(victim);
+}
+
+//------------------------------------------------------------------------------
+/// Indexes the records of a valid page.
+//------------------------------------------------------------------------------
+static unsigned char IndexPage(unsigned int sector, unsigned int page)
+{
+    unsigned int address = SECTOR_ADDRESS(sector) + page * IAP_PAGE_SIZE;
+    const unsigned char *record;
+    unsigned int offset;
+    IndexEntry *entry;
+
+    for (offset = 0; offset + RECORD_HEADER <= PAGE_PAYLOAD;
+         offset += RECORD_SIZE(record[2])) {
+
+        record = (const unsigned char *) address + offset;
+        if ((record[0] == 0xFF) && (record[1] == 0xFF)) {
+
+            break;
+        }
+        if ((record[2] > KVSTORE_MAX_VALUE)
+            || (offset + RECORD_SIZE(record[2]) > PAGE_PAYLOAD)) {
+
+            return 0;
+        }
+        entry = Find(record[0] | (record[1] << 8), 1);
+        if (!entry) {
+
+            return 0;
+        }
+        entry->location = (address - KVSTORE_START + offset) >> 2;
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Reads the sector headers and replays the log, oldest sector first.
+/// Returns 1 on success; 0 if the records do not fit in the index.
+//------------------------------------------------------------------------------
+static unsigned char Mount(void)
+{
+    const unsigned int *header;
+    unsigned int sector;
+    unsigned int order[KVSTORE_NUM_SECTORS];
+    unsigned int count = 0;
+    unsigned int page;
+    unsigned int address;
+    unsigned int i;
+    unsigned int j;
+
+    for (sector = 0; sector < KVSTORE_NUM_SECTORS; sector++) {
+
+        header = (const unsigned int *) SECTOR_ADDRESS(sector);
+        sequences[sector] = 0;
+        if ((header[0] == SECTOR_MAGIC) && header[1]
+            && IsValid(SECTOR_ADDRESS(sector))) {
+
+            sequences[sector] = header[1];
+
+            // Insertion by sequence number
+            for (i = count; (i > 0) && (sequences[order[i - 1]] > header[1]); i--) {
+
+                order[i] = order[i - 1];
+            }
+            order[i] = sector;
+            count++;
+        }
+        else if (!IsErased(SECTOR_ADDRESS(sector), KVSTORE_SECTOR_SIZE)
+                 && !EraseSector(sector)) {
+
+            return 0;
+        }
+    }
+
+    if (count == 0) {
+
+        return Activate(0, 1);
+    }
+
+    for (i = 0; i < count; i++) {
+
+        sector = order[i];
+        headSector = sector;
+        headPage = 1;
+        for (page = 1; page < PAGES_PER_SECTOR; page++) {
+
+            address = SECTOR_ADDRESS(sector) + page * IAP_PAGE_SIZE;
+            if (IsErased(address, IAP_PAGE_SIZE)) {
+
+                continue;
+            }
+            headPage = page + 1;
+            if (!IsValid(address)) {
+
+                kvstoreStats.corruptPages++;
+            }
+            else if (!IndexPage(sector, page)) {
+
+                return 0;
+            }
+        }
+    }
+
+    for (j = 0; j < INDEX_SIZE; j++) {
+
+        if ((keyIndex[j].key != KVSTORE_INVALID_KEY)
+            && (keyIndex[j].location != NO_RECORD)) {
+
+            kvstoreStats.liveBytes += RECORD_SIZE(RecordAt(keyIndex[j].location)[2]);
+        }
+    }
+
+    // A collection cut by a power loss is run again
+    if ((count == KVSTORE_NUM_SECTORS) && !Collect(order[0])) {
+
+        return 0;
+    }
+    return (headPage < PAGES_PER_SECTOR) || Advance();
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Mounts the store, formatting it if it holds no valid sector, and builds
+/// the index. IAP_Initialize() must have been called.
+/// Returns 1 on success; 0 if the flash cannot be written or the log holds
+/// more keys than KVSTORE_MAX_KEYS.
+//------------------------------------------------------------------------------
+unsigned char KVSTORE_Initialize(void)
+{
+    memset(keyIndex, 0xFF, sizeof(keyIndex));
+    memset(&kvstoreStats, 0, sizeof(kvstoreStats));
+    kvstoreStats.capacity = CAPACITY;
+    collecting = 0;
+    ResetOpenPage();
+
+    return Mount();
+}
+
+//------------------------------------------------------------------------------
+/// Reads a value.
+/// Returns the size of the value, of which at most size bytes are copied; 0
+/// if the key has no value.
+/// \param key  Key.
+/// \param buffer  Receives the value.
+/// \param size  Size of the buffer.
+//------------------------------------------------------------------------------
+unsigned int KVSTORE_Get(unsigned short key, void *buffer, unsigned int size)
+{
+    IndexEntry *entry = Find(key, 0);
+    const unsigned char *record;
+
+    if (!entry || (entry->location == NO_RECORD)) {
+
+        return 0;
+    }
+    record = RecordAt(entry->location);
+    if (record[3] != RECORD_VALUE) {
+
+        return 0;
+    }
+    memcpy(buffer, &record[RECORD_HEADER], (size < record[2]) ? size : record[2]);
+
+    return record[2];
+}
+
+//------------------------------------------------------------------------------
+/// Stores a value. It reaches the flash when its page is full or at the next
+/// KVSTORE_Commit(); storing the value already held writes nothing.
+/// Returns 1 on success; 0 if the key or the size is invalid, or if the
+/// store or its index is full.
+/// \param key  Key, other than KVSTORE_INVALID_KEY.
+/// \param data  Value.
+/// \param size  Size of the value, 1 to KVSTORE_MAX_VALUE.
+//------------------------------------------------------------------------------
+unsigned char KVSTORE_Set(unsigned short key,
+                          const void *data,
+                          unsigned int size)
+{
+    IndexEntry *entry;
+    const unsigned char *record = 0;
+    unsigned int previous = 0;
+
+    if ((key == KVSTORE_INVALID_KEY) || (size == 0)
+        || (size > KVSTORE_MAX_VALUE)) {
+
+        return 0;
+    }
+    entry = Find(key, 1);
+    if (!entry) {
+
+        return 0;
+    }
+
+    if (entry->location != NO_RECORD) {
+
+        record = RecordAt(entry->location);
+        if ((record[3] == RECORD_VALUE) && (record[2] == size)
+            && (memcmp(&record[RECORD_HEADER], data, size) == 0)) {
+
+            return 1;
+        }
+        previous = RECORD_SIZE(record[2]);
+    }
+    if (kvstoreStats.liveBytes - previous + RECORD_SIZE(size) > CAPACITY) {
+
+        return 0;
+    }
+
+    if (!Append(entry, RECORD_VALUE, data, size)) {
+
+        return 0;
+    }
+    kvstoreStats.liveBytes += RECORD_SIZE(size) - previous;
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Deletes a value; like KVSTORE_Set(), it reaches the flash later.
+/// Returns 1 on success (or if the key has no value); 0 if the store is full.
+//------------------------------------------------------------------------------
+unsigned char KVSTORE_Delete(unsigned short key)
+{
+    IndexEntry *entry = Find(key, 0);
+    unsigned int previous;
+
+    if (!entry || (entry->location == NO_RECORD)
+        || (RecordAt(entry->location)[3] != RECORD_VALUE)) {
+
+        return 1;
+    }
+    previous = RECORD_SIZE(RecordAt(entry->location)[2]);
+    if (!Append(entry, RECORD_DELETED, 0, 0)) {
+
+        return 0;
+    }
+    kvstoreStats.liveBytes += RECORD_SIZE(0);
+    kvstoreStats.liveBytes -= previous;
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Programs the values stored or deleted since the last commit. Once it
+/// returns 1, they survive a power loss.
+//------------------------------------------------------------------------------
+unsigned char KVSTORE_Commit(void)
+{
+    return Flush();
+}
+
+//------------------------------------------------------------------------------
+/// Returns the store counters.
+//------------------------------------------------------------------------------
+const KvstoreStats * KVSTORE_GetStats(void)
+{
+    return &kvstoreStats;
+}
@@ -0,0 +1,101 @@
+/* ----------------------------------------------------------------------------
+ *         Key-value store in flash
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Persistent values (configuration, calibration) identified by 16-bit keys,
+** kept in a log at the end of the internal flash: KVSTORE_NUM_SECTORS
+** sectors of KVSTORE_SECTOR_SIZE bytes, above the firmware slots of the
+** flash layout (image.h). Each sector starts with a header page holding its
+** sequence number; the other pages hold records.
+**
+** Records are gathered in a RAM page and programmed a whole page at a time,
+** when the page is full or when KVSTORE_Commit() is called. Each page ends
+** with a CRC-32, so a page cut by a power loss is ignored at the next mount:
+** what was committed before it survives. The newest record of a key wins.
+**
+** When the last page of a sector is used, the log moves to the next sector
+** in the ring, which is always kept erased. Once no erased sector is left,
+** the live records of the oldest sector are copied forward and that sector
+** is erased, so every sector is erased in turn (wear leveling). A hash
+** index in RAM maps each key to its newest record: reads never scan the
+** flash, and the log is only scanned at mount.
+**
+** The store runs flash commands (iap.h): call it from one thread, never
+** from an interrupt.
+*/
+
+#ifndef KVSTORE_H
+#define KVSTORE_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "iap.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Sectors: lock regions at the end of the flash.
+#ifndef KVSTORE_NUM_SECTORS
+#define KVSTORE_NUM_SECTORS     2
+#endif
+#define KVSTORE_SECTOR_SIZE     IAP_LOCK_REGION_SIZE
+#define KVSTORE_SIZE            (KVSTORE_NUM_SECTORS * KVSTORE_SECTOR_SIZE)
+#define KVSTORE_START           (IAP_FLASH_START + IAP_FLASH_SIZE - KVSTORE_SIZE)
+
+/// Largest number of keys, deleted ones included until the next mount.
+#ifndef KVSTORE_MAX_KEYS
+#define KVSTORE_MAX_KEYS        64
+#endif
+
+/// Largest value, in bytes.
+#ifndef KVSTORE_MAX_VALUE
+#define KVSTORE_MAX_VALUE       64
+#endif
+
+/// Key never stored (erased flash).
+#define KVSTORE_INVALID_KEY     0xFFFF
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Store counters.
+typedef struct {
+
+    /// Bytes of the live records, and the most they may take.
+    unsigned int liveBytes;
+    unsigned int capacity;
+    unsigned int keys;
+    unsigned int pagesWritten;
+    unsigned int sectorsErased;
+    /// Pages found cut by a power loss at mount.
+    unsigned int corruptPages;
+
+} KvstoreStats;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned char KVSTORE_Initialize(void);
+
+extern unsigned int KVSTORE_Get(unsigned short key,
+                                void *buffer,
+                                unsigned int size);
+
+extern unsigned char KVSTORE_Set(unsigned short key,
+                                 const void *data,
+                                 unsigned int size);
+
+extern unsigned char KVSTORE_Delete(unsigned short key);
+
+extern unsigned char KVSTORE_Commit(void);
+
+extern const KvstoreStats * KVSTORE_GetStats(void);
+
+#endif //#ifndef KVSTORE_H
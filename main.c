@@ -1,9 +1,185 @@
+#include "AT91SAM3U4.h"
+#include "startup.h"
+#include "cdc.h"
+#include "ustream.h"
+#include "msc.h"
+#include "sdcard.h"
+#include "clock.h"
+#include "dbgu.h"
+#include "fault.h"
+#include "hdma.h"
+#include "fastmem.h"
+#include "iap.h"
+#include "kvstore.h"
+#include "flashdisk.h"
+#include "nand.h"
+#include "nandftl.h"
+#include "evlog.h"
+#include "image.h"
+#include "update.h"
+#include "irq.h"
+#include "scheduler.h"
+#include "kernel.h"
+#include "watchdog.h"
+
+/// Expose the SD card as a USB disk instead of the serial port and stream.
+#ifndef MAIN_USB_MSC
+#define MAIN_USB_MSC  0
+#endif
+
+/// Keep the event log on a NAND flash on NCS0 instead of the internal flash.
+#ifndef MAIN_NAND_LOG
+#define MAIN_NAND_LOG  0
+#endif
+
+static unsigned long x = 0;
+
+#if MAIN_USB_MSC
+static BlockDevice sdcard;
+#endif
+
+/// Event log, in its flash region (image.h) or on the NAND flash.
+static BlockDevice logDisk;
+
+/// Heartbeats after which a newly installed image confirms its health.
+#ifndef MAIN_CONFIRM_BEATS
+#define MAIN_CONFIRM_BEATS  100
+#endif
+
+/// Watchdog clients.
+#define WDT_CLIENT_HEARTBEAT  0
+
+static const WatchdogClient watchdogClients[] =
+{
+  /* name         budget */
+  {  "heartbeat", 40 },
+};
+
+static void Heartbeat(void)
+{
+  x++;
+  WDT_CheckIn(WDT_CLIENT_HEARTBEAT);
+  if (x == MAIN_CONFIRM_BEATS)
+  {
+    UPDATE_Confirm();
+  }
+}
+
+/// Time CPU and HDMA copies at startup (FASTMEM_Calibrate()), for
+/// tools/gen_fastmem_threshold.py.
+#ifndef MAIN_FASTMEM_REPORT
+#define MAIN_FASTMEM_REPORT  1
+#endif
+
+/// Ticks between two reports of the context switch latency.
+#ifndef MAIN_REPORT_TICKS
+#define MAIN_REPORT_TICKS  60000
+#endif
+
+/// Cooperative tasks, highest priority first. They all run in the background
+/// thread; work that must preempt them gets a kernel thread of its own. The
+/// ticks in between are slept through (tickless idle).
+static const SchedulerTask tasks[] =
+{
+  /* name         function       period             deadline           offset */
+  {  "heartbeat", Heartbeat,     10,                10,                0 },
+  {  "evlog",     EVLOG_Flush,   10,                20,                5 },
+  {  "report",    KERNEL_Report, MAIN_REPORT_TICKS, MAIN_REPORT_TICKS, 7 },
+};
+
+#pragma data_alignment = 8
+static unsigned int backgroundStack[256];
+static KernelThread backgroundThread;
+
+#if MAIN_FASTMEM_REPORT
+/// Source and destination of the copies timed at startup.
+static unsigned int calibrationSrc[256];
+static unsigned int calibrationDst[256];
+#endif
+
+static void Background(void *arg)
+{
+#if MAIN_FASTMEM_REPORT
+  // Once, from a thread: the copies wait for the HDMA interrupt
+  FASTMEM_Calibrate(calibrationDst, calibrationSrc, sizeof(calibrationDst));
+#endif
+  SCHED_Run();
+}
+
+static const KernelThreadParams backgroundParams =
+{
+  Background, 0, KERNEL_IDLE_PRIORITY,
+  backgroundStack, sizeof(backgroundStack), "background"
+};
+
+/// Logs the fault or stall that caused the last reset, from its record in
+/// the NOINIT block, then discards the record. The fault and stall handlers
+/// leave this to the next boot: they must not program the flash.
+static void LogLastReset(void)
+{
+  const FaultRecord *fault = FAULT_GetRecord();
+  const WatchdogRecord *stall = WDT_GetRecord();
+
+  if (fault)
+  {
+    EVLOG_Write(EVLOG_ID_FAULT, fault->pc);
+    FAULT_Clear();
+  }
+  if (stall)
+  {
+    EVLOG_Write(EVLOG_ID_STALL, stall->stalled);
+    WDT_Clear();
+  }
+}
+
 void main(void)
 {
-  unsigned long x = 0;
-  
-  while(1)
+  STARTUP_MarkMain();
+
+  // Threads and watchdog clients first, so that the fault and stall reports
+  // can name them
+  KERNEL_CreateThread(&backgroundThread, &backgroundParams);
+  WDT_Initialize(watchdogClients,
+                 sizeof(watchdogClients) / sizeof(watchdogClients[0]));
+
+  // Report the boot timing, then the fault or stall that caused the last
+  // reset, if any
+  DBGU_Configure(AT91C_DBGU_PAR_NONE, DBGU_BAUDRATE, CLOCK_GetMck());
+  CLOCK_Report();
+  STARTUP_Report();
+  FAULT_Report();
+  WDT_Report();
+  IRQ_ConfigurePriorities();
+  DBGU_StartTx();
+  HDMA_Initialize();
+  IAP_Initialize();
+  KVSTORE_Initialize();
+#if MAIN_NAND_LOG
+  // Without a device, the log stays off
+  if (NAND_Initialize(CLOCK_GetMck()))
   {
-    x++;
+    NANDFTL_Initialize(&logDisk);
   }
+  EVLOG_Initialize(&logDisk, 0, logDisk.numBlocks);
+#else
+  FLASHDISK_Initialize(&logDisk, IMAGE_LOG_START, IMAGE_LOG_SIZE / BLOCK_SIZE);
+  EVLOG_Initialize(&logDisk, 0, IMAGE_LOG_SIZE / BLOCK_SIZE);
+#endif
+  EVLOG_Write(EVLOG_ID_BOOT, AT91C_BASE_RSTC->RSTC_RSR);
+  LogLastReset();
+#if MAIN_USB_MSC
+  // Without a card, the disk is reported without medium
+  SDCARD_Initialize(&sdcard, CLOCK_GetMck());
+  MSC_Initialize(&sdcard);
+#else
+  CDC_Initialize();
+  USTREAM_Initialize();
+#endif
+  USBD_Connect();
+  FAULT_Initialize();
+
+  SCHED_Initialize(tasks, sizeof(tasks) / sizeof(tasks[0]));
+
+  SCHED_Start();
+  KERNEL_Start();
 }
@@ -0,0 +1,896 @@
+/* ----------------------------------------------------------------------------
+ *         USB mass storage
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "msc.h"
+#include "evlog.h"
+#include "irq.h"
+#include "sections.h"
+#include "AT91SAM3U4.h"
+
+#if (MSC_BUFFER_SIZE % BLOCK_SIZE) || (MSC_BUFFER_SIZE > USBD_MAX_DMA_BUFFER)
+#error "MSC_BUFFER_SIZE must be a multiple of 512, at most USBD_MAX_DMA_BUFFER"
+#endif
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Class requests.
+#define BULK_ONLY_RESET         0xFF
+#define GET_MAX_LUN             0xFE
+
+/// Bulk packet size in high speed and in full speed.
+#define HS_BULK_SIZE            512
+#define FS_BULK_SIZE            64
+
+/// Command block wrapper. It is received into a buffer of a whole number of
+/// packets, so that an oversized one is seen as such.
+#define CBW_SIGNATURE           0x43425355
+#define CBW_SIZE                31
+#define CBW_BUFFER_SIZE         512
+#define CBW_FLAGS_IN            0x80
+
+/// Command status wrapper.
+#define CSW_SIGNATURE           0x53425355
+#define CSW_SIZE                13
+#define CSW_PASSED              0
+#define CSW_FAILED              1
+#define CSW_PHASE_ERROR         2
+
+/// SCSI commands.
+#define TEST_UNIT_READY         0x00
+#define REQUEST_SENSE           0x03
+#define INQUIRY                 0x12
+#define MODE_SENSE6             0x1A
+#define START_STOP_UNIT         0x1B
+#define PREVENT_ALLOW_REMOVAL   0x1E
+#define READ_FORMAT_CAPACITIES  0x23
+#define READ_CAPACITY10         0x25
+#define READ10                  0x28
+#define WRITE10                 0x2A
+#define VERIFY10                0x2F
+#define SYNCHRONIZE_CACHE10     0x35
+
+/// Sense keys and additional sense codes (ASC << 8 | ASCQ).
+#define SENSE_NONE              0x0
+#define SENSE_NOT_READY         0x2
+#define SENSE_MEDIUM_ERROR      0x3
+#define SENSE_ILLEGAL_REQUEST   0x5
+#define SENSE_DATA_PROTECT      0x7
+#define ASC_NO_SENSE            0x0000
+#define ASC_WRITE_ERROR         0x0C00
+#define ASC_READ_ERROR          0x1100
+#define ASC_INVALID_COMMAND     0x2000
+#define ASC_OUT_OF_RANGE        0x2100
+#define ASC_INVALID_FIELD       0x2400
+#define ASC_WRITE_PROTECTED     0x2700
+#define ASC_NO_MEDIUM           0x3A00
+
+/// Blocks per data buffer.
+#define BUFFER_BLOCKS           (MSC_BUFFER_SIZE / BLOCK_SIZE)
+
+/// Protocol phases.
+#define PHASE_IDLE              0
+/// Receive the next command once the block device is idle.
+#define PHASE_NEXT              1
+#define PHASE_CBW               2
+#define PHASE_COMMAND           3
+#define PHASE_DATA              4
+#define PHASE_STATUS            5
+#define PHASE_CSW               6
+/// Invalid command block: both endpoints wedged until a Bulk-Only Reset.
+#define PHASE_HALTED            7
+
+/// Data buffer states.
+#define BUFFER_FREE             0
+#define BUFFER_BUSY             1
+#define BUFFER_READY            2
+
+#define WORD(value)             ((value) & 0xFF), ((value) >> 8)
+
+/// Configuration descriptor of one speed.
+#define CONFIGURATION(bulkSize) \
+    9, USB_DESC_CONFIGURATION, WORD(32), 1, 1, 0, 0xC0, 50, \
+    /* SCSI transparent command set, bulk-only transport */ \
+    9, USB_DESC_INTERFACE, 0, 0, 2, 0x08, 0x06, 0x50, 0, \
+    7, USB_DESC_ENDPOINT, MSC_EP_OUT, USBD_BULK, WORD(bulkSize), 0, \
+    7, USB_DESC_ENDPOINT, USB_DIR_IN | MSC_EP_IN, USBD_BULK, WORD(bulkSize), 0
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Command being processed.
+typedef struct {
+
+    unsigned int tag;
+    /// Number of bytes the host expects to move, and in which direction.
+    unsigned int dataLength;
+    unsigned char in;
+    /// Number of bytes of the data stage actually processed.
+    unsigned int processed;
+    /// The data stage has ended with a short packet: no halt is needed.
+    unsigned char terminated;
+    unsigned char status;
+
+} Command;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static const unsigned char deviceDescriptor[] = {
+
+    18, USB_DESC_DEVICE, WORD(0x0200),
+    0x00, 0x00, 0x00, USBD_EP0_SIZE,
+    WORD(MSC_VENDOR_ID), WORD(MSC_PRODUCT_ID), WORD(0x0100),
+    1, 2, 3, 1
+};
+
+static const unsigned char qualifierDescriptor[] = {
+
+    10, USB_DESC_QUALIFIER, WORD(0x0200),
+    0x00, 0x00, 0x00, USBD_EP0_SIZE, 1, 0
+};
+
+static const unsigned char fullSpeedConfiguration[] = {
+
+    CONFIGURATION(FS_BULK_SIZE)
+};
+
+static const unsigned char highSpeedConfiguration[] = {
+
+    CONFIGURATION(HS_BULK_SIZE)
+};
+
+static const unsigned char languages[] = {
+
+    4, USB_DESC_STRING, WORD(0x0409)
+};
+
+static const unsigned char manufacturer[] = {
+
+    8, USB_DESC_STRING, 'E', 0, 'I', 0, 'E', 0
+};
+
+static const unsigned char product[] = {
+
+    34, USB_DESC_STRING,
+    'E', 0, 'I', 0, 'E', 0, ' ', 0, 'M', 0, 'a', 0, 's', 0, 's', 0, ' ', 0,
+    'S', 0, 't', 0, 'o', 0, 'r', 0, 'a', 0, 'g', 0, 'e', 0
+};
+
+/// The bulk-only transport requires a serial number of 12 digits at least.
+static const unsigned char serialNumber[] = {
+
+    26, USB_DESC_STRING,
+    '0', 0, '0', 0, '0', 0, '0', 0, '0', 0, '0', 0, '0', 0, '0', 0, '0', 0,
+    '0', 0, '0', 0, '1', 0
+};
+
+static const unsigned char * const strings[] = {
+
+    languages, manufacturer, product, serialNumber
+};
+
+static const UsbDescriptors descriptors = {
+
+    deviceDescriptor,
+    qualifierDescriptor,
+    fullSpeedConfiguration,
+    highSpeedConfiguration,
+    strings,
+    sizeof(strings) / sizeof(strings[0])
+};
+
+/// Standard INQUIRY data: removable direct access device, SPC-2.
+static const unsigned char inquiryData[36] = {
+
+    0x00, 0x80, 0x04, 0x02, 31, 0, 0, 0,
+    'E', 'I', 'E', ' ', ' ', ' ', ' ', ' ',
+    'E', 'I', 'E', ' ', 'S', 'D', ' ', 'C',
+    'a', 'r', 'd', ' ', ' ', ' ', ' ', ' ',
+    '1', '.', '0', '0'
+};
+
+/// Answer of GET_MAX_LUN: a single logical unit.
+static unsigned char maxLun = 0;
+
+DMABUF static __no_init unsigned char cbw[CBW_BUFFER_SIZE];
+
+DMABUF static __no_init unsigned char csw[CSW_SIZE];
+
+/// Data buffers, also used for the short answers of the other commands.
+#pragma data_alignment = 4
+DMABUF static __no_init unsigned char buffers[2][MSC_BUFFER_SIZE];
+
+#pragma data_alignment = 16
+DMABUF static __no_init UsbdDmaDescriptor dmaDescriptors[2];
+
+static BlockDevice *blockDevice;
+
+static volatile unsigned char configured;
+
+static volatile unsigned char phase;
+
+static Command command;
+
+/// Sense data of the last failed command, reported by REQUEST_SENSE.
+static unsigned char senseKey;
+static unsigned short senseCode;
+
+/// Size of the last command block received.
+static unsigned int cbwSize;
+
+/// State of the data buffers, and number of blocks each one holds.
+static volatile unsigned char bufferState[2];
+static unsigned int bufferBlocks[2];
+
+/// Buffer used next by each side, and blocks left to it.
+static unsigned char mediaIndex;
+static unsigned char usbIndex;
+static unsigned int mediaBlock;
+static unsigned int mediaLeft;
+static unsigned int usbLeft;
+
+static volatile unsigned char mediaBusy;
+static volatile unsigned char mediaFailed;
+static volatile unsigned char usbBusy;
+static volatile unsigned char usbFailed;
+
+static MscStats mscStats;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns a little-endian 32-bit field.
+//------------------------------------------------------------------------------
+static unsigned int GetLe32(const unsigned char *data)
+{
+    return data[0] | (data[1] << 8) | (data[2] << 16)
+           | ((unsigned int) data[3] << 24);
+}
+
+//------------------------------------------------------------------------------
+/// Returns a big-endian 32-bit field.
+//------------------------------------------------------------------------------
+static unsigned int GetBe32(const unsigned char *data)
+{
+    return ((unsigned int) data[0] << 24) | (data[1] << 16)
+           | (data[2] << 8) | data[3];
+}
+
+//------------------------------------------------------------------------------
+/// Stores a 32-bit field, big-endian.
+//------------------------------------------------------------------------------
+static void PutBe32(unsigned char *data, unsigned int value)
+{
+    data[0] = value >> 24;
+    data[1] = (value >> 16) & 0xFF;
+    data[2] = (value >> 8) & 0xFF;
+    data[3] = value & 0xFF;
+}
+
+//------------------------------------------------------------------------------
+/// Stores a 32-bit field, little-endian.
+//------------------------------------------------------------------------------
+static void PutLe32(unsigned char *data, unsigned int value)
+{
+    data[0] = value & 0xFF;
+    data[1] = (value >> 8) & 0xFF;
+    data[2] = (value >> 16) & 0xFF;
+    data[3] = value >> 24;
+}
+
+//------------------------------------------------------------------------------
+/// Ends the command with a failed status and the given sense data.
+//------------------------------------------------------------------------------
+static void Fail(unsigned char key, unsigned short code)
+{
+    senseKey = key;
+    senseCode = code;
+    command.status = CSW_FAILED;
+}
+
+//------------------------------------------------------------------------------
+/// Makes the UDPHS interrupt run the protocol again.
+//------------------------------------------------------------------------------
+static void Kick(void)
+{
+    IRQ_SetPending(AT91C_ID_UDPHS);
+}
+
+//------------------------------------------------------------------------------
+/// End of a block device operation.
+//------------------------------------------------------------------------------
+static void MediaDone(void *arg, unsigned char status)
+{
+    unsigned int blocks = bufferBlocks[mediaIndex];
+
+    if (status == BLOCK_STATUS_OK) {
+
+        if (command.in) {
+
+            bufferState[mediaIndex] = BUFFER_READY;
+            mscStats.blocksRead += blocks;
+        }
+        else {
+
+            bufferState[mediaIndex] = BUFFER_FREE;
+            command.processed += blocks * BLOCK_SIZE;
+            mscStats.blocksWritten += blocks;
+        }
+        mediaBlock += blocks;
+        mediaLeft -= blocks;
+        mediaIndex ^= 1;
+    }
+    else {
+
+        mediaFailed = 1;
+    }
+    mediaBusy = 0;
+    Kick();
+}
+
+//------------------------------------------------------------------------------
+/// End of a data transfer of the pipeline.
+//------------------------------------------------------------------------------
+static void DataDone(void *arg, unsigned char status, unsigned int transferred)
+{
+    unsigned int size = bufferBlocks[usbIndex] * BLOCK_SIZE;
+
+    if ((status == USBD_STATUS_SUCCESS) && (transferred == size)) {
+
+        if (command.in) {
+
+            bufferState[usbIndex] = BUFFER_FREE;
+            command.processed += size;
+        }
+        else {
+
+            bufferState[usbIndex] = BUFFER_READY;
+        }
+        usbLeft -= bufferBlocks[usbIndex];
+        usbIndex ^= 1;
+    }
+    else {
+
+        usbFailed = 1;
+    }
+    usbBusy = 0;
+}
+
+//------------------------------------------------------------------------------
+/// End of a short answer.
+//------------------------------------------------------------------------------
+static void AnswerDone(void *arg, unsigned char status, unsigned int transferred)
+{
+    command.processed = transferred;
+    usbBusy = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Command block received.
+//------------------------------------------------------------------------------
+static void CbwReceived(void *arg, unsigned char status, unsigned int transferred)
+{
+    if ((status == USBD_STATUS_SUCCESS) && (phase == PHASE_CBW)) {
+
+        cbwSize = transferred;
+        phase = PHASE_COMMAND;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Status sent.
+//------------------------------------------------------------------------------
+static void CswSent(void *arg, unsigned char status, unsigned int transferred)
+{
+    if (phase == PHASE_CSW) {
+
+        phase = PHASE_NEXT;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Sends a short answer, at most the size the host expects: a short packet
+/// (or a zero-length one) ends it if it is smaller.
+//------------------------------------------------------------------------------
+static void Answer(unsigned int size)
+{
+    if (!command.in || (command.dataLength == 0)) {
+
+        command.status = CSW_PHASE_ERROR;
+        return;
+    }
+    if (size > command.dataLength) {
+
+        size = command.dataLength;
+    }
+
+    usbBusy = 1;
+    if (size == command.dataLength) {
+
+        // No zero-length packet after an exact answer
+        dmaDescriptors[0].buffer = buffers[0];
+        dmaDescriptors[0].size = size;
+        if (!USBD_TransferChain(MSC_EP_IN, dmaDescriptors, 1, 1,
+                                AnswerDone, 0)) {
+
+            usbBusy = 0;
+        }
+    }
+    else {
+
+        command.terminated = 1;
+        if (!USBD_Transfer(MSC_EP_IN, buffers[0], size, AnswerDone, 0)) {
+
+            usbBusy = 0;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if there is a medium; otherwise fails the command.
+//------------------------------------------------------------------------------
+static unsigned char CheckMedium(void)
+{
+    if (blockDevice->numBlocks == 0) {
+
+        Fail(SENSE_NOT_READY, ASC_NO_MEDIUM);
+        return 0;
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// READ(10) and WRITE(10): checks the command and starts the pipeline.
+//------------------------------------------------------------------------------
+static void StartTransfer(const unsigned char *cb, unsigned char write)
+{
+    unsigned int block = GetBe32(&cb[2]);
+    unsigned int count = (cb[7] << 8) | cb[8];
+
+    if ((count && ((command.in == write)
+                   || (command.dataLength < count * BLOCK_SIZE)))
+        || (!count && command.dataLength)) {
+
+        // The host expects less data, or the other direction
+        command.status = CSW_PHASE_ERROR;
+        return;
+    }
+    if (!CheckMedium()) {
+
+        return;
+    }
+    if ((block > blockDevice->numBlocks)
+        || (count > blockDevice->numBlocks - block)) {
+
+        Fail(SENSE_ILLEGAL_REQUEST, ASC_OUT_OF_RANGE);
+        return;
+    }
+    if (write && blockDevice->writeProtected) {
+
+        Fail(SENSE_DATA_PROTECT, ASC_WRITE_PROTECTED);
+        return;
+    }
+
+    bufferState[0] = BUFFER_FREE;
+    bufferState[1] = BUFFER_FREE;
+    mediaIndex = 0;
+    usbIndex = 0;
+    mediaBlock = block;
+    mediaLeft = count;
+    usbLeft = count;
+    mediaFailed = 0;
+    usbFailed = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Decodes a SCSI command and starts its data stage, if any.
+//------------------------------------------------------------------------------
+static void ProcessCommand(const unsigned char *cb)
+{
+    unsigned char *answer = buffers[0];
+    unsigned char noData = 0;
+    unsigned int length;
+    unsigned int i;
+
+    switch (cb[0]) {
+
+        case INQUIRY:
+            if (cb[1] & 0x01) {
+
+                // No vital product data pages
+                Fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+                break;
+            }
+            for (i = 0; i < sizeof(inquiryData); i++) {
+
+                answer[i] = inquiryData[i];
+            }
+            Answer((cb[4] < sizeof(inquiryData)) ? cb[4] : sizeof(inquiryData));
+            break;
+
+        case REQUEST_SENSE:
+            answer[0] = 0x70;
+            answer[1] = 0;
+            answer[2] = senseKey;
+            PutBe32(&answer[3], 0);
+            answer[7] = 10;
+            PutBe32(&answer[8], 0);
+            answer[12] = senseCode >> 8;
+            answer[13] = senseCode & 0xFF;
+            PutBe32(&answer[14], 0);
+            senseKey = SENSE_NONE;
+            senseCode = ASC_NO_SENSE;
+            Answer((cb[4] < 18) ? cb[4] : 18);
+            break;
+
+        case READ_CAPACITY10:
+            if (CheckMedium()) {
+
+                PutBe32(&answer[0], blockDevice->numBlocks - 1);
+                PutBe32(&answer[4], BLOCK_SIZE);
+                Answer(8);
+            }
+            break;
+
+        case READ_FORMAT_CAPACITIES:
+            // One current capacity descriptor: formatted, or no medium
+            PutBe32(&answer[0], 8);
+            PutBe32(&answer[4], blockDevice->numBlocks
+                                ? blockDevice->numBlocks : 0xFFFFFFFF);
+            PutBe32(&answer[8], BLOCK_SIZE);
+            answer[8] = blockDevice->numBlocks ? 0x02 : 0x03;
+            length = (cb[7] << 8) | cb[8];
+            Answer((length < 12) ? length : 12);
+            break;
+
+        case MODE_SENSE6:
+            // Header only, with the write protection
+            answer[0] = 3;
+            answer[1] = 0;
+            answer[2] = blockDevice->writeProtected ? 0x80 : 0x00;
+            answer[3] = 0;
+            Answer((cb[4] < 4) ? cb[4] : 4);
+            break;
+
+        case READ10:
+            StartTransfer(cb, 0);
+            break;
+
+        case WRITE10:
+            StartTransfer(cb, 1);
+            break;
+
+        case TEST_UNIT_READY:
+        case VERIFY10:
+        case SYNCHRONIZE_CACHE10:
+            noData = 1;
+            CheckMedium();
+            break;
+
+        case PREVENT_ALLOW_REMOVAL:
+        case START_STOP_UNIT:
+            noData = 1;
+            break;
+
+        default:
+            Fail(SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+            break;
+    }
+
+    if (noData && command.dataLength && (command.status == CSW_PASSED)) {
+
+        // The host expects data that the command does not have
+        command.status = CSW_PHASE_ERROR;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Checks a command block and starts the command. An invalid one halts both
+/// endpoints until the host resets the interface.
+//------------------------------------------------------------------------------
+static void StartCommand(void)
+{
+    const unsigned char *cb = &cbw[15];
+
+    if ((cbwSize != CBW_SIZE) || (GetLe32(cbw) != CBW_SIGNATURE)
+        || ((cbw[13] & 0x0F) != 0)
+        || (cbw[14] == 0) || (cbw[14] > 16)) {
+
+        // CLEAR_FEATURE alone must not revive the endpoints (BOT 6.6.1)
+        USBD_Wedge(USB_DIR_IN | MSC_EP_IN, 1);
+        USBD_Wedge(MSC_EP_OUT, 1);
+        phase = PHASE_HALTED;
+        return;
+    }
+
+    mscStats.commands++;
+    EVLOG_Write(EVLOG_ID_MSC_COMMAND, cb[0]);
+    command.tag = GetLe32(&cbw[4]);
+    command.dataLength = GetLe32(&cbw[8]);
+    command.in = (cbw[12] & CBW_FLAGS_IN) != 0;
+    command.processed = 0;
+    command.terminated = 0;
+    command.status = CSW_PASSED;
+    mediaLeft = 0;
+    usbLeft = 0;
+    mediaFailed = 0;
+    usbFailed = 0;
+
+    ProcessCommand(cb);
+    phase = PHASE_DATA;
+}
+
+//------------------------------------------------------------------------------
+/// Moves the blocks of READ(10) through the buffers: device, then bus.
+//------------------------------------------------------------------------------
+static void PumpRead(void)
+{
+    unsigned int blocks;
+
+    if (!mediaBusy && mediaLeft && (bufferState[mediaIndex] == BUFFER_FREE)) {
+
+        blocks = (mediaLeft < BUFFER_BLOCKS) ? mediaLeft : BUFFER_BLOCKS;
+        bufferBlocks[mediaIndex] = blocks;
+        bufferState[mediaIndex] = BUFFER_BUSY;
+        mediaBusy = 1;
+        if (!blockDevice->read(blockDevice, mediaBlock, buffers[mediaIndex],
+                               blocks, MediaDone, 0)) {
+
+            mediaBusy = 0;
+            mediaFailed = 1;
+        }
+    }
+    if (!usbBusy && (bufferState[usbIndex] == BUFFER_READY)) {
+
+        dmaDescriptors[usbIndex].buffer = buffers[usbIndex];
+        dmaDescriptors[usbIndex].size = bufferBlocks[usbIndex] * BLOCK_SIZE;
+        bufferState[usbIndex] = BUFFER_BUSY;
+        usbBusy = 1;
+        if (!USBD_TransferChain(MSC_EP_IN, &dmaDescriptors[usbIndex], 1, 1,
+                                DataDone, 0)) {
+
+            usbBusy = 0;
+            usbFailed = 1;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Moves the blocks of WRITE(10) through the buffers: bus, then device.
+//------------------------------------------------------------------------------
+static void PumpWrite(void)
+{
+    unsigned int blocks;
+
+    if (!usbBusy && usbLeft && (bufferState[usbIndex] == BUFFER_FREE)) {
+
+        blocks = (usbLeft < BUFFER_BLOCKS) ? usbLeft : BUFFER_BLOCKS;
+        bufferBlocks[usbIndex] = blocks;
+        bufferState[usbIndex] = BUFFER_BUSY;
+        usbBusy = 1;
+        if (!USBD_Transfer(MSC_EP_OUT, buffers[usbIndex], blocks * BLOCK_SIZE,
+                           DataDone, 0)) {
+
+            usbBusy = 0;
+            usbFailed = 1;
+        }
+    }
+    if (!mediaBusy && (bufferState[mediaIndex] == BUFFER_READY)) {
+
+        bufferState[mediaIndex] = BUFFER_BUSY;
+        mediaBusy = 1;
+        if (!blockDevice->write(blockDevice, mediaBlock, buffers[mediaIndex],
+                                bufferBlocks[mediaIndex], MediaDone, 0)) {
+
+            mediaBusy = 0;
+            mediaFailed = 1;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Runs the data stage. Once it is over, the rest of the expected data is
+/// refused with a halt, and the status is sent with the residue.
+//------------------------------------------------------------------------------
+static void PumpData(void)
+{
+    if (!mediaFailed && !usbFailed) {
+
+        if (command.in) {
+
+            PumpRead();
+        }
+        else {
+
+            PumpWrite();
+        }
+    }
+    if (usbBusy || mediaBusy
+        || ((mediaLeft || usbLeft) && !mediaFailed && !usbFailed)) {
+
+        return;
+    }
+
+    if (mediaFailed) {
+
+        Fail(SENSE_MEDIUM_ERROR,
+             command.in ? ASC_READ_ERROR : ASC_WRITE_ERROR);
+    }
+    else if (usbFailed) {
+
+        command.status = CSW_FAILED;
+    }
+    if ((command.processed < command.dataLength) && !command.terminated) {
+
+        USBD_Halt(command.in ? (USB_DIR_IN | MSC_EP_IN) : MSC_EP_OUT);
+    }
+    phase = PHASE_STATUS;
+}
+
+//------------------------------------------------------------------------------
+/// Sends the command status.
+//------------------------------------------------------------------------------
+static void SendStatus(void)
+{
+    PutLe32(&csw[0], CSW_SIGNATURE);
+    PutLe32(&csw[4], command.tag);
+    PutLe32(&csw[8], command.dataLength - command.processed);
+    csw[12] = command.status;
+    if (command.status != CSW_PASSED) {
+
+        mscStats.failed++;
+        EVLOG_Write(EVLOG_ID_MSC_FAILED, senseKey);
+    }
+
+    // Behind a halt, the status waits until the host clears it
+    phase = PHASE_CSW;
+    if (!USBD_Transfer(MSC_EP_IN, csw, CSW_SIZE, CswSent, 0)) {
+
+        phase = PHASE_STATUS;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Runs the protocol, at the end of every UDPHS interrupt.
+//------------------------------------------------------------------------------
+static void Service(void)
+{
+    if (phase == PHASE_NEXT) {
+
+        if (mediaBusy) {
+
+            return;
+        }
+        phase = PHASE_CBW;
+        if (!USBD_Transfer(MSC_EP_OUT, cbw, CBW_BUFFER_SIZE, CbwReceived, 0)) {
+
+            phase = PHASE_NEXT;
+        }
+    }
+    if (phase == PHASE_COMMAND) {
+
+        StartCommand();
+    }
+    if (phase == PHASE_DATA) {
+
+        PumpData();
+    }
+    if (phase == PHASE_STATUS) {
+
+        SendStatus();
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Class requests sent to the interface.
+//------------------------------------------------------------------------------
+static void ClassRequest(const UsbSetup *setup, UsbReply *reply)
+{
+    if (((setup->bmRequestType & USB_TYPE_MASK) != USB_TYPE_CLASS)
+        || (setup->wIndex != 0)) {
+
+        return;
+    }
+
+    switch (setup->bRequest) {
+
+        case BULK_ONLY_RESET:
+            if ((setup->wValue == 0) && (setup->wLength == 0)) {
+
+                // The endpoints stay halted until the host clears them,
+                // which it can do from now on
+                USBD_Wedge(USB_DIR_IN | MSC_EP_IN, 0);
+                USBD_Wedge(MSC_EP_OUT, 0);
+                phase = configured ? PHASE_NEXT : PHASE_IDLE;
+                USBD_Abort(MSC_EP_OUT);
+                USBD_Abort(MSC_EP_IN);
+                reply->action = USBCTL_STATUS;
+                Kick();
+            }
+            break;
+
+        case GET_MAX_LUN:
+            if ((setup->wValue == 0) && (setup->wLength >= 1)) {
+
+                reply->action = USBCTL_DATA_IN;
+                reply->data = &maxLun;
+                reply->size = 1;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Sets up the endpoints of the configuration, at the speed of the bus. The
+/// transfers in progress have been aborted by the driver.
+//------------------------------------------------------------------------------
+static void Configured(unsigned char configuration)
+{
+    unsigned short bulkSize = USBD_IsHighSpeed() ? HS_BULK_SIZE : FS_BULK_SIZE;
+
+    configured = 0;
+    phase = PHASE_IDLE;
+    if (configuration == 0) {
+
+        return;
+    }
+
+    if (USBD_ConfigureEndpoint(MSC_EP_OUT, USBD_BULK, bulkSize, 2)
+        && USBD_ConfigureEndpoint(USB_DIR_IN | MSC_EP_IN, USBD_BULK,
+                                  bulkSize, 2)) {
+
+        configured = 1;
+        phase = PHASE_NEXT;
+    }
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Starts the USB device with the mass storage descriptors. The disk appears
+/// on the host once USBD_Connect() has been called.
+/// \param device  Block device to expose; a device without blocks is reported
+///                as a drive without medium.
+//------------------------------------------------------------------------------
+void MSC_Initialize(BlockDevice *device)
+{
+    blockDevice = device;
+    phase = PHASE_IDLE;
+    senseKey = SENSE_NONE;
+    senseCode = ASC_NO_SENSE;
+    USBD_Initialize(&descriptors, ClassRequest, Configured);
+    USBD_SetServiceHandler(Service);
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the host has configured the device.
+//------------------------------------------------------------------------------
+unsigned char MSC_IsConfigured(void)
+{
+    return configured;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the command counters.
+//------------------------------------------------------------------------------
+const MscStats * MSC_GetStats(void)
+{
+    return &mscStats;
+}
@@ -0,0 +1,81 @@
+/* ----------------------------------------------------------------------------
+ *         USB mass storage
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Mass storage class (bulk-only transport, SCSI transparent command set) on
+** top of usbd.c, exposing a block device (block.h) as a single removable
+** disk. Commands arrive in 31-byte command blocks on the OUT endpoint and end
+** with a 13-byte status on the IN endpoint.
+**
+** READ(10) and WRITE(10) go through two buffers of MSC_BUFFER_SIZE bytes:
+** while one is moved by the UDPHS DMA, the other is read or written by the
+** block device, so the bus and the card overlap. All the protocol runs from
+** the service handler of the UDPHS interrupt; the block callbacks only mark
+** their buffer and set that interrupt pending, so they may run from any
+** interrupt of the same group priority, or synchronously (RAM disk).
+**
+** The device has its own descriptor set and replaces the CDC one: a firmware
+** uses one or the other (MAIN_USB_MSC in main.c).
+*/
+
+#ifndef MSC_H
+#define MSC_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "usbd.h"
+#include "block.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Vendor and product identifiers.
+#ifndef MSC_VENDOR_ID
+#define MSC_VENDOR_ID           0x03EB
+#endif
+#ifndef MSC_PRODUCT_ID
+#define MSC_PRODUCT_ID          0x6129
+#endif
+
+/// Endpoints.
+#define MSC_EP_OUT              1
+#define MSC_EP_IN               2
+
+/// Size of each of the two data buffers: a multiple of 512, at most
+/// USBD_MAX_DMA_BUFFER. Both live in the DMABUF block, whose budget is set
+/// in the .icf file.
+#ifndef MSC_BUFFER_SIZE
+#define MSC_BUFFER_SIZE         2048
+#endif
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Command counters.
+typedef struct {
+
+    unsigned int commands;
+    /// Commands that ended with a failed or phase error status.
+    unsigned int failed;
+    unsigned int blocksRead;
+    unsigned int blocksWritten;
+
+} MscStats;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void MSC_Initialize(BlockDevice *device);
+
+extern unsigned char MSC_IsConfigured(void);
+
+extern const MscStats * MSC_GetStats(void);
+
+#endif //#ifndef MSC_H
@@ -0,0 +1,586 @@
+/* ----------------------------------------------------------------------------
+ *         NAND flash driver
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "nand.h"
+#include "dwt.h"
+#include "irq.h"
+#include "exceptions.h"
+#include "AT91SAM3U4.h"
+
+#include <intrinsics.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// D0-D7, NANDOE, NANDWE, NCS0, NANDALE, NANDCLE and NANDRDY (peripheral A).
+#define NAND_PINS               (AT91C_PB9_D0 | AT91C_PB10_D1 | AT91C_PB11_D2 \
+                                 | AT91C_PB12_D3 | AT91C_PB13_D4 \
+                                 | AT91C_PB14_D5 | AT91C_PB15_D6 \
+                                 | AT91C_PB16_D7 | AT91C_PB17_NANDOE \
+                                 | AT91C_PB18_NANDWE | AT91C_PB20_NCS0 \
+                                 | AT91C_PB21_A21_NANDALE \
+                                 | AT91C_PB22_A22_NANDCLE | AT91C_PB24_NANDRDY)
+
+/// Data of the device: NCS0 with ALE and CLE low.
+#define NAND_DATA               (*(volatile unsigned char *) NAND_EBI_BASE)
+
+/// Fields of an NFC command address. The command registers sit at
+/// NAND_EBI_BASE with NFCCMD set; the address cycles after the first one
+/// are the data written there.
+#define NFC_CMD1(command)       ((command) << 2)
+#define NFC_CMD2(command)       (((command) << 10) | (1 << 18))
+#define NFC_ACYCLE(cycles)      ((cycles) << 19)
+#define NFC_CSID_0              (0 << 22)
+#define NFC_NFCEN               (1 << 25)
+#define NFC_NFCWR               (1 << 26)
+#define NFC_NFCCMD              (1 << 27)
+
+/// Device commands.
+#define CMD_READ                0x00
+#define CMD_READ_CONFIRM        0x30
+#define CMD_PROGRAM             0x80
+#define CMD_PROGRAM_CONFIRM     0x10
+#define CMD_ERASE               0x60
+#define CMD_ERASE_CONFIRM       0xD0
+#define CMD_STATUS              0x70
+#define CMD_READ_ID             0x90
+#define CMD_RESET               0xFF
+
+/// Status register: the last program or erase failed.
+#define STATUS_FAIL             0x01
+
+/// Controller errors.
+#define SR_ERRORS               (AT91C_HSMC4_DTOE | AT91C_HSMC4_UNDEF \
+                                 | AT91C_HSMC4_AWB | AT91C_HSMC4_HASE)
+
+/// HSMC4_CFG: 2112-byte pages, rising edge of ready/busy detected, longest
+/// data timeout.
+#define CFG                     (AT91C_HSMC4_PAGESIZE_2112_Bytes \
+                                 | AT91C_HSMC4_RBEDGE | AT91C_HSMC4_DTOCYC \
+                                 | AT91C_HSMC4_DTOMUL_1048576)
+
+/// Hamming code of a sector: error position (byte << 3 | bit) and its
+/// complement.
+#define ECC_MASK                0xFFFFFF
+#define ECC_POSITION            0xFFF
+#define ECC_ERASED              0xFFFFFF
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Capacity of a device code, in Mbit.
+typedef struct {
+
+    unsigned char device;
+    unsigned short megabits;
+
+} NandDevice;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Large-page 8-bit devices, 3.3 V and 1.8 V.
+static const NandDevice nandDevices[] = {
+
+    { 0xF1, 1024 }, { 0xA1, 1024 },
+    { 0xDA, 2048 }, { 0xAA, 2048 },
+    { 0xDC, 4096 }, { 0xAC, 4096 },
+    { 0xD3, 8192 }, { 0xA3, 8192 }
+};
+
+static NandInfo nandInfo;
+
+static NandStats nandStats;
+
+/// Flags of HSMC4_SR gathered during the operation (cleared when read).
+static unsigned int status;
+
+/// Sectors that the last NAND_ReadPage() could not read.
+static unsigned int unreadable;
+
+/// Cycles per ms.
+static unsigned int cyclesPerMs;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the HSMC4 interrupt can end a wait: thread mode, with no
+/// interrupt masked.
+//------------------------------------------------------------------------------
+static unsigned char CanSleep(void)
+{
+    return (__get_IPSR() == 0) && ((__get_PRIMASK() & 1) == 0)
+           && (__get_BASEPRI() == 0);
+}
+
+//------------------------------------------------------------------------------
+/// Sends a command through the NFC, after clearing the flags of the previous
+/// one.
+/// \param command  NFC_xxx fields.
+/// \param cycle0  First address cycle.
+/// \param cycles  Next address cycles, first one in the low byte.
+//------------------------------------------------------------------------------
+static void SendCommand(unsigned int command,
+                        unsigned int cycle0,
+                        unsigned int cycles)
+{
+    AT91PS_HSMC4 hsmc = AT91C_BASE_HSMC4;
+
+    // Reading the status clears the flags
+    (void) hsmc->HSMC4_SR;
+    status = 0;
+    hsmc->HSMC4_ADDR = cycle0;
+    *(volatile unsigned int *) (NAND_EBI_BASE | NFC_NFCCMD | command) = cycles;
+}
+
+//------------------------------------------------------------------------------
+/// Waits until all the flags are set. Returns 1 on success; 0 on a timeout
+/// or a controller error.
+//------------------------------------------------------------------------------
+static unsigned char Wait(unsigned int flags)
+{
+    AT91PS_HSMC4 hsmc = AT91C_BASE_HSMC4;
+    unsigned int start = DWT_GetCycles();
+    unsigned char sleep = CanSleep();
+
+    // Flags are cleared when read, so they are gathered along the wait
+    while (((status & flags) != flags) && !(status & SR_ERRORS)) {
+
+        if (DWT_GetCycles() - start > NAND_TIMEOUT * cyclesPerMs) {
+
+            nandStats.failures++;
+            return 0;
+        }
+        if (sleep) {
+
+            // Masked between the check and the sleep, so that the interrupt
+            // cannot slip in unnoticed; the sleep still ends on it (or on
+            // the system tick, for the timeout)
+            __disable_interrupt();
+            status |= hsmc->HSMC4_SR;
+            if (((status & flags) != flags) && !(status & SR_ERRORS)) {
+
+                hsmc->HSMC4_IER = flags | SR_ERRORS;
+                __WFI();
+            }
+            __enable_interrupt();
+        }
+        else {
+
+            status |= hsmc->HSMC4_SR;
+        }
+    }
+
+    if (status & SR_ERRORS) {
+
+        nandStats.failures++;
+        return 0;
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Waits for the end of a program or an erase and checks its status.
+//------------------------------------------------------------------------------
+static unsigned char WaitReady(void)
+{
+    if (!Wait(AT91C_HSMC4_CMDDONE | AT91C_HSMC4_RBEDGE0)) {
+
+        return 0;
+    }
+
+    SendCommand(NFC_CMD1(CMD_STATUS) | NFC_CSID_0, 0, 0);
+    if (!Wait(AT91C_HSMC4_CMDDONE)) {
+
+        return 0;
+    }
+    if (NAND_DATA & STATUS_FAIL) {
+
+        nandStats.failures++;
+        return 0;
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Sends a read, program or spare read command for a page: two column cycles,
+/// then the page number.
+//------------------------------------------------------------------------------
+static void SendPageCommand(unsigned int command,
+                            unsigned int page,
+                            unsigned int column)
+{
+    SendCommand(command | NFC_ACYCLE(2 + nandInfo.rowCycles) | NFC_CSID_0,
+                column & 0xFF,
+                ((column >> 8) & 0xFF) | (page << 8));
+}
+
+//------------------------------------------------------------------------------
+/// Returns the Hamming code the HSMC4 computed for a sector.
+//------------------------------------------------------------------------------
+static unsigned int Parity(unsigned int sector)
+{
+    AT91PS_HSMC4 hsmc = AT91C_BASE_HSMC4;
+
+    switch (sector) {
+
+    case 0:  return hsmc->HSMC4_ECCPR0 & ECC_MASK;
+    case 1:  return hsmc->HSMC4_ECCPR1 & ECC_MASK;
+    case 2:  return hsmc->HSMC4_ECCPR2 & ECC_MASK;
+    default: return hsmc->HSMC4_ECCPR3 & ECC_MASK;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Checks a sector of the buffer against its stored code, and corrects one
+/// flipped bit. Returns 1 if the sector is good, NAND_CORRECTED if a bit has
+/// been corrected, 0 if the sector is corrupted.
+//------------------------------------------------------------------------------
+static unsigned char CorrectSector(unsigned int sector)
+{
+    unsigned char *buffer = NAND_GetBuffer();
+    const unsigned char *code = &buffer[NAND_PAGE_SIZE + NAND_SPARE_ECC
+                                        + 3 * sector];
+    unsigned int stored = code[0] | (code[1] << 8) | (code[2] << 16);
+    unsigned int error;
+    unsigned int position;
+
+    // Never written since the last erase
+    if (stored == ECC_ERASED) {
+
+        return 1;
+    }
+
+    error = stored ^ Parity(sector);
+    if (error == 0) {
+
+        return 1;
+    }
+
+    // One bit of the code itself
+    if ((error & (error - 1)) == 0) {
+
+        nandStats.corrected++;
+        return NAND_CORRECTED;
+    }
+
+    // One bit of the data: the code halves differ on each position bit
+    if (((error ^ (error >> 12)) & ECC_POSITION) == ECC_POSITION) {
+
+        position = error & ECC_POSITION;
+        buffer[sector * NAND_SECTOR_SIZE + (position >> 3)] ^= 1 << (position & 7);
+        nandStats.corrected++;
+        return NAND_CORRECTED;
+    }
+
+    nandStats.uncorrectable++;
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Sets up the HSMC4 for the NAND flash on NCS0, resets the device and reads
+/// its geometry.
+/// Returns 1 if a supported device answers; otherwise 0.
+/// \param mck  Master clock frequency.
+//------------------------------------------------------------------------------
+unsigned char NAND_Initialize(unsigned int mck)
+{
+    AT91PS_HSMC4 hsmc = AT91C_BASE_HSMC4;
+    AT91PS_HSMC4_CS cs = AT91C_BASE_HSMC4_CS0;
+    unsigned char id[4];
+    unsigned int i;
+
+    cyclesPerMs = mck / 1000;
+    nandInfo.numBlocks = 0;
+
+    AT91C_BASE_PIOB->PIO_ABSR &= ~NAND_PINS;
+    AT91C_BASE_PIOB->PIO_PDR = NAND_PINS;
+    AT91C_BASE_PIOB->PIO_PPUER = AT91C_PB24_NANDRDY;
+    AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_HSMC4;
+
+    // 96 MHz MCK (10.4 ns) and a 25 ns cycle device: 21 ns write pulses,
+    // 31 ns read pulses, tADL 73 ns, tWB 104 ns
+    cs->HSMC4_SETUP = 0;
+    cs->HSMC4_PULSE = (2 << 0) | (4 << 8) | (3 << 16) | (4 << 24);
+    cs->HSMC4_CYCLE = (4 << 0) | (4 << 16);
+    cs->HSMC4_TIMINGS = (2 << 0) | (7 << 4) | (2 << 8) | (3 << 16) | (10 << 24)
+                        | AT91C_HSMC4_NFSEL;
+    cs->HSMC4_MODE = AT91C_HSMC4_READ_MODE | AT91C_HSMC4_WRITE_MODE
+                     | AT91C_HSMC4_DBW_WIDTH_EIGTH_BITS;
+
+    hsmc->HSMC4_IDR = 0xFFFFFFFF;
+    hsmc->HSMC4_CFG = CFG;
+    hsmc->HSMC4_ECCCMD = AT91C_HSMC4_PAGESIZE_2112_Bytes
+                         | AT91C_ECC_TYPCORRECT_ONE_EVERY_512_BYTES;
+    hsmc->HSMC4_CTRL = AT91C_HSMC4_NFCEN;
+    IRQ_Enable(AT91C_ID_HSMC4);
+
+    SendCommand(NFC_CMD1(CMD_RESET) | NFC_CSID_0, 0, 0);
+    if (!Wait(AT91C_HSMC4_CMDDONE | AT91C_HSMC4_RBEDGE0)) {
+
+        return 0;
+    }
+
+    SendCommand(NFC_CMD1(CMD_READ_ID) | NFC_ACYCLE(1) | NFC_CSID_0, 0, 0);
+    if (!Wait(AT91C_HSMC4_CMDDONE)) {
+
+        return 0;
+    }
+    for (i = 0; i < sizeof(id); i++) {
+
+        id[i] = NAND_DATA;
+    }
+
+    // Fourth byte: page size, spare size per 512 bytes, block size, bus width
+    if (((1024 << (id[3] & 0x03)) != NAND_PAGE_SIZE)
+        || ((8 << ((id[3] >> 2) & 0x01)) != NAND_SPARE_SIZE / NAND_SECTORS_PER_PAGE)
+        || (id[3] & 0x40)) {
+
+        return 0;
+    }
+    for (i = 0; i < sizeof(nandDevices) / sizeof(nandDevices[0]); i++) {
+
+        if (nandDevices[i].device == id[1]) {
+
+            break;
+        }
+    }
+    if (i == sizeof(nandDevices) / sizeof(nandDevices[0])) {
+
+        return 0;
+    }
+
+    nandInfo.maker = id[0];
+    nandInfo.device = id[1];
+    nandInfo.pagesPerBlock = (65536 << ((id[3] >> 4) & 0x03)) / NAND_PAGE_SIZE;
+    nandInfo.numBlocks = nandDevices[i].megabits * (1024 * 1024 / 8)
+                         / (nandInfo.pagesPerBlock * NAND_PAGE_SIZE);
+    nandInfo.rowCycles =
+        (nandInfo.numBlocks * nandInfo.pagesPerBlock > 65536) ? 3 : 2;
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the device information.
+//------------------------------------------------------------------------------
+const NandInfo * NAND_GetInfo(void)
+{
+    return &nandInfo;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the page buffer: NAND_PAGE_SIZE bytes of data, then the
+/// NAND_SPARE_SIZE bytes of the spare area. Each read or program of a page
+/// goes through it.
+//------------------------------------------------------------------------------
+unsigned char * NAND_GetBuffer(void)
+{
+    return (unsigned char *) NAND_NFC_SRAM;
+}
+
+//------------------------------------------------------------------------------
+/// Reads a page and its spare area into the buffer, and corrects its sectors.
+/// Returns 1 on success, NAND_CORRECTED if flipped bits have been corrected
+/// (the page should be rewritten), 0 on failure or if a sector is corrupted.
+/// \param page  Page number (block * pages per block + page in the block).
+//------------------------------------------------------------------------------
+unsigned char NAND_ReadPage(unsigned int page)
+{
+    AT91PS_HSMC4 hsmc = AT91C_BASE_HSMC4;
+    unsigned char result = 1;
+    unsigned char sector;
+    unsigned int i;
+
+    nandStats.reads++;
+    unreadable = (1 << NAND_SECTORS_PER_PAGE) - 1;
+    hsmc->HSMC4_CFG = CFG | AT91C_HSMC4_RSPARE;
+    hsmc->HSMC4_ECCCR = AT91C_HSMC4_ECCRESET;
+    SendPageCommand(NFC_CMD1(CMD_READ) | NFC_CMD2(CMD_READ_CONFIRM)
+                    | NFC_NFCEN, page, 0);
+    if (!Wait(AT91C_HSMC4_XFRDONE)) {
+
+        return 0;
+    }
+
+    unreadable = 0;
+    for (i = 0; i < NAND_SECTORS_PER_PAGE; i++) {
+
+        sector = CorrectSector(i);
+        if (sector == 0) {
+
+            unreadable |= 1 << i;
+            result = 0;
+        }
+        else if ((sector == NAND_CORRECTED) && result) {
+
+            result = NAND_CORRECTED;
+        }
+    }
+    return result;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the sectors that the last NAND_ReadPage() could not read, bit i for
+/// sector i: those with more flipped bits than the code corrects, or all of
+/// them if the page could not be transferred.
+//------------------------------------------------------------------------------
+unsigned int NAND_GetUnreadable(void)
+{
+    return unreadable;
+}
+
+//------------------------------------------------------------------------------
+/// Reads the start of the spare area of a page, without going through the
+/// buffer (which keeps its page).
+/// Returns 1 on success; otherwise 0.
+/// \param page  Page number.
+/// \param spare  Receives the bytes.
+/// \param size  Number of bytes, up to NAND_SPARE_SIZE.
+//------------------------------------------------------------------------------
+unsigned char NAND_ReadSpare(unsigned int page, void *spare, unsigned int size)
+{
+    unsigned char *bytes = spare;
+
+    SendPageCommand(NFC_CMD1(CMD_READ) | NFC_CMD2(CMD_READ_CONFIRM),
+                    page, NAND_PAGE_SIZE);
+    if (!Wait(AT91C_HSMC4_CMDDONE | AT91C_HSMC4_RBEDGE0)) {
+
+        return 0;
+    }
+    while (size--) {
+
+        *bytes++ = NAND_DATA;
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Programs a page from the buffer. The codes of the given sectors are added
+/// to the spare area of the buffer before it is written; the other sectors
+/// and spare bytes must be 0xFF in the buffer, or hold what the page already
+/// holds (partial programming).
+/// Returns 1 on success; 0 on failure (the block should be retired).
+/// \param page  Page number.
+/// \param sectors  Sectors written, bit i for sector i.
+//------------------------------------------------------------------------------
+unsigned char NAND_ProgramPage(unsigned int page, unsigned int sectors)
+{
+    AT91PS_HSMC4 hsmc = AT91C_BASE_HSMC4;
+    unsigned char *spare = NAND_GetBuffer() + NAND_PAGE_SIZE;
+    unsigned int parity;
+    unsigned int i;
+
+    nandStats.programs++;
+
+    // Data from the SRAM; the spare area follows from the CPU, once the
+    // codes are known
+    hsmc->HSMC4_CFG = CFG;
+    hsmc->HSMC4_ECCCR = AT91C_HSMC4_ECCRESET;
+    SendPageCommand(NFC_CMD1(CMD_PROGRAM) | NFC_NFCEN | NFC_NFCWR, page, 0);
+    if (!Wait(AT91C_HSMC4_XFRDONE)) {
+
+        return 0;
+    }
+
+    for (i = 0; i < NAND_SECTORS_PER_PAGE; i++) {
+
+        if (sectors & (1 << i)) {
+
+            parity = Parity(i);
+            spare[NAND_SPARE_ECC + 3 * i] = parity;
+            spare[NAND_SPARE_ECC + 3 * i + 1] = parity >> 8;
+            spare[NAND_SPARE_ECC + 3 * i + 2] = parity >> 16;
+        }
+    }
+    for (i = 0; i < NAND_SPARE_SIZE; i++) {
+
+        NAND_DATA = spare[i];
+    }
+
+    SendCommand(NFC_CMD1(CMD_PROGRAM_CONFIRM) | NFC_CSID_0, 0, 0);
+    return WaitReady();
+}
+
+//------------------------------------------------------------------------------
+/// Erases a block.
+/// Returns 1 on success; 0 on failure (the block should be retired).
+//------------------------------------------------------------------------------
+unsigned char NAND_EraseBlock(unsigned int block)
+{
+    unsigned int page = block * nandInfo.pagesPerBlock;
+
+    nandStats.erases++;
+    SendCommand(NFC_CMD1(CMD_ERASE) | NFC_CMD2(CMD_ERASE_CONFIRM)
+                | NFC_ACYCLE(nandInfo.rowCycles) | NFC_CSID_0,
+                page & 0xFF,
+                page >> 8);
+    return WaitReady();
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if a block is marked bad, by the maker or by NAND_MarkBad(), or
+/// cannot be read.
+//------------------------------------------------------------------------------
+unsigned char NAND_IsBad(unsigned int block)
+{
+    unsigned int page = block * nandInfo.pagesPerBlock;
+    unsigned char marker;
+    unsigned int i;
+
+    for (i = 0; i < 2; i++) {
+
+        if (!NAND_ReadSpare(page + i, &marker, 1) || (marker != 0xFF)) {
+
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+/// Marks a block bad, in the spare area of its first page.
+//------------------------------------------------------------------------------
+void NAND_MarkBad(unsigned int block)
+{
+    unsigned char *buffer = NAND_GetBuffer();
+
+    // The erase may fail too: the marker is programmed anyway
+    NAND_EraseBlock(block);
+    memset(buffer, 0xFF, NAND_PAGE_SIZE + NAND_SPARE_SIZE);
+    buffer[NAND_PAGE_SIZE + NAND_SPARE_BAD] = 0;
+    NAND_ProgramPage(block * nandInfo.pagesPerBlock, 0);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the operation counters.
+//------------------------------------------------------------------------------
+const NandStats * NAND_GetStats(void)
+{
+    return &nandStats;
+}
+
+//------------------------------------------------------------------------------
+/// HSMC4 interrupt: ends the sleep of Wait(). The flags stay set until read,
+/// so the interrupt is disabled until the next wait.
+//------------------------------------------------------------------------------
+void HSMC4_IrqHandler(void)
+{
+    AT91C_BASE_HSMC4->HSMC4_IDR = 0xFFFFFFFF;
+}
@@ -0,0 +1,131 @@
+/* ----------------------------------------------------------------------------
+ *         NAND flash driver
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Raw access to an 8-bit SLC NAND flash with 2048 + 64-byte pages on NCS0,
+** through the NAND flash controller (NFC) of the HSMC4. The NFC sends the
+** command and address cycles, waits for the device and moves a whole page
+** between the device and its SRAM: NAND_GetBuffer() returns that SRAM, where
+** pages are read, patched and programmed in place, so the driver needs no
+** page buffer in RAM.
+**
+** The HSMC4 computes a Hamming code of each 512-byte sector as the page goes
+** through. NAND_ProgramPage() stores the codes of the sectors it writes in
+** the spare area, and NAND_ReadPage() compares them with the codes of the
+** data read: one flipped bit per sector is corrected in the buffer, two are
+** reported. Sectors whose code is still erased are not checked, so that a
+** page can be programmed one sector at a time (up to four times).
+**
+** Spare area of a page:
+**     0                   bad block marker (0xFF: good), pages 0 and 1
+**     NAND_SPARE_USER     NAND_SPARE_USER_SIZE bytes for the caller
+**     NAND_SPARE_ECC      3 bytes of Hamming code per sector
+**
+** Operations wait for the NFC flags, asleep on HSMC4_IrqHandler() when they
+** run in thread mode with interrupts enabled, and take up to a few ms (block
+** erase): call them from a task.
+**
+** AT91SAM3U4.h predates the final memory map (its AT91C_EBI_xxx addresses
+** overlap the peripherals): the external memory and NFC SRAM addresses
+** below are those of the datasheet.
+*/
+
+#ifndef NAND_H
+#define NAND_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// External memory area (NCS0 data) and NFC SRAM.
+#ifndef NAND_EBI_BASE
+#define NAND_EBI_BASE           0x60000000
+#endif
+#ifndef NAND_NFC_SRAM
+#define NAND_NFC_SRAM           0x20100000
+#endif
+
+/// Supported geometry.
+#define NAND_PAGE_SIZE          2048
+#define NAND_SPARE_SIZE         64
+#define NAND_SECTOR_SIZE        512
+#define NAND_SECTORS_PER_PAGE   (NAND_PAGE_SIZE / NAND_SECTOR_SIZE)
+
+/// Spare area layout.
+#define NAND_SPARE_BAD          0
+#define NAND_SPARE_USER         2
+#define NAND_SPARE_USER_SIZE    14
+#define NAND_SPARE_ECC          16
+#define NAND_SPARE_USED         (NAND_SPARE_ECC + 3 * NAND_SECTORS_PER_PAGE)
+
+/// NAND_ReadPage() result: data read, after correcting flipped bits.
+#define NAND_CORRECTED          2
+
+/// Operation timeout, in ms (block erase: 3 ms at most on common devices).
+#ifndef NAND_TIMEOUT
+#define NAND_TIMEOUT            20
+#endif
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Device information.
+typedef struct {
+
+    /// Maker and device codes (READ ID).
+    unsigned char maker;
+    unsigned char device;
+    /// Address cycles of a page number (2 up to 1 Gbit, then 3).
+    unsigned char rowCycles;
+    unsigned int pagesPerBlock;
+    unsigned int numBlocks;
+
+} NandInfo;
+
+/// Operation counters.
+typedef struct {
+
+    unsigned int reads;
+    unsigned int programs;
+    unsigned int erases;
+    /// Sectors read with a flipped bit, corrected.
+    unsigned int corrected;
+    /// Sectors read with more flipped bits than the code can correct.
+    unsigned int uncorrectable;
+    /// Timeouts, controller errors and program or erase failures.
+    unsigned int failures;
+
+} NandStats;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned char NAND_Initialize(unsigned int mck);
+
+extern const NandInfo * NAND_GetInfo(void);
+
+extern unsigned char * NAND_GetBuffer(void);
+
+extern unsigned char NAND_ReadPage(unsigned int page);
+
+extern unsigned int NAND_GetUnreadable(void);
+
+extern unsigned char NAND_ReadSpare(unsigned int page,
+                                    void *spare,
+                                    unsigned int size);
+
+extern unsigned char NAND_ProgramPage(unsigned int page, unsigned int sectors);
+
+extern unsigned char NAND_EraseBlock(unsigned int block);
+
+extern unsigned char NAND_IsBad(unsigned int block);
+
+extern void NAND_MarkBad(unsigned int block);
+
+extern const NandStats * NAND_GetStats(void);
+
+#endif //#ifndef NAND_H
@@ -0,0 +1,1126 @@
+/* ----------------------------------------------------------------------------
+ *         NAND flash translation layer
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "nandftl.h"
+#include "nand.h"
+#include "crc.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#if (NANDFTL_MAX_BLOCKS >= 0xFFFF) || (NANDFTL_MAX_BLOCKS & 7)
+#error "NANDFTL_MAX_BLOCKS must be a multiple of 8, below 65535"
+#endif
+
+#if NANDFTL_MAX_REPLACEMENTS < 1
+#error "NANDFTL_MAX_REPLACEMENTS must be at least 1"
+#endif
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define NO_BLOCK                0xFFFF
+#define NO_PAGE                 0xFFFFFFFF
+
+/// Kinds of block, in the tags. The pages copied by a fold are marked
+/// KIND_COPY but the last one, whose tag KIND_FOLDED is programmed alone
+/// after everything else; pages written in place later are marked
+/// KIND_PRIMARY.
+#define KIND_PRIMARY            'P'
+#define KIND_REPLACEMENT        'R'
+#define KIND_COPY               'C'
+#define KIND_FOLDED             'F'
+
+#define ALL_SECTORS             ((1 << NAND_SECTORS_PER_PAGE) - 1)
+
+/// Blocks tried by a fold, each retired if a program fails.
+#define FOLD_ATTEMPTS           3
+
+/// Blocks whose next page to program is remembered.
+#define NEXT_CACHE_SIZE         4
+
+#define IS_SET(map, i)          ((map)[(i) >> 3] & (1 << ((i) & 7)))
+#define SET(map, i)             ((map)[(i) >> 3] |= 1 << ((i) & 7))
+#define CLEAR(map, i)           ((map)[(i) >> 3] &= ~(1 << ((i) & 7)))
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Page tag, in the spare area. The tag of the first page of a block tells
+/// its kind, logical block and the order of its allocation.
+typedef struct {
+
+    unsigned short logical;
+    unsigned char kind;
+    unsigned char reserved;
+    unsigned int sequence;
+    unsigned int crc;
+
+} Tag;
+
+/// Replacement block of a logical block (logical is NO_BLOCK if unused).
+typedef struct {
+
+    unsigned short logical;
+    unsigned short block;
+    unsigned int lastUse;
+
+} Replacement;
+
+/// Next page to program of a block, so that the tags are not searched again.
+typedef struct {
+
+    unsigned short block;
+    unsigned short next;
+
+} NextPageEntry;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Primary block of each logical block (NO_BLOCK: never written).
+static unsigned short primaries[NANDFTL_MAX_BLOCKS];
+
+static Replacement replacements[NANDFTL_MAX_REPLACEMENTS];
+static unsigned int useCount;
+
+/// Blocks that are bad, mapped, and known to be erased.
+static unsigned char badBlocks[NANDFTL_MAX_BLOCKS / 8];
+static unsigned char usedBlocks[NANDFTL_MAX_BLOCKS / 8];
+static unsigned char erasedBlocks[NANDFTL_MAX_BLOCKS / 8];
+
+static unsigned int numBlocks;
+static unsigned int logicalBlocks;
+static unsigned int pagesPerBlock;
+
+/// Sequence number of the last allocation, and next block to try.
+static unsigned int sequence;
+static unsigned int cursor;
+
+static NextPageEntry nextPages[NEXT_CACHE_SIZE];
+static unsigned int nextVictim;
+
+/// Page held by the NAND buffer, read by Load().
+static unsigned int bufferedPage;
+
+static NandftlStats ftlStats;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns the page number of a page of a block.
+//------------------------------------------------------------------------------
+static unsigned int Row(unsigned int block, unsigned int page)
+{
+    return block * pagesPerBlock + page;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the sectors of a page whose code is programmed, from its spare
+/// area.
+//------------------------------------------------------------------------------
+static unsigned int SectorMask(const unsigned char *spare)
+{
+    const unsigned char *code = spare + NAND_SPARE_ECC;
+    unsigned int sectors = 0;
+    unsigned int i;
+
+    for (i = 0; i < NAND_SECTORS_PER_PAGE; i++, code += 3) {
+
+        if ((code[0] & code[1] & code[2]) != 0xFF) {
+
+            sectors |= 1 << i;
+        }
+    }
+    return sectors;
+}
+
+//------------------------------------------------------------------------------
+/// Reads the tag of a page, and the sectors it holds if sectors is not 0.
+/// Returns 1 if the tag is valid (the page is programmed); otherwise 0.
+//------------------------------------------------------------------------------
+static unsigned char ReadTag(unsigned int block,
+                             unsigned int page,
+                             Tag *tag,
+                             unsigned int *sectors)
+{
+    unsigned char spare[NAND_SPARE_USED];
+
+    if (sectors) {
+
+        *sectors = 0;
+    }
+    if (!NAND_ReadSpare(Row(block, page), spare, sizeof(spare))) {
+
+        return 0;
+    }
+    memcpy(tag, &spare[NAND_SPARE_USER], sizeof(Tag));
+    if (sectors) {
+
+        *sectors = SectorMask(spare);
+    }
+    return tag->crc == CRC_Compute32(0, tag, offsetof(Tag, crc));
+}
+
+//------------------------------------------------------------------------------
+/// Records the next page to program of a block.
+//------------------------------------------------------------------------------
+static void SetNext(unsigned int block, unsigned int next)
+{
+    unsigned int i;
+
+    for (i = 0; i < NEXT_CACHE_SIZE; i++) {
+
+        if (nextPages[i].block == block) {
+
+            nextPages[i].next = next;
+            return;
+        }
+    }
+    nextPages[nextVictim].block = block;
+    nextPages[nextVictim].next = next;
+    nextVictim = (nextVictim + 1) % NEXT_CACHE_SIZE;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the next page to program of a block: the programmed pages come
+/// first, so a binary search on their tags finds it.
+//------------------------------------------------------------------------------
+static unsigned int NextPage(unsigned int block)
+{
+    Tag tag;
+    unsigned int low = 0;
+    unsigned int high = pagesPerBlock;
+    unsigned int middle;
+    unsigned int i;
+
+    for (i = 0; i < NEXT_CACHE_SIZE; i++) {
+
+        if (nextPages[i].block == block) {
+
+            return nextPages[i].next;
+        }
+    }
+
+    while (low < high) {
+
+        middle = (low + high) / 2;
+        if (ReadTag(block, middle, &tag, 0)) {
+
+            low = middle + 1;
+        }
+        else {
+
+            high = middle;
+        }
+    }
+    SetNext(block, low);
+
+    return low;
+}
+
+//------------------------------------------------------------------------------
+/// Forgets what is known of a block that is erased or retired.
+//------------------------------------------------------------------------------
+static void Forget(unsigned int block)
+{
+    unsigned int i;
+
+    for (i = 0; i < NEXT_CACHE_SIZE; i++) {
+
+        if (nextPages[i].block == block) {
+
+            nextPages[i].block = NO_BLOCK;
+        }
+    }
+    bufferedPage = NO_PAGE;
+}
+
+//------------------------------------------------------------------------------
+/// Clears the NAND buffer for a program, and returns it.
+//------------------------------------------------------------------------------
+static unsigned char * Blank(void)
+{
+    unsigned char *buffer = NAND_GetBuffer();
+
+    memset(buffer, 0xFF, NAND_PAGE_SIZE + NAND_SPARE_SIZE);
+    bufferedPage = NO_PAGE;
+
+    return buffer;
+}
+
+//------------------------------------------------------------------------------
+/// Puts the tag of a page into the spare area of the buffer.
+//------------------------------------------------------------------------------
+static void PutTag(unsigned char *buffer,
+                   unsigned int logical,
+                   unsigned char kind)
+{
+    Tag tag;
+
+    tag.logical = logical;
+    tag.kind = kind;
+    tag.reserved = 0xFF;
+    tag.sequence = sequence;
+    tag.crc = CRC_Compute32(0, &tag, offsetof(Tag, crc));
+    memcpy(&buffer[NAND_PAGE_SIZE + NAND_SPARE_USER], &tag, sizeof(tag));
+}
+
+//------------------------------------------------------------------------------
+/// Reads a page into the buffer, unless it is already there.
+/// Returns 1 on success, NAND_CORRECTED if flipped bits have been corrected;
+/// 0 on failure.
+//------------------------------------------------------------------------------
+static unsigned char Load(unsigned int block, unsigned int page)
+{
+    unsigned int row = Row(block, page);
+    unsigned char result;
+
+    if (row == bufferedPage) {
+
+        return 1;
+    }
+    bufferedPage = NO_PAGE;
+    result = NAND_ReadPage(row);
+    if (!result) {
+
+        ftlStats.readErrors++;
+        return 0;
+    }
+    bufferedPage = row;
+
+    return result;
+}
+
+//------------------------------------------------------------------------------
+/// Marks a block bad and stops using it.
+//------------------------------------------------------------------------------
+static void Retire(unsigned int block)
+{
+    NAND_MarkBad(block);
+    Forget(block);
+    SET(badBlocks, block);
+    CLEAR(usedBlocks, block);
+    CLEAR(erasedBlocks, block);
+    ftlStats.badBlocks++;
+}
+
+//------------------------------------------------------------------------------
+/// Erases a block that is no longer mapped, so that mounting ignores it.
+//------------------------------------------------------------------------------
+static void Release(unsigned int block)
+{
+    Forget(block);
+    CLEAR(usedBlocks, block);
+    if (NAND_EraseBlock(block)) {
+
+        SET(erasedBlocks, block);
+    }
+    else {
+
+        Retire(block);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Releases a block, or retires it if it is the one that failed.
+//------------------------------------------------------------------------------
+static void Dispose(unsigned int block, unsigned int failed)
+{
+    if (block == failed) {
+
+        Retire(block);
+    }
+    else {
+
+        Release(block);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Takes a free block, erased, in rotation over the device so that the
+/// blocks wear evenly.
+/// Returns the block, or NO_BLOCK if there is none left.
+//------------------------------------------------------------------------------
+static unsigned int Allocate(void)
+{
+    unsigned int block;
+    unsigned int i;
+
+    for (i = 0; i < numBlocks; i++) {
+
+        block = cursor;
+        cursor = (cursor + 1) % numBlocks;
+        if (IS_SET(badBlocks, block) || IS_SET(usedBlocks, block)) {
+
+            continue;
+        }
+        if (!IS_SET(erasedBlocks, block) && !NAND_EraseBlock(block)) {
+
+            Retire(block);
+            continue;
+        }
+        CLEAR(erasedBlocks, block);
+        SET(usedBlocks, block);
+        Forget(block);
+        SetNext(block, 0);
+        sequence++;
+
+        return block;
+    }
+    return NO_BLOCK;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if a sector can be programmed in a block: its page comes after
+/// those programmed, or is the last programmed and does not hold the sector.
+//------------------------------------------------------------------------------
+static unsigned char CanProgram(unsigned int block,
+                                unsigned int page,
+                                unsigned int sector)
+{
+    unsigned int next = NextPage(block);
+    unsigned int sectors;
+    Tag tag;
+
+    if (page >= next) {
+
+        return 1;
+    }
+    return (page + 1 == next) && ReadTag(block, page, &tag, &sectors)
+           && !(sectors & (1 << sector));
+}
+
+//------------------------------------------------------------------------------
+/// Programs a sector in a block, after CanProgram(). The pages skipped are
+/// programmed with their tag only, to keep the programmed pages first.
+/// Returns 1 on success; 0 on failure (the block should be retired).
+//------------------------------------------------------------------------------
+static unsigned char Program(unsigned int block,
+                             unsigned int logical,
+                             unsigned char kind,
+                             unsigned int page,
+                             unsigned int sector,
+                             const void *data)
+{
+    unsigned int next = NextPage(block);
+    unsigned char *buffer;
+
+    for (; next < page; next++) {
+
+        PutTag(Blank(), logical, kind);
+        if (!NAND_ProgramPage(Row(block, next), 0)) {
+
+            return 0;
+        }
+        SetNext(block, next + 1);
+    }
+
+    // The tag goes with the first program of the page only
+    buffer = Blank();
+    memcpy(&buffer[sector * NAND_SECTOR_SIZE], data, NAND_SECTOR_SIZE);
+    if (page == next) {
+
+        PutTag(buffer, logical, kind);
+    }
+    if (!NAND_ProgramPage(Row(block, page), 1 << sector)) {
+
+        return 0;
+    }
+    if (page == next) {
+
+        SetNext(block, page + 1);
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Copies sectors of a page to the same page of another block, with a tag
+/// if kind is not 0. Sectors that cannot be read are left erased, so that
+/// they read as never written rather than under a fresh code, and counted.
+/// Returns 1 on success; 0 if the program failed.
+//------------------------------------------------------------------------------
+static unsigned char Copy(unsigned int from,
+                          unsigned int to,
+                          unsigned int page,
+                          unsigned int sectors,
+                          unsigned int logical,
+                          unsigned char kind)
+{
+    unsigned char *buffer = NAND_GetBuffer();
+    unsigned int lost;
+    unsigned int i;
+
+    if (!NAND_ReadPage(Row(from, page))) {
+
+        ftlStats.readErrors++;
+        lost = sectors & NAND_GetUnreadable();
+        sectors &= ~lost;
+        for (; lost; lost &= lost - 1) {
+
+            ftlStats.lostSectors++;
+        }
+    }
+    bufferedPage = NO_PAGE;
+    if (!sectors && !kind) {
+
+        return 1;
+    }
+
+    for (i = 0; i < NAND_SECTORS_PER_PAGE; i++) {
+
+        if (!(sectors & (1 << i))) {
+
+            memset(&buffer[i * NAND_SECTOR_SIZE], 0xFF, NAND_SECTOR_SIZE);
+        }
+    }
+    memset(&buffer[NAND_PAGE_SIZE], 0xFF, NAND_SPARE_SIZE);
+    if (kind) {
+
+        PutTag(buffer, logical, kind);
+    }
+    return NAND_ProgramPage(Row(to, page), sectors);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the replacement of a logical block, or 0 if it has none. A free
+/// entry is found with NO_BLOCK.
+//------------------------------------------------------------------------------
+static Replacement * FindReplacement(unsigned int logical)
+{
+    unsigned int i;
+
+    for (i = 0; i < NANDFTL_MAX_REPLACEMENTS; i++) {
+
+        if (replacements[i].logical == logical) {
+
+            return &replacements[i];
+        }
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+/// Writes a logical block to a new primary: the sectors of its replacement,
+/// then those of its primary, then a new sector if data is not 0, page by
+/// page (a page is programmed up to three times). The replacement and the
+/// primary are then released, or retired if one of them is failed.
+/// Returns 1 on success; 0 if there is no block left that can be programmed.
+/// \param logical  Logical block.
+/// \param page  Page of the new sector.
+/// \param sector  Sector of the new sector in its page.
+/// \param data  New sector, or 0.
+/// \param failed  Block whose program has failed, or NO_BLOCK.
+//------------------------------------------------------------------------------
+static unsigned char Fold(unsigned int logical,
+                          unsigned int page,
+                          unsigned int sector,
+                          const void *data,
+                          unsigned int failed)
+{
+    Replacement *replacement = FindReplacement(logical);
+    unsigned int source = replacement ? replacement->block : NO_BLOCK;
+    unsigned int primary = primaries[logical];
+    unsigned int sourceNext = 0;
+    unsigned int primaryNext = 0;
+    unsigned int last;
+    unsigned int block = NO_BLOCK;
+    unsigned int newSectors;
+    unsigned int sourceSectors;
+    unsigned int primarySectors;
+    unsigned char kind;
+    unsigned char ok = 0;
+    unsigned char *buffer;
+    unsigned int attempt;
+    unsigned int p;
+    Tag tag;
+
+    if (source != NO_BLOCK) {
+
+        sourceNext = NextPage(source);
+    }
+    if (primary != NO_BLOCK) {
+
+        primaryNext = NextPage(primary);
+    }
+    last = (sourceNext > primaryNext) ? sourceNext : primaryNext;
+    if (data && (page >= last)) {
+
+        last = page + 1;
+    }
+
+    for (attempt = 0; !ok && (attempt < FOLD_ATTEMPTS); attempt++) {
+
+        block = Allocate();
+        if (block == NO_BLOCK) {
+
+            return 0;
+        }
+
+        ok = 1;
+        for (p = 0; ok && (p < last); p++) {
+
+            // The tag goes with the first program of the page; that of the
+            // last page comes at the end
+            kind = (p + 1 == last) ? 0 : KIND_COPY;
+            newSectors = (data && (p == page)) ? (1 << sector) : 0;
+            sourceSectors = 0;
+            primarySectors = 0;
+            if (p < sourceNext) {
+
+                ReadTag(source, p, &tag, &sourceSectors);
+                sourceSectors &= ~newSectors;
+            }
+            if (p < primaryNext) {
+
+                ReadTag(primary, p, &tag, &primarySectors);
+                primarySectors &= ~(newSectors | sourceSectors);
+            }
+
+            if (sourceSectors) {
+
+                ok = Copy(source, block, p, sourceSectors, logical, kind);
+                kind = 0;
+            }
+            if (ok && primarySectors) {
+
+                ok = Copy(primary, block, p, primarySectors, logical, kind);
+                kind = 0;
+            }
+            if (ok && (newSectors || kind)) {
+
+                buffer = Blank();
+                if (kind) {
+
+                    PutTag(buffer, logical, kind);
+                }
+                if (newSectors) {
+
+                    memcpy(&buffer[sector * NAND_SECTOR_SIZE],
+                           data,
+                           NAND_SECTOR_SIZE);
+                }
+                ok = NAND_ProgramPage(Row(block, p), newSectors);
+            }
+        }
+
+        // The marker last: a power loss before it leaves an unfinished fold,
+        // which mounting drops, and never one that lacks sectors
+        if (ok && last) {
+
+            PutTag(Blank(), logical, KIND_FOLDED);
+            ok = NAND_ProgramPage(Row(block, last - 1), 0);
+        }
+        if (!ok) {
+
+            Retire(block);
+        }
+    }
+    if (!ok) {
+
+        return 0;
+    }
+
+    // A power loss before the sources are erased leaves them older than the
+    // new primary, which mounting prefers
+    SetNext(block, last);
+    primaries[logical] = block;
+    if (replacement) {
+
+        replacement->logical = NO_BLOCK;
+        Dispose(source, failed);
+    }
+    if (primary != NO_BLOCK) {
+
+        Dispose(primary, failed);
+    }
+    ftlStats.folds++;
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns a free replacement entry, folding the least recently used logical
+/// block if there is none; 0 if the fold failed.
+//------------------------------------------------------------------------------
+static Replacement * Reserve(void)
+{
+    Replacement *entry = FindReplacement(NO_BLOCK);
+    unsigned int i;
+
+    if (entry) {
+
+        return entry;
+    }
+
+    entry = &replacements[0];
+    for (i = 1; i < NANDFTL_MAX_REPLACEMENTS; i++) {
+
+        if ((int) (replacements[i].lastUse - entry->lastUse) < 0) {
+
+            entry = &replacements[i];
+        }
+    }
+    return Fold(entry->logical, 0, 0, 0, NO_BLOCK) ? entry : 0;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if every sector of a block is programmed.
+//------------------------------------------------------------------------------
+static unsigned char IsComplete(unsigned int block)
+{
+    unsigned int sectors;
+    unsigned int page;
+    Tag tag;
+
+    for (page = 0; page < pagesPerBlock; page++) {
+
+        if (!ReadTag(block, page, &tag, &sectors) || (sectors != ALL_SECTORS)) {
+
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the fold that wrote a block has completed: the pages it
+/// copied come first and are followed by the one marked KIND_FOLDED.
+//------------------------------------------------------------------------------
+static unsigned char IsFolded(unsigned int block)
+{
+    unsigned int next = NextPage(block);
+    unsigned int low = 0;
+    unsigned int high = next;
+    unsigned int middle;
+    Tag tag;
+
+    while (low < high) {
+
+        middle = (low + high) / 2;
+        if (ReadTag(block, middle, &tag, 0) && (tag.kind == KIND_COPY)) {
+
+            low = middle + 1;
+        }
+        else {
+
+            high = middle;
+        }
+    }
+    return (low < next) && ReadTag(block, low, &tag, 0)
+           && (tag.kind == KIND_FOLDED);
+}
+
+//------------------------------------------------------------------------------
+/// Splits a sector number into logical block, page and sector in the page.
+//------------------------------------------------------------------------------
+static void Locate(unsigned int sector,
+                   unsigned int *logical,
+                   unsigned int *page,
+                   unsigned int *index)
+{
+    unsigned int perBlock = pagesPerBlock * NAND_SECTORS_PER_PAGE;
+
+    *logical = sector / perBlock;
+    *page = (sector % perBlock) / NAND_SECTORS_PER_PAGE;
+    *index = sector % NAND_SECTORS_PER_PAGE;
+}
+
+//------------------------------------------------------------------------------
+/// Reads a sector: from the replacement of its logical block if it holds it,
+/// else from the primary; a sector never written reads as 0xFF. A page read
+/// with flipped bits is rewritten by a fold.
+/// Returns 1 on success; 0 if the page cannot be read.
+//------------------------------------------------------------------------------
+static unsigned char ReadSector(unsigned int sector, unsigned char *data)
+{
+    const unsigned char *buffer = NAND_GetBuffer();
+    const Replacement *replacement;
+    unsigned int logical;
+    unsigned int page;
+    unsigned int index;
+    unsigned int primary;
+    unsigned char result = 0;
+
+    Locate(sector, &logical, &page, &index);
+    replacement = FindReplacement(logical);
+    primary = primaries[logical];
+
+    if (replacement && (page < NextPage(replacement->block))) {
+
+        result = Load(replacement->block, page);
+        if (!result) {
+
+            return 0;
+        }
+        if (!(SectorMask(&buffer[NAND_PAGE_SIZE]) & (1 << index))) {
+
+            result = 0;
+        }
+    }
+    if (!result && (primary != NO_BLOCK) && (page < NextPage(primary))) {
+
+        result = Load(primary, page);
+        if (!result) {
+
+            return 0;
+        }
+    }
+
+    if (!result) {
+
+        memset(data, 0xFF, NAND_SECTOR_SIZE);
+    }
+    else {
+
+        memcpy(data, &buffer[index * NAND_SECTOR_SIZE], NAND_SECTOR_SIZE);
+        if (result == NAND_CORRECTED) {
+
+            Fold(logical, 0, 0, 0, NO_BLOCK);
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Writes a sector: in place in the primary of its logical block if possible,
+/// else in its replacement (which becomes the primary once complete), else
+/// by a fold. A block whose program fails is retired by a fold.
+/// Returns 1 on success; 0 if there is no block left that can be programmed.
+//------------------------------------------------------------------------------
+static unsigned char WriteSector(unsigned int sector, const unsigned char *data)
+{
+    Replacement *replacement;
+    unsigned int logical;
+    unsigned int page;
+    unsigned int index;
+    unsigned int primary;
+    unsigned int block;
+
+    Locate(sector, &logical, &page, &index);
+    replacement = FindReplacement(logical);
+    primary = primaries[logical];
+
+    if (!replacement) {
+
+        if (primary == NO_BLOCK) {
+
+            primary = Allocate();
+            if (primary == NO_BLOCK) {
+
+                return 0;
+            }
+            primaries[logical] = primary;
+        }
+        if (CanProgram(primary, page, index)) {
+
+            return Program(primary, logical, KIND_PRIMARY, page, index, data)
+                   || Fold(logical, page, index, data, primary);
+        }
+
+        replacement = Reserve();
+        if (!replacement) {
+
+            return 0;
+        }
+        block = Allocate();
+        if (block == NO_BLOCK) {
+
+            return 0;
+        }
+        replacement->logical = logical;
+        replacement->block = block;
+    }
+    replacement->lastUse = ++useCount;
+    block = replacement->block;
+
+    if (!CanProgram(block, page, index)) {
+
+        return Fold(logical, page, index, data, NO_BLOCK);
+    }
+    if (!Program(block, logical, KIND_REPLACEMENT, page, index, data)) {
+
+        return Fold(logical, page, index, data, block);
+    }
+
+    // Sequential rewrites fill the replacement up: it needs no fold
+    if ((page == pagesPerBlock - 1) && (index == NAND_SECTORS_PER_PAGE - 1)
+        && IsComplete(block)) {
+
+        primaries[logical] = block;
+        replacement->logical = NO_BLOCK;
+        if (primary != NO_BLOCK) {
+
+            Release(primary);
+        }
+        ftlStats.promotions++;
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Rebuilds the map from the tags of the first pages: the primaries first,
+/// keeping the newest of a logical block and dropping unfinished folds; then
+/// the replacements, dropping those older than their primary. A replacement
+/// without a primary was promoted, and so is the older of two.
+//------------------------------------------------------------------------------
+static void Mount(void)
+{
+    unsigned char pending[NANDFTL_MAX_BLOCKS / 8];
+    Replacement *replacement;
+    unsigned int block;
+    unsigned int newer;
+    unsigned int other;
+    Tag tag;
+    Tag otherTag;
+
+    memset(pending, 0, sizeof(pending));
+    for (block = 0; block < numBlocks; block++) {
+
+        if (NAND_IsBad(block)) {
+
+            SET(badBlocks, block);
+            ftlStats.badBlocks++;
+            continue;
+        }
+        if (!ReadTag(block, 0, &tag, 0) || (tag.logical >= logicalBlocks)) {
+
+            continue;
+        }
+        if ((int) (tag.sequence - sequence) > 0) {
+
+            sequence = tag.sequence;
+        }
+        SET(usedBlocks, block);
+
+        if (tag.kind == KIND_REPLACEMENT) {
+
+            SET(pending, block);
+        }
+        else if ((tag.kind != KIND_PRIMARY) && !IsFolded(block)) {
+
+            Release(block);
+        }
+        else {
+
+            other = primaries[tag.logical];
+            if (other == NO_BLOCK) {
+
+                primaries[tag.logical] = block;
+            }
+            else if (ReadTag(other, 0, &otherTag, 0)
+                     && ((int) (otherTag.sequence - tag.sequence) > 0)) {
+
+                Release(block);
+            }
+            else {
+
+                primaries[tag.logical] = block;
+                Release(other);
+            }
+        }
+    }
+
+    for (block = 0; block < numBlocks; block++) {
+
+        if (!IS_SET(pending, block) || !ReadTag(block, 0, &tag, 0)) {
+
+            continue;
+        }
+        other = primaries[tag.logical];
+        if (other == NO_BLOCK) {
+
+            primaries[tag.logical] = block;
+            continue;
+        }
+        newer = block;
+        ReadTag(other, 0, &otherTag, 0);
+        if ((otherTag.kind == KIND_REPLACEMENT)
+            && ((int) (otherTag.sequence - tag.sequence) > 0)) {
+
+            // Both are replacements: the older one was promoted
+            primaries[tag.logical] = block;
+            newer = other;
+        }
+        else if ((int) (otherTag.sequence - tag.sequence) > 0) {
+
+            Release(block);
+            continue;
+        }
+
+        replacement = FindReplacement(tag.logical);
+        if (!replacement) {
+
+            replacement = Reserve();
+        }
+        if (!replacement) {
+
+            continue;
+        }
+        if (replacement->logical == tag.logical) {
+
+            // Cannot happen: there is one replacement at a time
+            Release(newer);
+            continue;
+        }
+        replacement->logical = tag.logical;
+        replacement->block = newer;
+        replacement->lastUse = ++useCount;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// BlockDevice.read
+//------------------------------------------------------------------------------
+static unsigned char Read(BlockDevice *device,
+                          unsigned int block,
+                          void *buffer,
+                          unsigned int count,
+                          BlockCallback callback,
+                          void *arg)
+{
+    unsigned char *data = buffer;
+    unsigned char status = BLOCK_STATUS_OK;
+
+    if ((count == 0) || (block >= device->numBlocks)
+        || (count > device->numBlocks - block)) {
+
+        return 0;
+    }
+    for (; count; count--, block++, data += BLOCK_SIZE) {
+
+        if (!ReadSector(block, data)) {
+
+            status = BLOCK_STATUS_ERROR;
+        }
+    }
+    if (callback) {
+
+        callback(arg, status);
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// BlockDevice.write
+//------------------------------------------------------------------------------
+static unsigned char Write(BlockDevice *device,
+                           unsigned int block,
+                           const void *buffer,
+                           unsigned int count,
+                           BlockCallback callback,
+                           void *arg)
+{
+    const unsigned char *data = buffer;
+    unsigned char status = BLOCK_STATUS_OK;
+
+    if ((count == 0) || (block >= device->numBlocks)
+        || (count > device->numBlocks - block)) {
+
+        return 0;
+    }
+    for (; count; count--, block++, data += BLOCK_SIZE) {
+
+        if (!WriteSector(block, data)) {
+
+            ftlStats.writeErrors++;
+            status = BLOCK_STATUS_ERROR;
+        }
+    }
+    if (callback) {
+
+        callback(arg, status);
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Mounts the NAND flash and sets up its block device. NAND_Initialize() must
+/// have succeeded. Mounting reads two to a few tags per block: about 0.1 s
+/// for 1024 blocks.
+/// Returns 1 on success; 0 if the device is too small.
+/// \param device  Block device to fill in.
+//------------------------------------------------------------------------------
+unsigned char NANDFTL_Initialize(BlockDevice *device)
+{
+    const NandInfo *info = NAND_GetInfo();
+    unsigned int i;
+
+    device->read = Read;
+    device->write = Write;
+    device->numBlocks = 0;
+    device->writeProtected = 0;
+    device->context = 0;
+
+    numBlocks = info->numBlocks;
+    if (numBlocks > NANDFTL_MAX_BLOCKS) {
+
+        numBlocks = NANDFTL_MAX_BLOCKS;
+    }
+    if (numBlocks <= NANDFTL_RESERVED_BLOCKS) {
+
+        return 0;
+    }
+    pagesPerBlock = info->pagesPerBlock;
+    logicalBlocks = numBlocks - NANDFTL_RESERVED_BLOCKS;
+
+    memset(primaries, 0xFF, sizeof(primaries));
+    memset(badBlocks, 0, sizeof(badBlocks));
+    memset(usedBlocks, 0, sizeof(usedBlocks));
+    memset(erasedBlocks, 0, sizeof(erasedBlocks));
+    memset(&ftlStats, 0, sizeof(ftlStats));
+    for (i = 0; i < NANDFTL_MAX_REPLACEMENTS; i++) {
+
+        replacements[i].logical = NO_BLOCK;
+    }
+    for (i = 0; i < NEXT_CACHE_SIZE; i++) {
+
+        nextPages[i].block = NO_BLOCK;
+    }
+    nextVictim = 0;
+    bufferedPage = NO_PAGE;
+    useCount = 0;
+    sequence = 0;
+    cursor = 0;
+
+    Mount();
+
+    // Start the rotation elsewhere at each boot
+    cursor = sequence % numBlocks;
+    device->numBlocks = logicalBlocks * pagesPerBlock * NAND_SECTORS_PER_PAGE;
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the layer counters.
+//------------------------------------------------------------------------------
+const NandftlStats * NANDFTL_GetStats(void)
+{
+    unsigned int block;
+
+    ftlStats.freeBlocks = 0;
+    for (block = 0; block < numBlocks; block++) {
+
+        if (!IS_SET(badBlocks, block) && !IS_SET(usedBlocks, block)) {
+
+            ftlStats.freeBlocks++;
+        }
+    }
+    return &ftlStats;
+}
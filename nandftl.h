@@ -0,0 +1,94 @@
+/* ----------------------------------------------------------------------------
+ *         NAND flash translation layer
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Block device of 512-byte sectors on the NAND flash (nand.h). A page holds
+** four sectors, each programmed once between two erases of its block, in
+** page order; the layer maps logical blocks (of pages) onto physical blocks
+** so that sectors can be rewritten.
+**
+** Each logical block has a primary block, written in place while the writes
+** move forward. A rewrite goes to a replacement block, also written in
+** order, whose sectors hide those of the primary. The sequential rewrites of
+** a log thus cost no copy: once every sector of the replacement is written,
+** it simply becomes the primary. A write that cannot go in order, or the
+** need for a replacement while NANDFTL_MAX_REPLACEMENTS are in use, folds
+** the two blocks into a new primary, which copies the live sectors.
+**
+** Each page carries a tag in its spare area: logical block, kind of block,
+** and the sequence number of the allocation. Mounting reads the tag of each
+** first page to rebuild the map, and resolves the blocks left by a power
+** loss: an unfinished fold is dropped, a finished one supersedes its
+** sources. The bad block table is rebuilt the same way, from the markers of
+** the maker and of the blocks retired after a failed erase or program.
+** NANDFTL_RESERVED_BLOCKS blocks are kept out of the capacity for the bad
+** blocks, replacements and folds.
+**
+** Operations complete before read() and write() return, and take up to a
+** few ms (a fold: tens of ms): call them from a task, never from an
+** interrupt. Only the first NANDFTL_MAX_BLOCKS blocks of the device are used.
+*/
+
+#ifndef NANDFTL_H
+#define NANDFTL_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "block.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Blocks handled: 2 bytes of RAM each, plus 2 bits (1 Gbit: 1024 blocks).
+#ifndef NANDFTL_MAX_BLOCKS
+#define NANDFTL_MAX_BLOCKS      1024
+#endif
+
+/// Blocks kept out of the capacity.
+#ifndef NANDFTL_RESERVED_BLOCKS
+#define NANDFTL_RESERVED_BLOCKS 32
+#endif
+
+/// Logical blocks that can have a replacement at the same time.
+#ifndef NANDFTL_MAX_REPLACEMENTS
+#define NANDFTL_MAX_REPLACEMENTS 4
+#endif
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Layer counters.
+typedef struct {
+
+    /// Replacements that became primaries, and folds.
+    unsigned int promotions;
+    unsigned int folds;
+    /// Blocks marked bad, by the maker or since.
+    unsigned int badBlocks;
+    /// Erased or erasable blocks left.
+    unsigned int freeBlocks;
+    /// Pages that could not be read back, and sectors that could not be
+    /// written.
+    unsigned int readErrors;
+    unsigned int writeErrors;
+    /// Sectors that a fold could not read, and left erased: they read back
+    /// as 0xFF.
+    unsigned int lostSectors;
+
+} NandftlStats;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned char NANDFTL_Initialize(BlockDevice *device);
+
+extern const NandftlStats * NANDFTL_GetStats(void);
+
+#endif //#ifndef NANDFTL_H
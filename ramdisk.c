@@ -0,0 +1,96 @@
+/* ----------------------------------------------------------------------------
+ *         RAM disk
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "ramdisk.h"
+
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the range of blocks is inside the device.
+//------------------------------------------------------------------------------
+static unsigned char IsInside(const BlockDevice *device,
+                              unsigned int block,
+                              unsigned int count)
+{
+    return (count != 0) && (block < device->numBlocks)
+           && (count <= device->numBlocks - block);
+}
+
+//------------------------------------------------------------------------------
+/// BlockDevice.read
+//------------------------------------------------------------------------------
+static unsigned char Read(BlockDevice *device,
+                          unsigned int block,
+                          void *buffer,
+                          unsigned int count,
+                          BlockCallback callback,
+                          void *arg)
+{
+    if (!IsInside(device, block, count)) {
+
+        return 0;
+    }
+    memcpy(buffer,
+           (unsigned char *) device->context + block * BLOCK_SIZE,
+           count * BLOCK_SIZE);
+    if (callback) {
+
+        callback(arg, BLOCK_STATUS_OK);
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// BlockDevice.write
+//------------------------------------------------------------------------------
+static unsigned char Write(BlockDevice *device,
+                           unsigned int block,
+                           const void *buffer,
+                           unsigned int count,
+                           BlockCallback callback,
+                           void *arg)
+{
+    if (!IsInside(device, block, count)) {
+
+        return 0;
+    }
+    memcpy((unsigned char *) device->context + block * BLOCK_SIZE,
+           buffer,
+           count * BLOCK_SIZE);
+    if (callback) {
+
+        callback(arg, BLOCK_STATUS_OK);
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Sets up a RAM disk. The memory is not cleared.
+/// \param device  Block device to fill in.
+/// \param memory  Storage, numBlocks * BLOCK_SIZE bytes.
+/// \param numBlocks  Size of the disk, in blocks.
+//------------------------------------------------------------------------------
+void RAMDISK_Initialize(BlockDevice *device,
+                        void *memory,
+                        unsigned int numBlocks)
+{
+    device->read = Read;
+    device->write = Write;
+    device->numBlocks = numBlocks;
+    device->writeProtected = 0;
+    device->context = memory;
+}
@@ -0,0 +1,30 @@
+/* ----------------------------------------------------------------------------
+ *         RAM disk
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Block device backed by a memory array. Operations complete before read()
+** and write() return. The module has no hardware dependency, so the users of
+** the block interface (mass storage, file systems) can run on top of it on a
+** development host as well as on the target.
+*/
+
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "block.h"
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void RAMDISK_Initialize(BlockDevice *device,
+                               void *memory,
+                               unsigned int numBlocks);
+
+#endif //#ifndef RAMDISK_H
@@ -0,0 +1,308 @@
+/* ----------------------------------------------------------------------------
+ *         Cooperative run-to-completion scheduler
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "scheduler.h"
+#include "clock.h"
+#include "dwt.h"
+#include "evlog.h"
+#include "exceptions.h"
+#include "tickless.h"
+#include "watchdog.h"
+#include "irq.h"
+#include "AT91SAM3U4.h"
+
+#include <intrinsics.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Bitmap bit of a task: task 0 is the MSB so that CLZ returns its index.
+#define TASK_BIT(index)     (0x80000000u >> (index))
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Release bookkeeping of a task.
+typedef struct {
+
+    /// Tick of the next release.
+    unsigned int nextRelease;
+    /// Tick of the release being served.
+    unsigned int release;
+
+} TaskTiming;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Task table given to SCHED_Initialize().
+static const SchedulerTask *taskTable;
+static unsigned int taskCount;
+
+static TaskTiming timings[SCHED_MAX_TASKS];
+static SchedulerStats stats[SCHED_MAX_TASKS];
+
+/// Tasks whose next release falls in each slot (nextRelease modulo size).
+static unsigned int wheel[SCHED_WHEEL_SIZE];
+
+/// Released tasks waiting to run.
+static volatile unsigned int readyTasks;
+
+/// Ticks since SCHED_Start().
+static volatile unsigned int ticks;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Registers the task table. Entries are in decreasing priority order.
+/// \param tasks  Task table (must stay valid).
+/// \param count  Number of entries, up to SCHED_MAX_TASKS.
+//------------------------------------------------------------------------------
+void SCHED_Initialize(const SchedulerTask *tasks, unsigned int count)
+{
+    unsigned int i;
+
+    if (count > SCHED_MAX_TASKS) {
+
+        count = SCHED_MAX_TASKS;
+    }
+    taskTable = tasks;
+    taskCount = count;
+    readyTasks = 0;
+    ticks = 0;
+
+    for (i = 0; i < SCHED_WHEEL_SIZE; i++) {
+
+        wheel[i] = 0;
+    }
+
+    for (i = 0; i < count; i++) {
+
+        timings[i].nextRelease = tasks[i].offset;
+        timings[i].release = 0;
+        stats[i].runs = 0;
+        stats[i].wcet = 0;
+        stats[i].overruns = 0;
+        stats[i].deadlineMisses = 0;
+
+        if (tasks[i].offset == 0) {
+
+            // Released immediately, next release one period later
+            readyTasks |= TASK_BIT(i);
+            timings[i].nextRelease = tasks[i].period;
+        }
+        wheel[timings[i].nextRelease & (SCHED_WHEEL_SIZE - 1)] |= TASK_BIT(i);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Starts SysTick at SCHED_TICK_HZ from the current master clock.
+//------------------------------------------------------------------------------
+void SCHED_Start(void)
+{
+    AT91C_BASE_NVIC->NVIC_STICKRVR = CLOCK_GetMck() / SCHED_TICK_HZ - 1;
+    AT91C_BASE_NVIC->NVIC_STICKCVR = 0;
+    AT91C_BASE_NVIC->NVIC_STICKCSR = AT91C_NVIC_STICKCLKSOURCE
+                                     | AT91C_NVIC_STICKINT
+                                     | AT91C_NVIC_STICKENABLE;
+}
+
+//------------------------------------------------------------------------------
+/// Advances time by one tick and releases the tasks due in this tick. Only the
+/// tasks sharing the current wheel slot are examined. Also runs the watchdog
+/// supervision.
+//------------------------------------------------------------------------------
+void SCHED_Tick(void)
+{
+    unsigned int now = ticks + 1;
+    unsigned int *slot = &wheel[now & (SCHED_WHEEL_SIZE - 1)];
+    unsigned int candidates = *slot;
+    unsigned int index;
+    unsigned int bit;
+    TaskTiming *timing;
+
+    ticks = now;
+
+    while (candidates) {
+
+        index = __CLZ(candidates);
+        bit = TASK_BIT(index);
+        candidates &= ~bit;
+
+        timing = &timings[index];
+        if (timing->nextRelease != now) {
+
+            // Due on a later turn of the wheel
+            continue;
+        }
+
+        if (readyTasks & bit) {
+
+            stats[index].overruns++;
+            EVLOG_Write(EVLOG_ID_TASK_OVERRUN, index);
+        }
+        readyTasks |= bit;
+        timing->release = now;
+        timing->nextRelease = now + taskTable[index].period;
+
+        *slot &= ~bit;
+        wheel[timing->nextRelease & (SCHED_WHEEL_SIZE - 1)] |= bit;
+    }
+
+    WDT_Supervise(now);
+}
+
+//------------------------------------------------------------------------------
+/// Advances time by count ticks at once, after a tickless sleep. Only the last
+/// tick may release tasks: the sleep never goes past the next release (see
+/// SCHED_GetIdleTicks()).
+//------------------------------------------------------------------------------
+void SCHED_Advance(unsigned int count)
+{
+    if (count == 0) {
+
+        return;
+    }
+    ticks += count - 1;
+    SCHED_Tick();
+}
+
+//------------------------------------------------------------------------------
+/// Returns the number of ticks until the next release, 0xFFFFFFFF if there is
+/// no task. Must be called with interrupts disabled.
+//------------------------------------------------------------------------------
+unsigned int SCHED_GetIdleTicks(void)
+{
+    unsigned int idle = 0xFFFFFFFF;
+    unsigned int delay;
+    unsigned int i;
+
+    for (i = 0; i < taskCount; i++) {
+
+        delay = timings[i].nextRelease - ticks;
+        if (delay < idle) {
+
+            idle = delay;
+        }
+    }
+
+    return idle;
+}
+
+//------------------------------------------------------------------------------
+/// Runs the highest priority ready task, if any, and updates its statistics.
+/// Returns 1 if a task was run; otherwise 0.
+//------------------------------------------------------------------------------
+unsigned char SCHED_RunOnce(void)
+{
+    unsigned int index;
+    unsigned int release;
+    unsigned int cycles;
+    IrqState state;
+
+    state = IRQ_EnterCritical();
+    if (readyTasks == 0) {
+
+        IRQ_ExitCritical(state);
+        return 0;
+    }
+    index = __CLZ(readyTasks);
+    readyTasks &= ~TASK_BIT(index);
+    release = timings[index].release;
+    IRQ_ExitCritical(state);
+
+    cycles = DWT_GetCycles();
+    taskTable[index].run();
+    cycles = DWT_GetCycles() - cycles;
+
+    stats[index].runs++;
+    if (cycles > stats[index].wcet) {
+
+        stats[index].wcet = cycles;
+    }
+    if ((ticks - release) > taskTable[index].deadline) {
+
+        stats[index].deadlineMisses++;
+        EVLOG_Write(EVLOG_ID_TASK_LATE, index);
+    }
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Scheduler main loop: runs ready tasks and sleeps when there are none,
+/// until the next release with SCHED_TICKLESS, otherwise until the next
+/// interrupt. Never returns.
+//------------------------------------------------------------------------------
+void SCHED_Run(void)
+{
+#if SCHED_TICKLESS
+    unsigned int idle;
+
+#endif
+    while (1) {
+
+        if (!SCHED_RunOnce()) {
+
+            // Interrupts stay masked between the check and the sleep so that
+            // a release cannot slip in unnoticed; the sleep still ends on it.
+            __disable_interrupt();
+            if (readyTasks == 0) {
+
+#if SCHED_TICKLESS
+                idle = SCHED_GetIdleTicks();
+                if (idle >= TICKLESS_MIN_TICKS) {
+
+                    SCHED_Advance(TICKLESS_Sleep(idle, SCHED_TICK_HZ));
+                }
+                else {
+
+                    __WFI();
+                }
+#else
+                __WFI();
+#endif
+            }
+            __enable_interrupt();
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Returns the number of ticks since SCHED_Start().
+//------------------------------------------------------------------------------
+unsigned int SCHED_GetTicks(void)
+{
+    return ticks;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the statistics of a task, or 0 if the index is out of range.
+//------------------------------------------------------------------------------
+const SchedulerStats * SCHED_GetStats(unsigned int index)
+{
+    if (index >= taskCount) {
+
+        return 0;
+    }
+    return &stats[index];
+}
+
+//------------------------------------------------------------------------------
+/// SysTick interrupt: scheduler time base.
+//------------------------------------------------------------------------------
+void SysTick_Handler(void)
+{
+    SCHED_Tick();
+}
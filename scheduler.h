@@ -0,0 +1,103 @@
+/* ----------------------------------------------------------------------------
+ *         Cooperative run-to-completion scheduler
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Superloop scheduler driven by a 1 ms SysTick. Tasks come from a fixed table
+** ordered by priority (entry 0 first) and run to completion.
+**
+** Releases are kept in a timing wheel and ready tasks in a bitmap, so a tick
+** only touches the tasks released in that tick and the next task to run is
+** found with a single CLZ, whatever the number of registered tasks.
+**
+** SCHED_Tick() and SCHED_RunOnce() do not depend on SysTick and can be driven
+** by any tick source.
+**
+** With SCHED_TICKLESS, the idle loop skips the ticks in which nothing is due
+** and catches up with SCHED_Advance() on wakeup.
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Maximum number of tasks (one bit each in the ready bitmap).
+#define SCHED_MAX_TASKS         32
+
+/// Number of slots of the timing wheel (power of two). Tasks with a longer
+/// period stay in their slot for several turns of the wheel.
+#define SCHED_WHEEL_SIZE        32
+
+/// SysTick frequency.
+#define SCHED_TICK_HZ           1000
+
+/// Set to 1 to stop SysTick while idle and sleep until the next release
+/// (see tickless.h); 0 to sleep with WFI and wake up on every tick.
+#ifndef SCHED_TICKLESS
+#define SCHED_TICKLESS          1
+#endif
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Task entry point.
+typedef void (*SchedulerFunc)(void);
+
+/// Static description of a task.
+typedef struct {
+
+    /// Name shown in statistics dumps.
+    const char *name;
+    /// Function called on each release.
+    SchedulerFunc run;
+    /// Release period in ticks (> 0).
+    unsigned int period;
+    /// Maximum ticks between release and completion.
+    unsigned int deadline;
+    /// Tick of the first release, to spread tasks sharing a period.
+    unsigned int offset;
+
+} SchedulerTask;
+
+/// Run-time statistics of a task.
+typedef struct {
+
+    /// Number of completed runs.
+    unsigned int runs;
+    /// Worst-case execution time, in core cycles.
+    unsigned int wcet;
+    /// Releases that happened while the previous one had not run yet.
+    unsigned int overruns;
+    /// Runs that completed after their deadline.
+    unsigned int deadlineMisses;
+
+} SchedulerStats;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void SCHED_Initialize(const SchedulerTask *tasks, unsigned int count);
+
+extern void SCHED_Start(void);
+
+extern void SCHED_Run(void);
+
+extern void SCHED_Tick(void);
+
+extern void SCHED_Advance(unsigned int count);
+
+extern unsigned int SCHED_GetIdleTicks(void);
+
+extern unsigned char SCHED_RunOnce(void);
+
+extern unsigned int SCHED_GetTicks(void);
+
+extern const SchedulerStats * SCHED_GetStats(unsigned int index);
+
+#endif //#ifndef SCHEDULER_H
@@ -0,0 +1,706 @@
+/* ----------------------------------------------------------------------------
+ *         SD card block driver
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "sdcard.h"
+#include "evlog.h"
+#include "hdma.h"
+#include "dwt.h"
+#include "irq.h"
+#include "exceptions.h"
+#include "AT91SAM3U4.h"
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define MCI_PINS                (AT91C_PA3_MCI0_CK | AT91C_PA4_MCI0_CDA \
+                                 | AT91C_PA5_MCI0_DA0 | AT91C_PA6_MCI0_DA1 \
+                                 | AT91C_PA7_MCI0_DA2 | AT91C_PA8_MCI0_DA3)
+
+/// CMD and DAT lines, pulled up.
+#define MCI_PULLUPS             (MCI_PINS & ~AT91C_PA3_MCI0_CK)
+
+/// Bus clocks.
+#define IDENTIFICATION_CLOCK    400000
+#define DEFAULT_SPEED_CLOCK     25000000
+#define HIGH_SPEED_CLOCK        50000000
+
+/// Timeouts, in ms.
+#define COMMAND_TIMEOUT         10
+#define POWER_UP_TIMEOUT        1000
+#define BUSY_TIMEOUT            500
+
+/// Errors of the command phase and of the data phase.
+#define RESPONSE_ERRORS         (AT91C_MCI_RINDE | AT91C_MCI_RDIRE \
+                                 | AT91C_MCI_RCRCE | AT91C_MCI_RENDE \
+                                 | AT91C_MCI_RTOE)
+#define DATA_ERRORS             (AT91C_MCI_DCRCE | AT91C_MCI_DTOE \
+                                 | AT91C_MCI_OVRE | AT91C_MCI_UNRE)
+
+/// Response types of the commands used here. NO_CRC is a driver flag, never
+/// written to MCI_CMDR: the R3 response (OCR) carries no valid CRC.
+#define RSP_NONE                AT91C_MCI_RSPTYP_NO
+#define RSP_R1                  (AT91C_MCI_RSPTYP_48 | AT91C_MCI_MAXLAT_64)
+#define RSP_R1B                 (AT91C_MCI_RSPTYP_R1B | AT91C_MCI_MAXLAT_64)
+#define RSP_R2                  (AT91C_MCI_RSPTYP_136 | AT91C_MCI_MAXLAT_64)
+#define NO_CRC                  (1u << 31)
+#define RSP_R3                  (RSP_R1 | NO_CRC)
+
+/// Commands.
+#define CMD0_GO_IDLE_STATE      0
+#define CMD2_ALL_SEND_CID       2
+#define CMD3_SEND_RCA           3
+#define CMD6_SWITCH_FUNC        6
+#define CMD7_SELECT_CARD        7
+#define CMD8_SEND_IF_COND       8
+#define CMD9_SEND_CSD           9
+#define CMD12_STOP              12
+#define CMD16_SET_BLOCKLEN      16
+#define CMD17_READ_SINGLE       17
+#define CMD18_READ_MULTIPLE     18
+#define CMD24_WRITE_SINGLE      24
+#define CMD25_WRITE_MULTIPLE    25
+#define CMD55_APP_CMD           55
+#define ACMD6_SET_BUS_WIDTH     6
+#define ACMD41_SEND_OP_COND     41
+
+/// CMD8 argument: 2.7-3.6 V, check pattern 0xAA.
+#define IF_COND                 0x1AA
+
+/// ACMD41 argument: 2.7-3.6 V, plus HCS for cards that answered CMD8.
+#define OCR_VOLTAGES            0x00FF8000
+#define OCR_HCS                 (1u << 30)
+#define OCR_BUSY                (1u << 31)
+
+/// CMD6 argument: switch function group 1 to high speed.
+#define SWITCH_HIGH_SPEED       0x80FFFFF1
+
+/// Size of the CMD6 status.
+#define SWITCH_STATUS_SIZE      64
+
+/// HDMA descriptors: SDCARD_MAX_BLOCKS words fit in two.
+#define MAX_DESCRIPTORS         2
+
+/// Phases of a transfer.
+#define PHASE_IDLE              0
+#define PHASE_DATA              1
+#define PHASE_STOP              2
+#define PHASE_BUSY              3
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static SdcardInfo sdcardInfo;
+
+static SdcardStats sdcardStats;
+
+/// MCI_MR without the block length.
+static unsigned int modeRegister;
+
+/// Cycles per ms.
+static unsigned int cyclesPerMs;
+
+static HdmaTransfer transfer;
+static HdmaDescriptor descriptors[MAX_DESCRIPTORS];
+
+/// Transfer in progress.
+static volatile unsigned char busy;
+static volatile unsigned char phase;
+static unsigned char writing;
+static unsigned char multiple;
+static unsigned char failed;
+static unsigned char mciDone;
+static unsigned char dmaDone;
+static BlockCallback callback;
+static void *callbackArg;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns the MCI_MR clock divider for the highest clock not above hz.
+//------------------------------------------------------------------------------
+static unsigned int ClockDivider(unsigned int mck, unsigned int hz)
+{
+    unsigned int div = (mck + 2 * hz - 1) / (2 * hz);
+
+    if (div > 0) {
+
+        div--;
+    }
+    return (div > 0xFF) ? 0xFF : div;
+}
+
+//------------------------------------------------------------------------------
+/// Resets the controller and sets its clock and bus width.
+//------------------------------------------------------------------------------
+static void ConfigureController(unsigned int clkdiv, unsigned char wide)
+{
+    AT91PS_MCI mci = AT91C_BASE_MCI0;
+
+    mci->MCI_CR = AT91C_MCI_SWRST;
+    mci->MCI_IDR = 0xFFFFFFFF;
+    mci->MCI_DTOR = AT91C_MCI_DTOCYC | AT91C_MCI_DTOMUL_1048576;
+    modeRegister = clkdiv | AT91C_MCI_RDPROOF | AT91C_MCI_WRPROOF;
+    mci->MCI_MR = modeRegister | (BLOCK_SIZE << 16);
+    mci->MCI_SDCR = AT91C_MCI_SCDSEL_SLOTA
+                    | (wide ? AT91C_MCI_SCDBUS_4BITS : AT91C_MCI_SCDBUS_1BIT);
+    mci->MCI_CFG = AT91C_MCI_FIFOMODE | AT91C_MCI_FERRCTRL
+                   | (sdcardInfo.highSpeed ? AT91C_MCI_HSMODE : 0);
+    mci->MCI_DMA = 0;
+    mci->MCI_CR = AT91C_MCI_MCIEN | AT91C_MCI_PWSDIS;
+}
+
+//------------------------------------------------------------------------------
+/// Waits for a status flag of the MCI. Returns 1 if it is set in time.
+//------------------------------------------------------------------------------
+static unsigned char WaitStatus(unsigned int flag, unsigned int ms)
+{
+    unsigned int start = DWT_GetCycles();
+
+    while (!(AT91C_BASE_MCI0->MCI_SR & flag)) {
+
+        if (DWT_GetCycles() - start > ms * cyclesPerMs) {
+
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Sends a command and waits for its response (initialization only).
+/// Returns 1 on success; 0 on timeout or response error.
+/// \param command  Command number and MCI_CMDR flags (RSP_xxx included).
+/// \param argument  Command argument.
+/// \param response  Receives the response (4 words for R2), or 0.
+//------------------------------------------------------------------------------
+static unsigned char SendCommand(unsigned int command,
+                                 unsigned int argument,
+                                 unsigned int *response)
+{
+    AT91PS_MCI mci = AT91C_BASE_MCI0;
+    unsigned int errors = RESPONSE_ERRORS;
+    unsigned int count;
+    unsigned int i;
+
+    if (command & NO_CRC) {
+
+        errors &= ~AT91C_MCI_RCRCE;
+    }
+
+    mci->MCI_ARGR = argument;
+    mci->MCI_CMDR = command & ~NO_CRC;
+    if (!WaitStatus(AT91C_MCI_CMDRDY, COMMAND_TIMEOUT)
+        || (mci->MCI_SR & errors)) {
+
+        return 0;
+    }
+
+    if (response) {
+
+        // Each read of RSPR returns the next word of the response
+        count = ((command & AT91C_MCI_RSPTYP) == AT91C_MCI_RSPTYP_136) ? 4 : 1;
+        for (i = 0; i < count; i++) {
+
+            response[i] = mci->MCI_RSPR[0];
+        }
+    }
+    if ((command & AT91C_MCI_RSPTYP) == AT91C_MCI_RSPTYP_R1B) {
+
+        return WaitStatus(AT91C_MCI_NOTBUSY, BUSY_TIMEOUT);
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Sends an application command (CMD55 then the command).
+//------------------------------------------------------------------------------
+static unsigned char SendAppCommand(unsigned int command,
+                                    unsigned int argument,
+                                    unsigned int *response)
+{
+    return SendCommand(CMD55_APP_CMD | RSP_R1, sdcardInfo.rca << 16, 0)
+           && SendCommand(command, argument, response);
+}
+
+//------------------------------------------------------------------------------
+/// Returns width bits of the CSD from bit lsb. csd[0] holds bits 127 to 96.
+//------------------------------------------------------------------------------
+static unsigned int CsdBits(const unsigned int *csd,
+                            unsigned int lsb,
+                            unsigned int width)
+{
+    unsigned int value = 0;
+    unsigned int bit;
+    unsigned int i;
+
+    for (i = 0; i < width; i++) {
+
+        bit = lsb + i;
+        if (csd[3 - (bit >> 5)] & (1u << (bit & 0x1F))) {
+
+            value |= 1u << i;
+        }
+    }
+    return value;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the number of blocks of the card described by a CSD.
+//------------------------------------------------------------------------------
+static unsigned int CapacityFromCsd(const unsigned int *csd)
+{
+    unsigned int readBlockLength;
+    unsigned int multiplier;
+
+    if (CsdBits(csd, 126, 2) == 1) {
+
+        // CSD version 2.0: C_SIZE counts 512 KB units
+        return (CsdBits(csd, 48, 22) + 1) << 10;
+    }
+
+    readBlockLength = CsdBits(csd, 80, 4);
+    multiplier = CsdBits(csd, 47, 3) + 2;
+    return (CsdBits(csd, 62, 12) + 1) << (multiplier + readBlockLength - 9);
+}
+
+//------------------------------------------------------------------------------
+/// Switches the card to the high speed mode (CMD6, SD 1.10 and later).
+/// Returns 1 if the card has accepted it.
+//------------------------------------------------------------------------------
+static unsigned char SwitchHighSpeed(void)
+{
+    AT91PS_MCI mci = AT91C_BASE_MCI0;
+    unsigned int status[SWITCH_STATUS_SIZE / 4];
+    unsigned int i;
+
+    mci->MCI_MR = modeRegister | (SWITCH_STATUS_SIZE << 16);
+    mci->MCI_BLKR = (SWITCH_STATUS_SIZE << 16) | 1;
+    if (!SendCommand(CMD6_SWITCH_FUNC | RSP_R1 | AT91C_MCI_TRCMD_START
+                     | AT91C_MCI_TRDIR_READ | AT91C_MCI_TRTYP_BLOCK,
+                     SWITCH_HIGH_SPEED, 0)) {
+
+        return 0;
+    }
+    for (i = 0; i < SWITCH_STATUS_SIZE / 4; i++) {
+
+        if (!WaitStatus(AT91C_MCI_RXRDY, COMMAND_TIMEOUT)) {
+
+            return 0;
+        }
+        status[i] = mci->MCI_RDR;
+    }
+    if (!WaitStatus(AT91C_MCI_XFRDONE, COMMAND_TIMEOUT)
+        || (mci->MCI_SR & DATA_ERRORS)) {
+
+        return 0;
+    }
+    mci->MCI_MR = modeRegister | (BLOCK_SIZE << 16);
+
+    // Byte 16 of the status (first byte received in the LSB), low nibble:
+    // function selected in group 1
+    return (status[4] & 0xF) == 1;
+}
+
+//------------------------------------------------------------------------------
+/// Identifies the card and brings it to the transfer state on the 4-bit bus.
+/// Returns the number of blocks, or 0 if no card answers.
+//------------------------------------------------------------------------------
+static unsigned int IdentifyCard(unsigned int mck)
+{
+    unsigned int response[4];
+    unsigned int csd[4];
+    unsigned int argument = OCR_VOLTAGES;
+    unsigned int start;
+
+    ConfigureController(ClockDivider(mck, IDENTIFICATION_CLOCK), 0);
+
+    // 74 clock cycles, then back to the idle state
+    SendCommand(CMD0_GO_IDLE_STATE | RSP_NONE | AT91C_MCI_SPCMD_INIT, 0, 0);
+    if (!SendCommand(CMD0_GO_IDLE_STATE | RSP_NONE, 0, 0)) {
+
+        return 0;
+    }
+
+    // Only version 2.00 cards answer CMD8; they may be high capacity
+    if (SendCommand(CMD8_SEND_IF_COND | RSP_R1, IF_COND, response)) {
+
+        if ((response[0] & 0xFFF) != IF_COND) {
+
+            return 0;
+        }
+        argument |= OCR_HCS;
+    }
+
+    start = DWT_GetCycles();
+    do {
+
+        if (DWT_GetCycles() - start > POWER_UP_TIMEOUT * cyclesPerMs) {
+
+            return 0;
+        }
+        if (!SendAppCommand(ACMD41_SEND_OP_COND | RSP_R3, argument, response)) {
+
+            return 0;
+        }
+    }
+    while (!(response[0] & OCR_BUSY));
+    sdcardInfo.highCapacity = (response[0] & OCR_HCS) != 0;
+
+    if (!SendCommand(CMD2_ALL_SEND_CID | RSP_R2, 0, response)
+        || !SendCommand(CMD3_SEND_RCA | RSP_R1, 0, response)) {
+
+        return 0;
+    }
+    sdcardInfo.rca = response[0] >> 16;
+
+    if (!SendCommand(CMD9_SEND_CSD | RSP_R2, sdcardInfo.rca << 16, csd)
+        || !SendCommand(CMD7_SELECT_CARD | RSP_R1B, sdcardInfo.rca << 16, 0)
+        || !SendAppCommand(ACMD6_SET_BUS_WIDTH | RSP_R1, 2, 0)
+        || !SendCommand(CMD16_SET_BLOCKLEN | RSP_R1, BLOCK_SIZE, 0)) {
+
+        return 0;
+    }
+    AT91C_BASE_MCI0->MCI_SDCR = AT91C_MCI_SCDSEL_SLOTA | AT91C_MCI_SCDBUS_4BITS;
+
+    return CapacityFromCsd(csd);
+}
+
+//------------------------------------------------------------------------------
+/// Ends the transfer once both the MCI and the HDMA are done.
+//------------------------------------------------------------------------------
+static void Finish(void)
+{
+    BlockCallback done = callback;
+
+    if (!mciDone || !dmaDone) {
+
+        return;
+    }
+    if (failed) {
+
+        sdcardStats.errors++;
+        EVLOG_Write(EVLOG_ID_SDCARD_ERROR, 0);
+    }
+    busy = 0;
+    if (done) {
+
+        done(callbackArg, failed ? BLOCK_STATUS_ERROR : BLOCK_STATUS_OK);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// End of the MCI part of a transfer.
+//------------------------------------------------------------------------------
+static void MciDone(void)
+{
+    AT91PS_MCI mci = AT91C_BASE_MCI0;
+
+    mci->MCI_IDR = 0xFFFFFFFF;
+    mci->MCI_DMA = 0;
+    phase = PHASE_IDLE;
+    mciDone = 1;
+    Finish();
+}
+
+//------------------------------------------------------------------------------
+/// HDMA callback.
+//------------------------------------------------------------------------------
+static void DmaDone(void *arg, unsigned char status)
+{
+    if (status != HDMA_STATUS_DONE) {
+
+        failed = 1;
+    }
+    dmaDone = 1;
+    Finish();
+}
+
+//------------------------------------------------------------------------------
+/// Stops a multiple block transfer (CMD12).
+//------------------------------------------------------------------------------
+static void SendStop(void)
+{
+    AT91PS_MCI mci = AT91C_BASE_MCI0;
+
+    phase = PHASE_STOP;
+    mci->MCI_IDR = 0xFFFFFFFF;
+    mci->MCI_ARGR = 0;
+    mci->MCI_CMDR = CMD12_STOP | RSP_R1B | AT91C_MCI_TRCMD_STOP;
+    mci->MCI_IER = AT91C_MCI_CMDRDY | RESPONSE_ERRORS;
+}
+
+//------------------------------------------------------------------------------
+/// Waits for the end of programming after a write.
+//------------------------------------------------------------------------------
+static void WaitNotBusy(void)
+{
+    phase = PHASE_BUSY;
+    AT91C_BASE_MCI0->MCI_IDR = 0xFFFFFFFF;
+    AT91C_BASE_MCI0->MCI_IER = AT91C_MCI_NOTBUSY;
+}
+
+//------------------------------------------------------------------------------
+/// Starts a read or a write.
+//------------------------------------------------------------------------------
+static unsigned char Start(BlockDevice *device,
+                           unsigned int block,
+                           void *buffer,
+                           unsigned int count,
+                           unsigned char write,
+                           BlockCallback done,
+                           void *arg)
+{
+    AT91PS_MCI mci = AT91C_BASE_MCI0;
+    unsigned int command;
+    IrqState state;
+
+    if ((count == 0) || (count > SDCARD_MAX_BLOCKS)
+        || (block >= device->numBlocks) || (count > device->numBlocks - block)
+        || (write && device->writeProtected)) {
+
+        return 0;
+    }
+
+    state = IRQ_EnterCritical();
+    if (busy) {
+
+        IRQ_ExitCritical(state);
+        return 0;
+    }
+    busy = 1;
+    IRQ_ExitCritical(state);
+
+    if (write) {
+
+        HDMA_Prepare(&transfer, HDMA_MEM2PER, HDMA_PER_MCI0, HDMA_WIDTH_WORD,
+                     descriptors, MAX_DESCRIPTORS);
+        if (!HDMA_AddBuffer(&transfer, buffer, (void *) &mci->MCI_TDR,
+                            count * BLOCK_SIZE)) {
+
+            busy = 0;
+            return 0;
+        }
+        sdcardStats.writes++;
+        command = (count > 1) ? CMD25_WRITE_MULTIPLE : CMD24_WRITE_SINGLE;
+    }
+    else {
+
+        HDMA_Prepare(&transfer, HDMA_PER2MEM, HDMA_PER_MCI0, HDMA_WIDTH_WORD,
+                     descriptors, MAX_DESCRIPTORS);
+        if (!HDMA_AddBuffer(&transfer, (void *) &mci->MCI_RDR, buffer,
+                            count * BLOCK_SIZE)) {
+
+            busy = 0;
+            return 0;
+        }
+        sdcardStats.reads++;
+        command = (count > 1) ? CMD18_READ_MULTIPLE : CMD17_READ_SINGLE;
+        command |= AT91C_MCI_TRDIR_READ;
+    }
+
+    writing = write;
+    multiple = (count > 1);
+    failed = 0;
+    mciDone = 0;
+    dmaDone = 0;
+    callback = done;
+    callbackArg = arg;
+    phase = PHASE_DATA;
+
+    mci->MCI_BLKR = (BLOCK_SIZE << 16) | count;
+    mci->MCI_DMA = AT91C_MCI_DMAEN;
+    HDMA_Submit(&transfer, SDCARD_DMA_PRIORITY, DmaDone, 0);
+
+    mci->MCI_ARGR = sdcardInfo.highCapacity ? block : block * BLOCK_SIZE;
+    mci->MCI_CMDR = command | RSP_R1 | AT91C_MCI_TRCMD_START
+                    | (multiple ? AT91C_MCI_TRTYP_MULTIPLE
+                                : AT91C_MCI_TRTYP_BLOCK);
+    mci->MCI_IER = AT91C_MCI_XFRDONE | DATA_ERRORS | RESPONSE_ERRORS;
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// BlockDevice.read
+//------------------------------------------------------------------------------
+static unsigned char Read(BlockDevice *device,
+                          unsigned int block,
+                          void *buffer,
+                          unsigned int count,
+                          BlockCallback done,
+                          void *arg)
+{
+    return Start(device, block, buffer, count, 0, done, arg);
+}
+
+//------------------------------------------------------------------------------
+/// BlockDevice.write
+//------------------------------------------------------------------------------
+static unsigned char Write(BlockDevice *device,
+                           unsigned int block,
+                           const void *buffer,
+                           unsigned int count,
+                           BlockCallback done,
+                           void *arg)
+{
+    return Start(device, block, (void *) buffer, count, 1, done, arg);
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Identifies the card in slot A and sets up the block device. Blocks for up
+/// to one second while the card powers up. HDMA_Initialize() must have been
+/// called.
+/// Returns 1 if a card has been found; otherwise 0, and the device reports no
+/// medium.
+/// \param device  Block device to fill in.
+/// \param mck  Master clock frequency.
+//------------------------------------------------------------------------------
+unsigned char SDCARD_Initialize(BlockDevice *device, unsigned int mck)
+{
+    unsigned int numBlocks;
+    unsigned int clock;
+
+    device->read = Read;
+    device->write = Write;
+    device->numBlocks = 0;
+    device->writeProtected = 0;
+    device->context = 0;
+
+    cyclesPerMs = mck / 1000;
+    sdcardInfo.highSpeed = 0;
+    sdcardInfo.rca = 0;
+
+    AT91C_BASE_PIOA->PIO_ABSR &= ~MCI_PINS;
+    AT91C_BASE_PIOA->PIO_PDR = MCI_PINS;
+    AT91C_BASE_PIOA->PIO_PPUER = MCI_PULLUPS;
+    AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_MCI0;
+
+    numBlocks = IdentifyCard(mck);
+    if (numBlocks == 0) {
+
+        AT91C_BASE_MCI0->MCI_CR = AT91C_MCI_MCIDIS;
+        return 0;
+    }
+
+    // An older card does not answer CMD6 and the controller is reset
+    clock = DEFAULT_SPEED_CLOCK;
+    ConfigureController(ClockDivider(mck, IDENTIFICATION_CLOCK), 1);
+    if (SwitchHighSpeed()) {
+
+        sdcardInfo.highSpeed = 1;
+        clock = HIGH_SPEED_CLOCK;
+    }
+    ConfigureController(ClockDivider(mck, clock), 1);
+    sdcardInfo.clock = mck / (2 * (ClockDivider(mck, clock) + 1));
+
+    busy = 0;
+    phase = PHASE_IDLE;
+    device->numBlocks = numBlocks;
+    IRQ_Enable(AT91C_ID_MCI0);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the card information.
+//------------------------------------------------------------------------------
+const SdcardInfo * SDCARD_GetInfo(void)
+{
+    return &sdcardInfo;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the operation counters.
+//------------------------------------------------------------------------------
+const SdcardStats * SDCARD_GetStats(void)
+{
+    return &sdcardStats;
+}
+
+//------------------------------------------------------------------------------
+/// MCI0 interrupt: end of the data phase, stop command, end of programming.
+//------------------------------------------------------------------------------
+void MCI0_IrqHandler(void)
+{
+    AT91PS_MCI mci = AT91C_BASE_MCI0;
+    unsigned int status = mci->MCI_SR & mci->MCI_IMR;
+
+    switch (phase) {
+
+        case PHASE_DATA:
+            if (status & (DATA_ERRORS | RESPONSE_ERRORS)) {
+
+                failed = 1;
+                HDMA_Cancel(&transfer);
+                dmaDone = 1;
+                if (multiple) {
+
+                    SendStop();
+                }
+                else {
+
+                    MciDone();
+                }
+            }
+            else if (status & AT91C_MCI_XFRDONE) {
+
+                if (multiple) {
+
+                    SendStop();
+                }
+                else if (writing) {
+
+                    WaitNotBusy();
+                }
+                else {
+
+                    MciDone();
+                }
+            }
+            break;
+
+        case PHASE_STOP:
+            if (status & RESPONSE_ERRORS) {
+
+                failed = 1;
+                MciDone();
+            }
+            else if (status & AT91C_MCI_CMDRDY) {
+
+                if (writing) {
+
+                    WaitNotBusy();
+                }
+                else {
+
+                    MciDone();
+                }
+            }
+            break;
+
+        case PHASE_BUSY:
+            if (status & AT91C_MCI_NOTBUSY) {
+
+                MciDone();
+            }
+            break;
+
+        default:
+            mci->MCI_IDR = 0xFFFFFFFF;
+            break;
+    }
+}
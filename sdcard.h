@@ -0,0 +1,75 @@
+/* ----------------------------------------------------------------------------
+ *         SD card block driver
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** SD and SDHC cards on MCI0 (slot A), exposed as a block device. The card is
+** identified at 400 kHz, then switched to the 4-bit bus and, when it supports
+** it, to the high speed mode: 48 MHz with a 96 MHz MCK (the MCI clock is MCK
+** divided by an even number), otherwise 24 MHz.
+**
+** Reads and writes use the multiple block commands for more than one block.
+** The data goes through the MCI FIFO and the HDMA (handshaking interface 0),
+** so the CPU only handles the command, the end of the transfer and the stop
+** command, from MCI0_IrqHandler() and the HDMA callback.
+*/
+
+#ifndef SDCARD_H
+#define SDCARD_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "block.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// HDMA priority of the transfers.
+#ifndef SDCARD_DMA_PRIORITY
+#define SDCARD_DMA_PRIORITY     4
+#endif
+
+/// Largest number of blocks per operation (512 KB, two HDMA descriptors).
+#define SDCARD_MAX_BLOCKS       1024
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Card information.
+typedef struct {
+
+    /// Block addressing (SDHC, SDXC) rather than byte addressing.
+    unsigned char highCapacity;
+    unsigned char highSpeed;
+    /// Relative card address.
+    unsigned short rca;
+    /// Bus clock, in Hz.
+    unsigned int clock;
+
+} SdcardInfo;
+
+/// Operation counters.
+typedef struct {
+
+    unsigned int reads;
+    unsigned int writes;
+    unsigned int errors;
+
+} SdcardStats;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned char SDCARD_Initialize(BlockDevice *device, unsigned int mck);
+
+extern const SdcardInfo * SDCARD_GetInfo(void);
+
+extern const SdcardStats * SDCARD_GetStats(void);
+
+#endif //#ifndef SDCARD_H
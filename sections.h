@@ -0,0 +1,28 @@
+/* ----------------------------------------------------------------------------
+ *         Memory placement helpers
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Shorthands for the blocks defined in sam3u2c_flash.icf.
+*/
+
+#ifndef SECTIONS_H
+#define SECTIONS_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Function copied to and executed from SRAM (RAMFUNC block).
+#define RAMFUNC         __ramfunc
+
+/// Variable neither initialized nor cleared at boot (NOINIT block).
+#define NOINIT          __no_init
+
+/// Prefix for a __no_init variable accessed by the PDC or the HDMA (DMABUF
+/// block, 32-byte aligned). Example:
+///     DMABUF static __no_init unsigned char buffer[512];
+#define DMABUF          _Pragma("location=\".dmabuf\"")
+
+#endif //#ifndef SECTIONS_H
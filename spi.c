@@ -0,0 +1,398 @@
+/* ----------------------------------------------------------------------------
+ *         SPI master
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "spi.h"
+#include "irq.h"
+#include "AT91SAM3U4.h"
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// MISO, MOSI and SPCK, on peripheral A.
+#define SPI_PINS                (AT91C_PA13_SPI0_MISO | AT91C_PA14_SPI0_MOSI \
+                                 | AT91C_PA15_SPI0_SPCK)
+
+/// Position of the fields of SPI_MR and SPI_CSR.
+#define MR_PCS_SHIFT            16
+#define CSR_SCBR_SHIFT          8
+#define CSR_DLYBS_SHIFT         16
+#define CSR_DLYBCT_SHIFT        24
+
+/// SPI_MR without the chip select.
+#define MR_MASTER               (AT91C_SPI_MSTR | AT91C_SPI_PS_FIXED \
+                                 | AT91C_SPI_MODFDIS)
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Chip select pin.
+typedef struct {
+
+    unsigned int pin;
+    unsigned char peripheralB;
+
+} SpiCsPin;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static const SpiCsPin csPins[SPI_NUM_CS] = {
+
+    { AT91C_PA16_SPI0_NPCS0, 0 },
+    { AT91C_PA0_SPI0_NPCS1, 1 },
+    { AT91C_PA1_SPI0_NPCS2, 1 },
+    { AT91C_PA19_SPI0_NPCS3, 1 },
+};
+
+/// Waiting transactions of each chip select.
+static SpiTransaction *heads[SPI_NUM_CS];
+static SpiTransaction *tails[SPI_NUM_CS];
+
+/// Running transaction, and chip select served last.
+static SpiTransaction *current;
+static unsigned int lastCs;
+
+/// Number of the running transaction, passed to the HDMA callbacks so that
+/// the completions of an earlier one can be told apart.
+static unsigned int sequence;
+
+static HdmaTransfer txTransfer;
+static HdmaTransfer rxTransfer;
+static HdmaDescriptor txDescriptors[SPI_MAX_DESCRIPTORS];
+static HdmaDescriptor rxDescriptors[SPI_MAX_DESCRIPTORS];
+
+/// Sent when the transaction has no transmit buffer, and receive sink when
+/// it has no receive buffer.
+static unsigned char dummyTx = 0xFF;
+static unsigned char dummyRx;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+static void StartNext(void);
+
+//------------------------------------------------------------------------------
+/// Converts a delay in ns to a count of MCK cycles divided by unit, rounded
+/// up and limited to the 8-bit delay fields.
+//------------------------------------------------------------------------------
+static unsigned int DelayCycles(unsigned int ns, unsigned int mck,
+                                unsigned int unit)
+{
+    unsigned long long cycles = (unsigned long long) ns * mck;
+    unsigned long long divisor = 1000000000ull * unit;
+
+    cycles = (cycles + divisor - 1) / divisor;
+
+    return (cycles > 0xFF) ? 0xFF : (unsigned int) cycles;
+}
+
+//------------------------------------------------------------------------------
+/// Ends the running transaction, releases its chip select and starts the
+/// next one. HDMA interrupt context.
+//------------------------------------------------------------------------------
+static void Finish(unsigned char status)
+{
+    SpiTransaction *transaction = current;
+
+    AT91C_BASE_SPI0->SPI_CR = AT91C_SPI_LASTXFER;
+    current = 0;
+    StartNext();
+
+    transaction->status = status;
+    if (transaction->callback) {
+
+        transaction->callback(transaction->arg, status);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if an HDMA completion belongs to the running transaction. A
+/// transmit error and the end of the receive channel can be reported by the
+/// same interrupt: once the first has ended the transaction, the second is
+/// stale.
+//------------------------------------------------------------------------------
+static unsigned char IsCurrent(void *arg)
+{
+    return (current != 0) && ((unsigned int) arg == sequence);
+}
+
+//------------------------------------------------------------------------------
+/// End of the receive channel, which comes last: ends the transaction.
+//------------------------------------------------------------------------------
+static void RxDone(void *arg, unsigned char status)
+{
+    if (!IsCurrent(arg)) {
+
+        return;
+    }
+    if (status != HDMA_STATUS_DONE) {
+
+        HDMA_Cancel(&txTransfer);
+        Finish(SPI_STATUS_ERROR);
+    }
+    else {
+
+        Finish(SPI_STATUS_DONE);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// End of the transmit channel: only errors matter, the receive channel
+/// completes the transaction.
+//------------------------------------------------------------------------------
+static void TxDone(void *arg, unsigned char status)
+{
+    if (IsCurrent(arg) && (status != HDMA_STATUS_DONE)) {
+
+        HDMA_Cancel(&rxTransfer);
+        Finish(SPI_STATUS_ERROR);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Selects the device of a transaction and hands the transaction to the
+/// HDMA. The receive channel is submitted first so that it is running before
+/// the first byte is clocked in.
+//------------------------------------------------------------------------------
+static void Start(SpiTransaction *transaction)
+{
+    AT91PS_SPI spi = AT91C_BASE_SPI0;
+    unsigned int cs = transaction->device->cs;
+
+    current = transaction;
+    sequence++;
+    transaction->status = SPI_STATUS_BUSY;
+
+    spi->SPI_CSR[cs] = transaction->device->csr;
+    spi->SPI_MR = MR_MASTER | ((~(1 << cs) & 0xF) << MR_PCS_SHIFT);
+    spi->SPI_RDR;
+    spi->SPI_SR;
+
+    if (transaction->rx) {
+
+        HDMA_Prepare(&rxTransfer, HDMA_PER2MEM, HDMA_PER_SPI0_RX,
+                     HDMA_WIDTH_BYTE, rxDescriptors, SPI_MAX_DESCRIPTORS);
+        HDMA_AddBuffer(&rxTransfer, (void *) &spi->SPI_RDR,
+                       transaction->rx, transaction->size);
+    }
+    else {
+
+        HDMA_Prepare(&rxTransfer, HDMA_PER2MEM | HDMA_FIXED_MEMORY,
+                     HDMA_PER_SPI0_RX, HDMA_WIDTH_BYTE,
+                     rxDescriptors, SPI_MAX_DESCRIPTORS);
+        HDMA_AddBuffer(&rxTransfer, (void *) &spi->SPI_RDR,
+                       &dummyRx, transaction->size);
+    }
+
+    if (transaction->tx) {
+
+        HDMA_Prepare(&txTransfer, HDMA_MEM2PER, HDMA_PER_SPI0_TX,
+                     HDMA_WIDTH_BYTE, txDescriptors, SPI_MAX_DESCRIPTORS);
+        HDMA_AddBuffer(&txTransfer, transaction->tx,
+                       (void *) &spi->SPI_TDR, transaction->size);
+    }
+    else {
+
+        HDMA_Prepare(&txTransfer, HDMA_MEM2PER | HDMA_FIXED_MEMORY,
+                     HDMA_PER_SPI0_TX, HDMA_WIDTH_BYTE,
+                     txDescriptors, SPI_MAX_DESCRIPTORS);
+        HDMA_AddBuffer(&txTransfer, &dummyTx,
+                       (void *) &spi->SPI_TDR, transaction->size);
+    }
+
+    HDMA_Submit(&rxTransfer, SPI_DMA_PRIORITY, RxDone, (void *) sequence);
+    HDMA_Submit(&txTransfer, SPI_DMA_PRIORITY, TxDone, (void *) sequence);
+}
+
+//------------------------------------------------------------------------------
+/// Starts the first waiting transaction of the next chip select that has
+/// one, in turn. Critical section or HDMA interrupt context.
+//------------------------------------------------------------------------------
+static void StartNext(void)
+{
+    SpiTransaction *transaction;
+    unsigned int cs;
+    unsigned int i;
+
+    for (i = 1; i <= SPI_NUM_CS; i++) {
+
+        cs = (lastCs + i) % SPI_NUM_CS;
+        transaction = heads[cs];
+        if (transaction) {
+
+            heads[cs] = transaction->next;
+            if (heads[cs] == 0) {
+
+                tails[cs] = 0;
+            }
+            transaction->next = 0;
+            lastCs = cs;
+            Start(transaction);
+            return;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Configures SPI0 as a master. HDMA_Initialize() must have been called.
+//------------------------------------------------------------------------------
+void SPI_Initialize(void)
+{
+    AT91PS_SPI spi = AT91C_BASE_SPI0;
+
+    AT91C_BASE_PIOA->PIO_ABSR &= ~SPI_PINS;
+    AT91C_BASE_PIOA->PIO_PDR = SPI_PINS;
+    AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_SPI0;
+
+    spi->SPI_CR = AT91C_SPI_SPIDIS;
+    spi->SPI_CR = AT91C_SPI_SWRST;
+    spi->SPI_MR = MR_MASTER | AT91C_SPI_PCS;
+    spi->SPI_IDR = 0xFFFFFFFF;
+    spi->SPI_CR = AT91C_SPI_SPIEN;
+}
+
+//------------------------------------------------------------------------------
+/// Sets up a device and configures its chip select pin.
+/// Returns 1 on success; 0 if the chip select does not exist or the clock
+/// rate cannot be reached.
+/// \param device  Device to set up.
+/// \param cs  Chip select (0 to 3).
+/// \param mode  SPI mode (0 to 3): bit 1 is CPOL, bit 0 is CPHA.
+/// \param baudrate  Highest SPCK frequency supported by the device.
+/// \param csDelayNs  Delay from the chip select to the first SPCK edge.
+/// \param gapNs  Delay between two consecutive bytes.
+/// \param mck  Master clock frequency.
+//------------------------------------------------------------------------------
+unsigned char SPI_ConfigureDevice(SpiDevice *device,
+                                  unsigned char cs,
+                                  unsigned char mode,
+                                  unsigned int baudrate,
+                                  unsigned int csDelayNs,
+                                  unsigned int gapNs,
+                                  unsigned int mck)
+{
+    unsigned int scbr;
+    unsigned int csr;
+
+    if ((cs >= SPI_NUM_CS) || (mode > 3) || (baudrate == 0)) {
+
+        return 0;
+    }
+    scbr = (mck + baudrate - 1) / baudrate;
+    if (scbr > 0xFF) {
+
+        return 0;
+    }
+
+    // 8-bit transfers, chip select held until SPI_CR.LASTXFER
+    csr = AT91C_SPI_CSAAT | (scbr << CSR_SCBR_SHIFT)
+          | (DelayCycles(csDelayNs, mck, 1) << CSR_DLYBS_SHIFT)
+          | (DelayCycles(gapNs, mck, 32) << CSR_DLYBCT_SHIFT);
+    if (mode & 2) {
+
+        csr |= AT91C_SPI_CPOL;
+    }
+    if ((mode & 1) == 0) {
+
+        csr |= AT91C_SPI_NCPHA;
+    }
+
+    device->cs = cs;
+    device->csr = csr;
+
+    if (csPins[cs].peripheralB) {
+
+        AT91C_BASE_PIOA->PIO_ABSR |= csPins[cs].pin;
+    }
+    else {
+
+        AT91C_BASE_PIOA->PIO_ABSR &= ~csPins[cs].pin;
+    }
+    AT91C_BASE_PIOA->PIO_PDR = csPins[cs].pin;
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Queues a transaction behind those of the same chip select. Can be called
+/// from threads and from interrupt handlers of preemption level
+/// IRQ_CRITICAL_LEVEL or lower.
+/// Returns 1 on success; 0 if the size is out of range or the transaction is
+/// already queued or running.
+/// \param transaction  Transaction, owned by the driver until done.
+/// \param device  Device set up with SPI_ConfigureDevice().
+/// \param tx  Bytes to send, or 0 to send 0xFF.
+/// \param rx  Buffer for the received bytes, or 0 to discard them.
+/// \param size  Number of bytes.
+/// \param callback  Called at the end of the transaction, or 0.
+/// \param arg  Argument of the callback.
+//------------------------------------------------------------------------------
+unsigned char SPI_Submit(SpiTransaction *transaction,
+                         const SpiDevice *device,
+                         const void *tx,
+                         void *rx,
+                         unsigned int size,
+                         SpiCallback callback,
+                         void *arg)
+{
+    unsigned int cs = device->cs;
+    IrqState state;
+
+    if ((size == 0) || (size > SPI_MAX_DESCRIPTORS * HDMA_MAX_BTSIZE)
+        || (transaction->status == SPI_STATUS_QUEUED)
+        || (transaction->status == SPI_STATUS_BUSY)) {
+
+        return 0;
+    }
+    transaction->device = device;
+    transaction->tx = tx;
+    transaction->rx = rx;
+    transaction->size = size;
+    transaction->callback = callback;
+    transaction->arg = arg;
+    transaction->next = 0;
+    transaction->status = SPI_STATUS_QUEUED;
+
+    state = IRQ_EnterCritical();
+
+    if (tails[cs]) {
+
+        tails[cs]->next = transaction;
+    }
+    else {
+
+        heads[cs] = transaction;
+    }
+    tails[cs] = transaction;
+
+    if (current == 0) {
+
+        StartNext();
+    }
+
+    IRQ_ExitCritical(state);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the status of a transaction (SPI_STATUS_xxx).
+//------------------------------------------------------------------------------
+unsigned char SPI_GetStatus(const SpiTransaction *transaction)
+{
+    return transaction->status;
+}
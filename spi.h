@@ -0,0 +1,109 @@
+/* ----------------------------------------------------------------------------
+ *         SPI master
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** SPI0 master with one transaction queue per chip select. Each device
+** carries its own SPI_CSR settings (clock rate, mode, delays), loaded before
+** each of its transactions. A transaction keeps its chip select asserted
+** from the first to the last byte and is moved by two HDMA channels, one
+** feeding SPI_TDR and one draining SPI_RDR, so the CPU is only involved at
+** the start and at the end. The queues are served in turn, one transaction
+** at a time, and the next transaction is started from the completion of
+** the previous one.
+**
+** NPCS3 (PA19) shares its pin with RXD0 of USART0.
+*/
+
+#ifndef SPI_H
+#define SPI_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "hdma.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Number of chip selects.
+#define SPI_NUM_CS              4
+
+/// HDMA queue priority of the SPI transfers.
+#ifndef SPI_DMA_PRIORITY
+#define SPI_DMA_PRIORITY        2
+#endif
+
+/// Descriptors per direction; limits a transaction to
+/// SPI_MAX_DESCRIPTORS * HDMA_MAX_BTSIZE bytes.
+#ifndef SPI_MAX_DESCRIPTORS
+#define SPI_MAX_DESCRIPTORS     2
+#endif
+
+/// Transaction status.
+#define SPI_STATUS_IDLE         0
+#define SPI_STATUS_QUEUED       1
+#define SPI_STATUS_BUSY         2
+#define SPI_STATUS_DONE         3
+#define SPI_STATUS_ERROR        4
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Device on a chip select. Set up with SPI_ConfigureDevice().
+typedef struct {
+
+    unsigned char cs;
+    /// SPI_CSR value.
+    unsigned int csr;
+
+} SpiDevice;
+
+/// Called from the HDMA interrupt at the end of a transaction, with its
+/// status (SPI_STATUS_DONE or SPI_STATUS_ERROR).
+typedef void (*SpiCallback)(void *arg, unsigned char status);
+
+/// Transaction. Owned by the driver from SPI_Submit() until the callback.
+typedef struct _SpiTransaction {
+
+    const SpiDevice *device;
+    const unsigned char *tx;
+    unsigned char *rx;
+    unsigned int size;
+    SpiCallback callback;
+    void *arg;
+    volatile unsigned char status;
+    /// Next transaction of the same chip select.
+    struct _SpiTransaction *next;
+
+} SpiTransaction;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void SPI_Initialize(void);
+
+extern unsigned char SPI_ConfigureDevice(SpiDevice *device,
+                                         unsigned char cs,
+                                         unsigned char mode,
+                                         unsigned int baudrate,
+                                         unsigned int csDelayNs,
+                                         unsigned int gapNs,
+                                         unsigned int mck);
+
+extern unsigned char SPI_Submit(SpiTransaction *transaction,
+                                const SpiDevice *device,
+                                const void *tx,
+                                void *rx,
+                                unsigned int size,
+                                SpiCallback callback,
+                                void *arg);
+
+extern unsigned char SPI_GetStatus(const SpiTransaction *transaction);
+
+#endif //#ifndef SPI_H
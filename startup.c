@@ -0,0 +1,254 @@
+/* ----------------------------------------------------------------------------
+ *         Startup data initialization
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "startup.h"
+#include "dbgu.h"
+#include "dwt.h"
+#include "hdma.h"
+#include "AT91SAM3U4.h"
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Section initialized from a copy stored in flash.
+typedef struct {
+
+    unsigned char *dst;
+    const unsigned char *src;
+    unsigned char *end;
+
+} StartupCopyEntry;
+
+/// Section cleared to zero.
+typedef struct {
+
+    unsigned char *dst;
+    unsigned char *end;
+
+} StartupZeroEntry;
+
+/// Section copy in progress on HDMA channel 0, in transfers of at most
+/// HDMA_MAX_BTSIZE words.
+typedef struct {
+
+    unsigned char *dst;
+    const unsigned char *src;
+    unsigned int words;
+
+} StartupDmaCopy;
+
+//------------------------------------------------------------------------------
+//         Section tables
+//------------------------------------------------------------------------------
+
+// The linker fills in the bounds of each section; the init images (_init
+// suffix) are generated because of "initialize manually" in the .icf file.
+#pragma section = ".data"
+#pragma section = ".data_init"
+#pragma section = ".textrw"
+#pragma section = ".textrw_init"
+#pragma section = ".bss"
+
+static const StartupCopyEntry copyTable[] = {
+
+    {__section_begin(".data"), __section_begin(".data_init"), __section_end(".data")},
+    {__section_begin(".textrw"), __section_begin(".textrw_init"), __section_end(".textrw")}
+};
+
+static const StartupZeroEntry zeroTable[] = {
+
+    {__section_begin(".bss"), __section_end(".bss")}
+};
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Boot milestones. Not initialized since it is written before and during
+/// the section initialization.
+static __no_init StartupTimes startupTimes;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+#if STARTUP_HDMA_THRESHOLD
+//------------------------------------------------------------------------------
+/// Starts the next transfer of a copy on HDMA channel 0.
+//------------------------------------------------------------------------------
+static void StartDmaTransfer(StartupDmaCopy *copy)
+{
+    AT91PS_HDMA_CH channel = AT91C_BASE_HDMA_CH_0;
+    unsigned int words = copy->words;
+
+    if (words > HDMA_MAX_BTSIZE) {
+
+        words = HDMA_MAX_BTSIZE;
+    }
+
+    channel->HDMA_SADDR = (unsigned int) copy->src;
+    channel->HDMA_DADDR = (unsigned int) copy->dst;
+    channel->HDMA_DSCR = 0;
+    channel->HDMA_CTRLA = words
+                          | AT91C_HDMA_SCSIZE_4 | AT91C_HDMA_DCSIZE_4
+                          | AT91C_HDMA_SRC_WIDTH_WORD | AT91C_HDMA_DST_WIDTH_WORD;
+    channel->HDMA_CTRLB = AT91C_HDMA_SRC_DSCR_FETCH_DISABLE
+                          | AT91C_HDMA_DST_DSCR_FETCH_DISABLE
+                          | AT91C_HDMA_FC_MEM2MEM
+                          | AT91C_HDMA_SRC_ADDRESS_MODE_INCR
+                          | AT91C_HDMA_DST_ADDRESS_MODE_INCR;
+    channel->HDMA_CFG = AT91C_HDMA_SOD_ENABLE | AT91C_HDMA_FIFOCFG_LARGESTBURST;
+    AT91C_BASE_HDMA->HDMA_CHER = AT91C_HDMA_ENA0;
+
+    copy->src += words << 2;
+    copy->dst += words << 2;
+    copy->words -= words;
+}
+
+//------------------------------------------------------------------------------
+/// Starts a word-wise memory-to-memory copy of size / 4 words on HDMA
+/// channel 0 and copies the remaining bytes with the CPU.
+//------------------------------------------------------------------------------
+static void StartDmaCopy(StartupDmaCopy *copy,
+                         const StartupCopyEntry *entry,
+                         unsigned int size)
+{
+    unsigned int words = size >> 2;
+
+    AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_HDMA;
+    AT91C_BASE_HDMA->HDMA_EN = AT91C_HDMA_ENABLE_ENABLE;
+
+    copy->dst = entry->dst;
+    copy->src = entry->src;
+    copy->words = words;
+    StartDmaTransfer(copy);
+
+    STARTUP_CopyBlock(entry->dst + (words << 2), entry->src + (words << 2), size & 3);
+}
+
+//------------------------------------------------------------------------------
+/// Runs the copy started by StartDmaCopy() to its end and releases the HDMA.
+//------------------------------------------------------------------------------
+static void WaitDmaCopy(StartupDmaCopy *copy)
+{
+    while (1) {
+
+        while (AT91C_BASE_HDMA->HDMA_CHSR & AT91C_HDMA_ENA0);
+        if (copy->words == 0) {
+
+            break;
+        }
+        StartDmaTransfer(copy);
+    }
+
+    AT91C_BASE_HDMA->HDMA_EN = AT91C_HDMA_ENABLE_DISABLE;
+    AT91C_BASE_PMC->PMC_PCDR = 1 << AT91C_ID_HDMA;
+}
+#endif
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Copies every section of copyTable from flash and clears every section of
+/// zeroTable. With STARTUP_HDMA_THRESHOLD set, the first section large
+/// enough is copied by the HDMA while the CPU handles the others.
+//------------------------------------------------------------------------------
+void STARTUP_InitSections(void)
+{
+    unsigned int copied = 0;
+    unsigned int zeroed = 0;
+    unsigned int size;
+    unsigned int i;
+#if STARTUP_HDMA_THRESHOLD
+    StartupDmaCopy dmaCopy;
+    unsigned char dmaBusy = 0;
+#endif
+
+    for (i = 0; i < sizeof(copyTable) / sizeof(copyTable[0]); i++) {
+
+        size = copyTable[i].end - copyTable[i].dst;
+#if STARTUP_HDMA_THRESHOLD
+        if (!dmaBusy && (size >= STARTUP_HDMA_THRESHOLD)) {
+
+            StartDmaCopy(&dmaCopy, &copyTable[i], size);
+            dmaBusy = 1;
+        }
+        else
+#endif
+        {
+            STARTUP_CopyBlock(copyTable[i].dst, copyTable[i].src, size);
+        }
+        copied += size;
+    }
+
+    for (i = 0; i < sizeof(zeroTable) / sizeof(zeroTable[0]); i++) {
+
+        size = zeroTable[i].end - zeroTable[i].dst;
+        STARTUP_ZeroBlock(zeroTable[i].dst, size);
+        zeroed += size;
+    }
+
+#if STARTUP_HDMA_THRESHOLD
+    if (dmaBusy) {
+
+        WaitDmaCopy(&dmaCopy);
+    }
+#endif
+
+    startupTimes.copied = copied;
+    startupTimes.zeroed = zeroed;
+    startupTimes.sections = DWT_GetCycles();
+}
+
+//------------------------------------------------------------------------------
+/// Records the end of the clock bring-up.
+//------------------------------------------------------------------------------
+void STARTUP_MarkClock(void)
+{
+    startupTimes.clock = DWT_GetCycles();
+}
+
+//------------------------------------------------------------------------------
+/// Records the entry into main(). Call it first thing in main().
+//------------------------------------------------------------------------------
+void STARTUP_MarkMain(void)
+{
+    startupTimes.main = DWT_GetCycles();
+}
+
+//------------------------------------------------------------------------------
+/// Returns the boot milestones of the current boot. Cycles up to the clock
+/// milestone elapse at the RC frequency, the later ones at CLOCK_GetMck().
+//------------------------------------------------------------------------------
+const StartupTimes * STARTUP_GetTimes(void)
+{
+    return &startupTimes;
+}
+
+//------------------------------------------------------------------------------
+/// Prints the boot milestones on the DBGU, which must be configured (polled
+/// output).
+//------------------------------------------------------------------------------
+void STARTUP_Report(void)
+{
+    DBGU_PutString("-I- Boot cycles: clock ");
+    DBGU_PutHex(startupTimes.clock);
+    DBGU_PutString(", sections ");
+    DBGU_PutHex(startupTimes.sections);
+    DBGU_PutString(", main ");
+    DBGU_PutHex(startupTimes.main);
+    DBGU_PutString("; bytes copied ");
+    DBGU_PutHex(startupTimes.copied);
+    DBGU_PutString(", zeroed ");
+    DBGU_PutHex(startupTimes.zeroed);
+    DBGU_PutString("\n");
+}
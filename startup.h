@@ -0,0 +1,63 @@
+/* ----------------------------------------------------------------------------
+ *         Startup data initialization
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Replaces the IAR runtime data initialization. The sections listed in the
+** copy and zero tables are set up from __low_level_init(), which then returns
+** 0 so that the runtime does not initialize them a second time.
+*/
+
+#ifndef STARTUP_H
+#define STARTUP_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Sections at least this large (in bytes) are copied by HDMA channel 0 while
+/// the CPU clears the zero-initialized sections. 0 disables the HDMA path.
+#ifndef STARTUP_HDMA_THRESHOLD
+#define STARTUP_HDMA_THRESHOLD  0
+#endif
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Boot milestones, in core cycles counted from the start of
+/// __low_level_init().
+typedef struct {
+
+    /// Clocks running at the boot operating point.
+    unsigned int clock;
+    /// Data sections initialized.
+    unsigned int sections;
+    /// main() entered.
+    unsigned int main;
+    /// Number of bytes copied and zeroed by STARTUP_InitSections().
+    unsigned int copied;
+    unsigned int zeroed;
+
+} StartupTimes;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void STARTUP_CopyBlock(void *dst, const void *src, unsigned int size);
+
+extern void STARTUP_ZeroBlock(void *dst, unsigned int size);
+
+extern void STARTUP_InitSections(void);
+
+extern void STARTUP_MarkClock(void);
+
+extern void STARTUP_MarkMain(void);
+
+extern const StartupTimes * STARTUP_GetTimes(void);
+
+extern void STARTUP_Report(void);
+
+#endif //#ifndef STARTUP_H
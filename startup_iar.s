@@ -0,0 +1,84 @@
+;------------------------------------------------------------------------------
+;         Block copy / fill routines for the startup init stage
+;------------------------------------------------------------------------------
+;
+; Both routines move 32 bytes per iteration with one LDM/STM pair, then finish
+; the tail with word and byte accesses. They only use the stack, so they are
+; safe to call before the data sections are initialized.
+;
+; Destination and source must be word aligned.
+;------------------------------------------------------------------------------
+
+        MODULE  ?startup_iar
+
+        SECTION .text:CODE:NOROOT(2)
+        THUMB
+
+;------------------------------------------------------------------------------
+; void STARTUP_CopyBlock(void *dst, const void *src, unsigned int size)
+;------------------------------------------------------------------------------
+        PUBLIC  STARTUP_CopyBlock
+STARTUP_CopyBlock:
+        PUSH    {R4-R9}
+        SUBS    R2, R2, #32
+        BCC     copy_tail
+copy_burst:
+        LDM     R1!, {R3-R9, R12}
+        STM     R0!, {R3-R9, R12}
+        SUBS    R2, R2, #32
+        BCS     copy_burst
+copy_tail:
+        ADDS    R2, R2, #32
+copy_word:
+        SUBS    R2, R2, #4
+        ITT     CS
+        LDRCS   R3, [R1], #4
+        STRCS   R3, [R0], #4
+        BCS     copy_word
+        ADDS    R2, R2, #4
+copy_byte:
+        SUBS    R2, R2, #1
+        ITT     CS
+        LDRBCS  R3, [R1], #1
+        STRBCS  R3, [R0], #1
+        BCS     copy_byte
+        POP     {R4-R9}
+        BX      LR
+
+;------------------------------------------------------------------------------
+; void STARTUP_ZeroBlock(void *dst, unsigned int size)
+;------------------------------------------------------------------------------
+        PUBLIC  STARTUP_ZeroBlock
+STARTUP_ZeroBlock:
+        PUSH    {R4-R9}
+        MOVS    R2, #0
+        MOVS    R3, #0
+        MOVS    R4, #0
+        MOVS    R5, #0
+        MOVS    R6, #0
+        MOVS    R7, #0
+        MOV     R8, R2
+        MOV     R9, R2
+        SUBS    R1, R1, #32
+        BCC     zero_tail
+zero_burst:
+        STM     R0!, {R2-R9}
+        SUBS    R1, R1, #32
+        BCS     zero_burst
+zero_tail:
+        ADDS    R1, R1, #32
+zero_word:
+        SUBS    R1, R1, #4
+        IT      CS
+        STRCS   R2, [R0], #4
+        BCS     zero_word
+        ADDS    R1, R1, #4
+zero_byte:
+        SUBS    R1, R1, #1
+        IT      CS
+        STRBCS  R2, [R0], #1
+        BCS     zero_byte
+        POP     {R4-R9}
+        BX      LR
+
+        END
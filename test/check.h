@@ -0,0 +1,55 @@
+/* ----------------------------------------------------------------------------
+ *         Host test checks
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** A failed CHECK() prints its location and condition and is counted; each
+** test program returns CHECK_Result() from main(), so that make stops on the
+** first program with a failure.
+*/
+
+#ifndef CHECK_H
+#define CHECK_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include <stdio.h>
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Counts and reports a failed condition.
+#define CHECK(condition) \
+    do { \
+        checkCount++; \
+        if (!(condition)) { \
+            checkFailures++; \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        } \
+    } while (0)
+
+//------------------------------------------------------------------------------
+//         Exported variables
+//------------------------------------------------------------------------------
+
+static unsigned int checkCount;
+static unsigned int checkFailures;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Prints the summary of a test program and returns its exit code.
+//------------------------------------------------------------------------------
+static inline int CHECK_Result(const char *name)
+{
+    printf("%s: %u checks, %u failed\n", name, checkCount, checkFailures);
+    return checkFailures != 0;
+}
+
+#endif //#ifndef CHECK_H
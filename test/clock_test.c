@@ -0,0 +1,551 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of clock.c
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Runs CLOCK_Configure() between every pair of operating points over a model
+** of the PMC and of the flash wait states of EFC0. The crystal, PLLA and the
+** master clock become ready a few PMC_SR reads after they are started, and
+** the model reports the orders the datasheet forbids: the crystal selected
+** before MOSCXTS was seen, MCK moved to PLLA before LOCKA, PMC_MCKR written
+** again before MCKRDY or with both fields at once, a PLLA out of its range,
+** an oscillator stopped under MAINCK, and MCK above what the wait states
+** allow at any moment. Each switch must then leave the registers of its
+** operating point.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "mmio.h"
+#include "clock.h"
+#include "AT91SAM3U4.h"
+
+#include <stddef.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define PMC_REG(name)           offsetof(AT91S_PMC, name)
+
+/// PMC_SR reads before a clock started or switched is ready.
+#define CRYSTAL_READS           3
+#define SELECT_READS            2
+#define LOCK_READS              3
+#define MCK_READS               2
+
+/// Highest MCK for each flash wait state.
+#define HZ_PER_WAIT_STATE       24000000
+
+/// Reset values.
+#define MOR_RESET               AT91C_CKGR_MOSCRCEN
+#define PLLAR_RESET             (AT91C_CKGR_SRC | (0x3F << 8))
+#define MCKR_RESET              AT91C_PMC_CSS_MAIN_CLK
+
+/// Events of the trace, in the order of clock.c.
+#define EVENT_FWS_RAISED        0
+#define EVENT_CRYSTAL_SEEN      1
+#define EVENT_CRYSTAL_SELECTED  2
+#define EVENT_PLLA_STARTED      3
+#define EVENT_LOCK_SEEN         4
+#define EVENT_PLLA_SELECTED     5
+#define EVENT_FWS_LOWERED       6
+#define NUM_EVENTS              7
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// A clock that becomes ready some PMC_SR reads after it starts; seen once
+/// a read has returned it ready.
+typedef struct {
+
+    unsigned int reads;
+    unsigned char seen;
+
+} Readiness;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Registers as written.
+static unsigned int mor;
+static unsigned int pllar;
+static unsigned int mckr;
+static unsigned int fmr;
+
+static Readiness crystal;
+static Readiness selection;
+static Readiness lock;
+static Readiness masterClock;
+
+/// Order of the events of the last switch (1 for the first); 0 if it did not
+/// happen.
+static unsigned int events[NUM_EVENTS];
+static unsigned int numEvents;
+
+static unsigned int violations;
+
+/// Output of CLOCK_Report().
+static char report[128];
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// dbgu.c
+//------------------------------------------------------------------------------
+void DBGU_PutString(const char *string)
+{
+    strncat(report, string, sizeof(report) - strlen(report) - 1);
+}
+
+void DBGU_PutHex(unsigned int value)
+{
+    char digits[9];
+
+    snprintf(digits, sizeof(digits), "%08X", value);
+    DBGU_PutString(digits);
+}
+
+//------------------------------------------------------------------------------
+/// Reports a forbidden order.
+//------------------------------------------------------------------------------
+static void Violation(const char *what)
+{
+    violations++;
+    printf("clock_test: %s\n", what);
+}
+
+//------------------------------------------------------------------------------
+/// Records an event of the switch.
+//------------------------------------------------------------------------------
+static void Event(unsigned int event)
+{
+    events[event] = ++numEvents;
+}
+
+//------------------------------------------------------------------------------
+/// Starts a clock: ready after the given number of reads.
+//------------------------------------------------------------------------------
+static void Start(Readiness *readiness, unsigned int reads)
+{
+    readiness->reads = reads;
+    readiness->seen = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if a clock is ready, counting the read.
+//------------------------------------------------------------------------------
+static unsigned char IsReady(Readiness *readiness)
+{
+    if (readiness->reads > 0) {
+
+        readiness->reads--;
+        return 0;
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns MAINCK.
+//------------------------------------------------------------------------------
+static unsigned int MainClock(void)
+{
+    return (mor & AT91C_CKGR_MOSCSEL) ? CLOCK_MAINCK_XTAL : CLOCK_MAINCK_RC;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the PLLA output, or 0 if it is stopped.
+//------------------------------------------------------------------------------
+static unsigned int PllaClock(void)
+{
+    unsigned int mula = (pllar & AT91C_CKGR_MULA) >> 16;
+    unsigned int diva = pllar & AT91C_CKGR_DIVA;
+
+    if ((mula == 0) || (diva == 0)) {
+
+        return 0;
+    }
+    return MainClock() / diva * (mula + 1);
+}
+
+//------------------------------------------------------------------------------
+/// Returns MCK.
+//------------------------------------------------------------------------------
+static unsigned int MasterClock(void)
+{
+    unsigned int clock;
+
+    if ((mckr & AT91C_PMC_CSS) == AT91C_PMC_CSS_PLLA_CLK) {
+
+        clock = PllaClock();
+    }
+    else {
+
+        clock = MainClock();
+    }
+    return clock >> ((mckr & AT91C_PMC_PRES) >> 4);
+}
+
+//------------------------------------------------------------------------------
+/// Checks that the flash wait states cover MCK.
+//------------------------------------------------------------------------------
+static void CheckWaitStates(void)
+{
+    unsigned int fws = (fmr & AT91C_EFC_FWS) >> 8;
+
+    if (MasterClock() > (fws + 1) * HZ_PER_WAIT_STATE) {
+
+        Violation("MCK above the flash wait states");
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Reads of the PMC.
+//------------------------------------------------------------------------------
+static unsigned int ReadPmc(void *device, unsigned int offset, unsigned int size)
+{
+    unsigned int status = 0;
+
+    switch (offset) {
+
+    case PMC_REG(PMC_MOR):
+        return mor;
+
+    case PMC_REG(PMC_PLLAR):
+        return pllar;
+
+    case PMC_REG(PMC_MCKR):
+        return mckr;
+
+    case PMC_REG(PMC_SR):
+        if ((mor & AT91C_CKGR_MOSCXTEN) && IsReady(&crystal)) {
+
+            status |= AT91C_PMC_MOSCXTS;
+            if (!crystal.seen) {
+
+                crystal.seen = 1;
+                Event(EVENT_CRYSTAL_SEEN);
+            }
+        }
+        if (IsReady(&selection)) {
+
+            status |= AT91C_PMC_MOSCSELS;
+        }
+        if (PllaClock() && IsReady(&lock)) {
+
+            status |= AT91C_PMC_LOCKA;
+            if (!lock.seen) {
+
+                lock.seen = 1;
+                Event(EVENT_LOCK_SEEN);
+            }
+        }
+        if (IsReady(&masterClock)) {
+
+            status |= AT91C_PMC_MCKRDY;
+            masterClock.seen = 1;
+        }
+        return status;
+
+    default:
+        return 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Writes of CKGR_MOR.
+//------------------------------------------------------------------------------
+static void WriteMor(unsigned int value)
+{
+    unsigned int previous = mor;
+
+    if ((value & (0xFF << 16)) != (0x37 << 16)) {
+
+        Violation("CKGR_MOR written without its key");
+        return;
+    }
+    mor = value & ~(0xFF << 16);
+
+    if ((mor & AT91C_CKGR_MOSCXTEN) && !(previous & AT91C_CKGR_MOSCXTEN)) {
+
+        Start(&crystal, CRYSTAL_READS);
+    }
+    if ((mor & AT91C_CKGR_MOSCSEL) != (previous & AT91C_CKGR_MOSCSEL)) {
+
+        if ((mor & AT91C_CKGR_MOSCSEL) && !crystal.seen) {
+
+            Violation("crystal selected before MOSCXTS");
+        }
+        if (mor & AT91C_CKGR_MOSCSEL) {
+
+            Event(EVENT_CRYSTAL_SELECTED);
+        }
+        Start(&selection, SELECT_READS);
+    }
+    if ((mor & AT91C_CKGR_MOSCSEL) ? !(mor & AT91C_CKGR_MOSCXTEN)
+                                   : !(mor & AT91C_CKGR_MOSCRCEN)) {
+
+        Violation("MAINCK oscillator stopped");
+    }
+    if (!(mor & AT91C_CKGR_MOSCXTEN)) {
+
+        crystal.seen = 0;
+    }
+    CheckWaitStates();
+}
+
+//------------------------------------------------------------------------------
+/// Writes of CKGR_PLLAR.
+//------------------------------------------------------------------------------
+static void WritePllar(unsigned int value)
+{
+    unsigned int input;
+
+    pllar = value;
+    if (!(pllar & AT91C_CKGR_SRC)) {
+
+        Violation("CKGR_PLLAR written without bit 29");
+    }
+    if (PllaClock() == 0) {
+
+        if ((mckr & AT91C_PMC_CSS) == AT91C_PMC_CSS_PLLA_CLK) {
+
+            Violation("PLLA stopped under MCK");
+        }
+        return;
+    }
+
+    input = MainClock() / (pllar & AT91C_CKGR_DIVA);
+    if ((input < 8000000) || (input > 16000000)
+        || (PllaClock() < 96000000) || (PllaClock() > 192000000)) {
+
+        Violation("PLLA out of range");
+    }
+    if ((mckr & AT91C_PMC_CSS) == AT91C_PMC_CSS_PLLA_CLK) {
+
+        Violation("PLLA reprogrammed under MCK");
+    }
+    Event(EVENT_PLLA_STARTED);
+    Start(&lock, LOCK_READS);
+}
+
+//------------------------------------------------------------------------------
+/// Writes of PMC_MCKR.
+//------------------------------------------------------------------------------
+static void WriteMckr(unsigned int value)
+{
+    unsigned int changed = (value ^ mckr) & (AT91C_PMC_CSS | AT91C_PMC_PRES);
+
+    if (!masterClock.seen) {
+
+        Violation("PMC_MCKR written before MCKRDY");
+    }
+    if ((changed & AT91C_PMC_CSS) && (changed & AT91C_PMC_PRES)) {
+
+        Violation("PMC_MCKR source and prescaler changed at once");
+    }
+    if ((changed & AT91C_PMC_CSS)
+        && ((value & AT91C_PMC_CSS) == AT91C_PMC_CSS_PLLA_CLK)) {
+
+        if (!lock.seen) {
+
+            Violation("MCK moved to PLLA before LOCKA");
+        }
+        Event(EVENT_PLLA_SELECTED);
+    }
+    mckr = value;
+    Start(&masterClock, MCK_READS);
+    CheckWaitStates();
+}
+
+//------------------------------------------------------------------------------
+/// Writes of the PMC.
+//------------------------------------------------------------------------------
+static void WritePmc(void *device,
+                     unsigned int offset,
+                     unsigned int value,
+                     unsigned int size)
+{
+    switch (offset) {
+
+    case PMC_REG(PMC_MOR):
+        WriteMor(value);
+        break;
+
+    case PMC_REG(PMC_PLLAR):
+        WritePllar(value);
+        break;
+
+    case PMC_REG(PMC_MCKR):
+        WriteMckr(value);
+        break;
+
+    default:
+        Violation("unexpected PMC register written");
+        break;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Reads of EFC0.
+//------------------------------------------------------------------------------
+static unsigned int ReadEfc(void *device, unsigned int offset, unsigned int size)
+{
+    return (offset == offsetof(AT91S_EFC, EFC_FMR)) ? fmr : 0;
+}
+
+//------------------------------------------------------------------------------
+/// Writes of EFC0: the wait states.
+//------------------------------------------------------------------------------
+static void WriteEfc(void *device,
+                     unsigned int offset,
+                     unsigned int value,
+                     unsigned int size)
+{
+    if (offset != offsetof(AT91S_EFC, EFC_FMR)) {
+
+        Violation("unexpected EFC register written");
+        return;
+    }
+    if ((value & AT91C_EFC_FWS) > (fmr & AT91C_EFC_FWS)) {
+
+        Event(EVENT_FWS_RAISED);
+    }
+    else if ((value & AT91C_EFC_FWS) < (fmr & AT91C_EFC_FWS)) {
+
+        Event(EVENT_FWS_LOWERED);
+    }
+    fmr = value;
+    CheckWaitStates();
+}
+
+//------------------------------------------------------------------------------
+/// Back to the reset configuration: 4 MHz RC, PLLA and crystal stopped.
+//------------------------------------------------------------------------------
+static void Reset(void)
+{
+    mor = MOR_RESET;
+    pllar = PLLAR_RESET;
+    mckr = MCKR_RESET;
+    fmr = 0;
+    memset(&crystal, 0, sizeof(crystal));
+    memset(&selection, 0, sizeof(selection));
+    memset(&lock, 0, sizeof(lock));
+    memset(&masterClock, 0, sizeof(masterClock));
+    masterClock.seen = 1;
+}
+
+//------------------------------------------------------------------------------
+/// Switches to an operating point; returns 1 if clock.c succeeded without a
+/// violation and left the registers of the point.
+//------------------------------------------------------------------------------
+static unsigned char Switch(unsigned int index)
+{
+    const ClockOperatingPoint *op = &clockOperatingPoints[index];
+    unsigned int before = violations;
+
+    memset(events, 0, sizeof(events));
+    numEvents = 0;
+    if (!CLOCK_Configure(index)) {
+
+        return 0;
+    }
+    return (violations == before)
+           && ((mckr & AT91C_PMC_CSS) == op->css)
+           && ((mckr & AT91C_PMC_PRES) == op->pres)
+           && ((mor & AT91C_CKGR_MOSCSEL) == op->moscsel)
+           && (((mor & AT91C_CKGR_MOSCXTEN) != 0) == (op->moscsel != 0))
+           && ((mor & AT91C_CKGR_MOSCRCEN) != 0)
+           && (((pllar & AT91C_CKGR_MULA) >> 16) == op->mula)
+           && ((op->mula == 0) || ((pllar & AT91C_CKGR_DIVA) == op->diva))
+           && ((fmr & AT91C_EFC_FWS) == op->fws)
+           && (MasterClock() == op->mck)
+           && (CLOCK_GetMck() == op->mck);
+}
+
+//------------------------------------------------------------------------------
+/// From reset to 96 MHz, as at boot: the order of the steps.
+//------------------------------------------------------------------------------
+static void TestBoot(void)
+{
+    Reset();
+    CHECK(CLOCK_GetMck() == CLOCK_MAINCK_RC);
+    CHECK(Switch(CLOCK_OP_96MHZ));
+
+    // Wait states first, then the crystal, PLLA, and MCK
+    CHECK(events[EVENT_FWS_RAISED] == 1);
+    CHECK(events[EVENT_CRYSTAL_SEEN] > events[EVENT_FWS_RAISED]);
+    CHECK(events[EVENT_CRYSTAL_SELECTED] > events[EVENT_CRYSTAL_SEEN]);
+    CHECK(events[EVENT_PLLA_STARTED] > events[EVENT_CRYSTAL_SELECTED]);
+    CHECK(events[EVENT_LOCK_SEEN] > events[EVENT_PLLA_STARTED]);
+    CHECK(events[EVENT_PLLA_SELECTED] > events[EVENT_LOCK_SEEN]);
+    CHECK(events[EVENT_FWS_LOWERED] == 0);
+
+    CHECK(mckr == (AT91C_PMC_CSS_PLLA_CLK | AT91C_PMC_PRES_CLK));
+    CHECK(pllar == (AT91C_CKGR_SRC | (7 << 16) | (0x3F << 8) | 1));
+    CHECK(mor == (AT91C_CKGR_MOSCRCEN | AT91C_CKGR_MOSCXTEN
+                  | AT91C_CKGR_MOSCSEL | (0x8 << 8)));
+    CHECK((fmr & AT91C_EFC_FWS) == AT91C_EFC_FWS_3WS);
+    CHECK(CLOCK_GetSwitchCycles() > 0);
+
+    report[0] = 0;
+    CLOCK_Report();
+    CHECK(strncmp(report, "-I- MCK 05B8D800 Hz, switched in ", 33) == 0);
+    CHECK(strcmp(report + 41, " cycles\n") == 0);
+
+    // Back down: the wait states only once MCK is slow
+    CHECK(Switch(CLOCK_OP_4MHZ_RC));
+    CHECK(events[EVENT_FWS_LOWERED] > 0);
+    CHECK(events[EVENT_FWS_RAISED] == 0);
+    CHECK(pllar == AT91C_CKGR_SRC);
+    CHECK(mor == AT91C_CKGR_MOSCRCEN);
+}
+
+//------------------------------------------------------------------------------
+/// Every operating point from every other one.
+//------------------------------------------------------------------------------
+static void TestTransitions(void)
+{
+    unsigned int from;
+    unsigned int to;
+
+    for (from = 0; from < CLOCK_NUM_OPERATING_POINTS; from++) {
+
+        for (to = 0; to < CLOCK_NUM_OPERATING_POINTS; to++) {
+
+            Reset();
+            CHECK(Switch(from));
+            CHECK(Switch(to));
+            CHECK(Switch(to));
+        }
+    }
+    CHECK(!CLOCK_Configure(CLOCK_NUM_OPERATING_POINTS));
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    HOST_Initialize();
+    MMIO_Map((unsigned int) (unsigned long) AT91C_BASE_PMC, sizeof(AT91S_PMC),
+             ReadPmc, WritePmc, 0);
+    MMIO_Map((unsigned int) (unsigned long) AT91C_BASE_EFC0, sizeof(AT91S_EFC),
+             ReadEfc, WriteEfc, 0);
+
+    TestBoot();
+    TestTransitions();
+    CHECK(violations == 0);
+
+    return CHECK_Result("clock_test");
+}
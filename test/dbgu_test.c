@@ -0,0 +1,436 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of dbgu.c
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Runs the transmit ring of the DBGU over a model of its PDC channel: the
+** current and next buffers, the reload of the one into the other, and
+** ENDTX, latched when the counter reaches 0 until a count is written, which
+** raises the interrupt while enabled. The bytes the PDC sends
+** must be those committed, in order, whatever the reservations: at the wrap
+** point, exactly filling the ring, or refused for lack of room. In the race
+** tests the PDC also moves on at every read of its registers by the driver,
+** so that commits and handovers see buffers complete between any two of
+** their accesses.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "mmio.h"
+#include "dbgu.h"
+#include "exceptions.h"
+#include "AT91SAM3U4.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define DBGU_REG(name)          offsetof(AT91S_DBGU, name)
+
+/// Bytes the PDC sends in the stress tests.
+#define MAX_SENT                200000
+
+/// Interrupts taken in a row before the handler is considered stuck.
+#define MAX_NESTED              8
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Transmit PDC channel and interrupt mask.
+typedef struct {
+
+    unsigned int tpr;
+    unsigned int tcr;
+    unsigned int tnpr;
+    unsigned int tncr;
+    unsigned int ptsr;
+    unsigned int imr;
+    /// The counter reached 0 since a non-zero count was last written.
+    unsigned char endtx;
+
+    /// Largest number of bytes sent at each read of the PDC registers; 0 if
+    /// the PDC only moves when the test says so.
+    unsigned int race;
+
+} Channel;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static Channel channel;
+
+/// Bytes sent by the PDC, and bytes committed.
+static unsigned char sent[MAX_SENT];
+static unsigned int numSent;
+static unsigned int numCommitted;
+
+/// Start of the ring, from the first reservation.
+static unsigned char *ring;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns the byte of the stream at a position.
+//------------------------------------------------------------------------------
+static unsigned char Pattern(unsigned int position)
+{
+    return (position * 2654435761u) >> 24;
+}
+
+//------------------------------------------------------------------------------
+/// Loads the next buffer into the current one once it is done.
+//------------------------------------------------------------------------------
+static void Reload(void)
+{
+    if ((channel.tcr == 0) && (channel.tncr != 0)) {
+
+        channel.tpr = channel.tnpr;
+        channel.tcr = channel.tncr;
+        channel.tncr = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Sends up to count bytes. Returns the number sent.
+//------------------------------------------------------------------------------
+static unsigned int Transmit(unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+
+        if (!(channel.ptsr & AT91C_PDC_TXTEN) || (channel.tcr == 0)) {
+
+            break;
+        }
+        if (numSent < MAX_SENT) {
+
+            sent[numSent] = *(unsigned char *) (unsigned long) channel.tpr;
+        }
+        numSent++;
+        channel.tpr++;
+        channel.tcr--;
+        if (channel.tcr == 0) {
+
+            channel.endtx = 1;
+        }
+        Reload();
+    }
+    return i;
+}
+
+//------------------------------------------------------------------------------
+/// Returns DBGU_CSR.
+//------------------------------------------------------------------------------
+static unsigned int Status(void)
+{
+    unsigned int csr = AT91C_DBGU_TXRDY | AT91C_DBGU_TXEMPTY;
+
+    if (channel.endtx) {
+
+        csr |= AT91C_DBGU_ENDTX;
+    }
+    if ((channel.tcr == 0) && (channel.tncr == 0)) {
+
+        csr |= AT91C_DBGU_TXBUFE;
+    }
+    return csr;
+}
+
+//------------------------------------------------------------------------------
+/// Register reads. The PDC may move on before a read of its registers.
+//------------------------------------------------------------------------------
+static unsigned int Read(void *device, unsigned int offset, unsigned int size)
+{
+    switch (offset) {
+
+    case DBGU_REG(DBGU_TPR):
+    case DBGU_REG(DBGU_TCR):
+    case DBGU_REG(DBGU_TNCR):
+        if (channel.race) {
+
+            Transmit(rand() % (channel.race + 1));
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    switch (offset) {
+
+    case DBGU_REG(DBGU_CSR):  return Status();
+    case DBGU_REG(DBGU_IMR):  return channel.imr;
+    case DBGU_REG(DBGU_TPR):  return channel.tpr;
+    case DBGU_REG(DBGU_TCR):  return channel.tcr;
+    case DBGU_REG(DBGU_TNPR): return channel.tnpr;
+    case DBGU_REG(DBGU_TNCR): return channel.tncr;
+    case DBGU_REG(DBGU_PTSR): return channel.ptsr;
+    default:                  return 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Register writes.
+//------------------------------------------------------------------------------
+static void Write(void *device,
+                  unsigned int offset,
+                  unsigned int value,
+                  unsigned int size)
+{
+    switch (offset) {
+
+    case DBGU_REG(DBGU_IER):  channel.imr |= value; break;
+    case DBGU_REG(DBGU_IDR):  channel.imr &= ~value; break;
+    case DBGU_REG(DBGU_TPR):  channel.tpr = value; break;
+    case DBGU_REG(DBGU_TNPR): channel.tnpr = value; break;
+
+    case DBGU_REG(DBGU_TCR):
+    case DBGU_REG(DBGU_TNCR):
+        if (offset == DBGU_REG(DBGU_TCR)) {
+
+            channel.tcr = value;
+        }
+        else {
+
+            channel.tncr = value;
+        }
+        if (value) {
+
+            channel.endtx = 0;
+        }
+        break;
+
+    case DBGU_REG(DBGU_PTCR):
+        if (value & AT91C_PDC_TXTDIS) {
+
+            channel.ptsr &= ~AT91C_PDC_TXTEN;
+        }
+        else if (value & AT91C_PDC_TXTEN) {
+
+            channel.ptsr |= AT91C_PDC_TXTEN;
+        }
+        break;
+
+    default:
+        break;
+    }
+    Reload();
+}
+
+//------------------------------------------------------------------------------
+/// Takes the DBGU interrupt while it is pending. Returns 0 if it stays
+/// pending.
+//------------------------------------------------------------------------------
+static unsigned char Interrupt(void)
+{
+    unsigned int nested;
+
+    for (nested = 0; nested < MAX_NESTED; nested++) {
+
+        if ((channel.imr & Status()) == 0) {
+
+            return 1;
+        }
+        DBGU_IrqHandler();
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+/// Restarts the ring with an idle PDC.
+//------------------------------------------------------------------------------
+static void Start(unsigned int race)
+{
+    memset(&channel, 0, sizeof(channel));
+    channel.race = race;
+    numSent = 0;
+    numCommitted = 0;
+    DBGU_StartTx();
+}
+
+//------------------------------------------------------------------------------
+/// Reserves size bytes and commits count of them, filled with the stream.
+/// Returns the reservation, or 0.
+//------------------------------------------------------------------------------
+static unsigned char * Put(unsigned int size, unsigned int count)
+{
+    unsigned char *buffer = DBGU_Reserve(size);
+    unsigned int i;
+
+    if (buffer) {
+
+        for (i = 0; i < count; i++) {
+
+            buffer[i] = Pattern(numCommitted + i);
+        }
+        DBGU_Commit(count);
+        numCommitted += count;
+    }
+    return buffer;
+}
+
+//------------------------------------------------------------------------------
+/// Sends everything, taking the interrupts. Returns 1 if the bytes sent are
+/// the bytes committed.
+//------------------------------------------------------------------------------
+static unsigned char Drain(void)
+{
+    unsigned int i;
+
+    do {
+
+        if (!Interrupt()) {
+
+            return 0;
+        }
+    } while (Transmit(1 + rand() % 64));
+
+    if ((numSent != numCommitted) || (numSent > MAX_SENT)) {
+
+        return 0;
+    }
+    for (i = 0; i < numSent; i++) {
+
+        if (sent[i] != Pattern(i)) {
+
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Filling the ring, the wrap point, and the refused reservations.
+//------------------------------------------------------------------------------
+static void TestWrap(void)
+{
+    unsigned int dropped;
+
+    Start(0);
+    ring = Put(1000, 1000);
+    CHECK(ring != 0);
+    CHECK(channel.tcr == 1000);
+    CHECK(!(channel.imr & AT91C_DBGU_ENDTX));
+
+    // The tail fits exactly; nothing more does while no byte is sent
+    dropped = DBGU_GetDropped();
+    CHECK(Put(DBGU_TX_BUFFER_SIZE - 1000, DBGU_TX_BUFFER_SIZE - 1000)
+          == ring + 1000);
+    CHECK(channel.tncr == DBGU_TX_BUFFER_SIZE - 1000);
+    CHECK(Put(1, 1) == 0);
+    CHECK(DBGU_GetDropped() == dropped + 1);
+
+    // A wrapped reservation needs one byte more than its size sent, so that
+    // the ring never looks empty when it is full
+    Transmit(100);
+    CHECK(Put(100, 100) == 0);
+    CHECK(Put(99, 99) == ring);
+    CHECK(DBGU_GetDropped() == dropped + 2);
+    CHECK(channel.imr & AT91C_DBGU_ENDTX);
+    CHECK(Drain());
+    CHECK(!(channel.imr & AT91C_DBGU_ENDTX));
+
+    // Uncommitted space is given back; a reservation that wraps leaves a
+    // watermark the PDC stops at
+    CHECK(Put(800, 500) == ring + 99);
+    CHECK(Put(400, 300) == ring + 599);
+    CHECK(Put(200, 200) == 0);
+    Transmit(250);
+    CHECK(Put(200, 150) == ring);
+    CHECK(Put(50, 0) == ring + 150);
+
+    // Behind the PDC, the room ends one byte before the next byte to send
+    CHECK(channel.tpr == (unsigned int) (unsigned long) (ring + 349));
+    CHECK(Put(199, 199) == 0);
+    CHECK(Put(198, 198) == ring + 150);
+    CHECK(Drain());
+    CHECK(numSent == 1000 + DBGU_TX_BUFFER_SIZE - 1000 + 99 + 500 + 300 + 150
+                     + 198);
+}
+
+//------------------------------------------------------------------------------
+/// DBGU_ReserveWait() waits for the room that DBGU_Reserve() drops for.
+//------------------------------------------------------------------------------
+static void TestWait(void)
+{
+    unsigned char *buffer;
+    unsigned int i;
+
+    Start(4);
+    CHECK(Put(DBGU_TX_BUFFER_SIZE - 1, DBGU_TX_BUFFER_SIZE - 1) == ring);
+    CHECK(DBGU_ReserveWait(DBGU_TX_BUFFER_SIZE / 2 + 1) == 0);
+
+    buffer = DBGU_ReserveWait(DBGU_TX_BUFFER_SIZE / 2);
+    CHECK(buffer == ring);
+    for (i = 0; i < DBGU_TX_BUFFER_SIZE / 2; i++) {
+
+        buffer[i] = Pattern(numCommitted + i);
+    }
+    DBGU_Commit(DBGU_TX_BUFFER_SIZE / 2);
+    numCommitted += DBGU_TX_BUFFER_SIZE / 2;
+    CHECK(Drain());
+}
+
+//------------------------------------------------------------------------------
+/// Random reservations and commits while the PDC runs, with the interrupt
+/// taken between them and the PDC moving within them.
+//------------------------------------------------------------------------------
+static void TestRace(void)
+{
+    unsigned int dropped;
+    unsigned int refused = 0;
+    unsigned char ok = 1;
+    unsigned int size;
+
+    Start(3);
+    dropped = DBGU_GetDropped();
+    while (numCommitted < MAX_SENT - DBGU_TX_BUFFER_SIZE) {
+
+        size = 1 + rand() % (DBGU_TX_BUFFER_SIZE / 3);
+        if (!Put(size, rand() % (size + 1))) {
+
+            refused++;
+        }
+        ok &= Interrupt();
+        Transmit(rand() % 200);
+        ok &= Interrupt();
+    }
+    CHECK(ok);
+    CHECK(Drain());
+    CHECK(DBGU_GetDropped() == dropped + refused);
+    CHECK(refused > 0);
+    CHECK(!(channel.imr & AT91C_DBGU_ENDTX));
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    HOST_Initialize();
+    MMIO_Map((unsigned int) (unsigned long) AT91C_BASE_DBGU, sizeof(AT91S_DBGU),
+             Read, Write, 0);
+    srand(1);
+
+    DBGU_Configure(AT91C_DBGU_PAR_NONE, DBGU_BAUDRATE, 96000000);
+    CHECK(DBGU_Reserve(1) == 0);
+    TestWrap();
+    TestWait();
+    TestRace();
+
+    return CHECK_Result("dbgu_test");
+}
@@ -0,0 +1,333 @@
+/* ----------------------------------------------------------------------------
+ *         Simulated embedded flash controller
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "efcsim.h"
+#include "mmio.h"
+#include "AT91SAM3U4.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Flash geometry.
+#define FLASH_SIZE              AT91C_IFLASH0_SIZE
+#define PAGE_SIZE               AT91C_IFLASH0_PAGE_SIZE
+#define NUM_PAGES               AT91C_IFLASH0_NB_OF_PAGES
+#define PAGES_PER_REGION        (AT91C_IFLASH0_LOCK_REGION_SIZE / PAGE_SIZE)
+#define NUM_GPNVM               3
+
+/// Register offsets.
+#define REG(name)               offsetof(AT91S_EFC, name)
+
+/// Reads of EFC_FSR that return busy after a command.
+#define BUSY_READS              2
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Controller and flash.
+typedef struct {
+
+    unsigned char *flash;
+    unsigned char latch[PAGE_SIZE];
+
+    unsigned int fmr;
+    unsigned int frr;
+    /// FCMDE and LOCKE of the last command, cleared when EFC_FSR is read.
+    unsigned int errors;
+    unsigned int busy;
+
+    unsigned int locks;
+    unsigned int gpnvm;
+
+    unsigned int commands;
+    unsigned int writes[NUM_PAGES];
+
+    /// Page writes before the one cut by a power loss, and the cut.
+    unsigned int writesBeforeCut;
+    void (*cut)(void);
+
+} EfcSim;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static EfcSim efc;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Writes part of a page, cut by a power loss, and calls the cut function.
+/// An erase cut short sets a random part of the bits; a write cut short
+/// programs the first words of the latch only.
+//------------------------------------------------------------------------------
+static void Tear(unsigned char *flash, unsigned char erase)
+{
+    void (*cut)(void) = efc.cut;
+    unsigned int words = rand() % (PAGE_SIZE / 4 + 1);
+    unsigned int i;
+
+    if (erase && (rand() & 1)) {
+
+        for (i = 0; i < PAGE_SIZE; i++) {
+
+            flash[i] |= rand();
+        }
+    }
+    else {
+
+        if (erase) {
+
+            memset(flash, 0xFF, PAGE_SIZE);
+        }
+        for (i = 0; i < words * 4; i++) {
+
+            flash[i] &= efc.latch[i];
+        }
+    }
+
+    efc.cut = 0;
+    efc.busy = 0;
+    efc.errors = 0;
+    memset(efc.latch, 0xFF, PAGE_SIZE);
+    cut();
+}
+
+//------------------------------------------------------------------------------
+/// Moves the latch into a page. Returns the error flags.
+//------------------------------------------------------------------------------
+static unsigned int WritePage(unsigned int page, unsigned char erase)
+{
+    unsigned char *flash = efc.flash + page * PAGE_SIZE;
+    unsigned int i;
+
+    if (page >= NUM_PAGES) {
+
+        return AT91C_EFC_FCMDE;
+    }
+    if ((efc.locks >> (page / PAGES_PER_REGION)) & 1) {
+
+        return AT91C_EFC_LOCKE;
+    }
+
+    if (efc.cut && (efc.writesBeforeCut-- == 0)) {
+
+        Tear(flash, erase);
+    }
+    if (erase) {
+
+        memset(flash, 0xFF, PAGE_SIZE);
+    }
+    for (i = 0; i < PAGE_SIZE; i++) {
+
+        flash[i] &= efc.latch[i];
+    }
+    efc.writes[page]++;
+
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+/// Runs a command written to EFC_FCR. Returns the error flags.
+//------------------------------------------------------------------------------
+static unsigned int Command(unsigned int fcr)
+{
+    unsigned int command = fcr & AT91C_EFC_FCMD;
+    unsigned int argument = (fcr & AT91C_EFC_FARG) >> 8;
+    unsigned int errors;
+
+    if ((fcr & AT91C_EFC_FKEY) != (0x5Au << 24)) {
+
+        return AT91C_EFC_FCMDE;
+    }
+
+    switch (command) {
+
+    case AT91C_EFC_FCMD_WP:
+    case AT91C_EFC_FCMD_EWP:
+        return WritePage(argument, command == AT91C_EFC_FCMD_EWP);
+
+    case AT91C_EFC_FCMD_WPL:
+    case AT91C_EFC_FCMD_EWPL:
+        errors = WritePage(argument, command == AT91C_EFC_FCMD_EWPL);
+        if (errors == 0) {
+
+            efc.locks |= 1u << (argument / PAGES_PER_REGION);
+        }
+        return errors;
+
+    case AT91C_EFC_FCMD_SLB:
+    case AT91C_EFC_FCMD_CLB:
+        if (argument >= NUM_PAGES) {
+
+            return AT91C_EFC_FCMDE;
+        }
+        if (command == AT91C_EFC_FCMD_SLB) {
+
+            efc.locks |= 1u << (argument / PAGES_PER_REGION);
+        }
+        else {
+
+            efc.locks &= ~(1u << (argument / PAGES_PER_REGION));
+        }
+        return 0;
+
+    case AT91C_EFC_FCMD_GLB:
+        efc.frr = efc.locks;
+        return 0;
+
+    case AT91C_EFC_FCMD_SFB:
+    case AT91C_EFC_FCMD_CFB:
+        // The security bit is cleared only by the ERASE pin
+        if ((argument >= NUM_GPNVM)
+            || ((command == AT91C_EFC_FCMD_CFB) && (argument == 0))) {
+
+            return AT91C_EFC_FCMDE;
+        }
+        if (command == AT91C_EFC_FCMD_SFB) {
+
+            efc.gpnvm |= 1u << argument;
+        }
+        else {
+
+            efc.gpnvm &= ~(1u << argument);
+        }
+        return 0;
+
+    case AT91C_EFC_FCMD_GFB:
+        efc.frr = efc.gpnvm;
+        return 0;
+
+    default:
+        return AT91C_EFC_FCMDE;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Reads of the EFC registers.
+//------------------------------------------------------------------------------
+static unsigned int Read(void *device, unsigned int offset, unsigned int size)
+{
+    unsigned int status;
+
+    switch (offset) {
+
+    case REG(EFC_FMR):
+        return efc.fmr;
+
+    case REG(EFC_FSR):
+        if (efc.busy) {
+
+            efc.busy--;
+            return 0;
+        }
+        status = AT91C_EFC_FRDY_S | efc.errors;
+        efc.errors = 0;
+        return status;
+
+    case REG(EFC_FRR):
+        return efc.frr;
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+/// Writes of the EFC registers.
+//------------------------------------------------------------------------------
+static void Write(void *device,
+                  unsigned int offset,
+                  unsigned int value,
+                  unsigned int size)
+{
+    switch (offset) {
+
+    case REG(EFC_FMR):
+        efc.fmr = value;
+        break;
+
+    case REG(EFC_FCR):
+        efc.errors = Command(value);
+        efc.busy = BUSY_READS;
+        efc.commands++;
+        memset(efc.latch, 0xFF, PAGE_SIZE);
+        break;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Writes of the flash area, into the latch.
+//------------------------------------------------------------------------------
+static void WriteLatch(void *device,
+                       unsigned int offset,
+                       unsigned int value,
+                       unsigned int size)
+{
+    memcpy(&efc.latch[offset % PAGE_SIZE], &value, size);
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Maps EFC0 and the flash, once per test program, after HOST_Initialize().
+/// Returns the flash, writable by the test.
+/// \param fd  File of FLASH_SIZE bytes holding the flash image; -1 for an
+///            erased flash in memory.
+//------------------------------------------------------------------------------
+unsigned char * EFCSIM_Initialize(int fd)
+{
+    memset(&efc, 0, sizeof(efc));
+    memset(efc.latch, 0xFF, PAGE_SIZE);
+    efc.flash = MMIO_MapMemory(AT91C_IFLASH0, FLASH_SIZE, fd, WriteLatch, 0);
+    if (fd < 0) {
+
+        memset(efc.flash, 0xFF, FLASH_SIZE);
+    }
+    MMIO_Map((unsigned int) (unsigned long) AT91C_BASE_EFC0, sizeof(AT91S_EFC),
+             Read, Write, 0);
+
+    return efc.flash;
+}
+
+//------------------------------------------------------------------------------
+/// Cuts the power during a page write.
+/// \param writes  Page writes to complete first.
+/// \param cut  Called once the page is torn, and must not return; 0 to
+///             cancel the cut.
+//------------------------------------------------------------------------------
+void EFCSIM_CutPower(unsigned int writes, void (*cut)(void))
+{
+    efc.writesBeforeCut = writes;
+    efc.cut = cut;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the number of commands run.
+//------------------------------------------------------------------------------
+unsigned int EFCSIM_GetCommands(void)
+{
+    return efc.commands;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the number of times a page has been written.
+//------------------------------------------------------------------------------
+unsigned int EFCSIM_GetWrites(unsigned int page)
+{
+    return efc.writes[page];
+}
@@ -0,0 +1,37 @@
+/* ----------------------------------------------------------------------------
+ *         Simulated embedded flash controller
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** EFC0 and the internal flash behind it. The flash is read-only memory at
+** AT91C_IFLASH0; each write of a driver lands in the page latch at its page
+** offset, whatever the page, and only a write command moves the latch into
+** the page given as argument: WP clears the bits that are 0 in the latch,
+** EWP replaces the page. The latch is back to 0xFF after each command, and
+** EFC_FSR reads busy a few times before the command ends. Lock bits (one per
+** 8 KB region) and GPNVM bits are modelled; a command on a locked region
+** fails with LOCKE, an unknown command or argument with FCMDE.
+**
+** EFCSIM_CutPower() tears a later page write as a power loss would: part of
+** the erase, or the erase and only the first words of the latch, reach the
+** page. The simulator then calls the cut function, which does not return
+** (siglongjmp() back to the test, which mounts the flash again).
+*/
+
+#ifndef EFCSIM_H
+#define EFCSIM_H
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned char * EFCSIM_Initialize(int fd);
+
+extern void EFCSIM_CutPower(unsigned int writes, void (*cut)(void));
+
+extern unsigned int EFCSIM_GetCommands(void);
+
+extern unsigned int EFCSIM_GetWrites(unsigned int page);
+
+#endif //#ifndef EFCSIM_H
@@ -0,0 +1,376 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of evlog.c and tools/evlog2csv.py
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Logs events of known cycles, identifiers and values to a range of a RAM
+** disk, dumps the range to a file and decodes it with evlog2csv.py: the
+** rows must give back the events in order, with the tick and sequence of
+** their blocks. Covers cycle deltas of every varint size, events published
+** out of order, the counter wrapping around, dropped events, the range
+** wrapping around, a torn block, and a mount resuming after the newest block.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "evlog.h"
+#include "ramdisk.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// The log range, between two blocks that it must not touch.
+#define NUM_BLOCKS              8
+#define LOG_FIRST               1
+#define LOG_COUNT               6
+
+#define MAX_EVENTS              2000
+
+#define DUMP                    "evlog_test.bin"
+#define CSV                     "evlog_test.csv"
+#define DECODE                  "python3 ../tools/evlog2csv.py " DUMP " " CSV
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Event, and the tick of the flush that encoded it.
+typedef struct {
+
+    unsigned int cycles;
+    unsigned short id;
+    unsigned int value;
+    unsigned int tick;
+
+} Event;
+
+/// Row of the CSV.
+typedef struct {
+
+    unsigned int sequence;
+    unsigned int tick;
+    unsigned int cycles;
+    unsigned int id;
+    unsigned int value;
+
+} Row;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static BlockDevice disk;
+static unsigned char memory[NUM_BLOCKS * BLOCK_SIZE];
+
+/// Events logged, in the order of the log.
+static Event events[MAX_EVENTS];
+static unsigned int numEvents;
+
+/// Events written but not flushed yet.
+static unsigned int staged;
+
+static Row rows[MAX_EVENTS];
+static unsigned int numRows;
+
+static unsigned int ticks;
+static unsigned int cycles;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// scheduler.c
+//------------------------------------------------------------------------------
+unsigned int SCHED_GetTicks(void)
+{
+    return ticks;
+}
+
+//------------------------------------------------------------------------------
+/// Writes an event at the cycle count given.
+//------------------------------------------------------------------------------
+static void Write(unsigned int at, unsigned short id, unsigned int value)
+{
+    Event *event = &events[numEvents + staged];
+
+    HOST_SetCycles(at);
+    EVLOG_Write(id, value);
+    if (staged < EVLOG_STAGING_SIZE) {
+
+        event->cycles = at;
+        event->id = id;
+        event->value = value;
+        staged++;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Flushes the staged events, at the next tick.
+//------------------------------------------------------------------------------
+static void Flush(void)
+{
+    unsigned int i;
+
+    ticks++;
+    for (i = 0; i < staged; i++) {
+
+        events[numEvents + i].tick = ticks;
+    }
+    numEvents += staged;
+    staged = 0;
+    EVLOG_Flush();
+}
+
+//------------------------------------------------------------------------------
+/// Writes random events, each flushed at once. The cycles mostly move ahead
+/// by some microseconds, sometimes by a lot or backward (published late).
+//------------------------------------------------------------------------------
+static void WriteEvents(unsigned int count)
+{
+    unsigned int value;
+
+    while (count--) {
+
+        switch (rand() % 8) {
+
+        case 0:
+            cycles -= rand() % 500;
+            value = rand() % 0x80;
+            break;
+
+        case 1:
+            cycles += 0x10000000 + rand();
+            value = 0xFFFFFFFF;
+            break;
+
+        default:
+            cycles += rand() % 20000;
+            value = rand() * 2654435761u;
+            break;
+        }
+        Write(cycles, rand() % EVLOG_ID_DROPPED, value);
+        Flush();
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Dumps the log range, decodes it with evlog2csv.py and reads the rows.
+/// Returns 1 on success.
+//------------------------------------------------------------------------------
+static unsigned char Decode(void)
+{
+    char line[128];
+    FILE *file;
+    Row *row;
+
+    numRows = 0;
+    file = fopen(DUMP, "wb");
+    if (!file) {
+
+        return 0;
+    }
+    fwrite(memory + LOG_FIRST * BLOCK_SIZE, BLOCK_SIZE, LOG_COUNT, file);
+    fclose(file);
+    if (system(DECODE " 2>/dev/null") != 0) {
+
+        return 0;
+    }
+
+    file = fopen(CSV, "r");
+    if (!file || !fgets(line, sizeof(line), file)
+        || strcmp(line, "sequence,tick,cycles,id,value\r\n")) {
+
+        return 0;
+    }
+    while (fgets(line, sizeof(line), file) && (numRows < MAX_EVENTS)) {
+
+        row = &rows[numRows++];
+        if (sscanf(line, "%u,%u,%u,%u,%u", &row->sequence, &row->tick,
+                   &row->cycles, &row->id, &row->value) != 5) {
+
+            fclose(file);
+            return 0;
+        }
+    }
+    fclose(file);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Checks that the rows are the events logged before end, in order, and
+/// returns the index of the first one.
+//------------------------------------------------------------------------------
+static unsigned int CheckRows(unsigned int end)
+{
+    unsigned int first = end - numRows;
+    const Event *event;
+    const Row *row;
+    unsigned int errors = 0;
+    unsigned int i;
+
+    CHECK((numRows > 0) && (numRows <= end));
+    for (i = 0; (i < numRows) && (numRows <= end); i++) {
+
+        event = &events[first + i];
+        row = &rows[i];
+        if ((row->cycles != event->cycles) || (row->id != event->id)
+            || (row->value != event->value)) {
+
+            errors++;
+        }
+
+        // Blocks in sequence; each one stamped with the tick of its first
+        // event
+        if ((i == 0) || (row->sequence != rows[i - 1].sequence)) {
+
+            if (((i > 0) && (row->sequence != rows[i - 1].sequence + 1))
+                || (row->tick != event->tick)) {
+
+                errors++;
+            }
+        }
+        else if (row->tick != rows[i - 1].tick) {
+
+            errors++;
+        }
+    }
+    CHECK(errors == 0);
+
+    return first;
+}
+
+//------------------------------------------------------------------------------
+/// Events of a first block or two, synced.
+//------------------------------------------------------------------------------
+static void TestRoundTrip(void)
+{
+    cycles = 0xFFFF0000;
+    WriteEvents(60);
+    EVLOG_Sync();
+    CHECK(EVLOG_GetStats()->events == 60);
+    CHECK(EVLOG_GetStats()->blocks >= 2);
+
+    CHECK(Decode());
+    CHECK(numRows == 60);
+    CHECK(CheckRows(numEvents) == 0);
+    CHECK(rows[0].sequence == 1);
+}
+
+//------------------------------------------------------------------------------
+/// Events dropped by a full staging ring: their count comes first in the
+/// next block flushed, then the staged events.
+//------------------------------------------------------------------------------
+static void TestDropped(void)
+{
+    Event dropped;
+    unsigned int i;
+
+    for (i = 0; i < EVLOG_STAGING_SIZE + 3; i++) {
+
+        Write(cycles + i * 100, i, i);
+    }
+    CHECK(EVLOG_GetStats()->dropped == 3);
+
+    // The count is stamped by the flush
+    cycles += EVLOG_STAGING_SIZE * 100;
+    dropped.cycles = cycles;
+    dropped.id = EVLOG_ID_DROPPED;
+    dropped.value = 3;
+    memmove(&events[numEvents + 1], &events[numEvents],
+            staged * sizeof(Event));
+    events[numEvents] = dropped;
+    staged++;
+    HOST_SetCycles(cycles);
+    Flush();
+    EVLOG_Sync();
+
+    CHECK(Decode());
+    CheckRows(numEvents);
+    CHECK(numRows >= EVLOG_STAGING_SIZE + 1);
+}
+
+//------------------------------------------------------------------------------
+/// The range wraps around, keeping the newest blocks; a torn block costs its
+/// own events only; a mount resumes after the newest block.
+//------------------------------------------------------------------------------
+static void TestWrap(void)
+{
+    unsigned char *block;
+    unsigned int sequence;
+    unsigned int newest;
+    unsigned int total;
+    unsigned int i;
+
+    WriteEvents(600);
+    EVLOG_Sync();
+    CHECK(EVLOG_GetStats()->blocks > LOG_COUNT);
+    CHECK(Decode());
+    CheckRows(numEvents);
+    CHECK(numRows > 4 * 30);
+    CHECK(rows[numRows - 1].sequence - rows[0].sequence == LOG_COUNT - 1);
+    sequence = rows[numRows - 1].sequence;
+    total = numRows;
+    for (newest = 0; rows[numRows - 1 - newest].sequence == sequence; newest++);
+
+    // Outside the range, nothing was written
+    for (i = 0; (i < BLOCK_SIZE) && (memory[i] == 0)
+                && (memory[(NUM_BLOCKS - 1) * BLOCK_SIZE + i] == 0); i++);
+    CHECK(i == BLOCK_SIZE);
+
+    // The newest block torn: the decoder skips its events only
+    for (i = LOG_FIRST; i < LOG_FIRST + LOG_COUNT; i++) {
+
+        block = memory + i * BLOCK_SIZE;
+        if (*(unsigned int *) (block + 4) == sequence) {
+
+            block[BLOCK_SIZE / 2] ^= 0x10;
+        }
+    }
+    CHECK(Decode());
+    CHECK(numRows == total - newest);
+    CHECK(rows[numRows - 1].sequence == sequence - 1);
+    CheckRows(numEvents - newest);
+
+    // A mount resumes after the newest valid block, over the torn one
+    EVLOG_Initialize(&disk, LOG_FIRST, LOG_COUNT);
+    WriteEvents(1);
+    EVLOG_Sync();
+    CHECK(Decode());
+    CHECK(rows[numRows - 1].sequence == sequence);
+    CHECK(rows[numRows - 2].sequence == sequence - 1);
+    CHECK(rows[numRows - 1].cycles == events[numEvents - 1].cycles);
+    CHECK(rows[numRows - 1].value == events[numEvents - 1].value);
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    HOST_Initialize();
+    RAMDISK_Initialize(&disk, memory, NUM_BLOCKS);
+    EVLOG_Initialize(&disk, LOG_FIRST, LOG_COUNT);
+    srand(1);
+
+    TestRoundTrip();
+    TestDropped();
+    TestWrap();
+
+    if (checkFailures == 0) {
+
+        remove(DUMP);
+        remove(CSV);
+    }
+    return CHECK_Result("evlog_test");
+}
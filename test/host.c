@@ -0,0 +1,138 @@
+/* ----------------------------------------------------------------------------
+ *         Host build of the firmware modules
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Stands in for the core peripherals under the drivers: the NVIC functions
+** of irq.c record what the drivers ask, the DWT cycle counter advances by
+** HOST_CYCLES_PER_READ at each read unless a test sets it, and the PMC and
+** PIO registers keep what the drivers write.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "mmio.h"
+#include "irq.h"
+#include "dwt.h"
+
+#include <stddef.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Cycles counted between two reads of DWT_CYCCNT.
+#define HOST_CYCLES_PER_READ    16
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static unsigned int cycles;
+
+/// Interrupts enabled and set pending, bit per peripheral identifier.
+static unsigned int enabled;
+static unsigned int pending;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Reads of the DWT registers.
+//------------------------------------------------------------------------------
+static unsigned int ReadDwt(void *device, unsigned int offset, unsigned int size)
+{
+    if (offset == offsetof(AT91S_DWT, DWT_CYCCNT)) {
+
+        cycles += HOST_CYCLES_PER_READ;
+        return cycles;
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Maps the core peripherals. Call it first in each test.
+//------------------------------------------------------------------------------
+void HOST_Initialize(void)
+{
+    MMIO_Map((unsigned int) (unsigned long) AT91C_BASE_DWT, sizeof(AT91S_DWT),
+             ReadDwt, 0, 0);
+    MMIO_Map((unsigned int) (unsigned long) AT91C_BASE_PMC, sizeof(AT91S_PMC),
+             0, 0, 0);
+    MMIO_Map((unsigned int) (unsigned long) AT91C_BASE_PIOA, sizeof(AT91S_PIO),
+             0, 0, 0);
+    MMIO_Map((unsigned int) (unsigned long) AT91C_BASE_PIOB, sizeof(AT91S_PIO),
+             0, 0, 0);
+}
+
+//------------------------------------------------------------------------------
+/// Sets the cycle counter: the next read returns cycles.
+//------------------------------------------------------------------------------
+void HOST_SetCycles(unsigned int value)
+{
+    cycles = value - HOST_CYCLES_PER_READ;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if an interrupt has been set pending since the last call, and
+/// clears it.
+//------------------------------------------------------------------------------
+unsigned char HOST_TakePending(unsigned int id)
+{
+    unsigned char result = (pending >> id) & 1;
+
+    pending &= ~(1u << id);
+    return result;
+}
+
+//------------------------------------------------------------------------------
+/// irq.c
+//------------------------------------------------------------------------------
+void IRQ_Enable(unsigned int id)
+{
+    enabled |= 1u << id;
+}
+
+void IRQ_Disable(unsigned int id)
+{
+    enabled &= ~(1u << id);
+}
+
+void IRQ_SetPending(unsigned int id)
+{
+    pending |= 1u << id;
+}
+
+void IRQ_ClearPending(unsigned int id)
+{
+    pending &= ~(1u << id);
+}
+
+IrqPriority IRQ_GetPriority(unsigned int id)
+{
+    IrqPriority priority = { IRQ_NUM_LEVELS - 1, 0 };
+
+    return priority;
+}
+
+IntFunc IRQ_Attach(unsigned int id, IntFunc handler)
+{
+    return 0;
+}
+
+IrqState IRQ_EnterCritical(void)
+{
+    return 0;
+}
+
+void IRQ_ExitCritical(IrqState state)
+{
+}
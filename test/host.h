@@ -0,0 +1,38 @@
+/* ----------------------------------------------------------------------------
+ *         Host build of the firmware modules
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Forced include (gcc -include host.h) of every file of the host tests. The
+** IAR keywords become nothing: placement (RAMFUNC, NOINIT, DMABUF) does not
+** matter on the host, and the #pragma lines are ignored. The peripherals
+** stay at their addresses of AT91SAM3U4.h, where mmio.c maps the simulated
+** ones, so the drivers build unchanged.
+*/
+
+#ifndef HOST_H
+#define HOST_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+#define __no_init
+#define __ramfunc
+#define __root
+#define __stackless
+#define __packed
+#define __weak                  __attribute__((weak))
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void HOST_Initialize(void);
+
+extern void HOST_SetCycles(unsigned int cycles);
+
+extern unsigned char HOST_TakePending(unsigned int id);
+
+#endif //#ifndef HOST_H
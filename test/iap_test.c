@@ -0,0 +1,212 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of iap.c
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Programs the flash of efcsim.c through iap.c: whole pages, ranges across
+** page boundaries programmed or rewritten around their neighbours, the pages
+** that are skipped because they already hold the data or are erased, ranges
+** outside the flash, lock regions and GPNVM bits.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "efcsim.h"
+#include "iap.h"
+
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Address of a page.
+#define PAGE(page)              (IAP_FLASH_START + (page) * IAP_PAGE_SIZE)
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// The flash, as written by the simulator.
+static unsigned char *flash;
+
+static unsigned char pattern[3 * IAP_PAGE_SIZE];
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the bytes of a range all hold value.
+//------------------------------------------------------------------------------
+static unsigned char IsFilled(unsigned int address,
+                              unsigned char value,
+                              unsigned int size)
+{
+    const unsigned char *bytes = flash + (address - IAP_FLASH_START);
+    unsigned int i;
+
+    for (i = 0; (i < size) && (bytes[i] == value); i++);
+    return i == size;
+}
+
+//------------------------------------------------------------------------------
+/// Whole pages, and the latch filled through the flash area.
+//------------------------------------------------------------------------------
+static void TestPages(void)
+{
+    unsigned char page[IAP_PAGE_SIZE];
+
+    CHECK(IAP_WritePage(0, pattern, 0));
+    CHECK(memcmp(flash, pattern, IAP_PAGE_SIZE) == 0);
+    CHECK(EFCSIM_GetWrites(0) == 1);
+
+    // Programming only clears bits; erasing first replaces the page
+    memset(page, 0x0F, sizeof(page));
+    CHECK(IAP_WritePage(0, page, 0));
+    CHECK(flash[1] == (pattern[1] & 0x0F));
+    CHECK(IAP_WritePage(0, page, 1));
+    CHECK(IsFilled(PAGE(0), 0x0F, IAP_PAGE_SIZE));
+
+    // The data may be unaligned
+    CHECK(IAP_WritePage(IAP_NUM_PAGES - 1, pattern + 1, 1));
+    CHECK(memcmp(flash + IAP_FLASH_SIZE - IAP_PAGE_SIZE, pattern + 1,
+                 IAP_PAGE_SIZE) == 0);
+    CHECK(!IAP_WritePage(IAP_NUM_PAGES, pattern, 1));
+}
+
+//------------------------------------------------------------------------------
+/// Ranges programmed and rewritten across page boundaries.
+//------------------------------------------------------------------------------
+static void TestRanges(void)
+{
+    unsigned int address = PAGE(8) + IAP_PAGE_SIZE - 40;
+    unsigned int commands;
+
+    // Programmed: the bytes around the range stay erased
+    CHECK(IAP_Program(address, pattern, 100));
+    CHECK(memcmp(flash + (address - IAP_FLASH_START), pattern, 100) == 0);
+    CHECK(IsFilled(PAGE(8), 0xFF, IAP_PAGE_SIZE - 40));
+    CHECK(IsFilled(address + 100, 0xFF, IAP_PAGE_SIZE - 60));
+    CHECK(EFCSIM_GetWrites(8) == 1);
+    CHECK(EFCSIM_GetWrites(9) == 1);
+
+    // A record appended after it, in the same page
+    CHECK(IAP_Program(address + 100, pattern + 200, 10));
+    CHECK(memcmp(flash + (address - IAP_FLASH_START), pattern, 100) == 0);
+    CHECK(memcmp(flash + (address + 100 - IAP_FLASH_START),
+                 pattern + 200, 10) == 0);
+
+    // Rewritten: the bytes around the range are kept
+    CHECK(IAP_Write(address + 20, pattern + 300, 40));
+    CHECK(memcmp(flash + (address - IAP_FLASH_START), pattern, 20) == 0);
+    CHECK(memcmp(flash + (address + 20 - IAP_FLASH_START),
+                 pattern + 300, 40) == 0);
+    CHECK(memcmp(flash + (address + 60 - IAP_FLASH_START),
+                 pattern + 60, 40) == 0);
+    CHECK(EFCSIM_GetWrites(8) == 2);
+    CHECK(EFCSIM_GetWrites(9) == 3);
+
+    // Pages that already hold the data are not written again
+    commands = EFCSIM_GetCommands();
+    CHECK(IAP_Write(address + 20, pattern + 300, 40));
+    CHECK(EFCSIM_GetCommands() == commands);
+    CHECK(IAP_Write(address + 20, pattern + 301, 40));
+    CHECK(EFCSIM_GetCommands() == commands + 2);
+
+    // Three pages, all written
+    CHECK(IAP_Write(PAGE(16), pattern, sizeof(pattern)));
+    CHECK(memcmp(flash + 16 * IAP_PAGE_SIZE, pattern, sizeof(pattern)) == 0);
+
+    // Erased pages are skipped
+    commands = EFCSIM_GetCommands();
+    CHECK(IAP_Erase(PAGE(7) + 1, 4 * IAP_PAGE_SIZE));
+    CHECK(EFCSIM_GetCommands() == commands + 2);
+    CHECK(IsFilled(PAGE(7), 0xFF, 5 * IAP_PAGE_SIZE));
+    CHECK(EFCSIM_GetWrites(10) == 0);
+
+    // Outside the flash
+    CHECK(!IAP_Program(IAP_FLASH_START - 1, pattern, 2));
+    CHECK(!IAP_Write(IAP_FLASH_START + IAP_FLASH_SIZE - 1, pattern, 2));
+    CHECK(!IAP_Erase(IAP_FLASH_START + IAP_FLASH_SIZE, 1));
+    CHECK(!IAP_Program(PAGE(8), pattern, 0));
+    CHECK(!IAP_Write(PAGE(8), pattern, 0xFFFFFFFF));
+    CHECK(IAP_Write(IAP_FLASH_START + IAP_FLASH_SIZE - 1, pattern, 1));
+}
+
+//------------------------------------------------------------------------------
+/// Lock regions: writes to a locked region fail and change nothing.
+//------------------------------------------------------------------------------
+static void TestLocks(void)
+{
+    unsigned int address = IAP_FLASH_START + 2 * IAP_LOCK_REGION_SIZE;
+
+    CHECK(!IAP_IsLocked(address));
+    CHECK(IAP_Lock(address + 10, IAP_LOCK_REGION_SIZE, 1));
+    CHECK(!IAP_IsLocked(address - 1));
+    CHECK(IAP_IsLocked(address));
+    CHECK(IAP_IsLocked(address + 2 * IAP_LOCK_REGION_SIZE - 1));
+    CHECK(!IAP_IsLocked(address + 2 * IAP_LOCK_REGION_SIZE));
+
+    CHECK(!IAP_Program(address, pattern, 10));
+    CHECK(!IAP_Write(address - 10, pattern, 20));
+    CHECK(IsFilled(address, 0xFF, IAP_PAGE_SIZE));
+    CHECK(memcmp(flash + (address - 10 - IAP_FLASH_START), pattern, 10) == 0);
+
+    CHECK(IAP_Lock(address, 2 * IAP_LOCK_REGION_SIZE, 0));
+    CHECK(!IAP_IsLocked(address));
+    CHECK(IAP_Program(address, pattern, 10));
+    CHECK(memcmp(flash + (address - IAP_FLASH_START), pattern, 10) == 0);
+
+    CHECK(!IAP_Lock(IAP_FLASH_START + IAP_FLASH_SIZE, 1, 1));
+    CHECK(!IAP_IsLocked(IAP_FLASH_START + IAP_FLASH_SIZE));
+}
+
+//------------------------------------------------------------------------------
+/// GPNVM bits.
+//------------------------------------------------------------------------------
+static void TestGpnvm(void)
+{
+    CHECK(!IAP_GetGpnvm(IAP_GPNVM_BOOT_FLASH));
+    CHECK(IAP_SetGpnvm(IAP_GPNVM_BOOT_FLASH, 1));
+    CHECK(IAP_GetGpnvm(IAP_GPNVM_BOOT_FLASH));
+    CHECK(!IAP_GetGpnvm(IAP_GPNVM_BOOT_BANK));
+    CHECK(IAP_SetGpnvm(IAP_GPNVM_BOOT_FLASH, 0));
+    CHECK(!IAP_GetGpnvm(IAP_GPNVM_BOOT_FLASH));
+
+    // The security bit does not clear, and there are three bits
+    CHECK(IAP_SetGpnvm(IAP_GPNVM_SECURITY, 1));
+    CHECK(!IAP_SetGpnvm(IAP_GPNVM_SECURITY, 0));
+    CHECK(IAP_GetGpnvm(IAP_GPNVM_SECURITY));
+    CHECK(!IAP_SetGpnvm(IAP_NUM_GPNVM, 1));
+    CHECK(!IAP_GetGpnvm(IAP_NUM_GPNVM));
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    unsigned int i;
+
+    HOST_Initialize();
+    flash = EFCSIM_Initialize(-1);
+    IAP_Initialize();
+
+    for (i = 0; i < sizeof(pattern); i++) {
+
+        pattern[i] = (unsigned char) (i * 13 + (i >> 8) + 1);
+    }
+
+    TestPages();
+    TestRanges();
+    TestLocks();
+    TestGpnvm();
+
+    return CHECK_Result("iap_test");
+}
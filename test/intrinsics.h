@@ -0,0 +1,68 @@
+/* ----------------------------------------------------------------------------
+ *         IAR intrinsics on the host
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** The host tests run single-threaded in thread mode with interrupts enabled:
+** masking does nothing, the interrupt handlers are called by the tests, and
+** the exclusive accesses always succeed. The exclusive accesses of the
+** firmware cast 32-bit variables to unsigned long *, so they stay 32-bit
+** here too.
+*/
+
+#ifndef INTRINSICS_H
+#define INTRINSICS_H
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+typedef unsigned int __istate_t;
+
+//------------------------------------------------------------------------------
+//         Functions
+//------------------------------------------------------------------------------
+
+static inline __istate_t __get_interrupt_state(void) { return 0; }
+static inline void __set_interrupt_state(__istate_t state) { (void) state; }
+static inline void __disable_interrupt(void) {}
+static inline void __enable_interrupt(void) {}
+static inline void __WFI(void) {}
+static inline void __WFE(void) {}
+static inline void __SEV(void) {}
+static inline void __DSB(void) {}
+static inline void __DMB(void) {}
+static inline void __ISB(void) {}
+static inline void __no_operation(void) {}
+
+static inline unsigned int __CLZ(unsigned int value)
+{
+    return value ? __builtin_clz(value) : 32;
+}
+
+static inline unsigned int __REV(unsigned int value)
+{
+    return __builtin_bswap32(value);
+}
+
+static inline unsigned int __get_BASEPRI(void) { return 0; }
+static inline void __set_BASEPRI(unsigned int value) { (void) value; }
+static inline unsigned int __get_PRIMASK(void) { return 0; }
+static inline void __set_PRIMASK(unsigned int value) { (void) value; }
+static inline unsigned int __get_IPSR(void) { return 0; }
+
+static inline unsigned long __LDREX(unsigned long *address)
+{
+    return *(volatile unsigned int *) address;
+}
+
+static inline unsigned long __STREX(unsigned long value, unsigned long *address)
+{
+    *(volatile unsigned int *) address = (unsigned int) value;
+    return 0;
+}
+
+static inline void __CLREX(void) {}
+
+#endif //#ifndef INTRINSICS_H
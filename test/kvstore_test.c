@@ -0,0 +1,359 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of kvstore.c
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Runs the key-value store over iap.c and efcsim.c, the flash being a file
+** image. Values, deletions, commits and mounts first; then sectors filled
+** and collected in turn; then random operations with power cuts injected in
+** page writes, the mount included. After each cut the store is mounted again
+** and must hold the committed values, plus a prefix of the operations that
+** followed the last commit (those of the pages that made it to the flash).
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "efcsim.h"
+#include "kvstore.h"
+
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Keys of the random operations, 1 to NUM_KEYS.
+#define NUM_KEYS                16
+
+/// Operations between two commits, at most.
+#define MAX_PENDING             40
+
+#define NUM_CYCLES              500
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Value of a key; size 0 if it has none.
+typedef struct {
+
+    unsigned char size;
+    unsigned char bytes[KVSTORE_MAX_VALUE];
+
+} Value;
+
+/// Value stored (or deleted, size 0) since the last commit.
+typedef struct {
+
+    unsigned short key;
+    Value value;
+
+} Operation;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// The flash, as written by the simulator.
+static unsigned char *flash;
+
+/// Values of the keys at the last commit, and the operations since then.
+static Value committed[NUM_KEYS + 1];
+static Operation pending[MAX_PENDING];
+static unsigned int numPending;
+
+static sigjmp_buf powerLoss;
+static unsigned int cuts;
+static unsigned int corruptPages;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Power loss: back to the test.
+//------------------------------------------------------------------------------
+static void CutPower(void)
+{
+    siglongjmp(powerLoss, 1);
+}
+
+//------------------------------------------------------------------------------
+/// Erases the store, as a new board.
+//------------------------------------------------------------------------------
+static void Format(void)
+{
+    memset(flash + (KVSTORE_START - IAP_FLASH_START), 0xFF, KVSTORE_SIZE);
+    memset(committed, 0, sizeof(committed));
+    numPending = 0;
+    CHECK(KVSTORE_Initialize());
+}
+
+//------------------------------------------------------------------------------
+/// Mounts the store again, after a reset; the mount itself may lose power
+/// once, and is run again then.
+//------------------------------------------------------------------------------
+static void Remount(unsigned char cut)
+{
+    if (cut) {
+
+        EFCSIM_CutPower(rand() % 4, CutPower);
+    }
+    if (sigsetjmp(powerLoss, 1)) {
+
+        cuts++;
+    }
+    CHECK(KVSTORE_Initialize());
+    EFCSIM_CutPower(0, 0);
+    corruptPages += KVSTORE_GetStats()->corruptPages;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the store holds the values given.
+//------------------------------------------------------------------------------
+static unsigned char Holds(const Value *values)
+{
+    unsigned char bytes[KVSTORE_MAX_VALUE];
+    unsigned short key;
+
+    for (key = 1; key <= NUM_KEYS; key++) {
+
+        if ((KVSTORE_Get(key, bytes, sizeof(bytes)) != values[key].size)
+            || memcmp(bytes, values[key].bytes, values[key].size)) {
+
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Checks that the store holds the committed values plus a prefix of the
+/// pending operations, and makes that the committed state.
+//------------------------------------------------------------------------------
+static void CheckRecovered(void)
+{
+    Value values[NUM_KEYS + 1];
+    unsigned int i = 0;
+
+    memcpy(values, committed, sizeof(values));
+    while (!Holds(values) && (i < numPending)) {
+
+        values[pending[i].key] = pending[i].value;
+        i++;
+    }
+    CHECK(Holds(values));
+    memcpy(committed, values, sizeof(values));
+    numPending = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Commits the pending operations.
+//------------------------------------------------------------------------------
+static void Commit(void)
+{
+    unsigned int i;
+
+    CHECK(KVSTORE_Commit());
+    for (i = 0; i < numPending; i++) {
+
+        committed[pending[i].key] = pending[i].value;
+    }
+    numPending = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Runs random operations, and commits them.
+//------------------------------------------------------------------------------
+static void RunOperations(unsigned int count)
+{
+    Operation *operation;
+    unsigned int i;
+
+    while (count--) {
+
+        if (numPending == MAX_PENDING) {
+
+            Commit();
+        }
+
+        operation = &pending[numPending];
+        operation->key = 1 + rand() % NUM_KEYS;
+        operation->value.size = 0;
+        switch (rand() % 8) {
+
+        case 0:
+            Commit();
+            continue;
+
+        case 1:
+            CHECK(KVSTORE_Delete(operation->key));
+            break;
+
+        default:
+            operation->value.size = 1 + rand() % KVSTORE_MAX_VALUE;
+            for (i = 0; i < operation->value.size; i++) {
+
+                operation->value.bytes[i] = rand();
+            }
+            CHECK(KVSTORE_Set(operation->key, operation->value.bytes,
+                              operation->value.size));
+            break;
+        }
+        numPending++;
+    }
+    Commit();
+}
+
+//------------------------------------------------------------------------------
+/// Values, deletions, commits and mounts.
+//------------------------------------------------------------------------------
+static void TestBasics(void)
+{
+    unsigned char bytes[KVSTORE_MAX_VALUE];
+    unsigned int written;
+    unsigned short key;
+
+    Format();
+    CHECK(KVSTORE_GetStats()->keys == 0);
+    CHECK(KVSTORE_Get(1, bytes, sizeof(bytes)) == 0);
+
+    CHECK(KVSTORE_Set(1, "abcde", 5));
+    CHECK(KVSTORE_Get(1, bytes, sizeof(bytes)) == 5);
+    CHECK(memcmp(bytes, "abcde", 5) == 0);
+    memset(bytes, 0, sizeof(bytes));
+    CHECK(KVSTORE_Get(1, bytes, 2) == 5);
+    CHECK((bytes[1] == 'b') && (bytes[2] == 0));
+
+    CHECK(!KVSTORE_Set(KVSTORE_INVALID_KEY, "a", 1));
+    CHECK(!KVSTORE_Set(2, "a", 0));
+    CHECK(!KVSTORE_Set(2, bytes, KVSTORE_MAX_VALUE + 1));
+
+    // Lost without a commit, kept with one
+    Remount(0);
+    CHECK(KVSTORE_Get(1, bytes, sizeof(bytes)) == 0);
+    CHECK(KVSTORE_Set(1, "abcde", 5));
+    CHECK(KVSTORE_Set(2, "xyz", 3));
+    CHECK(KVSTORE_Commit());
+    Remount(0);
+    CHECK(KVSTORE_Get(1, bytes, sizeof(bytes)) == 5);
+    CHECK(KVSTORE_Get(2, bytes, sizeof(bytes)) == 3);
+    CHECK(memcmp(bytes, "xyz", 3) == 0);
+
+    // The value already held writes nothing
+    written = KVSTORE_GetStats()->pagesWritten;
+    CHECK(KVSTORE_Set(2, "xyz", 3));
+    CHECK(KVSTORE_Commit());
+    CHECK(KVSTORE_GetStats()->pagesWritten == written);
+
+    // Deleted, then stored again
+    CHECK(KVSTORE_Delete(2));
+    CHECK(KVSTORE_Delete(3));
+    CHECK(KVSTORE_Get(2, bytes, sizeof(bytes)) == 0);
+    CHECK(KVSTORE_Commit());
+    Remount(0);
+    CHECK(KVSTORE_Get(2, bytes, sizeof(bytes)) == 0);
+    CHECK(KVSTORE_Get(1, bytes, sizeof(bytes)) == 5);
+    CHECK(KVSTORE_Set(2, "uv", 2));
+    CHECK(KVSTORE_Get(2, bytes, sizeof(bytes)) == 2);
+
+    // The index is full at KVSTORE_MAX_KEYS keys
+    for (key = 3; key <= KVSTORE_MAX_KEYS; key++) {
+
+        CHECK(KVSTORE_Set(key, &key, sizeof(key)));
+    }
+    CHECK(!KVSTORE_Set(KVSTORE_MAX_KEYS + 1, &key, sizeof(key)));
+    CHECK(KVSTORE_Commit());
+    Remount(0);
+    CHECK(KVSTORE_GetStats()->keys == KVSTORE_MAX_KEYS);
+    CHECK(KVSTORE_Get(KVSTORE_MAX_KEYS, &key, sizeof(key)) == sizeof(key));
+    CHECK(key == KVSTORE_MAX_KEYS);
+    CHECK(KVSTORE_GetStats()->corruptPages == 0);
+}
+
+//------------------------------------------------------------------------------
+/// Sectors filled and collected in turn, with every value kept.
+//------------------------------------------------------------------------------
+static void TestCollection(void)
+{
+    unsigned int i;
+
+    Format();
+    for (i = 0; i < 20; i++) {
+
+        RunOperations(MAX_PENDING);
+    }
+    CHECK(KVSTORE_GetStats()->sectorsErased >= 2 * KVSTORE_NUM_SECTORS);
+    CHECK(KVSTORE_GetStats()->liveBytes <= KVSTORE_GetStats()->capacity);
+    CHECK(Holds(committed));
+    Remount(0);
+    CHECK(Holds(committed));
+}
+
+//------------------------------------------------------------------------------
+/// Random operations, cut by power losses.
+//------------------------------------------------------------------------------
+static void TestPowerCuts(void)
+{
+    unsigned int cycle;
+
+    Format();
+    for (cycle = 0; cycle < NUM_CYCLES; cycle++) {
+
+        EFCSIM_CutPower(rand() % 8, CutPower);
+        if (sigsetjmp(powerLoss, 1) == 0) {
+
+            RunOperations(rand() % MAX_PENDING);
+            EFCSIM_CutPower(0, 0);
+        }
+        else {
+
+            cuts++;
+        }
+        Remount(rand() % 4 == 0);
+        CheckRecovered();
+    }
+    CHECK(cuts > NUM_CYCLES / 2);
+    CHECK(corruptPages > 0);
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    FILE *image = tmpfile();
+    unsigned char page[IAP_PAGE_SIZE];
+
+    if ((image == 0) || (ftruncate(fileno(image), IAP_FLASH_SIZE) != 0)) {
+
+        perror("image");
+        return 1;
+    }
+
+    HOST_Initialize();
+    flash = EFCSIM_Initialize(fileno(image));
+    memset(flash, 0xFF, IAP_FLASH_SIZE);
+    IAP_Initialize();
+    srand(1);
+
+    TestBasics();
+    TestCollection();
+    TestPowerCuts();
+
+    // The store is in the image file
+    CHECK(pread(fileno(image), page, sizeof(page),
+                KVSTORE_START - IAP_FLASH_START) == sizeof(page));
+    CHECK(memcmp(page, flash + (KVSTORE_START - IAP_FLASH_START),
+                 sizeof(page)) == 0);
+
+    return CHECK_Result("kvstore_test");
+}
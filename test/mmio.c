@@ -0,0 +1,437 @@
+/* ----------------------------------------------------------------------------
+ *         Simulated peripherals at their target addresses
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#define _GNU_SOURCE
+
+#include "mmio.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Page of the host MMU, the unit of protection.
+#define PAGE_SIZE               4096
+#define PAGE_OF(address)        ((address) & ~(unsigned long) (PAGE_SIZE - 1))
+
+#define MAX_REGIONS             16
+
+/// EFLAGS trap flag: one instruction, then SIGTRAP.
+#define TRAP_FLAG               0x100
+
+/// Page fault error code: the access was a write.
+#define ERROR_WRITE             0x2
+
+/// Kinds of stepped.
+#define KIND_LOAD               0
+#define KIND_STORE              1
+/// Read-modify-write, or a read by another instruction.
+#define KIND_UPDATE             2
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Registers or memory at a target address.
+typedef struct {
+
+    unsigned long base;
+    unsigned int size;
+    MmioRead read;
+    MmioWrite write;
+    void *device;
+    unsigned char memory;
+
+} MmioRegion;
+
+/// Access being single-stepped.
+typedef struct {
+
+    MmioRegion *region;
+    unsigned long address;
+    unsigned int size;
+    unsigned char write;
+    unsigned char pending;
+    /// Memory under a write, put back after the step.
+    unsigned char saved[8];
+
+} MmioAccess;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static MmioRegion regions[MAX_REGIONS];
+static unsigned int numRegions;
+
+static MmioAccess stepped;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Stops the test on a misuse of the simulation.
+//------------------------------------------------------------------------------
+static void Fatal(const char *message, unsigned long address)
+{
+    fprintf(stderr, "mmio: %s at 0x%08lX\n", message, address);
+    abort();
+}
+
+//------------------------------------------------------------------------------
+/// Returns the region that holds an address, or 0. The last one mapped there
+/// wins, so that a test can put its model over the plain registers of host.c.
+//------------------------------------------------------------------------------
+static MmioRegion * Find(unsigned long address)
+{
+    unsigned int i;
+
+    for (i = numRegions; i > 0; i--) {
+
+        if ((address >= regions[i - 1].base)
+            && (address - regions[i - 1].base < regions[i - 1].size)) {
+
+            return &regions[i - 1];
+        }
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if a region overlaps a page.
+//------------------------------------------------------------------------------
+static unsigned char IsMapped(unsigned long page)
+{
+    unsigned int i;
+
+    for (i = 0; i < numRegions; i++) {
+
+        if ((regions[i].base < page + PAGE_SIZE)
+            && (page < regions[i].base + regions[i].size)) {
+
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the protection of a page: none if it holds registers, read-only
+/// if it holds memory with a write handler.
+//------------------------------------------------------------------------------
+static int Protection(unsigned long page)
+{
+    int protection = PROT_READ | PROT_WRITE;
+    unsigned int i;
+
+    for (i = 0; i < numRegions; i++) {
+
+        if ((regions[i].base >= page + PAGE_SIZE)
+            || (page >= regions[i].base + regions[i].size)) {
+
+            continue;
+        }
+        if (!regions[i].memory) {
+
+            return PROT_NONE;
+        }
+        if (regions[i].write) {
+
+            protection = PROT_READ;
+        }
+    }
+    return protection;
+}
+
+//------------------------------------------------------------------------------
+/// Decodes the size and kind of the memory access of an x86-64 instruction:
+/// the moves the compiler emits for volatile accesses, anything else being
+/// taken as a read-modify-write.
+//------------------------------------------------------------------------------
+static unsigned char Decode(const unsigned char *code, unsigned int *size)
+{
+    unsigned int operand = 4;
+
+    while (1) {
+
+        if (*code == 0x66) {
+
+            operand = 2;
+        }
+        else if ((*code != 0xF0) && (*code != 0xF2) && (*code != 0xF3)
+                 && (*code != 0x2E) && (*code != 0x36) && (*code != 0x3E)
+                 && (*code != 0x26) && (*code != 0x64) && (*code != 0x65)
+                 && (*code != 0x67)) {
+
+            break;
+        }
+        code++;
+    }
+    if ((*code & 0xF0) == 0x40) {
+
+        if (*code & 0x08) {
+
+            operand = 8;
+        }
+        code++;
+    }
+
+    switch (*code) {
+
+        case 0x88:
+        case 0xC6:
+            *size = 1;
+            return KIND_STORE;
+
+        case 0x89:
+        case 0xC7:
+            *size = operand;
+            return KIND_STORE;
+
+        case 0x8A:
+            *size = 1;
+            return KIND_LOAD;
+
+        case 0x8B:
+            *size = operand;
+            return KIND_LOAD;
+
+        case 0x0F:
+            // MOVZX and MOVSX
+            if ((code[1] == 0xB6) || (code[1] == 0xBE)) {
+
+                *size = 1;
+            }
+            else if ((code[1] == 0xB7) || (code[1] == 0xBF)) {
+
+                *size = 2;
+            }
+            else {
+
+                *size = operand;
+            }
+            return KIND_LOAD;
+
+        default:
+            *size = (*code & 1) ? operand : 1;
+            return KIND_UPDATE;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// SIGSEGV: opens the page for the faulting access, after loading the value
+/// of a register read, and single-steps it.
+//------------------------------------------------------------------------------
+static void Fault(int signal, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = context;
+    unsigned long address = (unsigned long) info->si_addr;
+    MmioRegion *region = Find(address);
+    unsigned int value;
+    unsigned char kind;
+
+    if (!IsMapped(PAGE_OF(address)) || stepped.pending) {
+
+        Fatal("invalid access", address);
+    }
+
+    kind = Decode((const unsigned char *) uc->uc_mcontext.gregs[REG_RIP],
+                  &stepped.size);
+    stepped.region = region;
+    stepped.address = address;
+    stepped.write = (uc->uc_mcontext.gregs[REG_ERR] & ERROR_WRITE) != 0;
+    stepped.pending = 1;
+    if (region && !region->memory && (stepped.size > 4)) {
+
+        Fatal("register access wider than 32 bits", address);
+    }
+
+    mprotect((void *) PAGE_OF(address), PAGE_SIZE, PROT_READ | PROT_WRITE);
+    if (region && region->memory) {
+
+        if (stepped.write && region->write) {
+
+            memcpy(stepped.saved, (void *) address, stepped.size);
+        }
+    }
+    else if (region && (kind != KIND_STORE) && region->read) {
+
+        value = region->read(region->device, address - region->base,
+                             stepped.size);
+        memcpy((void *) address, &value, stepped.size);
+    }
+    uc->uc_mcontext.gregs[REG_EFL] |= TRAP_FLAG;
+}
+
+//------------------------------------------------------------------------------
+/// SIGTRAP, after the access: closes the page and passes a write on. The
+/// write handler may leave with siglongjmp() (power cut): the access is over
+/// by then.
+//------------------------------------------------------------------------------
+static void Step(int signal, siginfo_t *info, void *context)
+{
+    ucontext_t *uc = context;
+    MmioRegion *region = stepped.region;
+    unsigned long address = stepped.address;
+    unsigned int value = 0;
+
+    uc->uc_mcontext.gregs[REG_EFL] &= ~TRAP_FLAG;
+    if (!stepped.pending) {
+
+        return;
+    }
+
+    if (stepped.write && region && region->write) {
+
+        memcpy(&value, (void *) address,
+               (stepped.size < sizeof(value)) ? stepped.size : sizeof(value));
+        if (region->memory) {
+
+            memcpy((void *) address, stepped.saved, stepped.size);
+        }
+    }
+    mprotect((void *) PAGE_OF(address), PAGE_SIZE, Protection(PAGE_OF(address)));
+    stepped.pending = 0;
+
+    if (stepped.write && region && region->write) {
+
+        region->write(region->device, address - region->base, value,
+                      stepped.size);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Adds a region and installs the signal handlers with the first one.
+//------------------------------------------------------------------------------
+static MmioRegion * AddRegion(unsigned int base, unsigned int size)
+{
+    struct sigaction action;
+
+    if (numRegions == MAX_REGIONS) {
+
+        Fatal("too many regions", base);
+    }
+    if (numRegions == 0) {
+
+        memset(&action, 0, sizeof(action));
+        action.sa_flags = SA_SIGINFO;
+        action.sa_sigaction = Fault;
+        sigaction(SIGSEGV, &action, 0);
+        action.sa_sigaction = Step;
+        sigaction(SIGTRAP, &action, 0);
+    }
+    regions[numRegions].base = base;
+    regions[numRegions].size = size;
+
+    return &regions[numRegions++];
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Maps the registers of a simulated peripheral. The other addresses of the
+/// pages it touches behave as memory.
+/// \param base  Address of the registers on the target.
+/// \param size  Size of the register block.
+/// \param read  Handler of the reads, or 0 for reads of the last write.
+/// \param write  Handler of the writes, or 0.
+/// \param device  Argument of the handlers.
+//------------------------------------------------------------------------------
+void MMIO_Map(unsigned int base,
+              unsigned int size,
+              MmioRead read,
+              MmioWrite write,
+              void *device)
+{
+    unsigned long page;
+    unsigned long end = PAGE_OF((unsigned long) base + size - 1);
+    MmioRegion *region;
+
+    for (page = PAGE_OF(base); page <= end; page += PAGE_SIZE) {
+
+        if (!IsMapped(page)
+            && (mmap((void *) page, PAGE_SIZE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0)
+                == MAP_FAILED)) {
+
+            Fatal("cannot map", page);
+        }
+    }
+
+    region = AddRegion(base, size);
+    region->read = read;
+    region->write = write;
+    region->device = device;
+    region->memory = 0;
+    for (page = PAGE_OF(base); page <= end; page += PAGE_SIZE) {
+
+        mprotect((void *) page, PAGE_SIZE, PROT_NONE);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Maps memory at a fixed address, on its own pages.
+/// Returns the alias through which the simulator changes it.
+/// \param base  Address on the target, page-aligned.
+/// \param size  Size, a whole number of pages.
+/// \param fd  File that holds the content, at least size bytes, opened for
+///            reading and writing; -1 for anonymous memory, cleared.
+/// \param write  Handler of the writes of the drivers, which then do not
+///               change the memory; 0 for plain memory.
+/// \param device  Argument of the handler.
+//------------------------------------------------------------------------------
+void * MMIO_MapMemory(unsigned int base,
+                      unsigned int size,
+                      int fd,
+                      MmioWrite write,
+                      void *device)
+{
+    MmioRegion *region;
+    void *alias;
+
+    if ((base % PAGE_SIZE) || (size % PAGE_SIZE) || IsMapped(base)) {
+
+        Fatal("invalid memory region", base);
+    }
+    if (fd < 0) {
+
+        fd = memfd_create("mmio", 0);
+        if ((fd < 0) || (ftruncate(fd, size) != 0)) {
+
+            Fatal("cannot create memory", base);
+        }
+    }
+
+    if ((mmap((void *) (unsigned long) base, size,
+              write ? PROT_READ : (PROT_READ | PROT_WRITE),
+              MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0) == MAP_FAILED)
+        || ((alias = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))
+            == MAP_FAILED)) {
+
+        Fatal("cannot map", base);
+    }
+
+    region = AddRegion(base, size);
+    region->read = 0;
+    region->write = write;
+    region->device = device;
+    region->memory = 1;
+
+    return alias;
+}
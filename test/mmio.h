@@ -0,0 +1,59 @@
+/* ----------------------------------------------------------------------------
+ *         Simulated peripherals at their target addresses
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Maps the registers of a simulated peripheral at its address of the target,
+** with no access right: each access of a driver faults, the simulator
+** answers it, and the instruction is single-stepped on the real page. Reads
+** thus have their side effects (flags cleared when read, FIFOs) and writes
+** reach the simulator in order, write-only registers included, while the
+** drivers build unchanged.
+**
+** A memory region (flash, controller SRAM) is ordinary memory at a fixed
+** address. Given a write handler, it is read-only to the drivers and their
+** writes go to the handler instead (a flash page latch); the simulator
+** changes it through the alias that MMIO_MapMemory() returns.
+**
+** Linux on x86-64 only: the access size comes from the faulting instruction
+** (moves, and read-modify-write instructions on registers), and the tests
+** are linked without PIE so that their buffers have 32-bit addresses for the
+** PDC and DMA registers.
+*/
+
+#ifndef MMIO_H
+#define MMIO_H
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Read of size bytes (1, 2 or 4) at offset from the base of the region.
+typedef unsigned int (*MmioRead)(void *device,
+                                 unsigned int offset,
+                                 unsigned int size);
+
+/// Write of size bytes at offset from the base of the region.
+typedef void (*MmioWrite)(void *device,
+                          unsigned int offset,
+                          unsigned int value,
+                          unsigned int size);
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void MMIO_Map(unsigned int base,
+                     unsigned int size,
+                     MmioRead read,
+                     MmioWrite write,
+                     void *device);
+
+extern void * MMIO_MapMemory(unsigned int base,
+                             unsigned int size,
+                             int fd,
+                             MmioWrite write,
+                             void *device);
+
+#endif //#ifndef MMIO_H
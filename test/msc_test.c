@@ -0,0 +1,435 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of msc.c over ramdisk.c
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Exposes a RAM disk through the mass storage class and plays the host of
+** the bulk-only transport on usbdsim.c: SCSI commands with and without data,
+** multi-buffer reads and writes, the residue and halts of short or refused
+** data stages, medium errors, and the recovery of an invalid command block
+** by Bulk-Only Reset.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "usbdsim.h"
+#include "msc.h"
+#include "ramdisk.h"
+#include "evlog.h"
+
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define NUM_BLOCKS              64
+
+/// Bulk-only transport.
+#define CBW_SIZE                31
+#define CSW_SIZE                13
+#define CSW_PASSED              0
+#define CSW_FAILED              1
+#define CSW_PHASE_ERROR         2
+
+/// Sense keys and additional sense codes.
+#define SENSE_NOT_READY         0x2
+#define SENSE_MEDIUM_ERROR      0x3
+#define SENSE_ILLEGAL_REQUEST   0x5
+#define SENSE_DATA_PROTECT      0x7
+#define ASC_READ_ERROR          0x11
+#define ASC_INVALID_COMMAND     0x20
+#define ASC_OUT_OF_RANGE        0x21
+#define ASC_WRITE_PROTECTED     0x27
+#define ASC_NO_MEDIUM           0x3A
+
+/// Direction of the data stage.
+#define OUT                     0
+#define IN                      1
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static BlockDevice disk;
+static unsigned char memory[NUM_BLOCKS * BLOCK_SIZE];
+
+/// Read operation of the RAM disk, and the block it fails on.
+static unsigned char (*ramdiskRead)(BlockDevice *, unsigned int, void *,
+                                    unsigned int, BlockCallback, void *);
+static unsigned int badBlock = 0xFFFFFFFF;
+
+static unsigned char data[16 * BLOCK_SIZE];
+static unsigned char pattern[16 * BLOCK_SIZE];
+
+/// Result of the last command.
+static unsigned int tag;
+static unsigned int moved;
+static unsigned int residue;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// evlog.c
+//------------------------------------------------------------------------------
+void EVLOG_Write(unsigned short id, unsigned int value)
+{
+}
+
+//------------------------------------------------------------------------------
+/// BlockDevice.read of the RAM disk, with a bad block.
+//------------------------------------------------------------------------------
+static unsigned char FaultyRead(BlockDevice *device,
+                                unsigned int block,
+                                void *buffer,
+                                unsigned int count,
+                                BlockCallback callback,
+                                void *arg)
+{
+    if ((badBlock >= block) && (badBlock - block < count)) {
+
+        callback(arg, BLOCK_STATUS_ERROR);
+        return 1;
+    }
+    return ramdiskRead(device, block, buffer, count, callback, arg);
+}
+
+//------------------------------------------------------------------------------
+/// Sends a request on the control endpoint. Returns its reply.
+//------------------------------------------------------------------------------
+static unsigned char Control(unsigned char bmRequestType,
+                             unsigned char bRequest,
+                             unsigned short wValue,
+                             unsigned short wIndex,
+                             unsigned short wLength)
+{
+    unsigned char packet[8] = {
+
+        bmRequestType, bRequest, wValue & 0xFF, wValue >> 8,
+        wIndex & 0xFF, wIndex >> 8, wLength & 0xFF, wLength >> 8
+    };
+    UsbReply reply;
+
+    USBDSIM_Control(packet, 0, &reply);
+    return reply.action;
+}
+
+//------------------------------------------------------------------------------
+/// Clears the halt of an endpoint, as the host does on a STALL.
+//------------------------------------------------------------------------------
+static void ClearHalt(unsigned char address)
+{
+    CHECK(Control(0x02, USB_CLEAR_FEATURE, USB_FEATURE_ENDPOINT_HALT,
+                  address, 0) == USBCTL_STATUS);
+}
+
+//------------------------------------------------------------------------------
+/// Sends a command block.
+//------------------------------------------------------------------------------
+static unsigned int SendCbw(unsigned char in,
+                            unsigned int dataLength,
+                            const unsigned char *cb,
+                            unsigned char cbLength,
+                            unsigned int size)
+{
+    unsigned char cbw[CBW_SIZE + 1];
+
+    memset(cbw, 0, sizeof(cbw));
+    tag++;
+    cbw[0] = 'U';
+    cbw[1] = 'S';
+    cbw[2] = 'B';
+    cbw[3] = 'C';
+    memcpy(&cbw[4], &tag, 4);
+    memcpy(&cbw[8], &dataLength, 4);
+    cbw[12] = in ? 0x80 : 0x00;
+    cbw[14] = cbLength;
+    memcpy(&cbw[15], cb, cbLength);
+
+    return USBDSIM_Send(MSC_EP_OUT, cbw, size);
+}
+
+//------------------------------------------------------------------------------
+/// Runs a command as the host: command block, data stage (up to dataLength
+/// bytes, ended early by a short packet or a halt), then status, clearing
+/// the halts it meets. Returns the status, or 0xFF if the command block or
+/// the status is missing or invalid.
+/// \param in  Direction of the data stage.
+/// \param dataLength  Bytes the host expects to move.
+/// \param cb  Command descriptor block.
+/// \param cbLength  Its size.
+/// \param buffer  Data to send, or buffer for the data received.
+//------------------------------------------------------------------------------
+static unsigned char Command(unsigned char in,
+                             unsigned int dataLength,
+                             const unsigned char *cb,
+                             unsigned char cbLength,
+                             unsigned char *buffer)
+{
+    unsigned char address = in ? (USB_DIR_IN | MSC_EP_IN) : MSC_EP_OUT;
+    unsigned short maxPacket = USBDSIM_GetMaxPacket(MSC_EP_IN);
+    unsigned char csw[CSW_SIZE + 3];
+    unsigned int cswTag;
+    unsigned int size;
+
+    if (SendCbw(in, dataLength, cb, cbLength, CBW_SIZE) != CBW_SIZE) {
+
+        return 0xFF;
+    }
+
+    moved = 0;
+    while (moved < dataLength) {
+
+        if (in) {
+
+            size = USBDSIM_Receive(MSC_EP_IN, buffer + moved,
+                                   dataLength - moved);
+        }
+        else {
+
+            size = USBDSIM_Send(MSC_EP_OUT, buffer + moved,
+                                dataLength - moved);
+        }
+        moved += size;
+        if ((size == 0) || (in && (size % maxPacket))) {
+
+            break;
+        }
+    }
+    if (USBDSIM_IsHalted(address)) {
+
+        ClearHalt(address);
+    }
+
+    size = USBDSIM_Receive(MSC_EP_IN, csw, sizeof(csw));
+    if (size == 0) {
+
+        // The data stage ended with the endpoint halted
+        ClearHalt(USB_DIR_IN | MSC_EP_IN);
+        size = USBDSIM_Receive(MSC_EP_IN, csw, sizeof(csw));
+    }
+    memcpy(&cswTag, &csw[4], 4);
+    memcpy(&residue, &csw[8], 4);
+    if ((size != CSW_SIZE) || (memcmp(csw, "USBS", 4) != 0)
+        || (cswTag != tag)) {
+
+        return 0xFF;
+    }
+    return csw[12];
+}
+
+//------------------------------------------------------------------------------
+/// Runs READ(10) or WRITE(10).
+//------------------------------------------------------------------------------
+static unsigned char Transfer(unsigned char write,
+                              unsigned int block,
+                              unsigned short count,
+                              unsigned int dataLength,
+                              unsigned char *buffer)
+{
+    unsigned char cb[10] = {
+
+        write ? 0x2A : 0x28, 0,
+        block >> 24, (block >> 16) & 0xFF, (block >> 8) & 0xFF, block & 0xFF,
+        0, count >> 8, count & 0xFF, 0
+    };
+
+    return Command(!write, dataLength, cb, sizeof(cb), buffer);
+}
+
+//------------------------------------------------------------------------------
+/// Checks the sense data of the last failed command.
+//------------------------------------------------------------------------------
+static void CheckSense(unsigned char key, unsigned char asc)
+{
+    static const unsigned char requestSense[6] = { 0x03, 0, 0, 0, 18, 0 };
+    unsigned char sense[18];
+
+    CHECK(Command(IN, sizeof(sense), requestSense, 6, sense) == CSW_PASSED);
+    CHECK(moved == sizeof(sense));
+    CHECK(sense[0] == 0x70);
+    CHECK(sense[2] == key);
+    CHECK(sense[12] == asc);
+}
+
+//------------------------------------------------------------------------------
+/// Connects and configures the device.
+//------------------------------------------------------------------------------
+static void Enumerate(unsigned char highSpeed)
+{
+    USBDSIM_Reset(highSpeed);
+    CHECK(Control(0x00, USB_SET_ADDRESS, 5, 0, 0) == USBCTL_STATUS);
+    CHECK(Control(0x00, USB_SET_CONFIGURATION, 1, 0, 0) == USBCTL_STATUS);
+    CHECK(MSC_IsConfigured());
+    CHECK(USBDSIM_GetMaxPacket(MSC_EP_IN) == (highSpeed ? 512 : 64));
+}
+
+//------------------------------------------------------------------------------
+/// Commands without a data stage and short answers.
+//------------------------------------------------------------------------------
+static void TestCommands(void)
+{
+    static const unsigned char testUnitReady[6] = { 0x00 };
+    static const unsigned char inquiry[6] = { 0x12, 0, 0, 0, 36, 0 };
+    static const unsigned char capacity[10] = { 0x25 };
+    static const unsigned char unknown[6] = { 0xFF };
+
+    CHECK(Command(OUT, 0, testUnitReady, 6, 0) == CSW_PASSED);
+    CHECK(residue == 0);
+
+    CHECK(Command(IN, 36, inquiry, 6, data) == CSW_PASSED);
+    CHECK(moved == 36);
+    CHECK(residue == 0);
+    CHECK((data[0] == 0x00) && (data[1] == 0x80));
+    CHECK(memcmp(&data[8], "EIE ", 4) == 0);
+
+    // Shorter answer than expected: ended by a short packet, no halt
+    CHECK(Command(IN, 255, inquiry, 6, data) == CSW_PASSED);
+    CHECK(moved == 36);
+    CHECK(residue == 255 - 36);
+
+    CHECK(Command(IN, 8, capacity, 10, data) == CSW_PASSED);
+    CHECK((data[0] == 0) && (data[1] == 0) && (data[2] == 0)
+          && (data[3] == NUM_BLOCKS - 1));
+    CHECK((data[6] == 0x02) && (data[7] == 0x00));
+
+    CHECK(Command(OUT, 0, unknown, 6, 0) == CSW_FAILED);
+    CheckSense(SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+
+    // A data stage for a command without data
+    CHECK(Command(IN, 512, testUnitReady, 6, data) == CSW_PHASE_ERROR);
+    CHECK(residue == 512);
+
+    CHECK(Control(0xA1, 0xFE, 0, 0, 1) == USBCTL_DATA_IN);
+}
+
+//------------------------------------------------------------------------------
+/// READ(10) and WRITE(10) through the two buffers.
+//------------------------------------------------------------------------------
+static void TestTransfers(void)
+{
+    const MscStats *stats = MSC_GetStats();
+    unsigned int read = stats->blocksRead;
+    unsigned int written = stats->blocksWritten;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(pattern); i++) {
+
+        pattern[i] = (unsigned char) (i * 7 + (i >> 9));
+    }
+
+    // More blocks than the two buffers hold together
+    CHECK(Transfer(1, 5, 11, 11 * BLOCK_SIZE, pattern) == CSW_PASSED);
+    CHECK(moved == 11 * BLOCK_SIZE);
+    CHECK(residue == 0);
+    CHECK(memcmp(&memory[5 * BLOCK_SIZE], pattern, 11 * BLOCK_SIZE) == 0);
+    CHECK(stats->blocksWritten - written == 11);
+
+    memset(data, 0, sizeof(data));
+    CHECK(Transfer(0, 5, 11, 11 * BLOCK_SIZE, data) == CSW_PASSED);
+    CHECK(memcmp(data, pattern, 11 * BLOCK_SIZE) == 0);
+    CHECK(stats->blocksRead - read == 11);
+
+    // Last blocks of the disk, then past its end
+    CHECK(Transfer(0, NUM_BLOCKS - 2, 2, 2 * BLOCK_SIZE, data) == CSW_PASSED);
+    CHECK(Transfer(0, NUM_BLOCKS - 2, 3, 3 * BLOCK_SIZE, data) == CSW_FAILED);
+    CHECK(residue == 3 * BLOCK_SIZE);
+    CheckSense(SENSE_ILLEGAL_REQUEST, ASC_OUT_OF_RANGE);
+
+    // The host expects less data than the command moves
+    CHECK(Transfer(0, 0, 4, 2 * BLOCK_SIZE, data) == CSW_PHASE_ERROR);
+    // The host expects more: the device halts after its data
+    CHECK(Transfer(0, 0, 2, 4 * BLOCK_SIZE, data) == CSW_PASSED);
+    CHECK(moved == 2 * BLOCK_SIZE);
+    CHECK(residue == 2 * BLOCK_SIZE);
+    CHECK(Transfer(1, 20, 1, 2 * BLOCK_SIZE, pattern) == CSW_PASSED);
+    CHECK(residue == BLOCK_SIZE);
+
+    // Bad block in the second buffer: the first one still reaches the host
+    badBlock = 9;
+    CHECK(Transfer(0, 5, 8, 8 * BLOCK_SIZE, data) == CSW_FAILED);
+    CHECK(moved == 4 * BLOCK_SIZE);
+    CHECK(residue == 4 * BLOCK_SIZE);
+    CheckSense(SENSE_MEDIUM_ERROR, ASC_READ_ERROR);
+    badBlock = 0xFFFFFFFF;
+
+    disk.writeProtected = 1;
+    CHECK(Transfer(1, 0, 1, BLOCK_SIZE, pattern) == CSW_FAILED);
+    CheckSense(SENSE_DATA_PROTECT, ASC_WRITE_PROTECTED);
+    disk.writeProtected = 0;
+
+    disk.numBlocks = 0;
+    CHECK(Transfer(0, 0, 1, BLOCK_SIZE, data) == CSW_FAILED);
+    CheckSense(SENSE_NOT_READY, ASC_NO_MEDIUM);
+    disk.numBlocks = NUM_BLOCKS;
+}
+
+//------------------------------------------------------------------------------
+/// An invalid command block wedges both endpoints until Bulk-Only Reset.
+//------------------------------------------------------------------------------
+static void TestReset(void)
+{
+    static const unsigned char testUnitReady[6] = { 0x00 };
+    unsigned int failed = MSC_GetStats()->failed;
+
+    CHECK(SendCbw(OUT, 0, testUnitReady, 6, CBW_SIZE + 1) == CBW_SIZE + 1);
+    CHECK(USBDSIM_IsHalted(USB_DIR_IN | MSC_EP_IN));
+    CHECK(USBDSIM_IsHalted(MSC_EP_OUT));
+
+    // CLEAR_FEATURE alone does not revive them
+    ClearHalt(USB_DIR_IN | MSC_EP_IN);
+    ClearHalt(MSC_EP_OUT);
+    CHECK(USBDSIM_IsHalted(USB_DIR_IN | MSC_EP_IN));
+    CHECK(USBDSIM_IsHalted(MSC_EP_OUT));
+    CHECK(SendCbw(OUT, 0, testUnitReady, 6, CBW_SIZE) == 0);
+
+    // Reset recovery: Bulk-Only Reset, then CLEAR_FEATURE on both
+    CHECK(Control(0x21, 0xFF, 0, 0, 0) == USBCTL_STATUS);
+    CHECK(USBDSIM_IsHalted(USB_DIR_IN | MSC_EP_IN));
+    ClearHalt(USB_DIR_IN | MSC_EP_IN);
+    ClearHalt(MSC_EP_OUT);
+    CHECK(!USBDSIM_IsHalted(USB_DIR_IN | MSC_EP_IN));
+    CHECK(!USBDSIM_IsHalted(MSC_EP_OUT));
+
+    CHECK(Command(OUT, 0, testUnitReady, 6, 0) == CSW_PASSED);
+    CHECK(MSC_GetStats()->failed == failed);
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    HOST_Initialize();
+    RAMDISK_Initialize(&disk, memory, NUM_BLOCKS);
+    ramdiskRead = disk.read;
+    disk.read = FaultyRead;
+
+    // RAM disk alone
+    memset(pattern, 0x5A, sizeof(pattern));
+    CHECK(disk.write(&disk, NUM_BLOCKS - 1, pattern, 1, 0, 0));
+    CHECK(!disk.write(&disk, NUM_BLOCKS - 1, pattern, 2, 0, 0));
+    CHECK(!disk.read(&disk, NUM_BLOCKS, data, 1, 0, 0));
+    CHECK(disk.read(&disk, NUM_BLOCKS - 1, data, 1, 0, 0));
+    CHECK(memcmp(data, pattern, BLOCK_SIZE) == 0);
+
+    MSC_Initialize(&disk);
+    USBD_Connect();
+
+    Enumerate(1);
+    TestCommands();
+    TestTransfers();
+    TestReset();
+
+    Enumerate(0);
+    TestTransfers();
+
+    return CHECK_Result("msc_test");
+}
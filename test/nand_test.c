@@ -0,0 +1,232 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of nand.c
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Runs the NAND driver unchanged against nandsim.c: identification, pages
+** programmed whole and a sector at a time, spare reads, erases, bad block
+** markers and failed operations, and the ECC: one flipped bit per sector,
+** in the data or in the stored code, is corrected; two are reported, for
+** that sector only.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "nandsim.h"
+#include "nand.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define MCK                     96000000
+
+#define RAW_PAGE_SIZE           (NAND_PAGE_SIZE + NAND_SPARE_SIZE)
+
+/// Page number of a page of a block.
+#define ROW(block, page)        ((block) * NANDSIM_PAGES_PER_BLOCK + (page))
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static unsigned char pattern[NAND_PAGE_SIZE];
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Programs the sectors given of a page from the pattern, the others erased.
+//------------------------------------------------------------------------------
+static unsigned char Program(unsigned int page, unsigned int sectors)
+{
+    unsigned char *buffer = NAND_GetBuffer();
+    unsigned int i;
+
+    memset(buffer, 0xFF, RAW_PAGE_SIZE);
+    for (i = 0; i < NAND_SECTORS_PER_PAGE; i++) {
+
+        if (sectors & (1 << i)) {
+
+            memcpy(&buffer[i * NAND_SECTOR_SIZE], &pattern[i * NAND_SECTOR_SIZE],
+                   NAND_SECTOR_SIZE);
+        }
+    }
+    return NAND_ProgramPage(page, sectors);
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the buffer holds the pattern.
+//------------------------------------------------------------------------------
+static unsigned char HoldsPattern(void)
+{
+    return memcmp(NAND_GetBuffer(), pattern, NAND_PAGE_SIZE) == 0;
+}
+
+//------------------------------------------------------------------------------
+/// Pages programmed and read, whole and a sector at a time; spare reads and
+/// erases.
+//------------------------------------------------------------------------------
+static void TestPages(void)
+{
+    unsigned char *buffer = NAND_GetBuffer();
+    unsigned char spare[NAND_SPARE_USED];
+    const NandStats *stats = NAND_GetStats();
+
+    CHECK(Program(ROW(1, 0), 0xF));
+    memset(buffer, 0, RAW_PAGE_SIZE);
+    CHECK(NAND_ReadPage(ROW(1, 0)) == 1);
+    CHECK(HoldsPattern());
+    CHECK(NAND_GetUnreadable() == 0);
+    CHECK((stats->corrected == 0) && (stats->uncorrectable == 0));
+
+    // The user bytes of the spare area come back, beside the codes
+    memset(buffer, 0xFF, RAW_PAGE_SIZE);
+    memcpy(buffer, pattern, NAND_PAGE_SIZE);
+    memcpy(&buffer[NAND_PAGE_SIZE + NAND_SPARE_USER], "tag", 3);
+    CHECK(NAND_ProgramPage(ROW(1, 1), 0xF));
+    CHECK(NAND_ReadSpare(ROW(1, 1), spare, sizeof(spare)));
+    CHECK(spare[NAND_SPARE_BAD] == 0xFF);
+    CHECK(memcmp(&spare[NAND_SPARE_USER], "tag", 3) == 0);
+    CHECK((spare[NAND_SPARE_ECC] & spare[NAND_SPARE_ECC + 1]
+           & spare[NAND_SPARE_ECC + 2]) != 0xFF);
+
+    // A sector at a time: the sectors not written yet are not checked
+    CHECK(Program(ROW(1, 2), 0x2));
+    CHECK(NAND_ReadPage(ROW(1, 2)) == 1);
+    CHECK(memcmp(&buffer[NAND_SECTOR_SIZE], &pattern[NAND_SECTOR_SIZE],
+                 NAND_SECTOR_SIZE) == 0);
+    CHECK(buffer[0] == 0xFF);
+    CHECK(Program(ROW(1, 2), 0x1));
+    CHECK(Program(ROW(1, 2), 0xC));
+    CHECK(NAND_ReadPage(ROW(1, 2)) == 1);
+    CHECK(HoldsPattern());
+
+    // Erased
+    CHECK(NAND_EraseBlock(1));
+    CHECK(NAND_ReadPage(ROW(1, 0)) == 1);
+    CHECK((buffer[0] == 0xFF) && (buffer[NAND_PAGE_SIZE - 1] == 0xFF));
+    CHECK(NAND_ReadSpare(ROW(1, 1), spare, sizeof(spare)));
+    CHECK(spare[NAND_SPARE_USER] == 0xFF);
+    CHECK(stats->failures == 0);
+}
+
+//------------------------------------------------------------------------------
+/// Flipped bits: one per sector corrected, two reported.
+//------------------------------------------------------------------------------
+static void TestEcc(void)
+{
+    const NandStats *stats = NAND_GetStats();
+    unsigned int corrected = stats->corrected;
+    unsigned int bit;
+
+    // One bit in each sector, at both ends and inside
+    CHECK(Program(ROW(2, 0), 0xF));
+    NANDSIM_FlipBit(ROW(2, 0), 0, 0);
+    NANDSIM_FlipBit(ROW(2, 0), NAND_SECTOR_SIZE + 1, 3);
+    NANDSIM_FlipBit(ROW(2, 0), 2 * NAND_SECTOR_SIZE + 300, 6);
+    NANDSIM_FlipBit(ROW(2, 0), 3 * NAND_SECTOR_SIZE + NAND_SECTOR_SIZE - 1, 7);
+    CHECK(NAND_ReadPage(ROW(2, 0)) == NAND_CORRECTED);
+    CHECK(HoldsPattern());
+    CHECK(NAND_GetUnreadable() == 0);
+    CHECK(stats->corrected == corrected + 4);
+
+    // Bit positions across a sector
+    CHECK(Program(ROW(2, 1), 0xF));
+    for (bit = 0; bit < NAND_SECTOR_SIZE * 8; bit += 37) {
+
+        NANDSIM_FlipBit(ROW(2, 1), NAND_SECTOR_SIZE + (bit >> 3), bit & 7);
+        CHECK(NAND_ReadPage(ROW(2, 1)) == NAND_CORRECTED);
+        CHECK(HoldsPattern());
+        NANDSIM_FlipBit(ROW(2, 1), NAND_SECTOR_SIZE + (bit >> 3), bit & 7);
+    }
+
+    // One bit of a stored code: the data is good as read
+    CHECK(Program(ROW(2, 2), 0xF));
+    NANDSIM_FlipBit(ROW(2, 2), NAND_PAGE_SIZE + NAND_SPARE_ECC + 3 * 2 + 1, 4);
+    CHECK(NAND_ReadPage(ROW(2, 2)) == NAND_CORRECTED);
+    CHECK(HoldsPattern());
+
+    // Two bits of a sector: that sector is reported, the others corrected
+    corrected = stats->corrected;
+    CHECK(Program(ROW(2, 3), 0xF));
+    NANDSIM_FlipBit(ROW(2, 3), 10, 1);
+    NANDSIM_FlipBit(ROW(2, 3), 2 * NAND_SECTOR_SIZE + 5, 0);
+    NANDSIM_FlipBit(ROW(2, 3), 2 * NAND_SECTOR_SIZE + 77, 5);
+    CHECK(NAND_ReadPage(ROW(2, 3)) == 0);
+    CHECK(NAND_GetUnreadable() == (1 << 2));
+    CHECK(stats->uncorrectable == 1);
+    CHECK(stats->corrected == corrected + 1);
+    CHECK(memcmp(NAND_GetBuffer(), pattern, 2 * NAND_SECTOR_SIZE) == 0);
+
+    // A sector never written is not checked, whatever it reads
+    CHECK(Program(ROW(2, 4), 0x1));
+    NANDSIM_FlipBit(ROW(2, 4), 3 * NAND_SECTOR_SIZE, 0);
+    NANDSIM_FlipBit(ROW(2, 4), 3 * NAND_SECTOR_SIZE + 1, 0);
+    CHECK(NAND_ReadPage(ROW(2, 4)) == 1);
+}
+
+//------------------------------------------------------------------------------
+/// Bad block markers and failed operations.
+//------------------------------------------------------------------------------
+static void TestBadBlocks(void)
+{
+    const NandStats *stats = NAND_GetStats();
+
+    CHECK(!NAND_IsBad(3));
+    NANDSIM_SetBad(3);
+    CHECK(NAND_IsBad(3));
+
+    CHECK(!NAND_IsBad(4));
+    NAND_MarkBad(4);
+    CHECK(NAND_IsBad(4));
+    CHECK(NAND_EraseBlock(4));
+    CHECK(!NAND_IsBad(4));
+
+    // A worn block fails its erases and programs
+    CHECK(Program(ROW(5, 0), 0xF));
+    NANDSIM_Wear(5);
+    CHECK(!NAND_EraseBlock(5));
+    CHECK(!Program(ROW(5, 1), 0xF));
+    CHECK(stats->failures == 2);
+    NAND_MarkBad(5);
+    CHECK(NAND_IsBad(5));
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    const NandInfo *info = NAND_GetInfo();
+    unsigned int i;
+
+    HOST_Initialize();
+    NANDSIM_Initialize();
+    srand(1);
+    for (i = 0; i < sizeof(pattern); i++) {
+
+        pattern[i] = rand();
+    }
+
+    CHECK(NAND_Initialize(MCK));
+    CHECK(info->maker == 0x2C);
+    CHECK(info->numBlocks == NANDSIM_NUM_BLOCKS);
+    CHECK(info->pagesPerBlock == NANDSIM_PAGES_PER_BLOCK);
+    CHECK(info->rowCycles == 2);
+
+    TestPages();
+    TestEcc();
+    TestBadBlocks();
+
+    return CHECK_Result("nand_test");
+}
@@ -0,0 +1,299 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of nandftl.c
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Runs the translation layer over nand.c and nandsim.c, against a model of
+** the sectors written: writes in place, rewrites into replacements, their
+** promotion and the folds, a mount, then faults in the array. A sector read
+** with a flipped bit comes back corrected and its block is folded; one with
+** two is reported, and a fold leaves it erased and counted in lostSectors; a
+** block that fails a program is retired; a bad block of the maker is skipped.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "nandsim.h"
+#include "nandftl.h"
+#include "nand.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define MCK                     96000000
+
+/// Sectors of a logical block, and logical blocks of the model.
+#define SECTORS_PER_BLOCK       (NANDSIM_PAGES_PER_BLOCK * NAND_SECTORS_PER_PAGE)
+#define NUM_LOGICAL             8
+#define NUM_SECTORS             (NUM_LOGICAL * SECTORS_PER_BLOCK)
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static BlockDevice disk;
+
+/// Version of each sector written, 0 if never written (or lost).
+static unsigned int versions[NUM_SECTORS];
+
+static unsigned char data[SECTORS_PER_BLOCK * BLOCK_SIZE];
+
+static unsigned char status;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// BlockCallback: records the status.
+//------------------------------------------------------------------------------
+static void Done(void *arg, unsigned char result)
+{
+    status = result;
+}
+
+//------------------------------------------------------------------------------
+/// Fills the content of a version of a sector: its number and version, then
+/// bytes derived from them. Version 0 is erased.
+//------------------------------------------------------------------------------
+static void Fill(unsigned char *buffer, unsigned int sector, unsigned int version)
+{
+    unsigned int seed = sector * 2654435761u + version * 40503u;
+    unsigned int i;
+
+    if (version == 0) {
+
+        memset(buffer, 0xFF, BLOCK_SIZE);
+        return;
+    }
+    memcpy(buffer, &sector, 4);
+    memcpy(buffer + 4, &version, 4);
+    for (i = 8; i < BLOCK_SIZE; i++) {
+
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = seed >> 16;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Writes a new version of sectors.
+//------------------------------------------------------------------------------
+static void Write(unsigned int sector, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+
+        Fill(&data[i * BLOCK_SIZE], sector + i, ++versions[sector + i]);
+    }
+    status = 0xFF;
+    CHECK(disk.write(&disk, sector, data, count, Done, 0));
+    CHECK(status == BLOCK_STATUS_OK);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the number of sectors that do not read as the model.
+//------------------------------------------------------------------------------
+static unsigned int Verify(unsigned int sector, unsigned int count)
+{
+    unsigned char expected[BLOCK_SIZE];
+    unsigned int errors = 0;
+    unsigned int i;
+
+    status = 0xFF;
+    if (!disk.read(&disk, sector, data, count, Done, 0)
+        || (status != BLOCK_STATUS_OK)) {
+
+        return count;
+    }
+    for (i = 0; i < count; i++) {
+
+        Fill(expected, sector + i, versions[sector + i]);
+        if (memcmp(&data[i * BLOCK_SIZE], expected, BLOCK_SIZE)) {
+
+            errors++;
+        }
+    }
+    return errors;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if every sector of the model reads back.
+//------------------------------------------------------------------------------
+static unsigned char VerifyAll(void)
+{
+    unsigned int errors = 0;
+    unsigned int logical;
+
+    for (logical = 0; logical < NUM_LOGICAL; logical++) {
+
+        errors += Verify(logical * SECTORS_PER_BLOCK, SECTORS_PER_BLOCK);
+    }
+    return errors == 0;
+}
+
+//------------------------------------------------------------------------------
+/// Finds the page and offset of the current version of a sector.
+//------------------------------------------------------------------------------
+static unsigned char Locate(unsigned int sector,
+                            unsigned int *page,
+                            unsigned int *offset)
+{
+    unsigned char header[8];
+
+    memcpy(header, &sector, 4);
+    memcpy(header + 4, &versions[sector], 4);
+    return NANDSIM_Find(header, sizeof(header), page, offset);
+}
+
+//------------------------------------------------------------------------------
+/// Writes in place, rewrites, promotion and folds.
+//------------------------------------------------------------------------------
+static void TestWrites(void)
+{
+    const NandftlStats *stats = NANDFTL_GetStats();
+    unsigned int i;
+
+    CHECK(disk.numBlocks == (NANDSIM_NUM_BLOCKS - NANDFTL_RESERVED_BLOCKS)
+                            * SECTORS_PER_BLOCK);
+    CHECK(!disk.write(&disk, disk.numBlocks - 1, data, 2, Done, 0));
+    CHECK(!disk.read(&disk, disk.numBlocks, data, 1, Done, 0));
+
+    // Never written: erased
+    CHECK(Verify(0, SECTORS_PER_BLOCK) == 0);
+
+    // In place, in order
+    Write(0, SECTORS_PER_BLOCK);
+    CHECK(VerifyAll());
+    CHECK(stats->folds == 0);
+
+    // Rewritten whole, in order: the replacement becomes the primary
+    // without a fold
+    Write(0, SECTORS_PER_BLOCK);
+    CHECK(Verify(0, SECTORS_PER_BLOCK) == 0);
+    CHECK(stats->promotions == 1);
+    CHECK(stats->folds == 0);
+
+    // A rewrite goes to a replacement, a second one of the same sector folds
+    Write(10, 1);
+    CHECK(Verify(0, SECTORS_PER_BLOCK) == 0);
+    CHECK(stats->folds == 0);
+    Write(10, 1);
+    CHECK(Verify(0, SECTORS_PER_BLOCK) == 0);
+    CHECK(stats->folds == 1);
+
+    // Rewrites out of order, over more logical blocks than replacements; the
+    // last one is left to TestBadBlocks()
+    for (i = 0; i < 60; i++) {
+
+        Write(rand() % (NUM_SECTORS - SECTORS_PER_BLOCK - 8),
+              1 + rand() % 8 * (rand() % 4 == 0));
+    }
+    CHECK(VerifyAll());
+    CHECK(stats->folds > 10);
+    CHECK(stats->readErrors == 0);
+    CHECK(stats->lostSectors == 0);
+
+    // Mounted again
+    CHECK(NANDFTL_Initialize(&disk));
+    CHECK(VerifyAll());
+    CHECK(stats->badBlocks == 0);
+    CHECK(NANDFTL_GetStats()->freeBlocks
+          >= NANDSIM_NUM_BLOCKS - NUM_LOGICAL - NANDFTL_MAX_REPLACEMENTS);
+}
+
+//------------------------------------------------------------------------------
+/// Flipped bits: corrected and folded, or lost by a fold.
+//------------------------------------------------------------------------------
+static void TestBitErrors(void)
+{
+    const NandftlStats *stats = NANDFTL_GetStats();
+    unsigned int sector = 3 * SECTORS_PER_BLOCK + 21;
+    unsigned int folds;
+    unsigned int page;
+    unsigned int offset;
+    unsigned int newPage;
+
+    // One bit: read corrected, and the block folded away from it
+    Write(sector, 1);
+    CHECK(Locate(sector, &page, &offset));
+    NANDSIM_FlipBit(page, offset + 100, 2);
+    folds = stats->folds;
+    CHECK(Verify(sector, 1) == 0);
+    CHECK(stats->folds == folds + 1);
+    CHECK(Locate(sector, &newPage, &offset) && (newPage != page));
+    CHECK(VerifyAll());
+
+    // Two bits: the read fails; a fold then leaves the sector erased
+    CHECK(Locate(sector, &page, &offset));
+    NANDSIM_FlipBit(page, offset + 7, 0);
+    NANDSIM_FlipBit(page, offset + 300, 5);
+    CHECK(Verify(sector, 1) == 1);
+    CHECK(stats->readErrors == 1);
+
+    // Rewriting a sector of another page twice forces the fold
+    Write(sector + 8, 1);
+    Write(sector + 8, 1);
+    CHECK(stats->lostSectors == 1);
+    versions[sector] = 0;
+    CHECK(Verify(sector, 1) == 0);
+    CHECK(VerifyAll());
+
+    CHECK(NANDFTL_Initialize(&disk));
+    CHECK(VerifyAll());
+}
+
+//------------------------------------------------------------------------------
+/// A block that fails a program is retired; a bad block of the maker is
+/// skipped at mount.
+//------------------------------------------------------------------------------
+static void TestBadBlocks(void)
+{
+    const NandftlStats *stats = NANDFTL_GetStats();
+    unsigned int sector = (NUM_LOGICAL - 1) * SECTORS_PER_BLOCK;
+    unsigned int page;
+    unsigned int offset;
+
+    // A logical block half written in place, its primary worn out
+    Write(sector, SECTORS_PER_BLOCK / 2);
+    CHECK(Locate(sector, &page, &offset));
+    NANDSIM_Wear(page / NANDSIM_PAGES_PER_BLOCK);
+    Write(sector + SECTORS_PER_BLOCK / 2, 4);
+    CHECK(stats->badBlocks == 1);
+    CHECK(Verify(sector, SECTORS_PER_BLOCK / 2 + 4) == 0);
+    CHECK(VerifyAll());
+
+    NANDSIM_SetBad(NANDSIM_NUM_BLOCKS - 1);
+    CHECK(NANDFTL_Initialize(&disk));
+    CHECK(stats->badBlocks == 2);
+    CHECK(Verify(sector, SECTORS_PER_BLOCK / 2 + 4) == 0);
+    CHECK(VerifyAll());
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    HOST_Initialize();
+    NANDSIM_Initialize();
+    srand(1);
+
+    CHECK(NAND_Initialize(MCK));
+    CHECK(NANDFTL_Initialize(&disk));
+
+    TestWrites();
+    TestBitErrors();
+    TestBadBlocks();
+
+    return CHECK_Result("nandftl_test");
+}
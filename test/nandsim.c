@@ -0,0 +1,479 @@
+/* ----------------------------------------------------------------------------
+ *         Simulated NAND flash and HSMC4 NAND flash controller
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "nandsim.h"
+#include "nand.h"
+#include "mmio.h"
+#include "AT91SAM3U4.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define RAW_PAGE_SIZE           (NAND_PAGE_SIZE + NAND_SPARE_SIZE)
+#define BLOCK_BYTES             (NANDSIM_PAGES_PER_BLOCK * RAW_PAGE_SIZE)
+
+/// Command area of NCS0 (NFCCMD set), and NFC SRAM mapped.
+#define COMMAND_AREA            (NAND_EBI_BASE | (1u << 27))
+#define COMMAND_AREA_SIZE       (1u << 27)
+#define SRAM_SIZE               4096
+
+/// Fields of a command address.
+#define CMD1(address)           (((address) >> 2) & 0xFF)
+#define CMD2(address)           (((address) >> 10) & 0xFF)
+#define VCMD2                   (1u << 18)
+#define ACYCLE(address)         (((address) >> 19) & 0x7)
+#define NFCEN                   (1u << 25)
+#define NFCWR                   (1u << 26)
+
+/// Device commands.
+#define CMD_READ                0x00
+#define CMD_PROGRAM             0x80
+#define CMD_PROGRAM_CONFIRM     0x10
+#define CMD_ERASE               0x60
+#define CMD_STATUS              0x70
+#define CMD_READ_ID             0x90
+#define CMD_RESET               0xFF
+
+/// READ ID: Micron, 1 Gbit 3.3 V, 2048-byte pages, 64-byte spare, 128 KB
+/// blocks, 8 bits.
+static const unsigned char nandId[] = { 0x2C, 0xF1, 0x80, 0x15 };
+
+/// Status register: ready, not protected; bit 0 on a failure.
+#define STATUS_READY            0xE0
+#define STATUS_FAIL             0x01
+
+/// Register offsets.
+#define REG(name)               offsetof(AT91S_HSMC4, name)
+
+/// Reads of HSMC4_SR before the flags of a command show.
+#define BUSY_READS              1
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Controller and device.
+typedef struct {
+
+    /// Blocks of the array; 0 while erased.
+    unsigned char *blocks[NANDSIM_NUM_BLOCKS];
+    unsigned char worn[NANDSIM_NUM_BLOCKS];
+    unsigned char *sram;
+
+    unsigned int registers[sizeof(AT91S_HSMC4) / 4];
+    unsigned int sr;
+    unsigned int flags;
+    unsigned int busy;
+    unsigned int parity[NAND_SECTORS_PER_PAGE];
+
+    /// Page register of the device, its column, and the page it goes to.
+    unsigned char page[RAW_PAGE_SIZE];
+    unsigned int column;
+    unsigned int row;
+    unsigned char status;
+    /// Bytes read from the data register: from the page register, or the
+    /// identifier or status.
+    const unsigned char *output;
+    unsigned int outputSize;
+
+} NandSim;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static NandSim nand;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns a page of the array, or 0 if its block is erased (or out of the
+/// device) and create is 0. A block created reads erased.
+//------------------------------------------------------------------------------
+static unsigned char * Page(unsigned int row, unsigned char create)
+{
+    unsigned int block = row / NANDSIM_PAGES_PER_BLOCK;
+
+    if (block >= NANDSIM_NUM_BLOCKS) {
+
+        return 0;
+    }
+    if (!nand.blocks[block] && create) {
+
+        nand.blocks[block] = malloc(BLOCK_BYTES);
+        memset(nand.blocks[block], 0xFF, BLOCK_BYTES);
+    }
+    if (!nand.blocks[block]) {
+
+        return 0;
+    }
+    return nand.blocks[block] + (row % NANDSIM_PAGES_PER_BLOCK) * RAW_PAGE_SIZE;
+}
+
+//------------------------------------------------------------------------------
+/// Computes the codes of the sectors of a page, as the controller does while
+/// it moves the data.
+//------------------------------------------------------------------------------
+static void ComputeParity(const unsigned char *data)
+{
+    unsigned int sector;
+    unsigned int position;
+    unsigned int low;
+    unsigned int high;
+
+    for (sector = 0; sector < NAND_SECTORS_PER_PAGE; sector++) {
+
+        low = 0;
+        high = 0;
+        for (position = 0; position < NAND_SECTOR_SIZE * 8; position++) {
+
+            if (data[sector * NAND_SECTOR_SIZE + (position >> 3)]
+                & (1 << (position & 7))) {
+
+                low ^= position;
+                high ^= ~position & 0xFFF;
+            }
+        }
+        nand.parity[sector] = low | (high << 12);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Loads a page into the page register (READ confirmed).
+//------------------------------------------------------------------------------
+static void LoadPage(unsigned int row)
+{
+    const unsigned char *page = Page(row, 0);
+
+    if (page) {
+
+        memcpy(nand.page, page, RAW_PAGE_SIZE);
+    }
+    else {
+
+        memset(nand.page, 0xFF, RAW_PAGE_SIZE);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Programs the page register (PROGRAM confirmed): bits only clear.
+//------------------------------------------------------------------------------
+static void ProgramPage(unsigned int row)
+{
+    unsigned char *page = Page(row, 1);
+    unsigned int i;
+
+    nand.status = STATUS_READY;
+    if (!page) {
+
+        nand.status |= STATUS_FAIL;
+        return;
+    }
+    for (i = 0; i < RAW_PAGE_SIZE; i++) {
+
+        page[i] &= nand.page[i];
+    }
+    if (nand.worn[row / NANDSIM_PAGES_PER_BLOCK]) {
+
+        nand.status |= STATUS_FAIL;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Erases a block: a worn one fails and keeps its content.
+//------------------------------------------------------------------------------
+static void EraseBlock(unsigned int row)
+{
+    unsigned int block = row / NANDSIM_PAGES_PER_BLOCK;
+
+    nand.status = STATUS_READY;
+    if ((block >= NANDSIM_NUM_BLOCKS) || nand.worn[block]) {
+
+        nand.status |= STATUS_FAIL;
+        return;
+    }
+    free(nand.blocks[block]);
+    nand.blocks[block] = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Runs a command written to the command area.
+/// \param address  Offset in the command area: the command fields.
+/// \param cycles  Address cycles after the first one.
+//------------------------------------------------------------------------------
+static void Command(unsigned int address, unsigned int cycles)
+{
+    unsigned char bytes[5];
+    unsigned int count = ACYCLE(address);
+    unsigned int flags = AT91C_HSMC4_CMDDONE;
+    unsigned int i;
+
+    bytes[0] = nand.registers[REG(HSMC4_ADDR) / 4];
+    for (i = 1; i < sizeof(bytes); i++) {
+
+        bytes[i] = cycles >> (8 * (i - 1));
+    }
+
+    switch (CMD1(address)) {
+
+    case CMD_RESET:
+        nand.output = 0;
+        flags |= AT91C_HSMC4_RBEDGE0;
+        break;
+
+    case CMD_READ_ID:
+        nand.output = nandId;
+        nand.outputSize = sizeof(nandId);
+        break;
+
+    case CMD_STATUS:
+        nand.output = &nand.status;
+        nand.outputSize = 1;
+        break;
+
+    case CMD_READ:
+        // Column (2 cycles), then row
+        nand.column = bytes[0] | (bytes[1] << 8);
+        nand.row = bytes[2] | (bytes[3] << 8) | ((count > 4) ? bytes[4] << 16 : 0);
+        LoadPage(nand.row);
+        flags |= AT91C_HSMC4_RBEDGE0;
+        if (address & NFCEN) {
+
+            // The page, and its spare area if asked, to the SRAM
+            ComputeParity(nand.page);
+            memcpy(nand.sram, nand.page,
+                   (nand.registers[REG(HSMC4_CFG) / 4] & AT91C_HSMC4_RSPARE)
+                   ? RAW_PAGE_SIZE : NAND_PAGE_SIZE);
+            nand.column = RAW_PAGE_SIZE;
+            flags |= AT91C_HSMC4_XFRDONE;
+        }
+        nand.output = nand.page + nand.column;
+        nand.outputSize = RAW_PAGE_SIZE - nand.column;
+        break;
+
+    case CMD_PROGRAM:
+        nand.column = bytes[0] | (bytes[1] << 8);
+        nand.row = bytes[2] | (bytes[3] << 8) | ((count > 4) ? bytes[4] << 16 : 0);
+        memset(nand.page, 0xFF, RAW_PAGE_SIZE);
+        nand.output = 0;
+        if ((address & NFCEN) && (address & NFCWR)) {
+
+            // The data from the SRAM; the spare area follows from the CPU
+            ComputeParity(nand.sram);
+            memcpy(nand.page, nand.sram, NAND_PAGE_SIZE);
+            nand.column = NAND_PAGE_SIZE;
+            flags |= AT91C_HSMC4_XFRDONE;
+        }
+        break;
+
+    case CMD_PROGRAM_CONFIRM:
+        ProgramPage(nand.row);
+        flags |= AT91C_HSMC4_RBEDGE0;
+        break;
+
+    case CMD_ERASE:
+        EraseBlock(bytes[0] | (bytes[1] << 8) | ((count > 2) ? bytes[2] << 16 : 0));
+        flags |= AT91C_HSMC4_RBEDGE0;
+        break;
+
+    default:
+        flags = AT91C_HSMC4_UNDEF;
+        break;
+    }
+
+    nand.flags |= flags;
+    nand.busy = BUSY_READS;
+}
+
+//------------------------------------------------------------------------------
+/// Reads of the HSMC4 registers.
+//------------------------------------------------------------------------------
+static unsigned int ReadRegister(void *device,
+                                 unsigned int offset,
+                                 unsigned int size)
+{
+    unsigned int value;
+
+    switch (offset) {
+
+    case REG(HSMC4_SR):
+        if (nand.busy) {
+
+            nand.busy--;
+            return 0;
+        }
+        value = nand.flags;
+        nand.flags = 0;
+        return value;
+
+    case REG(HSMC4_ECCPR0): return nand.parity[0];
+    case REG(HSMC4_ECCPR1): return nand.parity[1];
+    case REG(HSMC4_ECCPR2): return nand.parity[2];
+    case REG(HSMC4_ECCPR3): return nand.parity[3];
+    }
+    return nand.registers[offset / 4];
+}
+
+//------------------------------------------------------------------------------
+/// Writes of the HSMC4 registers.
+//------------------------------------------------------------------------------
+static void WriteRegister(void *device,
+                          unsigned int offset,
+                          unsigned int value,
+                          unsigned int size)
+{
+    switch (offset) {
+
+    case REG(HSMC4_IER):
+        nand.registers[REG(HSMC4_IMR) / 4] |= value;
+        break;
+
+    case REG(HSMC4_IDR):
+        nand.registers[REG(HSMC4_IMR) / 4] &= ~value;
+        break;
+
+    case REG(HSMC4_ECCCR):
+        if (value & AT91C_HSMC4_ECCRESET) {
+
+            memset(nand.parity, 0, sizeof(nand.parity));
+        }
+        break;
+
+    default:
+        nand.registers[offset / 4] = value;
+        break;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Reads of the data register: the next byte of the page register, the
+/// identifier or the status.
+//------------------------------------------------------------------------------
+static unsigned int ReadData(void *device, unsigned int offset, unsigned int size)
+{
+    if (!nand.output || (nand.outputSize == 0)) {
+
+        return 0xFF;
+    }
+    nand.outputSize--;
+    return *nand.output++;
+}
+
+//------------------------------------------------------------------------------
+/// Writes of the data register: the next byte of the page register.
+//------------------------------------------------------------------------------
+static void WriteData(void *device,
+                      unsigned int offset,
+                      unsigned int value,
+                      unsigned int size)
+{
+    if (nand.column < RAW_PAGE_SIZE) {
+
+        nand.page[nand.column++] = value;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Writes of the command area.
+//------------------------------------------------------------------------------
+static void WriteCommand(void *device,
+                         unsigned int offset,
+                         unsigned int value,
+                         unsigned int size)
+{
+    Command(offset, value);
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Maps the controller and an erased device, once per test program, after
+/// HOST_Initialize().
+//------------------------------------------------------------------------------
+void NANDSIM_Initialize(void)
+{
+    memset(&nand, 0, sizeof(nand));
+    nand.status = STATUS_READY;
+    MMIO_Map((unsigned int) (unsigned long) AT91C_BASE_HSMC4, sizeof(AT91S_HSMC4),
+             ReadRegister, WriteRegister, 0);
+    MMIO_Map(NAND_EBI_BASE, 4, ReadData, WriteData, 0);
+    MMIO_Map(COMMAND_AREA, COMMAND_AREA_SIZE, 0, WriteCommand, 0);
+    nand.sram = MMIO_MapMemory(NAND_NFC_SRAM, SRAM_SIZE, -1, 0, 0);
+}
+
+//------------------------------------------------------------------------------
+/// Flips a bit of a programmed page, as a cell that lost or gained charge.
+/// \param page  Page number.
+/// \param offset  Byte of the page, spare area included.
+/// \param bit  Bit of the byte.
+//------------------------------------------------------------------------------
+void NANDSIM_FlipBit(unsigned int page, unsigned int offset, unsigned int bit)
+{
+    Page(page, 1)[offset] ^= 1 << bit;
+}
+
+//------------------------------------------------------------------------------
+/// Marks a block bad, as the maker does: in the spare area of its first page.
+//------------------------------------------------------------------------------
+void NANDSIM_SetBad(unsigned int block)
+{
+    Page(block * NANDSIM_PAGES_PER_BLOCK, 1)[NAND_PAGE_SIZE + NAND_SPARE_BAD] = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Wears a block out: its erases fail, and so do its programs, although the
+/// bits still get programmed.
+//------------------------------------------------------------------------------
+void NANDSIM_Wear(unsigned int block)
+{
+    nand.worn[block] = 1;
+}
+
+//------------------------------------------------------------------------------
+/// Finds data in the array, at a sector boundary.
+/// Returns 1 if found, with its page and its offset in the page; otherwise 0.
+//------------------------------------------------------------------------------
+unsigned char NANDSIM_Find(const void *data,
+                           unsigned int size,
+                           unsigned int *page,
+                           unsigned int *offset)
+{
+    const unsigned char *bytes;
+    unsigned int row;
+    unsigned int i;
+
+    for (row = 0; row < NANDSIM_NUM_BLOCKS * NANDSIM_PAGES_PER_BLOCK; row++) {
+
+        bytes = Page(row, 0);
+        if (!bytes) {
+
+            row += NANDSIM_PAGES_PER_BLOCK - 1;
+            continue;
+        }
+        for (i = 0; i < NAND_PAGE_SIZE; i += NAND_SECTOR_SIZE) {
+
+            if (memcmp(bytes + i, data, size) == 0) {
+
+                *page = row;
+                *offset = i;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
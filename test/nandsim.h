@@ -0,0 +1,51 @@
+/* ----------------------------------------------------------------------------
+ *         Simulated NAND flash and HSMC4 NAND flash controller
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** A 1 Gbit large-page device (1024 blocks of 64 pages of 2048 + 64 bytes)
+** behind the NFC: the HSMC4 registers, the command area of NCS0 and its data
+** register, and the NFC SRAM. The controller moves whole pages between the
+** device and the SRAM and computes the Hamming code of each 512-byte sector
+** as they go through, as the driver expects it: the low 12 bits are the XOR
+** of the positions (byte << 3 | bit) of the bits set, the high 12 bits that
+** of their complements. Programming only clears bits; an erased block reads
+** 0xFF. Flags of HSMC4_SR show up after a busy read, and are cleared when
+** read.
+**
+** Faults are injected in the array: flipped bits (in the data or the spare
+** area, including the stored codes), blocks marked bad by the maker, and
+** worn blocks whose erases and programs report a failure.
+*/
+
+#ifndef NANDSIM_H
+#define NANDSIM_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+#define NANDSIM_NUM_BLOCKS      1024
+#define NANDSIM_PAGES_PER_BLOCK 64
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void NANDSIM_Initialize(void);
+
+extern void NANDSIM_FlipBit(unsigned int page,
+                            unsigned int offset,
+                            unsigned int bit);
+
+extern void NANDSIM_SetBad(unsigned int block);
+
+extern void NANDSIM_Wear(unsigned int block);
+
+extern unsigned char NANDSIM_Find(const void *data,
+                                  unsigned int size,
+                                  unsigned int *page,
+                                  unsigned int *offset);
+
+#endif //#ifndef NANDSIM_H
@@ -0,0 +1,416 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of scheduler.c
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Drives the scheduler with SCHED_Tick(), SCHED_Advance() and SCHED_RunOnce()
+** as SysTick and the idle loop would. Ready tasks must run in the order of
+** the table, each task in the ticks of its releases, also with periods longer
+** than the timing wheel and across its wrap-around, and SCHED_Advance() over
+** the idle ticks of SCHED_GetIdleTicks() must release as tick by tick. The
+** execution times, overruns and deadline misses are then checked on a task
+** whose cycles and lateness the test sets.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "scheduler.h"
+#include "evlog.h"
+#include "tickless.h"
+
+#include <stdlib.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Cycle counter at the start of each run.
+#define CYCLES_BASE             100000
+
+/// Ticks of the release tests.
+#define NUM_TICKS               2000
+
+/// Tasks of the release tests.
+#define NUM_TASKS               8
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static SchedulerTask tasks[SCHED_MAX_TASKS];
+
+/// Periods and offsets of the release tests: shorter than, equal to and
+/// longer than the wheel, over several turns of it. The last task, released
+/// on every tick, is left out of the tickless test.
+static const unsigned int periods[NUM_TASKS] = {7, 31, 32, 33, 45, 100, 250, 1};
+static const unsigned int offsets[NUM_TASKS] = {3, 5, 0, 1, 17, 64, 2, 0};
+
+/// Cycles spent by the next run.
+static unsigned int cost;
+
+/// Events written, and the value of the last one.
+static unsigned int overrunEvents;
+static unsigned int lateEvents;
+static unsigned int lastValue;
+
+/// Last tick given to the watchdog.
+static unsigned int supervised;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// evlog.c: events are counted instead.
+//------------------------------------------------------------------------------
+void EVLOG_Write(unsigned short id, unsigned int value)
+{
+    if (id == EVLOG_ID_TASK_OVERRUN) {
+
+        overrunEvents++;
+    }
+    else if (id == EVLOG_ID_TASK_LATE) {
+
+        lateEvents++;
+    }
+    lastValue = value;
+}
+
+//------------------------------------------------------------------------------
+/// watchdog.c
+//------------------------------------------------------------------------------
+void WDT_Supervise(unsigned int tick)
+{
+    supervised = tick;
+}
+
+//------------------------------------------------------------------------------
+/// clock.c
+//------------------------------------------------------------------------------
+unsigned int CLOCK_GetMck(void)
+{
+    return 96000000;
+}
+
+//------------------------------------------------------------------------------
+/// tickless.c: SCHED_Run() is not called.
+//------------------------------------------------------------------------------
+unsigned int TICKLESS_Sleep(unsigned int maxTicks, unsigned int tickHz)
+{
+    return maxTicks;
+}
+
+//------------------------------------------------------------------------------
+/// Body of every task: spends its cycles.
+//------------------------------------------------------------------------------
+static void Work(void)
+{
+    HOST_SetCycles(CYCLES_BASE + cost);
+}
+
+//------------------------------------------------------------------------------
+/// Sets up and registers tasks with the given periods and offsets.
+//------------------------------------------------------------------------------
+static void Initialize(const unsigned int *period,
+                       const unsigned int *offset,
+                       unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+
+        tasks[i].name = "task";
+        tasks[i].run = Work;
+        tasks[i].period = period[i];
+        tasks[i].deadline = period[i];
+        tasks[i].offset = offset[i];
+    }
+    SCHED_Initialize(tasks, count);
+}
+
+//------------------------------------------------------------------------------
+/// Runs the next ready task, spending the given cycles.
+/// Returns its index; -1 if no task was ready, -2 if none counted the run.
+//------------------------------------------------------------------------------
+static int RunNext(unsigned int cycles, unsigned int count)
+{
+    unsigned int runs[SCHED_MAX_TASKS];
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+
+        runs[i] = SCHED_GetStats(i)->runs;
+    }
+    cost = cycles;
+    HOST_SetCycles(CYCLES_BASE);
+    if (!SCHED_RunOnce()) {
+
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+
+        if (SCHED_GetStats(i)->runs != runs[i]) {
+
+            return i;
+        }
+    }
+    return -2;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the number of releases of a task of the release tests up to a
+/// tick.
+//------------------------------------------------------------------------------
+static unsigned int Releases(unsigned int index, unsigned int tick)
+{
+    if (tick < offsets[index]) {
+
+        return 0;
+    }
+    return (tick - offsets[index]) / periods[index] + 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if a task of the release tests is released in a tick.
+//------------------------------------------------------------------------------
+static unsigned char IsRelease(unsigned int index, unsigned int tick)
+{
+    return (tick >= offsets[index])
+           && ((tick - offsets[index]) % periods[index] == 0);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the ticks from a tick to the next release of the first count tasks
+/// of the release tests.
+//------------------------------------------------------------------------------
+static unsigned int NextRelease(unsigned int tick, unsigned int count)
+{
+    unsigned int next = 0xFFFFFFFF;
+    unsigned int delay;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+
+        if (tick < offsets[i]) {
+
+            delay = offsets[i] - tick;
+        }
+        else {
+
+            delay = periods[i] - (tick - offsets[i]) % periods[i];
+        }
+        if (delay < next) {
+
+            next = delay;
+        }
+    }
+    return next;
+}
+
+//------------------------------------------------------------------------------
+/// Runs every ready task; returns 1 if each one runs in a tick where it has
+/// just been released, in the order of the table.
+//------------------------------------------------------------------------------
+static unsigned char Drain(unsigned int count)
+{
+    unsigned int now = SCHED_GetTicks();
+    unsigned char ok = 1;
+    int previous = -1;
+    int index;
+
+    while ((index = RunNext(0, count)) >= 0) {
+
+        if ((index <= previous)
+            || !IsRelease(index, now)
+            || (SCHED_GetStats(index)->runs != Releases(index, now))) {
+
+            ok = 0;
+        }
+        previous = index;
+    }
+    return ok && (index == -1);
+}
+
+//------------------------------------------------------------------------------
+/// Tasks released in the same tick run in the order of the table: first all
+/// 32, then a random half of them.
+//------------------------------------------------------------------------------
+static void TestPriority(void)
+{
+    unsigned int period[SCHED_MAX_TASKS];
+    unsigned int offset[SCHED_MAX_TASKS];
+    unsigned int released;
+    unsigned char ordered = 1;
+    int previous;
+    int index;
+    unsigned int i;
+
+    for (i = 0; i < SCHED_MAX_TASKS; i++) {
+
+        period[i] = 1000;
+        offset[i] = 0;
+    }
+    Initialize(period, offset, SCHED_MAX_TASKS);
+    for (i = 0; i < SCHED_MAX_TASKS; i++) {
+
+        CHECK(RunNext(0, SCHED_MAX_TASKS) == (int) i);
+    }
+    CHECK(RunNext(0, SCHED_MAX_TASKS) == -1);
+
+    // Half of the tasks released at tick 40, in several turns of the wheel
+    released = 0;
+    for (i = 0; i < SCHED_MAX_TASKS; i++) {
+
+        offset[i] = (rand() & 1) ? 40 : 41 + i;
+        released |= (offset[i] == 40) ? 0x80000000u >> i : 0;
+    }
+    Initialize(period, offset, SCHED_MAX_TASKS);
+    for (i = 0; i < 40; i++) {
+
+        CHECK(RunNext(0, SCHED_MAX_TASKS) == -1);
+        SCHED_Tick();
+    }
+    previous = -1;
+    while ((index = RunNext(0, SCHED_MAX_TASKS)) >= 0) {
+
+        if ((index <= previous) || !(released & (0x80000000u >> index))) {
+
+            ordered = 0;
+        }
+        released &= ~(0x80000000u >> index);
+        previous = index;
+    }
+    CHECK(ordered);
+    CHECK(released == 0);
+    CHECK(SCHED_GetStats(SCHED_MAX_TASKS) == 0);
+}
+
+//------------------------------------------------------------------------------
+/// Tick by tick, running the ready tasks after each tick.
+//------------------------------------------------------------------------------
+static void TestWheel(void)
+{
+    unsigned char ok = 1;
+    unsigned int tick;
+    unsigned int i;
+
+    Initialize(periods, offsets, NUM_TASKS);
+    ok &= Drain(NUM_TASKS);
+    for (tick = 1; tick <= NUM_TICKS; tick++) {
+
+        SCHED_Tick();
+        ok &= (SCHED_GetTicks() == tick) && (supervised == tick);
+        ok &= Drain(NUM_TASKS);
+    }
+    CHECK(ok);
+
+    for (i = 0; i < NUM_TASKS; i++) {
+
+        CHECK(SCHED_GetStats(i)->runs == Releases(i, NUM_TICKS));
+        CHECK(SCHED_GetStats(i)->overruns == 0);
+        CHECK(SCHED_GetStats(i)->deadlineMisses == 0);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Tickless: the idle ticks go to the next release, and SCHED_Advance() over
+/// them, or over fewer after an early wakeup, releases as tick by tick.
+//------------------------------------------------------------------------------
+static void TestAdvance(void)
+{
+    unsigned char ok = 1;
+    unsigned int idle;
+    unsigned int skip;
+    unsigned int i;
+
+    // Without the task of period 1, which leaves no idle tick
+    Initialize(periods, offsets, NUM_TASKS - 1);
+
+    while (SCHED_GetTicks() < NUM_TICKS) {
+
+        ok &= Drain(NUM_TASKS - 1);
+        idle = SCHED_GetIdleTicks();
+        ok &= (idle == NextRelease(SCHED_GetTicks(), NUM_TASKS - 1));
+
+        // Every third sleep ends early
+        skip = ((rand() % 3) == 0) ? 1 + rand() % idle : idle;
+        SCHED_Advance(skip);
+        ok &= (supervised == SCHED_GetTicks());
+    }
+    ok &= Drain(NUM_TASKS - 1);
+    CHECK(ok);
+
+    SCHED_Advance(0);
+    CHECK(supervised == SCHED_GetTicks());
+    for (i = 0; i < NUM_TASKS - 1; i++) {
+
+        CHECK(SCHED_GetStats(i)->runs == Releases(i, SCHED_GetTicks()));
+        CHECK(SCHED_GetStats(i)->overruns == 0);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Execution time, overruns and deadline misses of a task.
+//------------------------------------------------------------------------------
+static void TestStatistics(void)
+{
+    const SchedulerStats *stats;
+    unsigned int period = 10;
+    unsigned int offset = 0;
+    unsigned int i;
+
+    Initialize(&period, &offset, 1);
+    tasks[0].deadline = 3;
+    stats = SCHED_GetStats(0);
+
+    CHECK(RunNext(100, 1) == 0);
+    CHECK((stats->runs == 1) && (stats->wcet == 100));
+
+    // Completed on its deadline, then one tick after it
+    for (i = 0; i < 13; i++) {
+
+        SCHED_Tick();
+    }
+    CHECK(RunNext(5000, 1) == 0);
+    CHECK((stats->wcet == 5000) && (stats->deadlineMisses == 0));
+    for (i = 0; i < 11; i++) {
+
+        SCHED_Tick();
+    }
+    CHECK(RunNext(300, 1) == 0);
+    CHECK((stats->wcet == 5000) && (stats->deadlineMisses == 1));
+    CHECK((lateEvents == 1) && (lastValue == 0));
+
+    // Released again before it ran: one overrun, and the lateness counts
+    // from the last release
+    for (i = 0; i < 16; i++) {
+
+        SCHED_Tick();
+    }
+    CHECK(stats->overruns == 1);
+    CHECK((overrunEvents == 1) && (lastValue == 0));
+    CHECK(RunNext(0, 1) == 0);
+    CHECK(RunNext(0, 1) == -1);
+    CHECK((stats->runs == 4) && (stats->deadlineMisses == 1));
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    HOST_Initialize();
+    srand(1);
+
+    TestPriority();
+    TestWheel();
+    TestAdvance();
+    TestStatistics();
+
+    return CHECK_Result("scheduler_test");
+}
@@ -0,0 +1,316 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of tickless.c
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Runs thousands of TICKLESS_Sleep() over a model of SysTick and of the RTT
+** that keeps the real time. Between sleeps the core stays awake for a while
+** and SysTick counts its ticks from where it was restarted; each sleep starts
+** anywhere in a tick and ends at the RTT alarm, up to two ticks late, or
+** early on another interrupt. The ticks reported must never run ahead of the
+** real time, and fall behind it by less than a tick plus what the sleeps
+** cannot see: the part of an RTT period the counter does not show at an
+** early wakeup, and the latency after the alarm. The fractions of a tick
+** carry from one sleep to the next.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "mmio.h"
+#include "tickless.h"
+#include "AT91SAM3U4.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define TICK_HZ                 1000
+
+/// The model counts time in the units of tickless.c: a tick is
+/// TICKLESS_RTT_HZ units, an RTT period TICK_HZ units.
+#define UNITS_PER_TICK          TICKLESS_RTT_HZ
+#define UNITS_PER_PERIOD        TICK_HZ
+
+/// SysTick cycles per unit: the reload holds a whole number of units.
+#define CYCLES_PER_UNIT         10
+#define MCK                     (UNITS_PER_TICK * CYCLES_PER_UNIT * TICK_HZ)
+
+#define NUM_SLEEPS              5000
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Real time, and the time SysTick was last started.
+static unsigned long long now;
+static unsigned long long sysTickStart;
+
+/// Ticks counted by SysTick and reported by the sleeps.
+static unsigned long long credited;
+
+/// RTT: time of its last restart, alarm, and the counter once the core woke up.
+static unsigned long long rttStart;
+static unsigned int alarm;
+static unsigned int counter;
+static unsigned char awake;
+
+/// How the next sleep ends.
+static unsigned char early;
+static unsigned int latency;
+
+/// Time the sleeps could not account for, summed over all the wakeups: the
+/// part of an RTT period the counter cannot show, and the latency after the
+/// alarm.
+static unsigned long long hidden;
+
+/// Calls of clock.c by the Wait mode.
+static unsigned int configured[CLOCK_NUM_OPERATING_POINTS];
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// clock.c: the Wait mode changes the operating point.
+//------------------------------------------------------------------------------
+unsigned char CLOCK_Configure(unsigned int index)
+{
+    configured[index]++;
+    return 1;
+}
+
+unsigned int CLOCK_GetMck(void)
+{
+    return MCK;
+}
+
+//------------------------------------------------------------------------------
+/// Reads of the RTT. The core sleeps until the first read of the counter,
+/// which decides when it woke up.
+//------------------------------------------------------------------------------
+static unsigned int ReadRtt(void *device, unsigned int offset, unsigned int size)
+{
+    unsigned long long slept;
+
+    if (offset != offsetof(AT91S_RTTC, RTTC_RTVR)) {
+
+        return 0;
+    }
+    if (!awake) {
+
+        // The alarm fires when the counter reaches RTTC_RTAR + 1
+        slept = (unsigned long long) (alarm + 1) * UNITS_PER_PERIOD;
+        if (early) {
+
+            slept = (unsigned long long) rand() * rand() % slept;
+            hidden += slept % UNITS_PER_PERIOD;
+        }
+        else {
+
+            // Past the alarm, only the latency is lost
+            slept += latency;
+            hidden += latency;
+        }
+        now = rttStart + slept;
+        counter = slept / UNITS_PER_PERIOD;
+        awake = 1;
+    }
+    return counter;
+}
+
+//------------------------------------------------------------------------------
+/// Writes of the RTT.
+//------------------------------------------------------------------------------
+static void WriteRtt(void *device,
+                     unsigned int offset,
+                     unsigned int value,
+                     unsigned int size)
+{
+    if (offset == offsetof(AT91S_RTTC, RTTC_RTAR)) {
+
+        alarm = value;
+    }
+    else if ((offset == offsetof(AT91S_RTTC, RTTC_RTMR))
+             && (value & AT91C_RTTC_RTTRST)) {
+
+        rttStart = now;
+        awake = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Stays awake for some time; returns the SysTick interrupts taken.
+//------------------------------------------------------------------------------
+static unsigned int Run(unsigned long long time)
+{
+    unsigned int ticks = (now + time - sysTickStart) / UNITS_PER_TICK
+                         - (now - sysTickStart) / UNITS_PER_TICK;
+
+    now += time;
+    return ticks;
+}
+
+//------------------------------------------------------------------------------
+/// Sleeps from the current time, SysTick being where the real time has taken
+/// it. Returns the ticks reported, or -1 if SysTick was not restarted.
+//------------------------------------------------------------------------------
+static int Sleep(unsigned int maxTicks)
+{
+    AT91PS_NVIC nvic = AT91C_BASE_NVIC;
+    unsigned int units = (now - sysTickStart) % UNITS_PER_TICK;
+    unsigned int slept;
+
+    // SysTick counts down from the reload
+    nvic->NVIC_STICKCVR = UNITS_PER_TICK * CYCLES_PER_UNIT - 1
+                          - units * CYCLES_PER_UNIT;
+    nvic->NVIC_STICKCSR = AT91C_NVIC_STICKCLKSOURCE | AT91C_NVIC_STICKINT
+                          | AT91C_NVIC_STICKENABLE;
+    slept = TICKLESS_Sleep(maxTicks, TICK_HZ);
+
+    if ((nvic->NVIC_STICKCVR != 0)
+        || !(nvic->NVIC_STICKCSR & AT91C_NVIC_STICKENABLE)
+        || (nvic->NVIC_STICKRVR != UNITS_PER_TICK * CYCLES_PER_UNIT - 1)) {
+
+        return -1;
+    }
+    sysTickStart = now;
+    return slept;
+}
+
+//------------------------------------------------------------------------------
+/// Sleeps between short runs, ending earlyPercent of the sleeps early and
+/// the others up to maxLatency units after the alarm.
+/// Returns 1 if the ticks reported always stayed behind the real time, by
+/// less than a tick plus the hidden time.
+//------------------------------------------------------------------------------
+static unsigned char Simulate(unsigned int earlyPercent,
+                              unsigned int maxLatency,
+                              unsigned int *earlyWakeups)
+{
+    unsigned int maxTicks;
+    unsigned char ok = 1;
+    int slept;
+    unsigned int i;
+
+    *earlyWakeups = 0;
+    for (i = 0; i < NUM_SLEEPS; i++) {
+
+        credited += Run(rand() % (3 * UNITS_PER_TICK));
+
+        maxTicks = TICKLESS_MIN_TICKS + rand() % 40;
+        early = (unsigned int) (rand() % 100) < earlyPercent;
+        latency = maxLatency ? rand() % maxLatency : 0;
+        *earlyWakeups += early;
+        slept = Sleep(maxTicks);
+        if ((slept < 0) || ((unsigned int) slept > maxTicks)) {
+
+            ok = 0;
+            break;
+        }
+        credited += slept;
+
+        // Never ahead, and behind by less than a tick plus the hidden time
+        if ((credited * UNITS_PER_TICK > now)
+            || (now - credited * UNITS_PER_TICK >= hidden + UNITS_PER_TICK)) {
+
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+/// Sleeps ended by the alarm: the fractions of a tick at either end of each
+/// sleep carry over, with nothing hidden.
+//------------------------------------------------------------------------------
+static void TestAlarm(void)
+{
+    const TicklessStats *stats = TICKLESS_GetStats();
+    unsigned int earlyWakeups;
+    unsigned int sleeps = stats->sleeps + stats->waits;
+
+    CHECK(Simulate(0, 0, &earlyWakeups));
+    CHECK(hidden == 0);
+    CHECK(stats->sleeps + stats->waits == sleeps + NUM_SLEEPS);
+    CHECK(stats->earlyWakeups == 0);
+    CHECK((stats->waits > 0) && (stats->sleeps > 0));
+
+    // The Wait mode runs from the RC and restores the operating point
+    CHECK(configured[CLOCK_OP_4MHZ_RC] == stats->waits);
+    CHECK(configured[TICKLESS_OPERATING_POINT] == stats->waits);
+    CHECK(!(AT91C_BASE_PMC->PMC_FSMR & AT91C_PMC_LPM));
+
+    // Late wakeups, as after the PLL lock of the Wait mode, never report
+    // more than the ticks asked for
+    CHECK(Simulate(0, 2 * UNITS_PER_TICK, &earlyWakeups));
+}
+
+//------------------------------------------------------------------------------
+/// Sleeps ended early by other interrupts, and a peripheral running.
+//------------------------------------------------------------------------------
+static void TestEarly(void)
+{
+    const TicklessStats *stats = TICKLESS_GetStats();
+    unsigned int before = stats->earlyWakeups;
+    unsigned int denied = stats->waitsDenied;
+    unsigned int waits = stats->waits;
+    unsigned int earlyWakeups;
+
+    AT91C_BASE_PMC->PMC_PCSR = 1 << AT91C_ID_US0;
+    CHECK(Simulate(30, UNITS_PER_PERIOD / 2, &earlyWakeups));
+    CHECK(stats->waits == waits);
+    CHECK(stats->waitsDenied > denied);
+    AT91C_BASE_PMC->PMC_PCSR = 0;
+    CHECK(stats->earlyWakeups - before == earlyWakeups);
+}
+
+//------------------------------------------------------------------------------
+/// No sleep while a tick is due, or for less than TICKLESS_MIN_TICKS; long
+/// sleeps are split.
+//------------------------------------------------------------------------------
+static void TestLimits(void)
+{
+    AT91PS_NVIC nvic = AT91C_BASE_NVIC;
+
+    CHECK(TICKLESS_Sleep(TICKLESS_MIN_TICKS - 1, TICK_HZ) == 0);
+
+    nvic->NVIC_STICKCSR = AT91C_NVIC_STICKENABLE;
+    nvic->NVIC_ICSR = AT91C_NVIC_PENDSTSET;
+    CHECK(TICKLESS_Sleep(100, TICK_HZ) == 0);
+    CHECK(nvic->NVIC_STICKCSR & AT91C_NVIC_STICKENABLE);
+    nvic->NVIC_ICSR = 0;
+
+    early = 0;
+    latency = 0;
+    CHECK(Sleep(TICKLESS_MAX_TICKS + 1000) == TICKLESS_MAX_TICKS);
+    CHECK(alarm <= TICKLESS_MAX_TICKS * TICKLESS_RTT_HZ / TICK_HZ);
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    HOST_Initialize();
+    MMIO_Map((unsigned int) (unsigned long) AT91C_BASE_NVIC, sizeof(AT91S_NVIC),
+             0, 0, 0);
+    MMIO_Map((unsigned int) (unsigned long) AT91C_BASE_RTTC, sizeof(AT91S_RTTC),
+             ReadRtt, WriteRtt, 0);
+    AT91C_BASE_NVIC->NVIC_STICKRVR = UNITS_PER_TICK * CYCLES_PER_UNIT - 1;
+    srand(1);
+
+    TestAlarm();
+    TestEarly();
+    TestLimits();
+
+    return CHECK_Result("tickless_test");
+}
@@ -0,0 +1,310 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of twi.c
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Runs the TWI driver unchanged against the simulated bus of twisim.c:
+** register reads and writes of every size, the queue, NACK and arbitration
+** retries, the poll list, and the interrupts taken per transaction.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "twisim.h"
+#include "twi.h"
+#include "evlog.h"
+#include "exceptions.h"
+#include "AT91SAM3U4.h"
+
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define SENSOR                  0x48
+#define EEPROM                  0x50
+/// Nothing answers at this address.
+#define ABSENT                  0x23
+
+/// Bus steps after which any transaction of these tests is over.
+#define MAX_STEPS               2000
+
+/// Sensors of the poll list.
+#define NUM_POLLED              8
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static TwiSimDevice devices[2];
+
+/// Transactions and buffers are static: the PDC takes 32-bit addresses.
+static TwiTransaction transactions[NUM_POLLED];
+static unsigned char buffers[NUM_POLLED][64];
+
+static unsigned int interrupts;
+static unsigned int failures;
+
+/// Order of the callbacks.
+static unsigned int completed[NUM_POLLED];
+static unsigned int numCompleted;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// evlog.c: failed transactions are counted instead.
+//------------------------------------------------------------------------------
+void EVLOG_Write(unsigned short id, unsigned int value)
+{
+    if (id == EVLOG_ID_TWI_FAILED) {
+
+        failures++;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Records the order of the callbacks.
+//------------------------------------------------------------------------------
+static void Callback(void *arg, unsigned char status)
+{
+    completed[numCompleted++] = (unsigned int) (unsigned long) arg;
+}
+
+//------------------------------------------------------------------------------
+/// Moves bus 0 until it waits, taking its interrupt whenever it is pending.
+/// Returns the number of steps.
+//------------------------------------------------------------------------------
+static unsigned int Run(void)
+{
+    unsigned int steps = 0;
+    unsigned int nested;
+
+    while (steps < MAX_STEPS) {
+
+        for (nested = 0; TWISIM_IsPending(0) && (nested < 4); nested++) {
+
+            TWI0_IrqHandler();
+            interrupts++;
+        }
+        if (!TWISIM_Step(0) && !TWISIM_IsPending(0)) {
+
+            break;
+        }
+        steps++;
+    }
+    return steps;
+}
+
+//------------------------------------------------------------------------------
+/// Runs one transaction to its end. Returns its status.
+//------------------------------------------------------------------------------
+static unsigned char Transfer(unsigned char address,
+                              unsigned char reg,
+                              unsigned char read,
+                              unsigned short size)
+{
+    TWI_Setup(&transactions[0], address, reg, 1, read, buffers[0], size, 0, 0);
+    CHECK(TWI_Submit(0, &transactions[0]));
+    Run();
+    return TWI_GetStatus(&transactions[0]);
+}
+
+//------------------------------------------------------------------------------
+/// Register writes and reads of every size, with the interrupts they take.
+//------------------------------------------------------------------------------
+static void TestTransfers(void)
+{
+    static const unsigned short sizes[] = { 1, 2, 3, 4, 16, 64 };
+    unsigned int i, j;
+    unsigned int before;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+
+        for (j = 0; j < sizes[i]; j++) {
+
+            buffers[0][j] = (unsigned char) (i * 37 + j);
+        }
+        before = interrupts;
+        CHECK(Transfer(EEPROM, 0x40 + i, 0, sizes[i]) == TWI_STATUS_DONE);
+        CHECK(memcmp(&devices[1].registers[0x40 + i], buffers[0], sizes[i])
+              == 0);
+        // ENDTX and TXCOMP, whatever the size
+        CHECK(interrupts - before == 2);
+
+        memset(buffers[0], 0, sizeof(buffers[0]));
+        before = interrupts;
+        CHECK(Transfer(EEPROM, 0x40 + i, 1, sizes[i]) == TWI_STATUS_DONE);
+        CHECK(memcmp(&devices[1].registers[0x40 + i], buffers[0], sizes[i])
+              == 0);
+        // ENDRX, two RXRDY and TXCOMP at most: the PDC takes the rest
+        CHECK(interrupts - before <= 4);
+    }
+    CHECK(TWI_GetStats(0)->transactions == 2 * i);
+    CHECK(TWI_GetStats(0)->failures == 0);
+}
+
+//------------------------------------------------------------------------------
+/// Transactions queued together run in order.
+//------------------------------------------------------------------------------
+static void TestQueue(void)
+{
+    unsigned int i;
+
+    numCompleted = 0;
+    for (i = 0; i < 4; i++) {
+
+        TWI_Setup(&transactions[i], (i & 1) ? SENSOR : EEPROM, i, 1, i >= 2,
+                  buffers[i], 4, Callback, (void *) (unsigned long) i);
+        CHECK(TWI_Submit(0, &transactions[i]));
+    }
+    CHECK(TWI_GetStatus(&transactions[0]) == TWI_STATUS_BUSY);
+    CHECK(TWI_GetStatus(&transactions[3]) == TWI_STATUS_QUEUED);
+    // Already queued
+    CHECK(!TWI_Submit(0, &transactions[3]));
+
+    Run();
+    CHECK(numCompleted == 4);
+    for (i = 0; i < 4; i++) {
+
+        CHECK(completed[i] == i);
+        CHECK(TWI_GetStatus(&transactions[i]) == TWI_STATUS_DONE);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// NACK and arbitration loss: retried, then failed without stopping the
+/// queue.
+//------------------------------------------------------------------------------
+static void TestRetries(void)
+{
+    TwiStats before = *TWI_GetStats(0);
+    const TwiStats *stats = TWI_GetStats(0);
+
+    // Busy device: acknowledges on the last retry
+    devices[0].nacks = TWI_MAX_RETRIES;
+    CHECK(Transfer(SENSOR, 0, 1, 2) == TWI_STATUS_DONE);
+    CHECK(stats->nacks - before.nacks == TWI_MAX_RETRIES);
+    CHECK(stats->retries - before.retries == TWI_MAX_RETRIES);
+    CHECK(devices[0].nacks == 0);
+
+    // Absent device
+    CHECK(Transfer(ABSENT, 0, 0, 4) == TWI_STATUS_NACK);
+    CHECK(stats->nacks - before.nacks == 2 * TWI_MAX_RETRIES + 1);
+    CHECK(stats->failures - before.failures == 1);
+    CHECK(failures == 1);
+
+    // Lost arbitrations
+    TWISIM_LoseArbitration(0, 1);
+    CHECK(Transfer(EEPROM, 0, 1, 8) == TWI_STATUS_DONE);
+    TWISIM_LoseArbitration(0, TWI_MAX_RETRIES + 1);
+    CHECK(Transfer(EEPROM, 0, 1, 8) == TWI_STATUS_ERROR);
+    CHECK(stats->arbitrationLosses - before.arbitrationLosses
+          == TWI_MAX_RETRIES + 2);
+    CHECK(failures == 2);
+
+    // A failure in the middle of the queue
+    numCompleted = 0;
+    TWI_Setup(&transactions[0], EEPROM, 0, 1, 1, buffers[0], 3, Callback,
+              (void *) 0);
+    TWI_Setup(&transactions[1], ABSENT, 0, 1, 1, buffers[1], 3, Callback,
+              (void *) 1);
+    TWI_Setup(&transactions[2], SENSOR, 0, 1, 1, buffers[2], 3, Callback,
+              (void *) 2);
+    CHECK(TWI_Submit(0, &transactions[0]));
+    CHECK(TWI_Submit(0, &transactions[1]));
+    CHECK(TWI_Submit(0, &transactions[2]));
+    Run();
+    CHECK(numCompleted == 3);
+    CHECK(TWI_GetStatus(&transactions[0]) == TWI_STATUS_DONE);
+    CHECK(TWI_GetStatus(&transactions[1]) == TWI_STATUS_NACK);
+    CHECK(TWI_GetStatus(&transactions[2]) == TWI_STATUS_DONE);
+}
+
+//------------------------------------------------------------------------------
+/// Poll list: every sensor read once per period, and overruns counted when
+/// the bus cannot keep up.
+//------------------------------------------------------------------------------
+static void TestPoll(void)
+{
+    static TwiPollEntry entries[NUM_POLLED];
+    const TwiStats *stats = TWI_GetStats(0);
+    unsigned int transactionsBefore = stats->transactions;
+    unsigned int interruptsBefore = interrupts;
+    unsigned int bytesBefore = TWISIM_GetBytes(0);
+    unsigned int tick;
+    unsigned int i;
+
+    for (i = 0; i < NUM_POLLED; i++) {
+
+        TWI_Setup(&transactions[i], SENSOR, 0x10 + 6 * i, 1, 1, buffers[i], 6,
+                  0, 0);
+        entries[i].transaction = &transactions[i];
+        entries[i].period = 10;
+        entries[i].due = i;
+        devices[0].registers[0x10 + 6 * i] = i;
+    }
+
+    // The bus finishes each read within the tick
+    for (tick = 0; tick < 100; tick++) {
+
+        TWI_Poll(0, entries, NUM_POLLED, tick);
+        Run();
+    }
+    CHECK(stats->transactions - transactionsBefore == 10 * NUM_POLLED);
+    CHECK(stats->overruns == 0);
+    for (i = 0; i < NUM_POLLED; i++) {
+
+        CHECK(buffers[i][0] == i);
+    }
+    // Four interrupts per read (ENDRX, two RXRDY, TXCOMP), the PDC moving
+    // the other bytes
+    CHECK(interrupts - interruptsBefore == 4 * 10 * NUM_POLLED);
+    CHECK(TWISIM_GetBytes(0) - bytesBefore == 6 * 10 * NUM_POLLED);
+
+    // The bus stalls for a period: the entries still running are skipped
+    for (i = 0; i < NUM_POLLED; i++) {
+
+        entries[i].due = 100;
+    }
+    TWI_Poll(0, entries, NUM_POLLED, 100);
+    TWI_Poll(0, entries, NUM_POLLED, 110);
+    CHECK(stats->overruns == NUM_POLLED);
+    Run();
+    for (i = 0; i < NUM_POLLED; i++) {
+
+        CHECK(TWI_GetStatus(&transactions[i]) == TWI_STATUS_DONE);
+        CHECK(entries[i].due == 120);
+    }
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    HOST_Initialize();
+    devices[0].address = SENSOR;
+    devices[1].address = EEPROM;
+    TWISIM_Initialize(0, devices, 2);
+
+    CHECK(!TWI_Configure(2, 400000, 48000000));
+    CHECK(!TWI_Configure(0, 400000, 2000000));
+    CHECK(TWI_Configure(0, 400000, 48000000));
+    CHECK(AT91C_BASE_TWI0->TWI_CWGR == (56 | (56 << 8)));
+    CHECK(AT91C_BASE_PMC->PMC_PCER == (1 << AT91C_ID_TWI0));
+
+    TestTransfers();
+    TestQueue();
+    TestRetries();
+    TestPoll();
+
+    return CHECK_Result("twi_test");
+}
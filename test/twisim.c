@@ -0,0 +1,420 @@
+/* ----------------------------------------------------------------------------
+ *         Simulated TWI bus
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "twisim.h"
+#include "mmio.h"
+#include "AT91SAM3U4.h"
+
+#include <stddef.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define NUM_PORTS               2
+
+/// Register offsets.
+#define REG(name)               offsetof(AT91S_TWI, name)
+
+/// Flags cleared when TWI_SR is read.
+#define SR_CLEARED_ON_READ      (AT91C_TWI_NACK_MASTER \
+                                 | AT91C_TWI_ARBLST_MULTI_MASTER \
+                                 | AT91C_TWI_OVRE)
+
+/// Transfer phases.
+#define PHASE_IDLE              0
+#define PHASE_ADDRESS           1
+#define PHASE_DATA              2
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Controller, PDC channel and bus.
+typedef struct {
+
+    TwiSimDevice *devices;
+    unsigned int count;
+
+    unsigned int mmr;
+    unsigned int iadr;
+    unsigned int cwgr;
+    /// Flags other than the PDC ones, which follow the counters.
+    unsigned int sr;
+    unsigned int imr;
+    unsigned int rhr;
+    unsigned int rpr;
+    unsigned int rcr;
+    unsigned int tpr;
+    unsigned int tcr;
+    unsigned int ptsr;
+    unsigned char thr;
+    unsigned char thrFull;
+
+    unsigned char phase;
+    unsigned char read;
+    unsigned char stop;
+    TwiSimDevice *device;
+    unsigned char pointer;
+
+    unsigned int arbitrationLosses;
+    unsigned int bytes;
+
+} TwiSim;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static TwiSim buses[NUM_PORTS];
+
+static const unsigned int bases[NUM_PORTS] = {
+
+    (unsigned int) (unsigned long) AT91C_BASE_TWI0,
+    (unsigned int) (unsigned long) AT91C_BASE_TWI1
+};
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns TWI_SR: the PDC flags are levels of the counters.
+//------------------------------------------------------------------------------
+static unsigned int Status(const TwiSim *bus)
+{
+    unsigned int sr = bus->sr;
+
+    if (bus->rcr == 0) {
+
+        sr |= AT91C_TWI_ENDRX | AT91C_TWI_RXBUFF;
+    }
+    if (bus->tcr == 0) {
+
+        sr |= AT91C_TWI_ENDTX | AT91C_TWI_TXBUFE;
+    }
+    return sr;
+}
+
+//------------------------------------------------------------------------------
+/// Starts a transfer: the address phase comes at the next step.
+//------------------------------------------------------------------------------
+static void Begin(TwiSim *bus, unsigned char read)
+{
+    bus->phase = PHASE_ADDRESS;
+    bus->read = read;
+    bus->sr &= ~AT91C_TWI_TXCOMP_MASTER;
+}
+
+//------------------------------------------------------------------------------
+/// Ends a transfer with a STOP or after an error.
+//------------------------------------------------------------------------------
+static void End(TwiSim *bus)
+{
+    bus->phase = PHASE_IDLE;
+    bus->stop = 0;
+    bus->thrFull = 0;
+    bus->sr |= AT91C_TWI_TXCOMP_MASTER | AT91C_TWI_TXRDY_MASTER;
+}
+
+//------------------------------------------------------------------------------
+/// Address phase: the device acknowledges, or not.
+//------------------------------------------------------------------------------
+static void Address(TwiSim *bus)
+{
+    unsigned int address = (bus->mmr >> 16) & 0x7F;
+    unsigned int i;
+
+    if (bus->arbitrationLosses) {
+
+        bus->arbitrationLosses--;
+        bus->sr |= AT91C_TWI_ARBLST_MULTI_MASTER;
+        End(bus);
+        return;
+    }
+
+    bus->device = 0;
+    for (i = 0; i < bus->count; i++) {
+
+        if (bus->devices[i].address == address) {
+
+            bus->device = &bus->devices[i];
+        }
+    }
+    if ((bus->device == 0) || bus->device->nacks) {
+
+        if (bus->device) {
+
+            bus->device->nacks--;
+        }
+        bus->sr |= AT91C_TWI_NACK_MASTER;
+        End(bus);
+        return;
+    }
+
+    if ((bus->mmr >> 8) & 0x3) {
+
+        bus->pointer = bus->iadr & 0xFF;
+    }
+    bus->phase = PHASE_DATA;
+}
+
+//------------------------------------------------------------------------------
+/// Receives a byte, into memory through the PDC or into TWI_RHR. Returns 0
+/// while TWI_RHR is full.
+//------------------------------------------------------------------------------
+static unsigned char Receive(TwiSim *bus)
+{
+    unsigned char byte;
+
+    if ((bus->ptsr & AT91C_PDC_RXTEN) && bus->rcr) {
+
+        byte = bus->device->registers[bus->pointer++];
+        *(unsigned char *) (unsigned long) bus->rpr = byte;
+        bus->rpr++;
+        bus->rcr--;
+    }
+    else if (bus->sr & AT91C_TWI_RXRDY) {
+
+        return 0;
+    }
+    else {
+
+        bus->rhr = bus->device->registers[bus->pointer++];
+        bus->sr |= AT91C_TWI_RXRDY;
+    }
+    bus->bytes++;
+
+    // STOP requested during the byte before
+    if (bus->stop) {
+
+        End(bus);
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Sends a byte, from memory through the PDC or from TWI_THR, or the STOP
+/// once there is none left. Returns 0 while there is nothing to send.
+//------------------------------------------------------------------------------
+static unsigned char Send(TwiSim *bus)
+{
+    unsigned char byte;
+
+    if ((bus->ptsr & AT91C_PDC_TXTEN) && bus->tcr) {
+
+        byte = *(unsigned char *) (unsigned long) bus->tpr;
+        bus->tpr++;
+        bus->tcr--;
+    }
+    else if (bus->thrFull) {
+
+        byte = bus->thr;
+        bus->thrFull = 0;
+        bus->sr |= AT91C_TWI_TXRDY_MASTER;
+    }
+    else if (bus->stop) {
+
+        End(bus);
+        return 1;
+    }
+    else {
+
+        return 0;
+    }
+
+    bus->device->registers[bus->pointer++] = byte;
+    bus->bytes++;
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Register reads.
+//------------------------------------------------------------------------------
+static unsigned int Read(void *device, unsigned int offset, unsigned int size)
+{
+    TwiSim *bus = device;
+    unsigned int value;
+
+    switch (offset) {
+
+        case REG(TWI_SR):
+            value = Status(bus);
+            bus->sr &= ~SR_CLEARED_ON_READ;
+            return value;
+
+        case REG(TWI_RHR):
+            bus->sr &= ~AT91C_TWI_RXRDY;
+            return bus->rhr;
+
+        case REG(TWI_MMR):  return bus->mmr;
+        case REG(TWI_IADR): return bus->iadr;
+        case REG(TWI_CWGR): return bus->cwgr;
+        case REG(TWI_IMR):  return bus->imr;
+        case REG(TWI_RPR):  return bus->rpr;
+        case REG(TWI_RCR):  return bus->rcr;
+        case REG(TWI_TPR):  return bus->tpr;
+        case REG(TWI_TCR):  return bus->tcr;
+        case REG(TWI_PTSR): return bus->ptsr;
+        default:            return 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Register writes.
+//------------------------------------------------------------------------------
+static void Write(void *device,
+                  unsigned int offset,
+                  unsigned int value,
+                  unsigned int size)
+{
+    TwiSim *bus = device;
+
+    switch (offset) {
+
+        case REG(TWI_CR):
+            if (value & AT91C_TWI_SWRST) {
+
+                bus->imr = 0;
+                bus->phase = PHASE_IDLE;
+                bus->stop = 0;
+                bus->thrFull = 0;
+                bus->sr = AT91C_TWI_TXCOMP_MASTER | AT91C_TWI_TXRDY_MASTER;
+            }
+            if ((value & AT91C_TWI_START) && (bus->phase == PHASE_IDLE)) {
+
+                Begin(bus, (bus->mmr & AT91C_TWI_MREAD) != 0);
+            }
+            if (value & AT91C_TWI_STOP) {
+
+                bus->stop = 1;
+            }
+            break;
+
+        case REG(TWI_THR):
+            bus->thr = value;
+            bus->thrFull = 1;
+            bus->sr &= ~AT91C_TWI_TXRDY_MASTER;
+            if ((bus->phase == PHASE_IDLE) && !(bus->mmr & AT91C_TWI_MREAD)) {
+
+                Begin(bus, 0);
+            }
+            break;
+
+        case REG(TWI_IER):  bus->imr |= value; break;
+        case REG(TWI_IDR):  bus->imr &= ~value; break;
+        case REG(TWI_MMR):  bus->mmr = value; break;
+        case REG(TWI_IADR): bus->iadr = value; break;
+        case REG(TWI_CWGR): bus->cwgr = value; break;
+        case REG(TWI_RPR):  bus->rpr = value; break;
+        case REG(TWI_RCR):  bus->rcr = value; break;
+        case REG(TWI_TPR):  bus->tpr = value; break;
+        case REG(TWI_TCR):  bus->tcr = value; break;
+
+        case REG(TWI_PTCR):
+            if (value & AT91C_PDC_RXTDIS) {
+
+                bus->ptsr &= ~AT91C_PDC_RXTEN;
+            }
+            else if (value & AT91C_PDC_RXTEN) {
+
+                bus->ptsr |= AT91C_PDC_RXTEN;
+            }
+            if (value & AT91C_PDC_TXTDIS) {
+
+                bus->ptsr &= ~AT91C_PDC_TXTEN;
+            }
+            else if (value & AT91C_PDC_TXTEN) {
+
+                bus->ptsr |= AT91C_PDC_TXTEN;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Maps the controller of a bus, idle, with its devices.
+/// \param port  Bus number (0 or 1).
+/// \param devices  Devices on the bus; their state is kept by the caller.
+/// \param count  Number of devices.
+//------------------------------------------------------------------------------
+void TWISIM_Initialize(unsigned int port,
+                       TwiSimDevice *devices,
+                       unsigned int count)
+{
+    TwiSim *bus = &buses[port];
+
+    memset(bus, 0, sizeof(*bus));
+    bus->devices = devices;
+    bus->count = count;
+    bus->sr = AT91C_TWI_TXCOMP_MASTER | AT91C_TWI_TXRDY_MASTER;
+    MMIO_Map(bases[port], sizeof(AT91S_TWI), Read, Write, bus);
+}
+
+//------------------------------------------------------------------------------
+/// Makes the next address phases lose the arbitration.
+//------------------------------------------------------------------------------
+void TWISIM_LoseArbitration(unsigned int port, unsigned int count)
+{
+    buses[port].arbitrationLosses = count;
+}
+
+//------------------------------------------------------------------------------
+/// Moves the bus by one step: a write transfer started by the PDC, an
+/// address phase, a byte or a STOP.
+/// Returns 1 if the bus has moved; 0 if it waits for the driver.
+//------------------------------------------------------------------------------
+unsigned char TWISIM_Step(unsigned int port)
+{
+    TwiSim *bus = &buses[port];
+
+    switch (bus->phase) {
+
+        case PHASE_IDLE:
+            // The PDC writes the first byte to TWI_THR
+            if (!(bus->mmr & AT91C_TWI_MREAD)
+                && (bus->ptsr & AT91C_PDC_TXTEN) && bus->tcr) {
+
+                Begin(bus, 0);
+                return 1;
+            }
+            return 0;
+
+        case PHASE_ADDRESS:
+            Address(bus);
+            return 1;
+
+        default:
+            return bus->read ? Receive(bus) : Send(bus);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the bus requests its interrupt.
+//------------------------------------------------------------------------------
+unsigned char TWISIM_IsPending(unsigned int port)
+{
+    return (Status(&buses[port]) & buses[port].imr) != 0;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the number of data bytes moved on a bus.
+//------------------------------------------------------------------------------
+unsigned int TWISIM_GetBytes(unsigned int port)
+{
+    return buses[port].bytes;
+}
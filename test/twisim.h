@@ -0,0 +1,49 @@
+/* ----------------------------------------------------------------------------
+ *         Simulated TWI bus
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** The TWI controllers and their PDC channels, with the devices of each bus.
+** The bus moves one step at a time (address phase, one byte, STOP), so a test
+** calls TWISIM_Step() and then the interrupt handler while
+** TWISIM_IsPending(), and can inject faults in between. A device has 256
+** byte registers; the internal address of a transfer (its low byte) selects
+** the first one, and each byte moves to the next.
+*/
+
+#ifndef TWISIM_H
+#define TWISIM_H
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Device on a simulated bus.
+typedef struct {
+
+    /// 7-bit address.
+    unsigned char address;
+    unsigned char registers[256];
+    /// Address phases still to be not acknowledged.
+    unsigned int nacks;
+
+} TwiSimDevice;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void TWISIM_Initialize(unsigned int port,
+                              TwiSimDevice *devices,
+                              unsigned int count);
+
+extern void TWISIM_LoseArbitration(unsigned int port, unsigned int count);
+
+extern unsigned char TWISIM_Step(unsigned int port);
+
+extern unsigned char TWISIM_IsPending(unsigned int port);
+
+extern unsigned int TWISIM_GetBytes(unsigned int port);
+
+#endif //#ifndef TWISIM_H
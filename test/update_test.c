@@ -0,0 +1,331 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of update.c and tools/mkimage.py
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Builds two images, installs the first in slot A as a slot of mkimage.py,
+** then streams the second through update.c, over iap.c and efcsim.c, as a
+** raw, a compressed and a delta update of mkimage.py, in pieces of random
+** sizes. Slot B must then hold the image and the trailer mkimage.py computes
+** for it, and the update be pending. Streams with a bad header, against
+** another base, cut short, corrupt or too long must be refused, and no
+** update start while a new image is on trial.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "efcsim.h"
+#include "update.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define OLD_SIZE                30000
+#define INSERTED                200
+#define NEW_SIZE                (OLD_SIZE + INSERTED)
+
+#define OLD                     "update_old.bin"
+#define NEW                     "update_new.bin"
+#define STREAM                  "update_stream.bin"
+#define SLOT                    "update_slot.bin"
+#define MKIMAGE                 "python3 ../tools/mkimage.py "
+
+/// Largest stream: a raw one, with its header and opcode.
+#define MAX_STREAM              (NEW_SIZE + 64)
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// The flash, as written by the simulator.
+static unsigned char *flash;
+
+static unsigned char oldImage[OLD_SIZE];
+static unsigned char newImage[NEW_SIZE];
+
+static unsigned char stream[MAX_STREAM];
+static unsigned char slot[IMAGE_SLOT_SIZE];
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns the flash at an address.
+//------------------------------------------------------------------------------
+static unsigned char * At(unsigned int address)
+{
+    return flash + (address - IAP_FLASH_START);
+}
+
+//------------------------------------------------------------------------------
+/// Fills an image with code-like content: words from a small set, some
+/// random bytes, and runs of 0xFF.
+//------------------------------------------------------------------------------
+static void Generate(unsigned char *image, unsigned int size)
+{
+    unsigned int words[64];
+    unsigned int position = 0;
+    unsigned int length;
+    unsigned int i;
+
+    for (i = 0; i < 64; i++) {
+
+        words[i] = rand() ^ (rand() << 16);
+    }
+    while (position < size) {
+
+        length = 4;
+        if (rand() % 50 == 0) {
+
+            length = 100 + rand() % 200;
+            memset(image + position, 0xFF,
+                   (length < size - position) ? length : size - position);
+        }
+        else if (rand() % 8 == 0) {
+
+            image[position] = rand();
+            length = 1;
+        }
+        else {
+
+            memcpy(image + position, &words[rand() % 64],
+                   (length < size - position) ? length : size - position);
+        }
+        position += length;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Writes a file.
+//------------------------------------------------------------------------------
+static void Save(const char *path, const void *data, unsigned int size)
+{
+    FILE *file = fopen(path, "wb");
+
+    if (file) {
+
+        fwrite(data, 1, size, file);
+        fclose(file);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Runs mkimage.py and reads its output.
+/// Returns the size of the output; 0 if the tool fails.
+/// \param arguments  Arguments before the output file, which is read.
+/// \param options  Arguments after it.
+//------------------------------------------------------------------------------
+static unsigned int Make(const char *arguments,
+                         const char *output,
+                         const char *options,
+                         void *buffer,
+                         unsigned int size)
+{
+    char command[256];
+    unsigned int read;
+    FILE *file;
+
+    snprintf(command, sizeof(command), MKIMAGE "%s %s %s >/dev/null 2>&1",
+             arguments, output, options);
+    if (system(command) != 0) {
+
+        return 0;
+    }
+    file = fopen(output, "rb");
+    if (!file) {
+
+        return 0;
+    }
+    read = fread(buffer, 1, size, file);
+    fclose(file);
+
+    return read;
+}
+
+//------------------------------------------------------------------------------
+/// Sends a stream in pieces of random sizes.
+/// Returns the result of UPDATE_Finish(), or 0 if a write fails.
+//------------------------------------------------------------------------------
+static unsigned char Send(const unsigned char *data, unsigned int size)
+{
+    unsigned int piece;
+
+    if (!UPDATE_Begin()) {
+
+        return 0;
+    }
+    while (size) {
+
+        piece = 1 + rand() % 512;
+        if (piece > size) {
+
+            piece = size;
+        }
+        if (!UPDATE_Write(data, piece)) {
+
+            return 0;
+        }
+        data += piece;
+        size -= piece;
+    }
+    return UPDATE_Finish();
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if slot B holds the new image, with the trailer of mkimage.py.
+//------------------------------------------------------------------------------
+static unsigned char IsInstalled(void)
+{
+    const ImageTrailer *trailer = IMAGE_GetTrailer(IMAGE_SLOT_B);
+    ImageState state;
+
+    IMAGE_GetState(&state);
+    return trailer && IMAGE_Verify(IMAGE_SLOT_B, trailer)
+           && (trailer->version == 2)
+           && (memcmp(At(IMAGE_SLOT_B), slot,
+                      IMAGE_NUM_PAGES(NEW_SIZE) * IAP_PAGE_SIZE) == 0)
+           && (memcmp(At(IMAGE_SLOT_B + IMAGE_MAX_SIZE), slot + IMAGE_MAX_SIZE,
+                      IMAGE_TRAILER_SIZE) == 0)
+           && (state.state == IMAGE_STATE_PENDING);
+}
+
+//------------------------------------------------------------------------------
+/// Installs the old image in slot A, as mkimage.py builds a slot.
+//------------------------------------------------------------------------------
+static void TestSlot(void)
+{
+    const ImageTrailer *trailer;
+
+    Generate(oldImage, OLD_SIZE);
+    Save(OLD, oldImage, OLD_SIZE);
+    CHECK(Make("slot " OLD, SLOT, "1", slot, sizeof(slot)) == IMAGE_SLOT_SIZE);
+    memcpy(At(IMAGE_SLOT_A), slot, IMAGE_SLOT_SIZE);
+
+    trailer = IMAGE_GetTrailer(IMAGE_SLOT_A);
+    CHECK(trailer != 0);
+    CHECK(trailer && (trailer->size == OLD_SIZE) && (trailer->version == 1));
+    CHECK(trailer && IMAGE_Verify(IMAGE_SLOT_A, trailer));
+    CHECK(IMAGE_GetTrailer(IMAGE_SLOT_B) == 0);
+
+    // A flipped bit shows in its page CRC
+    At(IMAGE_SLOT_A)[1000] ^= 0x10;
+    CHECK(trailer && !IMAGE_Verify(IMAGE_SLOT_A, trailer));
+    At(IMAGE_SLOT_A)[1000] ^= 0x10;
+}
+
+//------------------------------------------------------------------------------
+/// The new image, streamed raw, compressed, and as a delta.
+//------------------------------------------------------------------------------
+static void TestStreams(void)
+{
+    unsigned int raw;
+    unsigned int compressed;
+    unsigned int delta;
+    unsigned int i;
+
+    // A few changed bytes, and code inserted in the middle
+    memcpy(newImage, oldImage, OLD_SIZE / 3);
+    Generate(newImage + OLD_SIZE / 3, INSERTED);
+    memcpy(newImage + OLD_SIZE / 3 + INSERTED, oldImage + OLD_SIZE / 3,
+           OLD_SIZE - OLD_SIZE / 3);
+    for (i = 0; i < 20; i++) {
+
+        newImage[rand() % NEW_SIZE] = rand();
+    }
+    Save(NEW, newImage, NEW_SIZE);
+    CHECK(Make("slot " NEW, SLOT, "2", slot, sizeof(slot)) == IMAGE_SLOT_SIZE);
+
+    raw = Make("update " NEW, STREAM, "2 --raw", stream, sizeof(stream));
+    CHECK(raw == sizeof(UpdateHeader) + 4 + NEW_SIZE);
+    CHECK(Send(stream, raw));
+    CHECK(IsInstalled());
+
+    compressed = Make("update " NEW, STREAM, "2", stream, sizeof(stream));
+    CHECK((compressed > 0) && (compressed < raw * 3 / 4));
+    // The pages are written again
+    memset(At(IMAGE_SLOT_B), 0, IAP_PAGE_SIZE);
+    CHECK(Send(stream, compressed));
+    CHECK(IsInstalled());
+
+    delta = Make("update " NEW, STREAM, "2 " OLD, stream, sizeof(stream));
+    CHECK((delta > 0) && (delta < compressed / 4));
+    CHECK(Send(stream, delta));
+    CHECK(IsInstalled());
+}
+
+//------------------------------------------------------------------------------
+/// Streams refused, and updates refused during a trial.
+//------------------------------------------------------------------------------
+static void TestErrors(void)
+{
+    ImageState state;
+    unsigned int size;
+
+    // Header
+    size = Make("update " NEW, STREAM, "2", stream, sizeof(stream));
+    stream[offsetof(UpdateHeader, version)] ^= 1;
+    CHECK(!Send(stream, size));
+    CHECK(!UPDATE_Finish());
+    CHECK(IMAGE_GetTrailer(IMAGE_SLOT_B) == 0);
+
+    // A delta made from another image than the one of slot A
+    size = Make("update " NEW, STREAM, "2 " NEW, stream, sizeof(stream));
+    CHECK(!Send(stream, size));
+
+    // Cut short, corrupt, or going on past the image
+    size = Make("update " NEW, STREAM, "2 --raw", stream, sizeof(stream));
+    CHECK(!Send(stream, size - 1));
+    CHECK(IMAGE_GetTrailer(IMAGE_SLOT_B) == 0);
+    stream[size - 100] ^= 0x80;
+    CHECK(!Send(stream, size));
+    stream[size - 100] ^= 0x80;
+    stream[size] = UPDATE_OP_FILL;
+    CHECK(!Send(stream, size + 1));
+    CHECK(IMAGE_GetTrailer(IMAGE_SLOT_B) == 0);
+    CHECK(Send(stream, size));
+    CHECK(IsInstalled());
+
+    // A new image on trial keeps slot B for a rollback until it confirms
+    CHECK(IMAGE_SetState(IMAGE_STATE_TRIAL, 0));
+    CHECK(!UPDATE_Begin());
+    CHECK(IMAGE_GetTrailer(IMAGE_SLOT_B) != 0);
+    CHECK(UPDATE_Confirm());
+    IMAGE_GetState(&state);
+    CHECK(state.state == IMAGE_STATE_CONFIRMED);
+    CHECK(UPDATE_Begin());
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    HOST_Initialize();
+    flash = EFCSIM_Initialize(-1);
+    IAP_Initialize();
+    srand(1);
+
+    TestSlot();
+    TestStreams();
+    TestErrors();
+
+    if (checkFailures == 0) {
+
+        remove(OLD);
+        remove(NEW);
+        remove(STREAM);
+        remove(SLOT);
+    }
+    return CHECK_Result("update_test");
+}
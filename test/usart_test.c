@@ -0,0 +1,727 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of usart.c
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Runs USART0 over a model of the line, one character time per step, and of
+** its PDC channels: current and next buffers with their reload, ENDRX and
+** ENDTX latched until a count is written, US_RHR and the overruns once the
+** PDC has no buffer, and the receiver time-out, armed by STTTO after a byte
+** or by RETTO at once, and raised after US_RTOR idle bit periods. The
+** consumer must get the bytes the PDC stored, in order, as full buffers on
+** ENDRX and partial ones on the time-out: with the interrupt on time or late
+** by up to two buffers, with a byte arriving while the handler has the PDC
+** stopped, with every buffer held by the consumer, and when it gives them
+** back from the callback. Buffers sent back to back must leave the line
+** with no gap while one is queued.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "mmio.h"
+#include "usart.h"
+#include "evlog.h"
+#include "exceptions.h"
+#include "AT91SAM3U4.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define US_REG(name)            offsetof(AT91S_USART, name)
+
+#define PORT                    0
+#define BAUDRATE                115200
+#define MCK                     48000000
+
+/// Bytes of the streams.
+#define MAX_BYTES               100000
+
+/// Interrupts taken in a row before the handler is considered stuck.
+#define MAX_NESTED              8
+
+/// Receive errors.
+#define ERRORS                  (AT91C_US_OVRE | AT91C_US_FRAME | AT91C_US_PARE)
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// USART with its PDC channels.
+typedef struct {
+
+    unsigned int rpr;
+    unsigned int rcr;
+    unsigned int rnpr;
+    unsigned int rncr;
+    unsigned int tpr;
+    unsigned int tcr;
+    unsigned int tnpr;
+    unsigned int tncr;
+    unsigned int ptsr;
+    unsigned int imr;
+    unsigned int rtor;
+    /// Error and time-out flags.
+    unsigned int csr;
+    /// A counter reached 0 since a non-zero count was last written.
+    unsigned char endrx;
+    unsigned char endtx;
+
+    unsigned char rhr;
+    unsigned char rhrFull;
+
+    /// Receiver time-out: counting once a byte came after STTTO, and the
+    /// idle bit periods since the last byte.
+    unsigned char timeoutArmed;
+    unsigned int idleBits;
+
+    /// Bytes that arrive while the handler runs: just after it read the
+    /// status, and when it stops the PDC (-1 if none).
+    unsigned int arrivingOnStatus;
+    int arriving;
+
+} Usart;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static Usart usart;
+
+/// Bytes on the line, bytes the PDC stored, and bytes handed to the consumer.
+static unsigned char line[MAX_BYTES];
+static unsigned int numLine;
+static unsigned char stored[MAX_BYTES];
+static unsigned int numStored;
+static unsigned char received[MAX_BYTES];
+static unsigned int numReceived;
+
+/// Consumer called back: gives the buffers back at once.
+static unsigned char releasing;
+
+/// Bytes sent by the transmitter.
+static unsigned char sent[MAX_BYTES];
+static unsigned int numSent;
+
+static unsigned int errorEvents;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// evlog.c: errors are counted instead.
+//------------------------------------------------------------------------------
+void EVLOG_Write(unsigned short id, unsigned int value)
+{
+    if (id == EVLOG_ID_USART_ERROR) {
+
+        errorEvents++;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Loads the next buffers into the current ones once they are done.
+//------------------------------------------------------------------------------
+static void Reload(void)
+{
+    if ((usart.rcr == 0) && (usart.rncr != 0)) {
+
+        usart.rpr = usart.rnpr;
+        usart.rcr = usart.rncr;
+        usart.rncr = 0;
+    }
+    if ((usart.tcr == 0) && (usart.tncr != 0)) {
+
+        usart.tpr = usart.tnpr;
+        usart.tcr = usart.tncr;
+        usart.tncr = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Moves US_RHR to memory if the PDC has room.
+//------------------------------------------------------------------------------
+static void Store(void)
+{
+    if (usart.rhrFull && (usart.ptsr & AT91C_PDC_RXTEN) && usart.rcr) {
+
+        *(unsigned char *) (unsigned long) usart.rpr = usart.rhr;
+        stored[numStored++] = usart.rhr;
+        usart.rhrFull = 0;
+        usart.rpr++;
+        usart.rcr--;
+        if (usart.rcr == 0) {
+
+            usart.endrx = 1;
+        }
+        Reload();
+    }
+}
+
+//------------------------------------------------------------------------------
+/// A byte comes in.
+//------------------------------------------------------------------------------
+static void Receive(unsigned char byte)
+{
+    if (usart.rhrFull) {
+
+        usart.csr |= AT91C_US_OVRE;
+    }
+    usart.rhr = byte;
+    usart.rhrFull = 1;
+    usart.timeoutArmed = 1;
+    usart.idleBits = 0;
+    Store();
+}
+
+//------------------------------------------------------------------------------
+/// A byte of the running pattern comes in on the line.
+//------------------------------------------------------------------------------
+static void Arrive(void)
+{
+    unsigned char byte = (numLine * 7 + 11) & 0xFF;
+
+    line[numLine++] = byte;
+    Receive(byte);
+}
+
+//------------------------------------------------------------------------------
+/// Returns US_CSR.
+//------------------------------------------------------------------------------
+static unsigned int Status(void)
+{
+    unsigned int csr = usart.csr | AT91C_US_TXRDY;
+
+    if (usart.rhrFull) {
+
+        csr |= AT91C_US_RXRDY;
+    }
+    if (usart.endrx) {
+
+        csr |= AT91C_US_ENDRX;
+    }
+    if ((usart.rcr == 0) && (usart.rncr == 0)) {
+
+        csr |= AT91C_US_RXBUFF;
+    }
+    if (usart.endtx) {
+
+        csr |= AT91C_US_ENDTX;
+    }
+    if ((usart.tcr == 0) && (usart.tncr == 0)) {
+
+        csr |= AT91C_US_TXBUFE;
+    }
+    return csr;
+}
+
+//------------------------------------------------------------------------------
+/// Register reads.
+//------------------------------------------------------------------------------
+static unsigned int Read(void *device, unsigned int offset, unsigned int size)
+{
+    unsigned int csr;
+
+    switch (offset) {
+
+    case US_REG(US_CSR):
+        csr = Status();
+        for (; usart.arrivingOnStatus > 0; usart.arrivingOnStatus--) {
+
+            Arrive();
+        }
+        return csr;
+
+    case US_REG(US_IMR):  return usart.imr;
+    case US_REG(US_RHR):  usart.rhrFull = 0; return usart.rhr;
+    case US_REG(US_RTOR): return usart.rtor;
+    case US_REG(US_RPR):  return usart.rpr;
+    case US_REG(US_RCR):  return usart.rcr;
+    case US_REG(US_RNPR): return usart.rnpr;
+    case US_REG(US_RNCR): return usart.rncr;
+    case US_REG(US_TPR):  return usart.tpr;
+    case US_REG(US_TCR):  return usart.tcr;
+    case US_REG(US_TNPR): return usart.tnpr;
+    case US_REG(US_TNCR): return usart.tncr;
+    case US_REG(US_PTSR): return usart.ptsr;
+    default:              return 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Writes of US_PTCR.
+//------------------------------------------------------------------------------
+static void WritePtcr(unsigned int value)
+{
+    if (value & AT91C_PDC_RXTDIS) {
+
+        usart.ptsr &= ~AT91C_PDC_RXTEN;
+        if (usart.arriving >= 0) {
+
+            line[numLine++] = usart.arriving;
+            Receive(usart.arriving);
+            usart.arriving = -1;
+        }
+    }
+    else if (value & AT91C_PDC_RXTEN) {
+
+        usart.ptsr |= AT91C_PDC_RXTEN;
+    }
+    if (value & AT91C_PDC_TXTDIS) {
+
+        usart.ptsr &= ~AT91C_PDC_TXTEN;
+    }
+    else if (value & AT91C_PDC_TXTEN) {
+
+        usart.ptsr |= AT91C_PDC_TXTEN;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Register writes.
+//------------------------------------------------------------------------------
+static void Write(void *device,
+                  unsigned int offset,
+                  unsigned int value,
+                  unsigned int size)
+{
+    switch (offset) {
+
+    case US_REG(US_CR):
+        if (value & AT91C_US_RSTSTA) {
+
+            usart.csr &= ~ERRORS;
+        }
+        if (value & AT91C_US_STTTO) {
+
+            usart.csr &= ~AT91C_US_TIMEOUT;
+            usart.timeoutArmed = 0;
+        }
+        if (value & AT91C_US_RETTO) {
+
+            usart.timeoutArmed = 1;
+            usart.idleBits = 0;
+        }
+        if (value & AT91C_US_RSTRX) {
+
+            usart.rhrFull = 0;
+        }
+        break;
+
+    case US_REG(US_IER):  usart.imr |= value; break;
+    case US_REG(US_IDR):  usart.imr &= ~value; break;
+    case US_REG(US_RTOR): usart.rtor = value; break;
+    case US_REG(US_RPR):  usart.rpr = value; break;
+    case US_REG(US_RNPR): usart.rnpr = value; break;
+    case US_REG(US_TPR):  usart.tpr = value; break;
+    case US_REG(US_TNPR): usart.tnpr = value; break;
+    case US_REG(US_PTCR): WritePtcr(value); break;
+
+    case US_REG(US_RCR):
+    case US_REG(US_RNCR):
+        *((offset == US_REG(US_RCR)) ? &usart.rcr : &usart.rncr) = value;
+        if (value) {
+
+            usart.endrx = 0;
+        }
+        break;
+
+    case US_REG(US_TCR):
+    case US_REG(US_TNCR):
+        *((offset == US_REG(US_TCR)) ? &usart.tcr : &usart.tncr) = value;
+        if (value) {
+
+            usart.endtx = 0;
+        }
+        break;
+
+    default:
+        break;
+    }
+    Reload();
+    Store();
+}
+
+//------------------------------------------------------------------------------
+/// Moves the line by one character time: a byte in, or an idle character,
+/// and a byte out if the transmitter has one.
+/// \param busy  1 if a byte comes in, 0 if the line is idle.
+//------------------------------------------------------------------------------
+static void Step(unsigned char busy)
+{
+    if (busy) {
+
+        Arrive();
+    }
+    else if (usart.timeoutArmed) {
+
+        usart.idleBits += 10;
+        if (usart.rtor && (usart.idleBits >= usart.rtor)) {
+
+            usart.csr |= AT91C_US_TIMEOUT;
+            usart.timeoutArmed = 0;
+        }
+    }
+
+    if ((usart.ptsr & AT91C_PDC_TXTEN) && usart.tcr) {
+
+        sent[numSent++] = *(unsigned char *) (unsigned long) usart.tpr;
+        usart.tpr++;
+        usart.tcr--;
+        if (usart.tcr == 0) {
+
+            usart.endtx = 1;
+        }
+        Reload();
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Takes the USART interrupt while it is pending. Returns 0 if it stays
+/// pending.
+//------------------------------------------------------------------------------
+static unsigned char Interrupt(void)
+{
+    unsigned int nested;
+
+    for (nested = 0; nested < MAX_NESTED; nested++) {
+
+        if ((usart.imr & Status()) == 0) {
+
+            return 1;
+        }
+        USART0_IrqHandler();
+    }
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+/// Takes the received buffers and gives them back.
+//------------------------------------------------------------------------------
+static void Collect(void)
+{
+    unsigned char *buffer;
+    unsigned int size;
+
+    while ((buffer = USART_Receive(PORT, &size)) != 0) {
+
+        memcpy(&received[numReceived], buffer, size);
+        numReceived += size;
+        USART_Release(PORT);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Receive callback: the buffer is taken, and given back at once when the
+/// consumer releases from the callback.
+//------------------------------------------------------------------------------
+static void Callback(unsigned int port, unsigned char *data, unsigned int size)
+{
+    if (releasing) {
+
+        memcpy(&received[numReceived], data, size);
+        numReceived += size;
+        USART_Release(port);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Receives count bytes of a running pattern, taking the interrupt every
+/// latency characters, and collecting if asked. Returns 0 if the interrupt
+/// got stuck.
+//------------------------------------------------------------------------------
+static unsigned char Burst(unsigned int count,
+                           unsigned int latency,
+                           unsigned char collect)
+{
+    unsigned char ok = 1;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+
+        Step(1);
+        if ((i + 1) % latency == 0) {
+
+            ok &= Interrupt();
+            if (collect) {
+
+                Collect();
+            }
+        }
+    }
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+/// Leaves the line idle for count characters, taking the interrupt and
+/// collecting after each. Returns 0 if the interrupt got stuck.
+//------------------------------------------------------------------------------
+static unsigned char Idle(unsigned int count, unsigned char collect)
+{
+    unsigned char ok = 1;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+
+        Step(0);
+        ok &= Interrupt();
+        if (collect) {
+
+            Collect();
+        }
+    }
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the consumer has got all the bytes the PDC stored, and the
+/// PDC all those of the line.
+//------------------------------------------------------------------------------
+static unsigned char IsComplete(void)
+{
+    return (numReceived == numStored) && (numStored == numLine)
+           && (memcmp(received, stored, numStored) == 0)
+           && (memcmp(stored, line, numLine) == 0);
+}
+
+//------------------------------------------------------------------------------
+/// Opens the port on an idle line.
+//------------------------------------------------------------------------------
+static void Open(UsartRxCallback callback)
+{
+    memset(&usart, 0, sizeof(usart));
+    usart.arriving = -1;
+    numLine = 0;
+    numStored = 0;
+    numReceived = 0;
+    numSent = 0;
+    CHECK(USART_Open(PORT, USART_MODE_8N1, BAUDRATE, MCK, callback));
+}
+
+//------------------------------------------------------------------------------
+/// Full buffers on ENDRX, and partial ones on the time-out.
+//------------------------------------------------------------------------------
+static void TestReceive(void)
+{
+    const UsartStats *stats = USART_GetStats(PORT);
+
+    Open(0);
+    CHECK(usart.rtor == USART_RX_TIMEOUT_BITS);
+    CHECK((usart.rcr == USART_RX_BUFFER_SIZE)
+          && (usart.rncr == USART_RX_BUFFER_SIZE));
+
+    CHECK(Burst(3 * USART_RX_BUFFER_SIZE, 1, 1));
+    CHECK(IsComplete());
+    CHECK((stats->buffers == 3) && (stats->timeouts == 0));
+
+    // A short frame comes out after two idle characters, only once
+    CHECK(Burst(10, 1, 1));
+    CHECK(Idle(1, 1));
+    CHECK(numReceived == 3 * USART_RX_BUFFER_SIZE);
+    CHECK(Idle(5, 1));
+    CHECK(IsComplete());
+    CHECK((stats->timeouts == 1) && (stats->buffers == 4));
+
+    // Then from the start of a fresh buffer
+    CHECK(Burst(USART_RX_BUFFER_SIZE + 44, 1, 1));
+    CHECK(Idle(2, 1));
+    CHECK(IsComplete());
+    CHECK((stats->timeouts == 2) && (stats->buffers == 6));
+    CHECK(stats->bytes == numLine);
+    CHECK((stats->overruns == 0) && (errorEvents == 0));
+}
+
+//------------------------------------------------------------------------------
+/// The ENDRX interrupt late by one buffer and a part, then by exactly two:
+/// the current and the next buffer are both full.
+//------------------------------------------------------------------------------
+static void TestLate(void)
+{
+    const UsartStats *stats = USART_GetStats(PORT);
+
+    Open(0);
+    CHECK(Burst(USART_RX_BUFFER_SIZE + 100, USART_RX_BUFFER_SIZE + 100, 1));
+    CHECK(stats->buffers == 1);
+    CHECK(Burst(2 * USART_RX_BUFFER_SIZE - 100, 1, 1));
+    CHECK(stats->buffers == 3);
+
+    CHECK(Burst(2 * USART_RX_BUFFER_SIZE, 2 * USART_RX_BUFFER_SIZE + 1, 0));
+    CHECK((usart.rcr == 0) && (usart.rncr == 0));
+    CHECK(Interrupt());
+    CHECK(stats->buffers == 5);
+    Collect();
+    CHECK((usart.rcr == USART_RX_BUFFER_SIZE)
+          && (usart.rncr == USART_RX_BUFFER_SIZE));
+    CHECK(Burst(30, 1, 1));
+    CHECK(Idle(2, 1));
+    CHECK(IsComplete());
+    CHECK(stats->overruns == 0);
+}
+
+//------------------------------------------------------------------------------
+/// A byte arriving while the time-out handler has the PDC stopped waits in
+/// US_RHR for the next buffer; bytes arriving after it read the status may
+/// fill the buffer and go on in the next one.
+//------------------------------------------------------------------------------
+static void TestTimeoutRace(void)
+{
+    const UsartStats *stats = USART_GetStats(PORT);
+
+    Open(0);
+    CHECK(Burst(20, 1, 1));
+    usart.arriving = 0x5A;
+    CHECK(Idle(2, 1));
+    CHECK(usart.arriving < 0);
+    CHECK((numReceived == 20) && (numStored == 21));
+    CHECK(Idle(2, 1));
+    CHECK(IsComplete());
+    CHECK((stats->timeouts == 2) && (stats->overruns == 0));
+
+    CHECK(usart.rcr == USART_RX_BUFFER_SIZE);
+    CHECK(Burst(USART_RX_BUFFER_SIZE - 1, 1, 1));
+    usart.arrivingOnStatus = 2;
+    CHECK(Idle(2, 1));
+    CHECK(usart.arrivingOnStatus == 0);
+    CHECK(IsComplete());
+    CHECK((stats->timeouts == 3) && (stats->buffers == 4));
+}
+
+//------------------------------------------------------------------------------
+/// While the consumer holds every buffer the PDC stops and the bytes are
+/// lost as overruns; reception goes on once they are given back.
+//------------------------------------------------------------------------------
+static void TestHeld(void)
+{
+    const UsartStats *stats = USART_GetStats(PORT);
+    unsigned int lost;
+
+    Open(0);
+    CHECK(Burst(USART_RX_NUM_BUFFERS * USART_RX_BUFFER_SIZE + 50, 1, 0));
+    CHECK(stats->buffers == USART_RX_NUM_BUFFERS);
+    CHECK((usart.rcr == 0) && (usart.rncr == 0));
+    CHECK(!(usart.imr & AT91C_US_ENDRX));
+    CHECK(stats->overruns == 49);
+    CHECK(errorEvents == 49);
+
+    // The last byte waits in US_RHR for the first buffer given back
+    Collect();
+    lost = numLine - numStored;
+    CHECK(lost == 49);
+    CHECK(numStored == USART_RX_NUM_BUFFERS * USART_RX_BUFFER_SIZE + 1);
+    CHECK(Burst(100, 1, 1));
+    CHECK(Idle(2, 1));
+    CHECK(numReceived == numStored);
+    CHECK(memcmp(received, stored, numStored) == 0);
+    CHECK(numStored == numLine - lost);
+    errorEvents = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Random bursts and gaps with the interrupt late by up to a buffer, the most
+/// the PDC can wait for once it has gone on with the next one, and the
+/// buffers given back from the callback.
+//------------------------------------------------------------------------------
+static void TestCallback(void)
+{
+    const UsartStats *stats = USART_GetStats(PORT);
+    unsigned char ok = 1;
+    unsigned int latency;
+
+    Open(Callback);
+    releasing = 1;
+    while (numLine < MAX_BYTES - 3 * USART_RX_BUFFER_SIZE) {
+
+        latency = 1 + rand() % USART_RX_BUFFER_SIZE;
+        ok &= Burst(latency * (1 + rand() % 3), latency, 0);
+        ok &= Idle(rand() % 4, 0);
+    }
+    ok &= Idle(2, 0);
+    CHECK(ok);
+    CHECK(IsComplete());
+    CHECK(stats->timeouts > 0);
+    CHECK(stats->overruns == 0);
+    releasing = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Buffers queued back to back go out with no gap on the line.
+//------------------------------------------------------------------------------
+static void TestTransmit(void)
+{
+    static unsigned char data[MAX_BYTES / 4];
+    unsigned int queued = 0;
+    unsigned int gaps = 0;
+    unsigned int size;
+    unsigned int i;
+
+    Open(0);
+    for (i = 0; i < sizeof(data); i++) {
+
+        data[i] = rand();
+    }
+    CHECK(USART_IsTxDone(PORT));
+    CHECK(USART_Send(PORT, data, 100));
+    CHECK(USART_Send(PORT, data + 100, 60));
+    CHECK(!USART_Send(PORT, data + 160, 40));
+    CHECK(!USART_Send(PORT, data, 0));
+    CHECK(!USART_Send(PORT, data, 0x10000));
+    queued = 160;
+
+    // A buffer queued as soon as there is room, each character time
+    while (queued < sizeof(data)) {
+
+        size = 1 + rand() % 300;
+        if (size > sizeof(data) - queued) {
+
+            size = sizeof(data) - queued;
+        }
+        if (USART_Send(PORT, data + queued, size)) {
+
+            queued += size;
+        }
+        i = numSent;
+        Step(0);
+        gaps += (numSent == i);
+    }
+    while (!USART_IsTxDone(PORT)) {
+
+        i = numSent;
+        Step(0);
+        gaps += (numSent == i);
+    }
+    CHECK(gaps == 0);
+    CHECK(numSent == sizeof(data));
+    CHECK(memcmp(sent, data, sizeof(data)) == 0);
+    USART_Close(PORT);
+    CHECK(!USART_Send(PORT, data, 1));
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(void)
+{
+    HOST_Initialize();
+    MMIO_Map((unsigned int) (unsigned long) AT91C_BASE_US0, sizeof(AT91S_USART),
+             Read, Write, 0);
+    srand(1);
+
+    TestReceive();
+    TestLate();
+    TestTimeoutRace();
+    TestHeld();
+    TestCallback();
+    TestTransmit();
+
+    return CHECK_Result("usart_test");
+}
@@ -0,0 +1,268 @@
+/* ----------------------------------------------------------------------------
+ *         Host test of usbctl.c
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Replays the SETUP packets of usbctl_setup.txt (or of the file given as
+** argument) through usbctl.c, with the descriptors and class requests of
+** cdc.c, and compares each reply with the one recorded in the file.
+*/
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "check.h"
+#include "usbdsim.h"
+#include "cdc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+#define MAX_LINE                512
+#define MAX_DATA                128
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static const char *file;
+static unsigned int line;
+
+/// Packet size given by cdc.c to the vendor stream.
+static unsigned short streamSize;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// ustream.c
+//------------------------------------------------------------------------------
+void USTREAM_Configure(unsigned short maxPacket)
+{
+    streamSize = maxPacket;
+}
+
+//------------------------------------------------------------------------------
+/// Reports a mismatch at the current line of the replay file.
+//------------------------------------------------------------------------------
+static void Mismatch(const char *what)
+{
+    checkFailures++;
+    printf("%s:%u: %s\n", file, line, what);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the next field of the line as a number, or -1 if there is none.
+//------------------------------------------------------------------------------
+static long Next(int base)
+{
+    char *field = strtok(0, " \t\r\n");
+
+    return field ? strtol(field, 0, base) : -1;
+}
+
+//------------------------------------------------------------------------------
+/// Checks the reply to a SETUP packet against the rest of the line.
+//------------------------------------------------------------------------------
+static void CheckReply(const char *expected, const UsbReply *reply)
+{
+    static const char * const events[] = {
+
+        "", "ADDRESS", "CONFIGURE", "HALT", "UNHALT"
+    };
+    const unsigned char *data = reply->data;
+    char *event;
+    long size;
+    long byte;
+    unsigned int i;
+
+    checkCount++;
+    if (strcmp(expected, "STALL") == 0) {
+
+        if (reply->action != USBCTL_STALL) {
+
+            Mismatch("not stalled");
+        }
+    }
+    else if (strcmp(expected, "STATUS") == 0) {
+
+        event = strtok(0, " \t\r\n");
+        if (reply->action != USBCTL_STATUS) {
+
+            Mismatch("no status stage");
+        }
+        else if (strcmp(event ? event : "", events[reply->event]) != 0) {
+
+            Mismatch("wrong event");
+        }
+        else if (event && (reply->value != Next(16))) {
+
+            Mismatch("wrong event value");
+        }
+    }
+    else if (strcmp(expected, "IN") == 0) {
+
+        size = Next(10);
+        if (reply->action != USBCTL_DATA_IN) {
+
+            Mismatch("no IN data stage");
+            return;
+        }
+        if (reply->size != size) {
+
+            Mismatch("wrong IN size");
+        }
+        for (i = 0; (byte = Next(16)) >= 0; i++) {
+
+            if ((i >= reply->size) || (data[i] != byte)) {
+
+                Mismatch("wrong IN data");
+                break;
+            }
+        }
+    }
+    else {
+
+        Mismatch("unknown reply");
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Replays one line.
+//------------------------------------------------------------------------------
+static void Replay(char *text)
+{
+    unsigned char packet[8];
+    unsigned char data[MAX_DATA];
+    char *field = strtok(text, " \t\r\n");
+    char *expected;
+    UsbReply reply;
+    long address;
+    long value;
+    unsigned int i;
+
+    if ((field == 0) || (field[0] == '#')) {
+
+        return;
+    }
+
+    if (strcmp(field, "RESET") == 0) {
+
+        field = strtok(0, " \t\r\n");
+        USBDSIM_Reset(strcmp(field, "HS") == 0);
+    }
+    else if (strcmp(field, "HALT") == 0) {
+
+        USBD_Halt(Next(16));
+    }
+    else if (strcmp(field, "WEDGE") == 0) {
+
+        USBD_Wedge(Next(16), 1);
+    }
+    else if (strcmp(field, "UNWEDGE") == 0) {
+
+        USBD_Wedge(Next(16), 0);
+    }
+    else if (strcmp(field, "HALTED") == 0) {
+
+        address = Next(16);
+        checkCount++;
+        if (USBDSIM_IsHalted(address) != Next(16)) {
+
+            Mismatch("wrong halt");
+        }
+    }
+    else if (strcmp(field, "CONFIGURED") == 0) {
+
+        checkCount++;
+        if (CDC_IsConfigured() != Next(16)) {
+
+            Mismatch("wrong configuration");
+        }
+        value = Next(10);
+        if ((value >= 0)
+            && ((USBDSIM_GetMaxPacket(CDC_EP_DATA_OUT) != value)
+                || (USBDSIM_GetMaxPacket(CDC_EP_DATA_IN) != value)
+                || (streamSize != value))) {
+
+            Mismatch("wrong bulk size");
+        }
+    }
+    else {
+
+        // SETUP packet
+        packet[0] = strtol(field, 0, 16);
+        for (i = 1; i < sizeof(packet); i++) {
+
+            packet[i] = Next(16);
+        }
+        expected = strtok(0, " \t\r\n");
+        if (expected == 0) {
+
+            Mismatch("no reply");
+            return;
+        }
+
+        if (strcmp(expected, "OUT") == 0) {
+
+            value = Next(10);
+            for (i = 0; (i < sizeof(data)) && (i < value); i++) {
+
+                data[i] = Next(16);
+            }
+            USBDSIM_Control(packet, data, &reply);
+            checkCount++;
+            if ((reply.action != USBCTL_DATA_OUT) || (reply.size != value)) {
+
+                Mismatch("no OUT data stage");
+            }
+        }
+        else {
+
+            USBDSIM_Control(packet, 0, &reply);
+            CheckReply(expected, &reply);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+int main(int argc, char *argv[])
+{
+    char text[MAX_LINE];
+    FILE *replay;
+
+    file = (argc > 1) ? argv[1] : "usbctl_setup.txt";
+    replay = fopen(file, "r");
+    if (replay == 0) {
+
+        perror(file);
+        return 1;
+    }
+
+    HOST_Initialize();
+    CDC_Initialize();
+
+    while (fgets(text, sizeof(text), replay)) {
+
+        line++;
+        Replay(text);
+    }
+    fclose(replay);
+
+    // The line coding set by the replay
+    CHECK(CDC_GetLineCoding()->baudrate == 921600);
+    CHECK(CDC_GetLineCoding()->parity == 2);
+    CHECK(CDC_GetLineCoding()->dataBits == 7);
+
+    return CHECK_Result("usbctl_test");
+}
@@ -0,0 +1,412 @@
+/* ----------------------------------------------------------------------------
+ *         Simulated USB device driver and host
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "usbdsim.h"
+#include "irq.h"
+#include "AT91SAM3U4.h"
+
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Halt bit of an endpoint address in UsbCtl.halted.
+#define HALT_BIT(address)   (1u << ((((address) & 0xF) << 1) \
+                                    | (((address) & USB_DIR_IN) ? 1 : 0)))
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// State of endpoints 1 to 6.
+typedef struct {
+
+    unsigned short maxPacket;
+    unsigned char in;
+    unsigned char busy;
+    /// Buffers of the transfer: one, or a descriptor chain.
+    UsbdDmaDescriptor single;
+    UsbdDmaDescriptor *descriptors;
+    unsigned int count;
+    unsigned int transferred;
+    UsbdCallback callback;
+    void *arg;
+
+} Endpoint;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static Endpoint endpoints[USBD_NUM_ENDPOINTS];
+
+static UsbCtl usbCtl;
+
+static UsbdConfigured configuredCallback;
+
+static void (*serviceHandler)(void);
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Ends the transfer of an endpoint and calls its callback.
+//------------------------------------------------------------------------------
+static void Complete(unsigned char number, unsigned char status)
+{
+    Endpoint *endpoint = &endpoints[number];
+
+    endpoint->busy = 0;
+    if (endpoint->callback) {
+
+        endpoint->callback(endpoint->arg, status, endpoint->transferred);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Aborts the transfers and disables endpoints 1 to 6.
+//------------------------------------------------------------------------------
+static void ResetEndpoints(void)
+{
+    unsigned char number;
+
+    for (number = 1; number < USBD_NUM_ENDPOINTS; number++) {
+
+        if (endpoints[number].busy) {
+
+            Complete(number, USBD_STATUS_ABORTED);
+        }
+        endpoints[number].maxPacket = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Applies the side effect of a request, as at the end of its status stage.
+//------------------------------------------------------------------------------
+static void ApplyEvent(const UsbReply *reply)
+{
+    if (reply->event == USBCTL_EVENT_CONFIGURE) {
+
+        ResetEndpoints();
+        if (configuredCallback) {
+
+            configuredCallback(reply->value);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if an endpoint can move data: configured, in the direction
+/// asked, with a transfer and no halt.
+//------------------------------------------------------------------------------
+static unsigned char IsReady(unsigned char number, unsigned char in)
+{
+    Endpoint *endpoint = &endpoints[number];
+
+    return (number > 0) && (number < USBD_NUM_ENDPOINTS)
+           && endpoint->maxPacket && (endpoint->in == in) && endpoint->busy
+           && !USBDSIM_IsHalted(number | (in ? USB_DIR_IN : 0));
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Bus reset: back to the default state, at the speed given.
+//------------------------------------------------------------------------------
+void USBDSIM_Reset(unsigned char highSpeed)
+{
+    unsigned char wasConfigured = usbCtl.configuration;
+
+    ResetEndpoints();
+    USBCTL_Reset(&usbCtl, highSpeed);
+    if (wasConfigured && configuredCallback) {
+
+        configuredCallback(0);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Runs a control transfer.
+/// \param packet  SETUP packet (8 bytes).
+/// \param data  Data stage of an OUT request, at least wLength bytes.
+/// \param reply  Receives the reply of the device.
+//------------------------------------------------------------------------------
+void USBDSIM_Control(const unsigned char *packet,
+                     const void *data,
+                     UsbReply *reply)
+{
+    UsbSetup setup;
+
+    USBCTL_ParseSetup(packet, &setup);
+    USBCTL_Request(&usbCtl, &setup, reply);
+
+    if (reply->action == USBCTL_DATA_OUT) {
+
+        memcpy(reply->data, data, reply->size);
+        if (reply->complete) {
+
+            reply->complete();
+        }
+    }
+    if (reply->action != USBCTL_STALL) {
+
+        ApplyEvent(reply);
+    }
+    USBDSIM_Service();
+}
+
+//------------------------------------------------------------------------------
+/// The host sends data on an OUT endpoint, in packets, the last one short
+/// unless size is a multiple of the packet size. The transfer of the device
+/// ends when its buffer is full or at the short packet.
+/// Returns the number of bytes taken, the host sending the others with the
+/// next call; 0 if the endpoint NAKs or stalls.
+//------------------------------------------------------------------------------
+unsigned int USBDSIM_Send(unsigned char number,
+                          const void *data,
+                          unsigned int size)
+{
+    Endpoint *endpoint = &endpoints[number];
+    unsigned int taken;
+
+    if (!IsReady(number, 0)) {
+
+        return 0;
+    }
+
+    taken = (size < endpoint->single.size) ? size : endpoint->single.size;
+    memcpy(endpoint->single.buffer, data, taken);
+    endpoint->transferred = taken;
+    Complete(number, USBD_STATUS_SUCCESS);
+    USBDSIM_Service();
+
+    return taken;
+}
+
+//------------------------------------------------------------------------------
+/// The host reads the transfer of an IN endpoint, whole.
+/// Returns the number of bytes received; 0 if the endpoint NAKs or stalls,
+/// or sent a zero-length packet.
+//------------------------------------------------------------------------------
+unsigned int USBDSIM_Receive(unsigned char number,
+                             void *buffer,
+                             unsigned int size)
+{
+    Endpoint *endpoint = &endpoints[number];
+    unsigned char *destination = buffer;
+    unsigned int received = 0;
+    unsigned int chunk;
+    unsigned int i;
+
+    if (!IsReady(number, 1)) {
+
+        return 0;
+    }
+
+    for (i = 0; i < endpoint->count; i++) {
+
+        chunk = endpoint->descriptors[i].size;
+        if (chunk > size - received) {
+
+            chunk = size - received;
+        }
+        memcpy(destination + received, endpoint->descriptors[i].buffer, chunk);
+        received += chunk;
+    }
+    endpoint->transferred = received;
+    Complete(number, USBD_STATUS_SUCCESS);
+    USBDSIM_Service();
+
+    return received;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the endpoint is halted.
+/// \param address  Endpoint address: number, plus USB_DIR_IN for IN.
+//------------------------------------------------------------------------------
+unsigned char USBDSIM_IsHalted(unsigned char address)
+{
+    return (usbCtl.halted & HALT_BIT(address)) != 0;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the packet size of an endpoint; 0 if it is not configured.
+//------------------------------------------------------------------------------
+unsigned short USBDSIM_GetMaxPacket(unsigned char number)
+{
+    return endpoints[number & 0xF].maxPacket;
+}
+
+//------------------------------------------------------------------------------
+/// Runs the service handler, as at the end of a UDPHS interrupt, until the
+/// interrupt is no longer set pending.
+//------------------------------------------------------------------------------
+void USBDSIM_Service(void)
+{
+    do {
+
+        if (serviceHandler) {
+
+            serviceHandler();
+        }
+    }
+    while (HOST_TakePending(AT91C_ID_UDPHS));
+}
+
+//------------------------------------------------------------------------------
+/// usbd.c
+//------------------------------------------------------------------------------
+void USBD_Initialize(const UsbDescriptors *descriptors,
+                     UsbClassHandler classHandler,
+                     UsbdConfigured configured)
+{
+    USBCTL_Initialize(&usbCtl, descriptors, classHandler);
+    configuredCallback = configured;
+    serviceHandler = 0;
+    memset(endpoints, 0, sizeof(endpoints));
+}
+
+void USBD_Connect(void)
+{
+}
+
+void USBD_Disconnect(void)
+{
+    USBDSIM_Reset(0);
+}
+
+unsigned char USBD_IsHighSpeed(void)
+{
+    return usbCtl.highSpeed;
+}
+
+unsigned char USBD_IsConfigured(void)
+{
+    return usbCtl.configuration != 0;
+}
+
+unsigned char USBD_ConfigureEndpoint(unsigned char address,
+                                     unsigned char type,
+                                     unsigned short maxPacket,
+                                     unsigned char banks)
+{
+    unsigned char number = address & 0xF;
+
+    if ((number == 0) || (number >= USBD_NUM_ENDPOINTS)
+        || (type < USBD_ISOCHRONOUS) || (type > USBD_INTERRUPT)
+        || (banks == 0) || (banks > 3)
+        || (maxPacket < 8) || (maxPacket > 1024)
+        || (maxPacket & (maxPacket - 1))) {
+
+        return 0;
+    }
+    USBD_Abort(number);
+    endpoints[number].maxPacket = maxPacket;
+    endpoints[number].in = (address & USB_DIR_IN) != 0;
+
+    return 1;
+}
+
+unsigned char USBD_Transfer(unsigned char number,
+                            void *buffer,
+                            unsigned int size,
+                            UsbdCallback callback,
+                            void *arg)
+{
+    Endpoint *endpoint = &endpoints[number];
+
+    if ((number == 0) || (number >= USBD_NUM_ENDPOINTS)
+        || (endpoint->maxPacket == 0) || endpoint->busy
+        || ((size == 0) && !endpoint->in)) {
+
+        return 0;
+    }
+    endpoint->single.buffer = buffer;
+    endpoint->single.size = size;
+    endpoint->descriptors = &endpoint->single;
+    endpoint->count = 1;
+    endpoint->busy = 1;
+    endpoint->transferred = 0;
+    endpoint->callback = callback;
+    endpoint->arg = arg;
+
+    return 1;
+}
+
+unsigned char USBD_TransferChain(unsigned char number,
+                                 UsbdDmaDescriptor *descriptors,
+                                 unsigned int count,
+                                 unsigned char validate,
+                                 UsbdCallback callback,
+                                 void *arg)
+{
+    Endpoint *endpoint = &endpoints[number];
+    unsigned int i;
+
+    if ((number == 0) || (number >= USBD_NUM_ENDPOINTS) || (count == 0)
+        || (endpoint->maxPacket == 0) || !endpoint->in || endpoint->busy) {
+
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+
+        if ((descriptors[i].size == 0)
+            || (descriptors[i].size > USBD_MAX_DMA_BUFFER)) {
+
+            return 0;
+        }
+    }
+    endpoint->descriptors = descriptors;
+    endpoint->count = count;
+    endpoint->busy = 1;
+    endpoint->transferred = 0;
+    endpoint->callback = callback;
+    endpoint->arg = arg;
+
+    return 1;
+}
+
+void USBD_Abort(unsigned char number)
+{
+    if ((number > 0) && (number < USBD_NUM_ENDPOINTS)
+        && endpoints[number].busy) {
+
+        Complete(number, USBD_STATUS_ABORTED);
+    }
+}
+
+unsigned char USBD_IsBusy(unsigned char number)
+{
+    return (number < USBD_NUM_ENDPOINTS) && endpoints[number].busy;
+}
+
+void USBD_Halt(unsigned char address)
+{
+    if (USBDSIM_GetMaxPacket(address)) {
+
+        USBCTL_SetHalt(&usbCtl, address, 1);
+    }
+}
+
+void USBD_Wedge(unsigned char address, unsigned char wedged)
+{
+    if (USBDSIM_GetMaxPacket(address)) {
+
+        USBCTL_SetWedge(&usbCtl, address, wedged);
+    }
+}
+
+void USBD_SetServiceHandler(void (*handler)(void))
+{
+    serviceHandler = handler;
+}
@@ -0,0 +1,48 @@
+/* ----------------------------------------------------------------------------
+ *         Simulated USB device driver and host
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Implements the interface of usbd.h over usbctl.c, without the UDPHS: the
+** test plays the host. SETUP packets go through USBCTL_Request() and their
+** side effects are applied as usbd.c does once the status stage is over;
+** bulk data moves a whole transfer at a time, and the service handler runs
+** after each host action and whenever the driver sets the UDPHS interrupt
+** pending.
+*/
+
+#ifndef USBDSIM_H
+#define USBDSIM_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "usbd.h"
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void USBDSIM_Reset(unsigned char highSpeed);
+
+extern void USBDSIM_Control(const unsigned char *packet,
+                            const void *data,
+                            UsbReply *reply);
+
+extern unsigned int USBDSIM_Send(unsigned char number,
+                                 const void *data,
+                                 unsigned int size);
+
+extern unsigned int USBDSIM_Receive(unsigned char number,
+                                    void *buffer,
+                                    unsigned int size);
+
+extern unsigned char USBDSIM_IsHalted(unsigned char address);
+
+extern unsigned short USBDSIM_GetMaxPacket(unsigned char number);
+
+extern void USBDSIM_Service(void);
+
+#endif //#ifndef USBDSIM_H
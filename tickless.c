@@ -0,0 +1,220 @@
+/* ----------------------------------------------------------------------------
+ *         Tickless idle
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "tickless.h"
+#include "clock.h"
+#include "exceptions.h"
+#include "AT91SAM3U4.h"
+
+#include <intrinsics.h>
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Time elapsed since the last whole tick reported to the caller. Time is
+/// accounted in units of 1 / (TICKLESS_RTT_HZ * tickHz) s, so that both a tick
+/// (TICKLESS_RTT_HZ units) and an RTT period (tickHz units) are whole numbers.
+static unsigned int residue;
+
+static TicklessStats ticklessStats;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns the RTT counter. The counter runs from the slow clock, so it is
+/// read until two consecutive reads match.
+//------------------------------------------------------------------------------
+static unsigned int ReadRtt(void)
+{
+    unsigned int value;
+
+    do {
+
+        value = AT91C_BASE_RTTC->RTTC_RTVR;
+    }
+    while (value != AT91C_BASE_RTTC->RTTC_RTVR);
+
+    return value;
+}
+
+//------------------------------------------------------------------------------
+/// Restarts SysTick for a full tick.
+//------------------------------------------------------------------------------
+static void RestartSysTick(void)
+{
+    AT91C_BASE_NVIC->NVIC_STICKCVR = 0;
+    AT91C_BASE_NVIC->NVIC_STICKCSR |= AT91C_NVIC_STICKENABLE;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if no peripheral depends on MCK or on the crystal, so that the
+/// Wait mode can stop them.
+//------------------------------------------------------------------------------
+static unsigned char CanWait(void)
+{
+    return ((AT91C_BASE_PMC->PMC_PCSR & TICKLESS_WAIT_BLOCKERS) == 0)
+           && ((AT91C_BASE_PMC->PMC_UCKR & AT91C_CKGR_UPLLEN) == 0);
+}
+
+//------------------------------------------------------------------------------
+/// Enters the Wait mode until the RTT alarm or another interrupt, running
+/// from the fast RC meanwhile.
+//------------------------------------------------------------------------------
+static void Wait(unsigned int tickHz)
+{
+    CLOCK_Configure(CLOCK_OP_4MHZ_RC);
+
+    AT91C_BASE_PMC->PMC_FSMR |= AT91C_PMC_RTTAL | AT91C_PMC_LPM;
+    AT91C_BASE_NVIC->NVIC_SCR |= AT91C_NVIC_SEVONPEND;
+
+    // Clear the event register first so that the second WFE really sleeps
+    __SEV();
+    __WFE();
+    __WFE();
+
+    AT91C_BASE_PMC->PMC_FSMR &= ~AT91C_PMC_LPM;
+
+    CLOCK_Configure(TICKLESS_OPERATING_POINT);
+    AT91C_BASE_NVIC->NVIC_STICKRVR = CLOCK_GetMck() / tickHz - 1;
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Stops SysTick and sleeps until at most maxTicks tick boundaries have gone
+/// by, or until an interrupt. Must be called with interrupts disabled; a
+/// pending interrupt still ends the sleep and is taken once the caller
+/// enables interrupts again.
+/// Returns the number of whole ticks elapsed, never more than maxTicks. The
+/// caller accounts for them, the last one included (SysTick is restarted
+/// for a full tick).
+/// \param maxTicks  Ticks until the next timer deadline.
+/// \param tickHz  SysTick frequency.
+//------------------------------------------------------------------------------
+unsigned int TICKLESS_Sleep(unsigned int maxTicks, unsigned int tickHz)
+{
+    AT91PS_NVIC nvic = AT91C_BASE_NVIC;
+    unsigned int reload;
+    unsigned int offset;
+    unsigned int target;
+    unsigned int counts;
+    unsigned int elapsed;
+    unsigned int slept;
+
+    if (maxTicks < TICKLESS_MIN_TICKS) {
+
+        return 0;
+    }
+    if (maxTicks > TICKLESS_MAX_TICKS) {
+
+        maxTicks = TICKLESS_MAX_TICKS;
+    }
+
+    // Stop SysTick, unless a tick is already pending
+    if (nvic->NVIC_ICSR & AT91C_NVIC_PENDSTSET) {
+
+        return 0;
+    }
+    nvic->NVIC_STICKCSR &= ~AT91C_NVIC_STICKENABLE;
+    if (nvic->NVIC_ICSR & AT91C_NVIC_PENDSTSET) {
+
+        nvic->NVIC_STICKCSR |= AT91C_NVIC_STICKENABLE;
+        return 0;
+    }
+
+    // Time since the last tick reported, part of the current tick included
+    reload = nvic->NVIC_STICKRVR + 1;
+    offset = residue + (unsigned int)
+             (((unsigned long long) (reload - 1 - nvic->NVIC_STICKCVR)
+               * TICKLESS_RTT_HZ) / reload);
+
+    // RTT periods until the boundary of the last tick, rounded up
+    target = maxTicks * TICKLESS_RTT_HZ;
+    if (offset >= target) {
+
+        RestartSysTick();
+        return 0;
+    }
+    counts = (target - offset + tickHz - 1) / tickHz;
+
+    // The alarm fires when the counter reaches RTTC_RTAR + 1
+    AT91C_BASE_RTTC->RTTC_RTMR = TICKLESS_RTT_PRESCALER | AT91C_RTTC_RTTRST;
+    AT91C_BASE_RTTC->RTTC_RTAR = counts - 1;
+    AT91C_BASE_RTTC->RTTC_RTMR = TICKLESS_RTT_PRESCALER | AT91C_RTTC_ALMIEN;
+    nvic->NVIC_ISER[0] = 1 << AT91C_ID_RTT;
+
+    if ((maxTicks >= TICKLESS_WAIT_MODE_TICKS) && CanWait()) {
+
+        Wait(tickHz);
+        ticklessStats.waits++;
+    }
+    else {
+
+        if (maxTicks >= TICKLESS_WAIT_MODE_TICKS) {
+
+            ticklessStats.waitsDenied++;
+        }
+        __WFI();
+        ticklessStats.sleeps++;
+    }
+
+    // Stop the alarm and drop its interrupt: the time is accounted here
+    elapsed = ReadRtt();
+    AT91C_BASE_RTTC->RTTC_RTMR = TICKLESS_RTT_PRESCALER;
+    AT91C_BASE_RTTC->RTTC_RTSR;
+    nvic->NVIC_ICPR[0] = 1 << AT91C_ID_RTT;
+
+    if (elapsed < counts) {
+
+        ticklessStats.earlyWakeups++;
+    }
+
+    // Never report more than maxTicks so that no release is skipped. Past
+    // the alarm, the excess is only the wakeup latency: it is dropped beyond
+    // one tick so that the residue stays below a tick
+    elapsed = elapsed * tickHz + offset;
+    slept = elapsed / TICKLESS_RTT_HZ;
+    if (slept > maxTicks) {
+
+        slept = maxTicks;
+    }
+    residue = elapsed - slept * TICKLESS_RTT_HZ;
+    if (residue >= TICKLESS_RTT_HZ) {
+
+        residue = TICKLESS_RTT_HZ - 1;
+    }
+    ticklessStats.ticks += slept;
+
+    RestartSysTick();
+
+    return slept;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the sleep statistics.
+//------------------------------------------------------------------------------
+const TicklessStats * TICKLESS_GetStats(void)
+{
+    return &ticklessStats;
+}
+
+//------------------------------------------------------------------------------
+/// RTT interrupt: only wakes the core up. Normally never taken, since
+/// TICKLESS_Sleep() clears the alarm before interrupts are enabled again.
+//------------------------------------------------------------------------------
+void RTT_IrqHandler(void)
+{
+    AT91C_BASE_RTTC->RTTC_RTMR = TICKLESS_RTT_PRESCALER;
+    AT91C_BASE_RTTC->RTTC_RTSR;
+}
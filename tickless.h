@@ -0,0 +1,103 @@
+/* ----------------------------------------------------------------------------
+ *         Tickless idle
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Lets the scheduler sleep through ticks in which nothing is due. SysTick is
+** stopped, the Real-Time Timer (clocked from the 32 kHz slow clock) is
+** programmed to fire at the next release, and the core sleeps until the RTT
+** alarm or any other interrupt. On wakeup the time spent asleep is converted
+** back to ticks; the fraction of a tick that does not fit is carried over to
+** the next sleep, so no time is lost over many sleeps.
+**
+** Short sleeps use the Sleep mode (WFI): MCK keeps running and the wakeup
+** latency is a few cycles. Long sleeps use the Wait mode (LPM + WFE): MCK is
+** dropped to the fast RC beforehand, which stops the crystal and the PLLA,
+** and the operating point is restored on wakeup, with interrupts still
+** masked, which costs the PLL lock time. The Wait mode is therefore only used
+** while the UPLL (USB) is off and every peripheral of TICKLESS_WAIT_BLOCKERS
+** has its clock disabled in the PMC: their baud rates and timings follow MCK
+** and they would be serviced late. Otherwise the Sleep mode is used.
+** SCR.SLEEPDEEP is kept clear: on the SAM3U it selects the Backup mode, from
+** which the core only exits through a reset.
+*/
+
+#ifndef TICKLESS_H
+#define TICKLESS_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "clock.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// RTT prescaler: the RTT counts at 32768 / TICKLESS_RTT_PRESCALER Hz. 4 gives
+/// a 122 us resolution (the values 1 and 2 are not allowed).
+#ifndef TICKLESS_RTT_PRESCALER
+#define TICKLESS_RTT_PRESCALER      4
+#endif
+
+#define TICKLESS_RTT_HZ             (32768 / TICKLESS_RTT_PRESCALER)
+
+/// Shortest idle time, in ticks, worth stopping SysTick for.
+#ifndef TICKLESS_MIN_TICKS
+#define TICKLESS_MIN_TICKS          2
+#endif
+
+/// Shortest idle time, in ticks, for which the Wait mode is used.
+#ifndef TICKLESS_WAIT_MODE_TICKS
+#define TICKLESS_WAIT_MODE_TICKS    20
+#endif
+
+/// Longest sleep, in ticks; longer idle times are split into several sleeps.
+#ifndef TICKLESS_MAX_TICKS
+#define TICKLESS_MAX_TICKS          60000
+#endif
+
+/// Peripherals that keep the core out of the Wait mode while their clock is
+/// enabled: all those clocked from MCK, except the PIO controllers.
+#ifndef TICKLESS_WAIT_BLOCKERS
+#define TICKLESS_WAIT_BLOCKERS      (0x3FFFFF00 & ~((1 << AT91C_ID_PIOA)      \
+                                                    | (1 << AT91C_ID_PIOB)    \
+                                                    | (1 << AT91C_ID_PIOC)))
+#endif
+
+/// Operating point restored after a Wait mode sleep.
+#ifndef TICKLESS_OPERATING_POINT
+#define TICKLESS_OPERATING_POINT    CLOCK_BOOT_OPERATING_POINT
+#endif
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Sleep statistics.
+typedef struct {
+
+    /// Sleeps in Sleep mode and in Wait mode.
+    unsigned int sleeps;
+    unsigned int waits;
+    /// Sleeps long enough for the Wait mode, made in Sleep mode because a
+    /// peripheral was running.
+    unsigned int waitsDenied;
+    /// Sleeps ended before the alarm by another interrupt.
+    unsigned int earlyWakeups;
+    /// Ticks spent asleep.
+    unsigned int ticks;
+
+} TicklessStats;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned int TICKLESS_Sleep(unsigned int maxTicks, unsigned int tickHz);
+
+extern const TicklessStats * TICKLESS_GetStats(void);
+
+#endif //#ifndef TICKLESS_H
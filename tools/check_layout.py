@@ -0,0 +1,140 @@
+#!/usr/bin/env python
+"""Checks the memory layout of a linked image against sam3u2c_flash.icf.
+
+Usage: check_layout.py <icf file> <map file>
+
+Reads the IAR ILINK map file and fails (exit status 1) when:
+  - __vector_table is not at __ICFEDIT_intvec_start__ or not aligned on
+    __vector_table_alignment__,
+  - the RAMVECTORS block is not aligned on __vector_table_alignment__,
+  - a block with a __budget_<BLOCK>__ symbol in the .icf file is larger
+    than its budget,
+  - the ROM or RAM usage exceeds the size of the region.
+
+Run as the post-build step of the Debug configuration.
+"""
+
+import re
+import sys
+
+
+def parse_number(text):
+    """Parses an ILINK number (0x0008'0000, 0x80000 or '12 560')."""
+    text = text.replace("'", "").replace(" ", "")
+    return int(text, 0)
+
+
+def parse_icf(path):
+    """Returns the symbols defined in the .icf file."""
+    symbols = {}
+    pattern = re.compile(r"define\s+symbol\s+(\w+)\s*=\s*(0x[0-9A-Fa-f]+|\d+)\s*;")
+    with open(path) as icf:
+        for line in icf:
+            match = pattern.search(line)
+            if match:
+                symbols[match.group(1)] = int(match.group(2), 0)
+    return symbols
+
+
+def parse_map(path):
+    """Returns (blocks, entries, usage) from an ILINK map file."""
+    blocks = {}
+    entries = {}
+    usage = {}
+    number = r"(0x[0-9A-Fa-f']+)"
+    block_re = re.compile(r"^\s+(\w+)\s+" + number + r"\s+" + number + r"\s+<Block>")
+    entry_re = re.compile(r"^\s*(\w+)\s+" + number + r"\s")
+    usage_re = re.compile(r"^\s*([\d ]+?)\s+bytes of (readonly|readwrite)\s+(code|data)\s+memory")
+    in_entries = False
+
+    with open(path) as mapfile:
+        for line in mapfile:
+            if "*** ENTRY LIST" in line:
+                in_entries = True
+                continue
+            if re.match(r"\*\*\* \w", line):
+                in_entries = False
+
+            match = block_re.match(line)
+            if match:
+                name = match.group(1)
+                address = parse_number(match.group(2))
+                size = parse_number(match.group(3))
+                start, old = blocks.get(name, (address, 0))
+                blocks[name] = (min(start, address), max(old, size))
+                continue
+
+            match = usage_re.match(line)
+            if match:
+                key = match.group(2)
+                usage[key] = usage.get(key, 0) + parse_number(match.group(1))
+                continue
+
+            if in_entries:
+                match = entry_re.match(line)
+                if match:
+                    entries[match.group(1)] = parse_number(match.group(2))
+
+    return blocks, entries, usage
+
+
+def main(argv):
+    if len(argv) != 3:
+        sys.stderr.write(__doc__)
+        return 2
+
+    symbols = parse_icf(argv[1])
+    blocks, entries, usage = parse_map(argv[2])
+    errors = []
+
+    alignment = symbols.get("__vector_table_alignment__", 0x100)
+    intvec = symbols.get("__ICFEDIT_intvec_start__")
+
+    vectors = entries.get("__vector_table")
+    if vectors is None:
+        errors.append("__vector_table not found in the map file")
+    else:
+        print("__vector_table   0x%08X" % vectors)
+        if intvec is not None and vectors != intvec:
+            errors.append("__vector_table at 0x%08X instead of 0x%08X"
+                          % (vectors, intvec))
+        if vectors % alignment:
+            errors.append("__vector_table not aligned on 0x%X" % alignment)
+
+    if "RAMVECTORS" in blocks:
+        address = blocks["RAMVECTORS"][0]
+        print("RAMVECTORS       0x%08X" % address)
+        if address % alignment:
+            errors.append("RAMVECTORS not aligned on 0x%X" % alignment)
+
+    for symbol in sorted(symbols):
+        match = re.match(r"__budget_(\w+)__$", symbol)
+        if not match:
+            continue
+        name = match.group(1)
+        budget = symbols[symbol]
+        size = blocks.get(name, (0, 0))[1]
+        print("%-16s %6d / %6d bytes" % (name, size, budget))
+        if size > budget:
+            errors.append("%s uses %d bytes, budget is %d" % (name, size, budget))
+
+    regions = (
+        ("ROM", "readonly", "__ICFEDIT_region_ROM_start__", "__ICFEDIT_region_ROM_end__"),
+        ("RAM", "readwrite", "__ICFEDIT_region_RAM_start__", "__ICFEDIT_region_RAM_end__"),
+    )
+    for name, kind, start, end in regions:
+        if start not in symbols or end not in symbols:
+            continue
+        size = symbols[end] - symbols[start] + 1
+        used = usage.get(kind, 0)
+        print("%-16s %6d / %6d bytes" % (name, used, size))
+        if used > size:
+            errors.append("%s uses %d bytes, region is %d" % (name, used, size))
+
+    for error in errors:
+        sys.stderr.write("error: %s\n" % error)
+    return 1 if errors else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,99 @@
+#!/usr/bin/env python
+"""Decodes a dump of the event log (evlog.h) to CSV.
+
+Usage: evlog2csv.py <dump.bin> [output.csv]
+
+The dump is the log range read back from the target, for example the
+IMAGE_LOG_SIZE bytes at IMAGE_LOG_START. Blocks that are erased or fail
+their CRC are skipped; the others are decoded oldest first, one row per
+event: block sequence, block tick, cycles (core counter, 32 bits), event
+identifier and value. A gap in the block sequences means the log wrapped
+or lost blocks; dropped events come as identifier 0xFFFF.
+"""
+
+import csv
+import struct
+import sys
+import zlib
+
+
+BLOCK_SIZE = 512
+HEADER = struct.Struct("<4I2H")
+MAGIC = 0x474F4C45
+ID_DROPPED = 0xFFFF
+
+
+def varint(data, offset):
+    """Returns an unsigned LEB128 number and the offset after it."""
+    value = 0
+    shift = 0
+    while True:
+        byte = data[offset]
+        offset += 1
+        value |= (byte & 0x7F) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value, offset
+
+
+def read_blocks(data):
+    """Returns the valid blocks of a dump, oldest first."""
+    blocks = []
+    for start in range(0, len(data) - BLOCK_SIZE + 1, BLOCK_SIZE):
+        block = data[start:start + BLOCK_SIZE]
+        crc, = struct.unpack_from("<I", block, BLOCK_SIZE - 4)
+        if (struct.unpack_from("<I", block)[0] != MAGIC
+                or zlib.crc32(block[:BLOCK_SIZE - 4]) & 0xFFFFFFFF != crc):
+            continue
+        blocks.append(block)
+    return sorted(blocks, key=lambda block: HEADER.unpack_from(block)[1])
+
+
+def decode(block):
+    """Yields the rows of a block."""
+    _, sequence, tick, cycles, size, count = HEADER.unpack_from(block)
+    offset = HEADER.size
+    end = offset + size
+    for _ in range(count):
+        if offset >= end:
+            raise ValueError("block %d: records overrun" % sequence)
+        delta, offset = varint(block, offset)
+        identifier, offset = varint(block, offset)
+        value, offset = varint(block, offset)
+        # Zigzag: events may be published slightly out of order
+        delta = (delta >> 1) ^ -(delta & 1)
+        cycles = (cycles + delta) & 0xFFFFFFFF
+        yield sequence, tick, cycles, identifier, value
+
+
+def main(argv):
+    if len(argv) < 2:
+        sys.stderr.write(__doc__)
+        return 2
+
+    with open(argv[1], "rb") as dump:
+        data = dump.read()
+    out = open(argv[2], "w", newline="") if len(argv) > 2 else sys.stdout
+
+    writer = csv.writer(out)
+    writer.writerow(["sequence", "tick", "cycles", "id", "value"])
+    events = 0
+    dropped = 0
+    blocks = read_blocks(data)
+    for block in blocks:
+        for row in decode(block):
+            writer.writerow(row)
+            if row[3] == ID_DROPPED:
+                dropped += row[4]
+            else:
+                events += 1
+    if out is not sys.stdout:
+        out.close()
+
+    sys.stderr.write("%d blocks, %d events, %d dropped\n"
+                     % (len(blocks), events, dropped))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
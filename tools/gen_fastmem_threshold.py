@@ -0,0 +1,90 @@
+#!/usr/bin/env python
+"""Generates fastmem_threshold.h from a FASTMEM_Calibrate() console log.
+
+Usage: gen_fastmem_threshold.py <console log> <output header>
+
+Reads the "-I- fastmem <size> <cpu> <hdma>" lines (hexadecimal, core
+cycles) printed by FASTMEM_Calibrate() on the target and sets
+FASTMEM_DMA_THRESHOLD to the smallest measured size from which the HDMA
+copy is faster than the CPU copy at every larger size. When the HDMA never
+wins, the threshold is 0 and every block stays on the CPU.
+"""
+
+import os
+import re
+import sys
+
+
+HEADER = """\
+/* ----------------------------------------------------------------------------
+ *         Block copy CPU/HDMA cutover
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Generated by tools/gen_fastmem_threshold.py; do not edit.
+** Source: %(source)s.
+*/
+
+#ifndef FASTMEM_THRESHOLD_H
+#define FASTMEM_THRESHOLD_H
+
+/// Smallest block, in bytes, handed to the HDMA; 0 keeps every block on the
+/// CPU.
+#ifndef FASTMEM_DMA_THRESHOLD
+#define FASTMEM_DMA_THRESHOLD   %(threshold)d
+#endif
+
+#endif //#ifndef FASTMEM_THRESHOLD_H
+"""
+
+
+def parse_log(path):
+    """Returns {size: (cpu cycles, hdma cycles)}; the last run wins."""
+    samples = {}
+    pattern = re.compile(r"-I- fastmem ([0-9A-Fa-f]{8}) ([0-9A-Fa-f]{8}) ([0-9A-Fa-f]{8})")
+    with open(path) as log:
+        for line in log:
+            match = pattern.search(line)
+            if match:
+                size, cpu, dma = [int(group, 16) for group in match.groups()]
+                samples[size] = (cpu, dma)
+    return samples
+
+
+def find_threshold(samples):
+    """Returns the smallest size from which the HDMA always wins, or 0."""
+    threshold = 0
+    for size in sorted(samples, reverse=True):
+        cpu, dma = samples[size]
+        if dma >= cpu:
+            break
+        threshold = size
+    return threshold
+
+
+def main(argv):
+    if len(argv) != 3:
+        sys.stderr.write(__doc__)
+        return 2
+
+    samples = parse_log(argv[1])
+    if not samples:
+        sys.stderr.write("error: no calibration lines in %s\n" % argv[1])
+        return 1
+
+    for size in sorted(samples):
+        cpu, dma = samples[size]
+        print("%8d bytes  cpu %8d  hdma %8d cycles" % (size, cpu, dma))
+    threshold = find_threshold(samples)
+    print("FASTMEM_DMA_THRESHOLD = %d" % threshold)
+
+    source = "%s, %d sizes from %d to %d bytes" % (
+        os.path.basename(argv[1]), len(samples), min(samples), max(samples))
+    with open(argv[2], "w") as header:
+        header.write(HEADER % {"source": source, "threshold": threshold})
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,197 @@
+#!/usr/bin/env python
+"""Builds firmware slot images and update streams (image.h, update.h).
+
+Usage: mkimage.py slot <image.bin> <output> [version]
+       mkimage.py update <image.bin> <output> [version] [base.bin] [--raw]
+       mkimage.py blank <output>
+
+The image is the raw binary of the application, linked for slot A
+(ielftool --bin eie_ide.out eie_ide.bin).
+
+"slot" writes a whole slot: the image padded with 0xFF, then its trailer
+with the page CRCs. Program it at slot A for a first installation, and
+whenever slot A is reflashed with the debugger: an image downloaded alone
+keeps the trailer of the previous one, and the bootloader then takes it for
+a corrupt image and recovers slot B.
+
+"blank" writes an erased trailer, to program at slot A + MAX_SIZE
+(0x0008D400) after downloading an image alone: the bootloader then adopts
+slot A as a whole, as after a full erase.
+
+"update" writes an update stream for UPDATE_Write(): LZ77 copies within the
+image, 0xFF fills and, with a base image (the one running on the target,
+as built), copies from the base, so that only the changed bytes are sent.
+--raw sends the image as a single literal instead.
+"""
+
+import struct
+import sys
+import zlib
+
+
+PAGE_SIZE = 256
+SLOT_SIZE = 0xB800
+TRAILER_SIZE = 0x400
+MAX_SIZE = SLOT_SIZE - TRAILER_SIZE
+MAX_PAGES = MAX_SIZE // PAGE_SIZE
+
+IMAGE_MAGIC = 0x474D4945
+UPDATE_MAGIC = 0x44505545
+
+OP_LITERAL = 0
+OP_FILL = 1
+OP_COPY = 2
+OP_BASE = 3
+
+# Shortest copy or fill worth an operation, and how far back to search.
+MIN_MATCH = 6
+MAX_CANDIDATES = 32
+
+
+def crc32(data):
+    return zlib.crc32(data) & 0xFFFFFFFF
+
+
+def read_image(path):
+    with open(path, "rb") as image:
+        data = image.read()
+    if not data or len(data) > MAX_SIZE:
+        raise ValueError("%s: %d bytes, slot holds 1 to %d"
+                         % (path, len(data), MAX_SIZE))
+    return data
+
+
+def make_trailer(image, version):
+    """Returns the trailer of an image, as written by IMAGE_WriteTrailer()."""
+    padded = image + b"\xFF" * (-len(image) % PAGE_SIZE)
+    crcs = [crc32(padded[offset:offset + PAGE_SIZE])
+            for offset in range(0, len(padded), PAGE_SIZE)]
+    crcs += [0xFFFFFFFF] * (MAX_PAGES - len(crcs))
+    fields = struct.pack("<4I%dI" % MAX_PAGES,
+                         IMAGE_MAGIC, len(image), version, crc32(image), *crcs)
+    return fields + struct.pack("<I", crc32(fields))
+
+
+def leb128(value):
+    out = bytearray()
+    while True:
+        byte = value & 0x7F
+        value >>= 7
+        if value:
+            out.append(byte | 0x80)
+        else:
+            out.append(byte)
+            return bytes(out)
+
+
+def index_positions(data, table, limit):
+    """Adds the positions of data below limit to a table of 4-byte keys."""
+    for position in range(limit - 3):
+        table.setdefault(data[position:position + 4], []).append(position)
+
+
+def match_length(source, start, target, position):
+    length = 0
+    end = min(len(source) - start, len(target) - position)
+    while length < end and source[start + length] == target[position + length]:
+        length += 1
+    return length
+
+
+def encode(image, base):
+    """Returns the operations that rebuild image (see update.h)."""
+    base_table = {}
+    if base:
+        index_positions(base, base_table, len(base))
+    own_table = {}
+    ops = bytearray()
+    literal = bytearray()
+    position = 0
+    indexed = 0
+
+    def flush_literal():
+        if literal:
+            ops.extend(bytes([OP_LITERAL]) + leb128(len(literal)) + literal)
+            del literal[:]
+
+    while position < len(image):
+        # Bytes before position can be copied from
+        for start in range(indexed, max(indexed, position - 3)):
+            own_table.setdefault(image[start:start + 4], []).append(start)
+        indexed = max(indexed, position - 3)
+
+        key = image[position:position + 4]
+        best = (0, None, 0)
+
+        run = 1
+        while position + run < len(image) and image[position + run] == image[position]:
+            run += 1
+        if run >= MIN_MATCH:
+            best = (run, OP_FILL, image[position])
+
+        for start in reversed(base_table.get(key, [])[-MAX_CANDIDATES:]):
+            length = match_length(base, start, image, position)
+            if length > best[0]:
+                best = (length, OP_BASE, start)
+        for start in reversed(own_table.get(key, [])[-MAX_CANDIDATES:]):
+            length = match_length(image, start, image, position)
+            if length > best[0]:
+                best = (length, OP_COPY, position - start)
+
+        length, op, argument = best
+        if length < MIN_MATCH:
+            literal.append(image[position])
+            position += 1
+            continue
+
+        flush_literal()
+        if op == OP_FILL:
+            ops.extend(bytes([OP_FILL]) + leb128(length) + bytes([argument]))
+        else:
+            ops.extend(bytes([op]) + leb128(argument) + leb128(length))
+        position += length
+
+    flush_literal()
+    return bytes(ops)
+
+
+def make_update(image, version, base, raw):
+    if raw:
+        ops = bytes([OP_LITERAL]) + leb128(len(image)) + image
+    else:
+        ops = encode(image, base)
+    fields = struct.pack("<5I", UPDATE_MAGIC, len(image), version, crc32(image),
+                         crc32(base) if base else 0)
+    return fields + struct.pack("<I", crc32(fields)) + ops
+
+
+def main(argv):
+    args = [arg for arg in argv[1:] if arg != "--raw"]
+    raw = "--raw" in argv
+    if args[:1] == ["blank"] and len(args) == 2:
+        with open(args[1], "wb") as out:
+            out.write(b"\xFF" * TRAILER_SIZE)
+        return 0
+    if len(args) < 3 or args[0] not in ("slot", "update"):
+        sys.stderr.write(__doc__)
+        return 2
+
+    image = read_image(args[1])
+    version = int(args[3], 0) if len(args) > 3 else 0
+
+    if args[0] == "slot":
+        padded = image + b"\xFF" * (MAX_SIZE - len(image))
+        output = padded + make_trailer(image, version)
+        output += b"\xFF" * (SLOT_SIZE - len(output))
+    else:
+        base = read_image(args[4]) if len(args) > 4 else b""
+        output = make_update(image, version, base, raw)
+        print("%d bytes -> %d bytes" % (len(image), len(output)))
+
+    with open(args[2], "wb") as out:
+        out.write(output)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,513 @@
+/* ----------------------------------------------------------------------------
+ *         TWI (I2C) master
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "twi.h"
+#include "evlog.h"
+#include "exceptions.h"
+#include "irq.h"
+#include "AT91SAM3U4.h"
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Position of the fields of TWI_MMR and TWI_CWGR.
+#define MMR_IADRSZ_SHIFT        8
+#define MMR_DADR_SHIFT          16
+#define CWGR_CHDIV_SHIFT        8
+#define CWGR_CKDIV_SHIFT        16
+
+/// Errors watched during every transfer.
+#define ERROR_INTERRUPTS        (AT91C_TWI_NACK_MASTER \
+                                 | AT91C_TWI_ARBLST_MULTI_MASTER)
+
+/// Bus states.
+#define STATE_IDLE              0
+#define STATE_WRITE_DATA        1
+#define STATE_READ_DATA         2
+#define STATE_READ_TAIL         3
+#define STATE_STOP              4
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Fixed description of a bus.
+typedef struct {
+
+    AT91PS_TWI twi;
+    unsigned int id;
+    /// TWD and TWCK, on peripheral A of PIOA.
+    unsigned int pins;
+
+} TwiHardware;
+
+/// Run-time state of a bus.
+typedef struct {
+
+    /// Waiting transactions and the running one.
+    TwiTransaction *head;
+    TwiTransaction *tail;
+    TwiTransaction *current;
+    unsigned char state;
+    /// Bytes of the running read already received.
+    unsigned short received;
+    TwiStats stats;
+
+} TwiBus;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static const TwiHardware hardware[TWI_NUM_PORTS] = {
+
+    { AT91C_BASE_TWI0, AT91C_ID_TWI0, AT91C_PA9_TWD0 | AT91C_PA10_TWCK0 },
+    { AT91C_BASE_TWI1, AT91C_ID_TWI1, AT91C_PA24_TWD1 | AT91C_PA25_TWCK1 },
+};
+
+static TwiBus buses[TWI_NUM_PORTS];
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Starts the running transaction of a bus from its first byte.
+//------------------------------------------------------------------------------
+static void Start(unsigned int port)
+{
+    TwiBus *bus = &buses[port];
+    AT91PS_TWI twi = hardware[port].twi;
+    TwiTransaction *transaction = bus->current;
+
+    twi->TWI_PTCR = AT91C_PDC_RXTDIS | AT91C_PDC_TXTDIS;
+    twi->TWI_MMR = (transaction->address << MMR_DADR_SHIFT)
+                   | (transaction->iaddrSize << MMR_IADRSZ_SHIFT)
+                   | (transaction->read ? AT91C_TWI_MREAD : 0);
+    twi->TWI_IADR = transaction->iaddr;
+    twi->TWI_SR;
+    transaction->status = TWI_STATUS_BUSY;
+
+    if (!transaction->read) {
+
+        // Writing the first byte to TWI_THR starts the transfer
+        bus->state = STATE_WRITE_DATA;
+        twi->TWI_TPR = (unsigned int) transaction->data;
+        twi->TWI_TCR = transaction->size;
+        twi->TWI_IER = AT91C_TWI_ENDTX | ERROR_INTERRUPTS;
+        twi->TWI_PTCR = AT91C_PDC_TXTEN;
+    }
+    else if (transaction->size > 2) {
+
+        // The PDC takes all but the last two bytes: STOP must be requested
+        // while the one before last is being received
+        bus->state = STATE_READ_DATA;
+        bus->received = transaction->size - 2;
+        twi->TWI_RPR = (unsigned int) transaction->data;
+        twi->TWI_RCR = transaction->size - 2;
+        twi->TWI_IER = AT91C_TWI_ENDRX | ERROR_INTERRUPTS;
+        twi->TWI_PTCR = AT91C_PDC_RXTEN;
+        twi->TWI_CR = AT91C_TWI_START;
+    }
+    else {
+
+        bus->state = STATE_READ_TAIL;
+        bus->received = 0;
+        twi->TWI_IER = AT91C_TWI_RXRDY | ERROR_INTERRUPTS;
+        twi->TWI_CR = (transaction->size == 1)
+                      ? (AT91C_TWI_START | AT91C_TWI_STOP) : AT91C_TWI_START;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Starts the first waiting transaction of a bus, if any. Critical section
+/// or TWI interrupt context.
+//------------------------------------------------------------------------------
+static void StartNext(unsigned int port)
+{
+    TwiBus *bus = &buses[port];
+    TwiTransaction *transaction = bus->head;
+
+    if (transaction == 0) {
+
+        bus->state = STATE_IDLE;
+        return;
+    }
+
+    bus->head = transaction->next;
+    if (bus->head == 0) {
+
+        bus->tail = 0;
+    }
+    transaction->next = 0;
+    bus->current = transaction;
+    Start(port);
+}
+
+//------------------------------------------------------------------------------
+/// Ends the running transaction and starts the next one.
+//------------------------------------------------------------------------------
+static void Complete(unsigned int port, unsigned char status)
+{
+    TwiBus *bus = &buses[port];
+    TwiTransaction *transaction = bus->current;
+
+    hardware[port].twi->TWI_IDR = 0xFFFFFFFF;
+    bus->current = 0;
+    if (status == TWI_STATUS_DONE) {
+
+        bus->stats.transactions++;
+    }
+    else {
+
+        bus->stats.failures++;
+        EVLOG_Write(EVLOG_ID_TWI_FAILED, (port << 16) | status);
+    }
+
+    transaction->status = status;
+    StartNext(port);
+
+    if (transaction->callback) {
+
+        transaction->callback(transaction->arg, status);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Stops the PDC after a NACK or an arbitration loss (the TWI has released
+/// the bus by itself) and starts the transaction again, or fails it once the
+/// retries are exhausted.
+//------------------------------------------------------------------------------
+static void Abort(unsigned int port, unsigned char status)
+{
+    TwiBus *bus = &buses[port];
+    AT91PS_TWI twi = hardware[port].twi;
+
+    twi->TWI_IDR = 0xFFFFFFFF;
+    twi->TWI_PTCR = AT91C_PDC_RXTDIS | AT91C_PDC_TXTDIS;
+    twi->TWI_RCR = 0;
+    twi->TWI_TCR = 0;
+    twi->TWI_RHR;
+
+    if (bus->current->attempts < TWI_MAX_RETRIES) {
+
+        bus->current->attempts++;
+        bus->stats.retries++;
+        Start(port);
+    }
+    else {
+
+        Complete(port, status);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Interrupt handler shared by the two buses.
+//------------------------------------------------------------------------------
+static void Handler(unsigned int port)
+{
+    TwiBus *bus = &buses[port];
+    AT91PS_TWI twi = hardware[port].twi;
+    unsigned int status = twi->TWI_SR & twi->TWI_IMR;
+    TwiTransaction *transaction = bus->current;
+
+    if (transaction == 0) {
+
+        twi->TWI_IDR = 0xFFFFFFFF;
+        return;
+    }
+
+    if (status & AT91C_TWI_NACK_MASTER) {
+
+        bus->stats.nacks++;
+        Abort(port, TWI_STATUS_NACK);
+        return;
+    }
+    if (status & AT91C_TWI_ARBLST_MULTI_MASTER) {
+
+        bus->stats.arbitrationLosses++;
+        Abort(port, TWI_STATUS_ERROR);
+        return;
+    }
+
+    switch (bus->state) {
+
+        case STATE_WRITE_DATA:
+            if (status & AT91C_TWI_ENDTX) {
+
+                // The last byte is in TWI_THR: STOP follows it
+                twi->TWI_PTCR = AT91C_PDC_TXTDIS;
+                twi->TWI_IDR = AT91C_TWI_ENDTX;
+                twi->TWI_CR = AT91C_TWI_STOP;
+                twi->TWI_IER = AT91C_TWI_TXCOMP_MASTER;
+                bus->state = STATE_STOP;
+            }
+            break;
+
+        case STATE_READ_DATA:
+            if (status & AT91C_TWI_ENDRX) {
+
+                twi->TWI_PTCR = AT91C_PDC_RXTDIS;
+                twi->TWI_IDR = AT91C_TWI_ENDRX;
+                twi->TWI_IER = AT91C_TWI_RXRDY;
+                bus->state = STATE_READ_TAIL;
+            }
+            break;
+
+        case STATE_READ_TAIL:
+            if (status & AT91C_TWI_RXRDY) {
+
+                if ((transaction->size - bus->received) == 2) {
+
+                    twi->TWI_CR = AT91C_TWI_STOP;
+                }
+                transaction->data[bus->received++] = twi->TWI_RHR;
+                if (bus->received == transaction->size) {
+
+                    twi->TWI_IDR = AT91C_TWI_RXRDY;
+                    twi->TWI_IER = AT91C_TWI_TXCOMP_MASTER;
+                    bus->state = STATE_STOP;
+                }
+            }
+            break;
+
+        case STATE_STOP:
+            if (status & AT91C_TWI_TXCOMP_MASTER) {
+
+                Complete(port, TWI_STATUS_DONE);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Configures a bus as a master.
+/// Returns 1 on success; 0 if the port does not exist or the clock rate
+/// cannot be reached.
+/// \param port  Bus number (0 or 1).
+/// \param baudrate  SCL frequency, at most 400 kHz.
+/// \param mck  Master clock frequency.
+//------------------------------------------------------------------------------
+unsigned char TWI_Configure(unsigned int port,
+                            unsigned int baudrate,
+                            unsigned int mck)
+{
+    const TwiHardware *hw;
+    unsigned int divider;
+    unsigned int ckdiv = 0;
+
+    if ((port >= TWI_NUM_PORTS) || (baudrate == 0)) {
+
+        return 0;
+    }
+    hw = &hardware[port];
+
+    // Each half period lasts (CxDIV * 2^CKDIV + 4) MCK cycles
+    divider = (mck + 2 * baudrate - 1) / (2 * baudrate);
+    if (divider <= 4) {
+
+        return 0;
+    }
+    divider -= 4;
+    while (divider > 0xFF) {
+
+        ckdiv++;
+        divider = (divider + 1) >> 1;
+    }
+    if (ckdiv > 7) {
+
+        return 0;
+    }
+
+    IRQ_Disable(hw->id);
+
+    AT91C_BASE_PIOA->PIO_ABSR &= ~hw->pins;
+    AT91C_BASE_PIOA->PIO_PDR = hw->pins;
+    AT91C_BASE_PMC->PMC_PCER = 1 << hw->id;
+
+    hw->twi->TWI_IDR = 0xFFFFFFFF;
+    hw->twi->TWI_PTCR = AT91C_PDC_RXTDIS | AT91C_PDC_TXTDIS;
+    hw->twi->TWI_CR = AT91C_TWI_SWRST;
+    hw->twi->TWI_RHR;
+    hw->twi->TWI_CR = AT91C_TWI_MSDIS | AT91C_TWI_SVDIS;
+    hw->twi->TWI_CR = AT91C_TWI_MSEN;
+    hw->twi->TWI_CWGR = divider | (divider << CWGR_CHDIV_SHIFT)
+                        | (ckdiv << CWGR_CKDIV_SHIFT);
+
+    IRQ_ClearPending(hw->id);
+    IRQ_Enable(hw->id);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Sets up a transaction. A register read is a read with the register as
+/// internal address.
+/// \param transaction  Transaction to set up; must not be queued or running.
+/// \param address  7-bit device address.
+/// \param iaddr  Internal (register) address.
+/// \param iaddrSize  Size of the internal address in bytes (0 to 3).
+/// \param read  1 for a read, 0 for a write.
+/// \param data  Data to write, or buffer for the data read.
+/// \param size  Number of data bytes (at least 1).
+/// \param callback  Called at the end of the transaction, or 0.
+/// \param arg  Argument of the callback.
+//------------------------------------------------------------------------------
+void TWI_Setup(TwiTransaction *transaction,
+               unsigned char address,
+               unsigned int iaddr,
+               unsigned char iaddrSize,
+               unsigned char read,
+               void *data,
+               unsigned short size,
+               TwiCallback callback,
+               void *arg)
+{
+    transaction->address = address;
+    transaction->iaddr = iaddr;
+    transaction->iaddrSize = iaddrSize;
+    transaction->read = read;
+    transaction->data = data;
+    transaction->size = size;
+    transaction->callback = callback;
+    transaction->arg = arg;
+    transaction->status = TWI_STATUS_IDLE;
+    transaction->next = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Queues a transaction on a bus. Can be called from threads and from
+/// interrupt handlers of preemption level IRQ_CRITICAL_LEVEL or lower.
+/// Returns 1 on success; 0 if the port does not exist, the transaction is
+/// empty, or it is already queued or running.
+//------------------------------------------------------------------------------
+unsigned char TWI_Submit(unsigned int port, TwiTransaction *transaction)
+{
+    TwiBus *bus;
+    IrqState state;
+
+    if ((port >= TWI_NUM_PORTS) || (transaction->size == 0)
+        || (transaction->iaddrSize > 3)
+        || (transaction->status == TWI_STATUS_QUEUED)
+        || (transaction->status == TWI_STATUS_BUSY)) {
+
+        return 0;
+    }
+    bus = &buses[port];
+    transaction->attempts = 0;
+    transaction->next = 0;
+    transaction->status = TWI_STATUS_QUEUED;
+
+    state = IRQ_EnterCritical();
+
+    if (bus->tail) {
+
+        bus->tail->next = transaction;
+    }
+    else {
+
+        bus->head = transaction;
+    }
+    bus->tail = transaction;
+
+    if (bus->current == 0) {
+
+        StartNext(port);
+    }
+
+    IRQ_ExitCritical(state);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the status of a transaction (TWI_STATUS_xxx).
+//------------------------------------------------------------------------------
+unsigned char TWI_GetStatus(const TwiTransaction *transaction)
+{
+    return transaction->status;
+}
+
+//------------------------------------------------------------------------------
+/// Submits the poll list entries that are due. An entry whose previous
+/// transaction is not over yet is skipped for this period and counted as an
+/// overrun. Meant to be called from a periodic task.
+/// \param port  Bus number (0 or 1).
+/// \param entries  Poll list.
+/// \param count  Number of entries.
+/// \param tick  Current tick.
+//------------------------------------------------------------------------------
+void TWI_Poll(unsigned int port,
+              TwiPollEntry *entries,
+              unsigned int count,
+              unsigned int tick)
+{
+    TwiPollEntry *entry;
+    unsigned int i;
+
+    if (port >= TWI_NUM_PORTS) {
+
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+
+        entry = &entries[i];
+        if ((int) (tick - entry->due) < 0) {
+
+            continue;
+        }
+
+        // Keep the phase, unless a whole period has been missed
+        entry->due += entry->period;
+        if ((int) (tick - entry->due) >= 0) {
+
+            entry->due = tick + entry->period;
+        }
+
+        if (!TWI_Submit(port, entry->transaction)) {
+
+            buses[port].stats.overruns++;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Returns the statistics of a bus, or 0 if it does not exist.
+//------------------------------------------------------------------------------
+const TwiStats * TWI_GetStats(unsigned int port)
+{
+    if (port >= TWI_NUM_PORTS) {
+
+        return 0;
+    }
+
+    return &buses[port].stats;
+}
+
+//------------------------------------------------------------------------------
+/// TWI interrupts.
+//------------------------------------------------------------------------------
+void TWI0_IrqHandler(void)
+{
+    Handler(0);
+}
+
+void TWI1_IrqHandler(void)
+{
+    Handler(1);
+}
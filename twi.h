@@ -0,0 +1,126 @@
+/* ----------------------------------------------------------------------------
+ *         TWI (I2C) master
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Non-blocking I2C master on TWI0 and TWI1. Each bus runs the transactions
+** of its queue one after the other: the PDC moves the data bytes and a short
+** state machine in TWIn_IrqHandler() handles the end of each transfer (STOP,
+** last two bytes of a read, completion). Register accesses use the internal
+** address of the TWI, which sends the register address and the repeated
+** START of a read by itself.
+**
+** A transaction that is not acknowledged, or loses the arbitration, is
+** started again up to TWI_MAX_RETRIES times before it fails.
+**
+** Sensors read at a fixed rate are described by a poll list: TWI_Poll(),
+** called from a periodic task, submits the entries that are due.
+*/
+
+#ifndef TWI_H
+#define TWI_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Number of buses.
+#define TWI_NUM_PORTS           2
+
+/// Attempts after the first one on NACK or arbitration loss.
+#ifndef TWI_MAX_RETRIES
+#define TWI_MAX_RETRIES         3
+#endif
+
+/// Transaction status.
+#define TWI_STATUS_IDLE         0
+#define TWI_STATUS_QUEUED       1
+#define TWI_STATUS_BUSY         2
+#define TWI_STATUS_DONE         3
+/// Not acknowledged after every retry.
+#define TWI_STATUS_NACK         4
+/// Arbitration lost or overrun after every retry.
+#define TWI_STATUS_ERROR        5
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Called from the TWI interrupt at the end of a transaction, with its status
+/// (TWI_STATUS_DONE, TWI_STATUS_NACK or TWI_STATUS_ERROR).
+typedef void (*TwiCallback)(void *arg, unsigned char status);
+
+/// Transaction. Set up with TWI_Setup(); owned by the driver from
+/// TWI_Submit() until the callback.
+typedef struct _TwiTransaction {
+
+    /// 7-bit device address.
+    unsigned char address;
+    /// Internal (register) address and its size in bytes (0 to 3).
+    unsigned char iaddrSize;
+    unsigned int iaddr;
+    unsigned char read;
+    unsigned char *data;
+    unsigned short size;
+    TwiCallback callback;
+    void *arg;
+    volatile unsigned char status;
+    unsigned char attempts;
+    struct _TwiTransaction *next;
+
+} TwiTransaction;
+
+/// Poll list entry: a transaction submitted every period ticks.
+typedef struct {
+
+    TwiTransaction *transaction;
+    unsigned int period;
+    /// Tick of the next submission.
+    unsigned int due;
+
+} TwiPollEntry;
+
+/// Bus statistics.
+typedef struct {
+
+    unsigned int transactions;
+    unsigned int nacks;
+    unsigned int arbitrationLosses;
+    unsigned int retries;
+    unsigned int failures;
+    /// Poll list entries skipped because the previous read was not over.
+    unsigned int overruns;
+
+} TwiStats;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned char TWI_Configure(unsigned int port,
+                                   unsigned int baudrate,
+                                   unsigned int mck);
+
+extern void TWI_Setup(TwiTransaction *transaction,
+                      unsigned char address,
+                      unsigned int iaddr,
+                      unsigned char iaddrSize,
+                      unsigned char read,
+                      void *data,
+                      unsigned short size,
+                      TwiCallback callback,
+                      void *arg);
+
+extern unsigned char TWI_Submit(unsigned int port, TwiTransaction *transaction);
+
+extern unsigned char TWI_GetStatus(const TwiTransaction *transaction);
+
+extern void TWI_Poll(unsigned int port,
+                     TwiPollEntry *entries,
+                     unsigned int count,
+                     unsigned int tick);
+
+extern const TwiStats * TWI_GetStats(unsigned int port);
+
+#endif //#ifndef TWI_H
@@ -0,0 +1,338 @@
+/* ----------------------------------------------------------------------------
+ *         Firmware update
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "update.h"
+#include "crc.h"
+
+#include <stddef.h>
+#include <string.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Decoder phases.
+#define PHASE_IDLE              0
+#define PHASE_HEADER            1
+#define PHASE_OPCODE            2
+#define PHASE_ARGUMENT          3
+#define PHASE_LITERAL           4
+#define PHASE_FILL              5
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static unsigned char phase = PHASE_IDLE;
+
+static UpdateHeader header;
+static unsigned int headerBytes;
+
+/// Operation being decoded, and its LEB128 arguments.
+static unsigned char opcode;
+static unsigned char numArguments;
+static unsigned char argument;
+static unsigned char shift;
+static unsigned int arguments[2];
+
+/// Size of the image UPDATE_OP_BASE reads from.
+static unsigned int baseSize;
+
+/// Bytes rebuilt, and the page being filled (at slot offset pageStart).
+static unsigned int produced;
+static unsigned int pageStart;
+static unsigned int page[IAP_PAGE_SIZE / 4];
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Writes the page being filled to slot B, padded with 0xFF.
+//------------------------------------------------------------------------------
+static unsigned char FlushPage(void)
+{
+    unsigned int fill = produced - pageStart;
+
+    memset((unsigned char *) page + fill, 0xFF, IAP_PAGE_SIZE - fill);
+    if (!IAP_Write(IMAGE_SLOT_B + pageStart, page, IAP_PAGE_SIZE)) {
+
+        return 0;
+    }
+    pageStart += IAP_PAGE_SIZE;
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Appends a byte to the image.
+//------------------------------------------------------------------------------
+static unsigned char Emit(unsigned char byte)
+{
+    ((unsigned char *) page)[produced - pageStart] = byte;
+    produced++;
+
+    return (produced - pageStart < IAP_PAGE_SIZE) || FlushPage();
+}
+
+//------------------------------------------------------------------------------
+/// Returns a byte already rebuilt.
+//------------------------------------------------------------------------------
+static unsigned char OutputAt(unsigned int position)
+{
+    if (position >= pageStart) {
+
+        return ((unsigned char *) page)[position - pageStart];
+    }
+    return *(const unsigned char *) (IMAGE_SLOT_B + position);
+}
+
+//------------------------------------------------------------------------------
+/// Checks the header once it is complete.
+//------------------------------------------------------------------------------
+static unsigned char CheckHeader(void)
+{
+    const ImageTrailer *base = IMAGE_GetTrailer(IMAGE_SLOT_A);
+
+    if ((header.magic != UPDATE_MAGIC)
+        || (CRC_Compute32(0, &header, offsetof(UpdateHeader, headerCrc))
+            != header.headerCrc)
+        || (header.size == 0) || (header.size > IMAGE_MAX_SIZE)) {
+
+        return 0;
+    }
+
+    // A delta only applies to the image it was made from
+    baseSize = 0;
+    if (header.base) {
+
+        if (!base || (base->crc != header.base)) {
+
+            return 0;
+        }
+        baseSize = base->size;
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Runs an operation once its arguments are decoded.
+//------------------------------------------------------------------------------
+static unsigned char Execute(void)
+{
+    unsigned int length = arguments[numArguments - 1];
+    unsigned int source = arguments[0];
+
+    if (length > header.size - produced) {
+
+        return 0;
+    }
+
+    switch (opcode) {
+
+    case UPDATE_OP_LITERAL:
+        phase = length ? PHASE_LITERAL : PHASE_OPCODE;
+        return 1;
+
+    case UPDATE_OP_FILL:
+        phase = PHASE_FILL;
+        return 1;
+
+    case UPDATE_OP_COPY:
+        if ((source == 0) || (source > produced)) {
+
+            return 0;
+        }
+        source = produced - source;
+        while (length--) {
+
+            // May overlap the bytes it produces, as in LZ77
+            if (!Emit(OutputAt(source++))) {
+
+                return 0;
+            }
+        }
+        break;
+
+    default:
+        if ((source > baseSize) || (length > baseSize - source)) {
+
+            return 0;
+        }
+        while (length--) {
+
+            if (!Emit(*(const unsigned char *) (IMAGE_SLOT_A + source++))) {
+
+                return 0;
+            }
+        }
+        break;
+    }
+
+    phase = PHASE_OPCODE;
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Decodes one byte of the stream.
+//------------------------------------------------------------------------------
+static unsigned char Decode(unsigned char byte)
+{
+    switch (phase) {
+
+    case PHASE_HEADER:
+        ((unsigned char *) &header)[headerBytes++] = byte;
+        if (headerBytes == sizeof(header)) {
+
+            phase = PHASE_OPCODE;
+            return CheckHeader();
+        }
+        return 1;
+
+    case PHASE_OPCODE:
+        if ((byte > UPDATE_OP_BASE) || (produced == header.size)) {
+
+            return 0;
+        }
+        opcode = byte;
+        numArguments = (byte <= UPDATE_OP_FILL) ? 1 : 2;
+        argument = 0;
+        shift = 0;
+        arguments[0] = 0;
+        arguments[1] = 0;
+        phase = PHASE_ARGUMENT;
+        return 1;
+
+    case PHASE_ARGUMENT:
+        if (shift > 28) {
+
+            return 0;
+        }
+        arguments[argument] |= (unsigned int) (byte & 0x7F) << shift;
+        shift += 7;
+        if (byte & 0x80) {
+
+            return 1;
+        }
+        shift = 0;
+        return (++argument < numArguments) || Execute();
+
+    case PHASE_LITERAL:
+        if (--arguments[0] == 0) {
+
+            phase = PHASE_OPCODE;
+        }
+        return Emit(byte);
+
+    case PHASE_FILL:
+        phase = PHASE_OPCODE;
+        while (arguments[0]--) {
+
+            if (!Emit(byte)) {
+
+                return 0;
+            }
+        }
+        return 1;
+
+    default:
+        return 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Starts receiving an update stream. The trailer of slot B is erased first,
+/// so that a stream cut short is never installed.
+/// Returns 1 on success; 0 if a new image has not confirmed its health yet
+/// (slot B then holds the image to roll back to).
+//------------------------------------------------------------------------------
+unsigned char UPDATE_Begin(void)
+{
+    ImageState state;
+
+    phase = PHASE_IDLE;
+    IMAGE_GetState(&state);
+    if ((state.state == IMAGE_STATE_TRIAL)
+        || !IAP_Erase(IMAGE_SLOT_B + IMAGE_MAX_SIZE, IMAGE_TRAILER_SIZE)) {
+
+        return 0;
+    }
+
+    headerBytes = 0;
+    produced = 0;
+    pageStart = 0;
+    phase = PHASE_HEADER;
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Decodes a piece of the update stream into slot B.
+/// Returns 1 on success; 0 if the stream is invalid or the flash write fails.
+/// The update is then abandoned until the next UPDATE_Begin().
+/// \param data  Bytes of the stream, following the previous ones.
+/// \param size  Number of bytes.
+//------------------------------------------------------------------------------
+unsigned char UPDATE_Write(const void *data, unsigned int size)
+{
+    const unsigned char *bytes = (const unsigned char *) data;
+
+    while (size--) {
+
+        if (!Decode(*bytes++)) {
+
+            phase = PHASE_IDLE;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Ends the stream: checks the CRC-32 of the image in slot B, writes its
+/// trailer and requests its installation at the next reset.
+/// Returns 1 on success; 0 if the stream is incomplete or the image does not
+/// match its CRC.
+//------------------------------------------------------------------------------
+unsigned char UPDATE_Finish(void)
+{
+    unsigned char ok;
+
+    ok = (phase == PHASE_OPCODE) && (produced == header.size)
+         && ((produced == pageStart) || FlushPage())
+         && (CRC_Compute32(0, (const void *) IMAGE_SLOT_B, header.size)
+             == header.crc)
+         && IMAGE_WriteTrailer(IMAGE_SLOT_B, header.size, header.version,
+                               header.crc)
+         && IMAGE_SetState(IMAGE_STATE_PENDING, 0);
+    phase = PHASE_IDLE;
+
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+/// Confirms that a newly installed image is healthy, which ends its trial.
+/// Does nothing otherwise.
+/// Returns 1 on success; 0 if the flash write fails.
+//------------------------------------------------------------------------------
+unsigned char UPDATE_Confirm(void)
+{
+    ImageState state;
+
+    IMAGE_GetState(&state);
+    if (state.state != IMAGE_STATE_TRIAL) {
+
+        return 1;
+    }
+    return IMAGE_SetState(IMAGE_STATE_CONFIRMED, 0);
+}
@@ -0,0 +1,84 @@
+/* ----------------------------------------------------------------------------
+ *         Firmware update
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Application side of the firmware update (image.h): decodes an update
+** stream as it arrives, in pieces of any size, into slot B, then asks the
+** bootloader to install it at the next reset.
+**
+** The stream (tools/mkimage.py) starts with an UpdateHeader, followed by
+** operations that rebuild the image in order. Each starts with an opcode
+** byte; its arguments are unsigned LEB128 numbers:
+**     UPDATE_OP_LITERAL  length, then the bytes
+**     UPDATE_OP_FILL     length, then the byte to repeat
+**     UPDATE_OP_COPY     distance, length: bytes already rebuilt (LZ77)
+**     UPDATE_OP_BASE     offset, length: bytes of the running image
+** A raw image is a single literal; a compressed one adds fills and copies;
+** a delta against the running image (checked by UpdateHeader.base) is
+** mostly made of base copies.
+**
+** The output is written a page at a time, so the stream needs no staging
+** buffer of its own. UPDATE_Finish() checks the CRC-32 of the rebuilt image
+** and writes the slot trailer; FAULT_Reset() then starts the bootloader,
+** which installs the image. A new image must call UPDATE_Confirm() once
+** it is healthy; otherwise the bootloader rolls back after IMAGE_MAX_TRIALS
+** boots. The functions program the flash: call them from a task, never from
+** an interrupt.
+*/
+
+#ifndef UPDATE_H
+#define UPDATE_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "image.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Header magic ("EUPD").
+#define UPDATE_MAGIC            0x44505545
+
+/// Opcodes.
+#define UPDATE_OP_LITERAL       0
+#define UPDATE_OP_FILL          1
+#define UPDATE_OP_COPY          2
+#define UPDATE_OP_BASE          3
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Stream header, little-endian.
+typedef struct {
+
+    unsigned int magic;
+    /// Size, version and CRC-32 of the image.
+    unsigned int size;
+    unsigned int version;
+    unsigned int crc;
+    /// CRC-32 of the image UPDATE_OP_BASE reads from; 0 if not used.
+    unsigned int base;
+    /// CRC-32 of the fields above.
+    unsigned int headerCrc;
+
+} UpdateHeader;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned char UPDATE_Begin(void);
+
+extern unsigned char UPDATE_Write(const void *data, unsigned int size);
+
+extern unsigned char UPDATE_Finish(void);
+
+extern unsigned char UPDATE_Confirm(void);
+
+#endif //#ifndef UPDATE_H
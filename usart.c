@@ -0,0 +1,512 @@
+/* ----------------------------------------------------------------------------
+ *         USART driver
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "usart.h"
+#include "evlog.h"
+#include "exceptions.h"
+#include "irq.h"
+#include "sections.h"
+#include "AT91SAM3U4.h"
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// US_BRGR fractional part.
+#define BRGR_FP_SHIFT           16
+
+/// Interrupts used for reception.
+#define RX_INTERRUPTS           (AT91C_US_ENDRX | AT91C_US_TIMEOUT \
+                                 | AT91C_US_OVRE | AT91C_US_FRAME \
+                                 | AT91C_US_PARE)
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// Fixed description of a port.
+typedef struct {
+
+    AT91PS_USART usart;
+    unsigned int id;
+    AT91PS_PIO pio;
+    /// RXD and TXD pins, and whether they are on peripheral B.
+    unsigned int pins;
+    unsigned char peripheralB;
+
+} UsartHardware;
+
+/// Run-time state of a port.
+typedef struct {
+
+    UsartRxCallback callback;
+    /// Buffers handed over and given back so far; buffer head % N is the one
+    /// the PDC fills.
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    /// Buffers loaded in the PDC (0 to 2).
+    unsigned int loaded;
+    /// Size of the data in each handed over buffer.
+    unsigned int sizes[USART_RX_NUM_BUFFERS];
+    unsigned char open;
+    UsartStats stats;
+
+} UsartPort;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+static const UsartHardware hardware[USART_NUM_PORTS] = {
+
+    { AT91C_BASE_US0, AT91C_ID_US0, AT91C_BASE_PIOA,
+      AT91C_PA19_RXD0 | AT91C_PA18_TXD0, 0 },
+    { AT91C_BASE_US1, AT91C_ID_US1, AT91C_BASE_PIOA,
+      AT91C_PA21_RXD1 | AT91C_PA20_TXD1, 0 },
+    { AT91C_BASE_US2, AT91C_ID_US2, AT91C_BASE_PIOA,
+      AT91C_PA23_RXD2 | AT91C_PA22_TXD2, 0 },
+    { AT91C_BASE_US3, AT91C_ID_US3, AT91C_BASE_PIOC,
+      AT91C_PC13_RXD3 | AT91C_PC12_TXD3, 1 },
+};
+
+static UsartPort ports[USART_NUM_PORTS];
+
+DMABUF static __no_init unsigned char
+    rxBuffers[USART_NUM_PORTS][USART_RX_NUM_BUFFERS][USART_RX_BUFFER_SIZE];
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Loads free buffers in the PDC until it has a current and a next one, or
+/// until the consumer holds all the others. Interrupt context or with the
+/// port interrupt masked.
+//------------------------------------------------------------------------------
+static void Refill(unsigned int port)
+{
+    UsartPort *state = &ports[port];
+    AT91PS_USART usart = hardware[port].usart;
+    unsigned char *buffer;
+
+    while ((state->loaded < 2)
+           && ((state->head + state->loaded - state->tail)
+               < USART_RX_NUM_BUFFERS)) {
+
+        buffer = rxBuffers[port][(state->head + state->loaded)
+                                 % USART_RX_NUM_BUFFERS];
+        if (state->loaded == 0) {
+
+            usart->US_RPR = (unsigned int) buffer;
+            usart->US_RCR = USART_RX_BUFFER_SIZE;
+        }
+        else {
+
+            usart->US_RNPR = (unsigned int) buffer;
+            usart->US_RNCR = USART_RX_BUFFER_SIZE;
+        }
+        state->loaded++;
+    }
+
+    // ENDRX stays set until a buffer is loaded: listen to it while the PDC
+    // has a next buffer, and to RXBUFF while it fills its last one
+    if (state->loaded == 2) {
+
+        usart->US_IDR = AT91C_US_RXBUFF;
+        usart->US_IER = AT91C_US_ENDRX;
+    }
+    else if (state->loaded == 1) {
+
+        usart->US_IDR = AT91C_US_ENDRX;
+        usart->US_IER = AT91C_US_RXBUFF;
+    }
+    else {
+
+        usart->US_IDR = AT91C_US_ENDRX | AT91C_US_RXBUFF;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Hands the buffer the PDC was filling over to the consumer.
+//------------------------------------------------------------------------------
+static void Deliver(unsigned int port, unsigned int size)
+{
+    UsartPort *state = &ports[port];
+    unsigned int index = state->head % USART_RX_NUM_BUFFERS;
+
+    state->sizes[index] = size;
+    state->head++;
+    state->loaded--;
+    state->stats.bytes += size;
+    state->stats.buffers++;
+
+    if (state->callback) {
+
+        state->callback(port, rxBuffers[port][index], size);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the PDC is filling the oldest loaded buffer; 0 once it has
+/// gone on to the next one or stopped at its end.
+//------------------------------------------------------------------------------
+static unsigned char IsFilling(unsigned int port)
+{
+    UsartPort *state = &ports[port];
+    AT91PS_USART usart = hardware[port].usart;
+    unsigned int buffer = (unsigned int)
+        rxBuffers[port][state->head % USART_RX_NUM_BUFFERS];
+    unsigned int pointer = usart->US_RPR;
+
+    return (pointer >= buffer) && (pointer < buffer + USART_RX_BUFFER_SIZE)
+           && (usart->US_RCR != 0);
+}
+
+//------------------------------------------------------------------------------
+/// Hands over the loaded buffers the PDC is done with.
+//------------------------------------------------------------------------------
+static void DeliverFull(unsigned int port)
+{
+    while (ports[port].loaded && !IsFilling(port)) {
+
+        Deliver(port, USART_RX_BUFFER_SIZE);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Interrupt handler shared by the four ports.
+//------------------------------------------------------------------------------
+static void Handler(unsigned int port)
+{
+    UsartPort *state = &ports[port];
+    AT91PS_USART usart = hardware[port].usart;
+    unsigned int status = usart->US_CSR & usart->US_IMR;
+    unsigned int size;
+
+    if (status & (AT91C_US_OVRE | AT91C_US_FRAME | AT91C_US_PARE)) {
+
+        EVLOG_Write(EVLOG_ID_USART_ERROR,
+                    (port << 16)
+                    | (status & (AT91C_US_OVRE | AT91C_US_FRAME | AT91C_US_PARE)));
+        if (status & AT91C_US_OVRE) {
+
+            state->stats.overruns++;
+        }
+        if (status & AT91C_US_FRAME) {
+
+            state->stats.framing++;
+        }
+        if (status & AT91C_US_PARE) {
+
+            state->stats.parity++;
+        }
+        usart->US_CR = AT91C_US_RSTSTA;
+    }
+
+    if (status & (AT91C_US_ENDRX | AT91C_US_RXBUFF)) {
+
+        // The current buffer is full and the PDC went on with the next one,
+        // which may be full as well if this interrupt came late. The PDC
+        // pointer tells, whatever buffers the callback gave back meanwhile
+        DeliverFull(port);
+        Refill(port);
+    }
+
+    if (status & AT91C_US_TIMEOUT) {
+
+        // The line is idle: stop the PDC for the few cycles needed to take
+        // the partly filled buffer out; a byte arriving meanwhile waits in
+        // US_RHR
+        usart->US_PTCR = AT91C_PDC_RXTDIS;
+        DeliverFull(port);
+        if (state->loaded) {
+
+            size = USART_RX_BUFFER_SIZE - usart->US_RCR;
+            if (size) {
+
+                usart->US_RNCR = 0;
+                usart->US_RCR = 0;
+                state->loaded = 1;
+                Deliver(port, size);
+                state->stats.timeouts++;
+                Refill(port);
+            }
+        }
+        usart->US_PTCR = AT91C_PDC_RXTEN;
+
+        // Wait for the next byte before counting again, or count from now
+        // if one came in meanwhile
+        usart->US_CR = AT91C_US_STTTO;
+        if (state->loaded && (usart->US_RCR != USART_RX_BUFFER_SIZE)) {
+
+            usart->US_CR = AT91C_US_RETTO;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Configures a port and starts receiving.
+/// Returns 1 on success; 0 if the port does not exist or the baud rate
+/// cannot be reached.
+/// \param port  Port number (0 to 3).
+/// \param mode  US_MR value, e.g. USART_MODE_8N1.
+/// \param baudrate  Baud rate.
+/// \param mck  Master clock frequency.
+/// \param callback  Called when a receive buffer is handed over, or 0 to
+///                  poll with USART_Receive().
+//------------------------------------------------------------------------------
+unsigned char USART_Open(unsigned int port,
+                         unsigned int mode,
+                         unsigned int baudrate,
+                         unsigned int mck,
+                         UsartRxCallback callback)
+{
+    const UsartHardware *hw;
+    UsartPort *state;
+    unsigned int divider;
+
+    if ((port >= USART_NUM_PORTS) || (baudrate == 0)) {
+
+        return 0;
+    }
+    hw = &hardware[port];
+    state = &ports[port];
+
+    // Divider in eighths, with 16x oversampling, or 8x for high rates
+    divider = (mck + baudrate) / (2 * baudrate);
+    if (divider >= 16 * 8) {
+
+        divider = (mck + 2 * baudrate) / (4 * baudrate);
+    }
+    else {
+
+        mode |= AT91C_US_OVER;
+    }
+    if ((divider < 8) || ((divider >> 3) > 0xFFFF)) {
+
+        return 0;
+    }
+
+    IRQ_Disable(hw->id);
+
+    if (hw->peripheralB) {
+
+        hw->pio->PIO_ABSR |= hw->pins;
+    }
+    else {
+
+        hw->pio->PIO_ABSR &= ~hw->pins;
+    }
+    hw->pio->PIO_PDR = hw->pins;
+    AT91C_BASE_PMC->PMC_PCER = 1 << hw->id;
+
+    hw->usart->US_CR = AT91C_US_RSTRX | AT91C_US_RSTTX
+                       | AT91C_US_RXDIS | AT91C_US_TXDIS | AT91C_US_RSTSTA;
+    hw->usart->US_IDR = 0xFFFFFFFF;
+    hw->usart->US_PTCR = AT91C_PDC_RXTDIS | AT91C_PDC_TXTDIS;
+    hw->usart->US_RCR = 0;
+    hw->usart->US_RNCR = 0;
+    hw->usart->US_TCR = 0;
+    hw->usart->US_TNCR = 0;
+
+    hw->usart->US_MR = mode;
+    hw->usart->US_BRGR = (divider >> 3) | ((divider & 7) << BRGR_FP_SHIFT);
+    hw->usart->US_RTOR = USART_RX_TIMEOUT_BITS;
+
+    state->callback = callback;
+    state->head = 0;
+    state->tail = 0;
+    state->loaded = 0;
+    state->stats.bytes = 0;
+    state->stats.buffers = 0;
+    state->stats.timeouts = 0;
+    state->stats.overruns = 0;
+    state->stats.framing = 0;
+    state->stats.parity = 0;
+    state->open = 1;
+
+    Refill(port);
+    hw->usart->US_IER = RX_INTERRUPTS;
+    hw->usart->US_PTCR = AT91C_PDC_RXTEN | AT91C_PDC_TXTEN;
+    hw->usart->US_CR = AT91C_US_RXEN | AT91C_US_TXEN | AT91C_US_STTTO;
+
+    IRQ_ClearPending(hw->id);
+    IRQ_Enable(hw->id);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Stops a port. Buffers held by the consumer become invalid.
+/// \param port  Port number (0 to 3).
+//------------------------------------------------------------------------------
+void USART_Close(unsigned int port)
+{
+    const UsartHardware *hw;
+
+    if (port >= USART_NUM_PORTS) {
+
+        return;
+    }
+    hw = &hardware[port];
+
+    IRQ_Disable(hw->id);
+    hw->usart->US_IDR = 0xFFFFFFFF;
+    hw->usart->US_PTCR = AT91C_PDC_RXTDIS | AT91C_PDC_TXTDIS;
+    hw->usart->US_CR = AT91C_US_RXDIS | AT91C_US_TXDIS;
+    AT91C_BASE_PMC->PMC_PCDR = 1 << hw->id;
+    ports[port].open = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the oldest received buffer not given back yet, or 0 if there is
+/// none. The buffer stays valid until USART_Release().
+/// \param port  Port number (0 to 3).
+/// \param size  Receives the number of bytes in the buffer.
+//------------------------------------------------------------------------------
+unsigned char * USART_Receive(unsigned int port, unsigned int *size)
+{
+    UsartPort *state;
+    unsigned int index;
+
+    if ((port >= USART_NUM_PORTS) || !ports[port].open) {
+
+        return 0;
+    }
+    state = &ports[port];
+    if (state->head == state->tail) {
+
+        return 0;
+    }
+
+    index = state->tail % USART_RX_NUM_BUFFERS;
+    *size = state->sizes[index];
+
+    return rxBuffers[port][index];
+}
+
+//------------------------------------------------------------------------------
+/// Gives the oldest received buffer back to the driver.
+/// \param port  Port number (0 to 3).
+//------------------------------------------------------------------------------
+void USART_Release(unsigned int port)
+{
+    UsartPort *state;
+    unsigned int id;
+
+    if ((port >= USART_NUM_PORTS) || !ports[port].open) {
+
+        return;
+    }
+    state = &ports[port];
+    if (state->head == state->tail) {
+
+        return;
+    }
+
+    // The PDC may be waiting for this buffer
+    id = hardware[port].id;
+    IRQ_Disable(id);
+    state->tail++;
+    Refill(port);
+    IRQ_Enable(id);
+}
+
+//------------------------------------------------------------------------------
+/// Queues a buffer for transmission, behind at most one other.
+/// Returns 1 if queued; 0 if two buffers are already queued.
+/// \param port  Port number (0 to 3).
+/// \param data  Data to send; must stay valid until sent.
+/// \param size  Number of bytes (at most 65535).
+//------------------------------------------------------------------------------
+unsigned char USART_Send(unsigned int port,
+                         const void *data,
+                         unsigned int size)
+{
+    AT91PS_USART usart;
+
+    if ((port >= USART_NUM_PORTS) || !ports[port].open
+        || (size == 0) || (size > 0xFFFF)) {
+
+        return 0;
+    }
+    usart = hardware[port].usart;
+
+    if (usart->US_TCR == 0) {
+
+        usart->US_TPR = (unsigned int) data;
+        usart->US_TCR = size;
+    }
+    else if (usart->US_TNCR == 0) {
+
+        usart->US_TNPR = (unsigned int) data;
+        usart->US_TNCR = size;
+    }
+    else {
+
+        return 0;
+    }
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 once every queued buffer has been sent; otherwise 0.
+/// \param port  Port number (0 to 3).
+//------------------------------------------------------------------------------
+unsigned char USART_IsTxDone(unsigned int port)
+{
+    if (port >= USART_NUM_PORTS) {
+
+        return 1;
+    }
+
+    return (hardware[port].usart->US_TCR == 0)
+           && (hardware[port].usart->US_TNCR == 0);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the statistics of a port, or 0 if it does not exist.
+//------------------------------------------------------------------------------
+const UsartStats * USART_GetStats(unsigned int port)
+{
+    if (port >= USART_NUM_PORTS) {
+
+        return 0;
+    }
+
+    return &ports[port].stats;
+}
+
+//------------------------------------------------------------------------------
+/// USART interrupts.
+//------------------------------------------------------------------------------
+void USART0_IrqHandler(void)
+{
+    Handler(0);
+}
+
+void USART1_IrqHandler(void)
+{
+    Handler(1);
+}
+
+void USART2_IrqHandler(void)
+{
+    Handler(2);
+}
+
+void USART3_IrqHandler(void)
+{
+    Handler(3);
+}
@@ -0,0 +1,111 @@
+/* ----------------------------------------------------------------------------
+ *         USART driver
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Driver for USART0 to USART3 in asynchronous mode.
+**
+** Reception goes through the PDC, which always has a current and, whenever
+** possible, a next buffer (RPR / RNPR) taken from a pool of
+** USART_RX_NUM_BUFFERS buffers per port, so no byte waits for the CPU. A
+** buffer is handed to the consumer when it is full (ENDRX) or when the line
+** has been idle for USART_RX_TIMEOUT_BITS bit periods after the last byte
+** (receiver time-out), which flushes short frames with low latency. The
+** consumer gets the buffer by pointer, from the callback or from
+** USART_Receive(), and gives it back with USART_Release(), oldest first.
+**
+** If the consumer holds every buffer, the PDC stops and the incoming bytes
+** are lost; they show up as overruns in the port statistics.
+**
+** Transmission also uses the PDC: USART_Send() queues a buffer, which must
+** stay valid until USART_IsTxDone() returns 1.
+*/
+
+#ifndef USART_H
+#define USART_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "AT91SAM3U4.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Number of ports.
+#define USART_NUM_PORTS         4
+
+/// Receive buffers per port (at least 2) and their size in bytes.
+#ifndef USART_RX_NUM_BUFFERS
+#define USART_RX_NUM_BUFFERS    4
+#endif
+#ifndef USART_RX_BUFFER_SIZE
+#define USART_RX_BUFFER_SIZE    256
+#endif
+
+/// Idle time, in bit periods, after which a partly filled buffer is handed
+/// over (2 characters of 10 bits).
+#ifndef USART_RX_TIMEOUT_BITS
+#define USART_RX_TIMEOUT_BITS   20
+#endif
+
+/// Usual mode: 8 data bits, no parity, 1 stop bit.
+#define USART_MODE_8N1          (AT91C_US_USMODE_NORMAL \
+                                 | AT91C_US_CLKS_CLOCK \
+                                 | AT91C_US_CHRL_8_BITS \
+                                 | AT91C_US_PAR_NONE \
+                                 | AT91C_US_NBSTOP_1_BIT)
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Called from the USART interrupt when a receive buffer is handed over.
+/// The buffer must be given back with USART_Release().
+typedef void (*UsartRxCallback)(unsigned int port,
+                                unsigned char *data,
+                                unsigned int size);
+
+/// Port statistics.
+typedef struct {
+
+    /// Bytes and buffers handed to the consumer.
+    unsigned int bytes;
+    unsigned int buffers;
+    /// Buffers flushed by the receiver time-out.
+    unsigned int timeouts;
+    /// Overrun, framing and parity errors.
+    unsigned int overruns;
+    unsigned int framing;
+    unsigned int parity;
+
+} UsartStats;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern unsigned char USART_Open(unsigned int port,
+                                unsigned int mode,
+                                unsigned int baudrate,
+                                unsigned int mck,
+                                UsartRxCallback callback);
+
+extern void USART_Close(unsigned int port);
+
+extern unsigned char * USART_Receive(unsigned int port, unsigned int *size);
+
+extern void USART_Release(unsigned int port);
+
+extern unsigned char USART_Send(unsigned int port,
+                                const void *data,
+                                unsigned int size);
+
+extern unsigned char USART_IsTxDone(unsigned int port);
+
+extern const UsartStats * USART_GetStats(unsigned int port);
+
+#endif //#ifndef USART_H
@@ -0,0 +1,395 @@
+/* ----------------------------------------------------------------------------
+ *         USB control requests
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "usbctl.h"
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Halt bit of an endpoint address.
+#define HALT_BIT(address)   (1u << ((((address) & 0xF) << 1) \
+                                    | (((address) & USB_DIR_IN) ? 1 : 0)))
+
+/// bmAttributes of a configuration descriptor: self-powered.
+#define CONFIG_SELF_POWERED 0x40
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns the wTotalLength of a configuration descriptor.
+//------------------------------------------------------------------------------
+static unsigned short TotalLength(const unsigned char *configuration)
+{
+    return configuration[2] | (configuration[3] << 8);
+}
+
+//------------------------------------------------------------------------------
+/// Replies with size bytes of data, cut to the length asked by the host.
+//------------------------------------------------------------------------------
+static void ReplyData(const UsbSetup *setup, UsbReply *reply,
+                      const void *data, unsigned short size)
+{
+    reply->action = USBCTL_DATA_IN;
+    reply->data = (void *) data;
+    reply->size = (size < setup->wLength) ? size : setup->wLength;
+}
+
+//------------------------------------------------------------------------------
+/// GET_DESCRIPTOR.
+//------------------------------------------------------------------------------
+static void GetDescriptor(UsbCtl *ctl, const UsbSetup *setup, UsbReply *reply)
+{
+    const UsbDescriptors *descriptors = ctl->descriptors;
+    const unsigned char *descriptor;
+    unsigned char index = setup->wValue & 0xFF;
+    unsigned short size;
+    unsigned short i;
+
+    switch (setup->wValue >> 8) {
+
+        case USB_DESC_DEVICE:
+            ReplyData(setup, reply, descriptors->device,
+                      descriptors->device[0]);
+            break;
+
+        case USB_DESC_CONFIGURATION:
+            descriptor = ctl->highSpeed ? descriptors->highSpeed
+                                        : descriptors->fullSpeed;
+            ReplyData(setup, reply, descriptor, TotalLength(descriptor));
+            break;
+
+        case USB_DESC_QUALIFIER:
+            if (descriptors->qualifier) {
+
+                ReplyData(setup, reply, descriptors->qualifier,
+                          descriptors->qualifier[0]);
+            }
+            break;
+
+        case USB_DESC_OTHER_SPEED:
+            // The configuration of the other speed, with its type changed
+            descriptor = ctl->highSpeed ? descriptors->fullSpeed
+                                        : descriptors->highSpeed;
+            if (descriptors->qualifier && descriptor) {
+
+                size = TotalLength(descriptor);
+                if (size <= USBCTL_BUFFER_SIZE) {
+
+                    for (i = 0; i < size; i++) {
+
+                        ctl->buffer[i] = descriptor[i];
+                    }
+                    ctl->buffer[1] = USB_DESC_OTHER_SPEED;
+                    ReplyData(setup, reply, ctl->buffer, size);
+                }
+            }
+            break;
+
+        case USB_DESC_STRING:
+            if (index < descriptors->numStrings) {
+
+                descriptor = descriptors->strings[index];
+                ReplyData(setup, reply, descriptor, descriptor[0]);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// GET_STATUS.
+//------------------------------------------------------------------------------
+static void GetStatus(UsbCtl *ctl, const UsbSetup *setup, UsbReply *reply)
+{
+    const unsigned char *configuration;
+
+    ctl->buffer[0] = 0;
+    ctl->buffer[1] = 0;
+
+    switch (setup->bmRequestType & USB_RECIPIENT_MASK) {
+
+        case USB_RECIPIENT_DEVICE:
+            configuration = ctl->highSpeed ? ctl->descriptors->highSpeed
+                                           : ctl->descriptors->fullSpeed;
+            if (configuration[7] & CONFIG_SELF_POWERED) {
+
+                ctl->buffer[0] |= 1;
+            }
+            if (ctl->remoteWakeup) {
+
+                ctl->buffer[0] |= 2;
+            }
+            break;
+
+        case USB_RECIPIENT_INTERFACE:
+            if (ctl->configuration == 0) {
+
+                return;
+            }
+            break;
+
+        case USB_RECIPIENT_ENDPOINT:
+            if (ctl->halted & HALT_BIT(setup->wIndex)) {
+
+                ctl->buffer[0] = 1;
+            }
+            break;
+
+        default:
+            return;
+    }
+    ReplyData(setup, reply, ctl->buffer, 2);
+}
+
+//------------------------------------------------------------------------------
+/// CLEAR_FEATURE and SET_FEATURE.
+//------------------------------------------------------------------------------
+static void SetFeature(UsbCtl *ctl, const UsbSetup *setup, UsbReply *reply,
+                       unsigned char set)
+{
+    unsigned char recipient = setup->bmRequestType & USB_RECIPIENT_MASK;
+
+    if ((recipient == USB_RECIPIENT_DEVICE)
+        && (setup->wValue == USB_FEATURE_REMOTE_WAKEUP)) {
+
+        ctl->remoteWakeup = set;
+        reply->action = USBCTL_STATUS;
+    }
+    else if ((recipient == USB_RECIPIENT_ENDPOINT)
+             && (setup->wValue == USB_FEATURE_ENDPOINT_HALT)) {
+
+        // The control endpoint is never halted
+        reply->action = USBCTL_STATUS;
+        if (setup->wIndex & 0xF) {
+
+            if (set) {
+
+                ctl->halted |= HALT_BIT(setup->wIndex);
+                reply->event = USBCTL_EVENT_HALT;
+            }
+            else if ((ctl->wedged & HALT_BIT(setup->wIndex)) == 0) {
+
+                ctl->halted &= ~HALT_BIT(setup->wIndex);
+                reply->event = USBCTL_EVENT_UNHALT;
+            }
+            reply->value = setup->wIndex & 0xFF;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Standard requests.
+//------------------------------------------------------------------------------
+static void StandardRequest(UsbCtl *ctl, const UsbSetup *setup,
+                            UsbReply *reply)
+{
+    switch (setup->bRequest) {
+
+        case USB_GET_DESCRIPTOR:
+            GetDescriptor(ctl, setup, reply);
+            break;
+
+        case USB_GET_STATUS:
+            GetStatus(ctl, setup, reply);
+            break;
+
+        case USB_CLEAR_FEATURE:
+            SetFeature(ctl, setup, reply, 0);
+            break;
+
+        case USB_SET_FEATURE:
+            SetFeature(ctl, setup, reply, 1);
+            break;
+
+        case USB_SET_ADDRESS:
+            // Takes effect after the status stage, still sent at address 0
+            ctl->address = setup->wValue & 0x7F;
+            reply->action = USBCTL_STATUS;
+            reply->event = USBCTL_EVENT_SET_ADDRESS;
+            reply->value = ctl->address;
+            break;
+
+        case USB_GET_CONFIGURATION:
+            ctl->buffer[0] = ctl->configuration;
+            ReplyData(setup, reply, ctl->buffer, 1);
+            break;
+
+        case USB_SET_CONFIGURATION:
+            if (setup->wValue <= 1) {
+
+                ctl->configuration = setup->wValue;
+                ctl->halted = 0;
+                ctl->wedged = 0;
+                reply->action = USBCTL_STATUS;
+                reply->event = USBCTL_EVENT_CONFIGURE;
+                reply->value = setup->wValue;
+            }
+            break;
+
+        case USB_GET_INTERFACE:
+            // Every interface has a single alternate setting
+            if (ctl->configuration) {
+
+                ctl->buffer[0] = 0;
+                ReplyData(setup, reply, ctl->buffer, 1);
+            }
+            break;
+
+        case USB_SET_INTERFACE:
+            if (ctl->configuration && (setup->wValue == 0)) {
+
+                reply->action = USBCTL_STATUS;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Sets up the control state of a device.
+/// \param ctl  Control state.
+/// \param descriptors  Descriptor set.
+/// \param classHandler  Handler of the class and vendor requests, or 0.
+//------------------------------------------------------------------------------
+void USBCTL_Initialize(UsbCtl *ctl,
+                       const UsbDescriptors *descriptors,
+                       UsbClassHandler classHandler)
+{
+    ctl->descriptors = descriptors;
+    ctl->classHandler = classHandler;
+    USBCTL_Reset(ctl, 0);
+}
+
+//------------------------------------------------------------------------------
+/// Returns to the default state after a bus reset.
+/// \param highSpeed  1 if the reset ended in high speed.
+//------------------------------------------------------------------------------
+void USBCTL_Reset(UsbCtl *ctl, unsigned char highSpeed)
+{
+    ctl->highSpeed = highSpeed;
+    ctl->address = 0;
+    ctl->configuration = 0;
+    ctl->remoteWakeup = 0;
+    ctl->halted = 0;
+    ctl->wedged = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Records a halt decided by the device (a class protocol error), so that
+/// GET_STATUS reports it until the host clears it.
+/// \param ctl  Control state.
+/// \param address  Endpoint address: number, plus USB_DIR_IN for IN.
+/// \param halted  1 to set the halt, 0 to clear it.
+//------------------------------------------------------------------------------
+void USBCTL_SetHalt(UsbCtl *ctl, unsigned char address, unsigned char halted)
+{
+    if ((address & 0xF) == 0) {
+
+        return;
+    }
+    if (halted) {
+
+        ctl->halted |= HALT_BIT(address);
+    }
+    else {
+
+        ctl->halted &= ~HALT_BIT(address);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Wedges a halted endpoint: CLEAR_FEATURE(ENDPOINT_HALT) then succeeds but
+/// leaves the halt in place, as the class protocol requires until its own
+/// reset (Bulk-Only Transport 6.6.1). Wedging also sets the halt; releasing
+/// the wedge keeps it, for the host to clear.
+/// \param ctl  Control state.
+/// \param address  Endpoint address: number, plus USB_DIR_IN for IN.
+/// \param wedged  1 to wedge the endpoint, 0 to release it.
+//------------------------------------------------------------------------------
+void USBCTL_SetWedge(UsbCtl *ctl, unsigned char address, unsigned char wedged)
+{
+    if ((address & 0xF) == 0) {
+
+        return;
+    }
+    if (wedged) {
+
+        ctl->halted |= HALT_BIT(address);
+        ctl->wedged |= HALT_BIT(address);
+    }
+    else {
+
+        ctl->wedged &= ~HALT_BIT(address);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Decodes the 8 bytes of a SETUP packet (little-endian fields).
+//------------------------------------------------------------------------------
+void USBCTL_ParseSetup(const unsigned char *packet, UsbSetup *setup)
+{
+    setup->bmRequestType = packet[0];
+    setup->bRequest = packet[1];
+    setup->wValue = packet[2] | (packet[3] << 8);
+    setup->wIndex = packet[4] | (packet[5] << 8);
+    setup->wLength = packet[6] | (packet[7] << 8);
+}
+
+//------------------------------------------------------------------------------
+/// Handles a SETUP packet. Unknown or invalid requests are stalled.
+/// \param ctl  Control state.
+/// \param setup  Decoded SETUP packet.
+/// \param reply  Receives the reply.
+//------------------------------------------------------------------------------
+void USBCTL_Request(UsbCtl *ctl, const UsbSetup *setup, UsbReply *reply)
+{
+    reply->action = USBCTL_STALL;
+    reply->event = USBCTL_EVENT_NONE;
+    reply->value = 0;
+    reply->data = 0;
+    reply->size = 0;
+    reply->complete = 0;
+
+    if ((setup->bmRequestType & USB_TYPE_MASK) == USB_TYPE_STANDARD) {
+
+        StandardRequest(ctl, setup, reply);
+    }
+    else if (ctl->classHandler) {
+
+        ctl->classHandler(setup, reply);
+    }
+
+    // A data stage must match the direction of the request
+    if ((reply->action == USBCTL_DATA_IN)
+        && !(setup->bmRequestType & USB_DIR_IN)) {
+
+        reply->action = USBCTL_STALL;
+    }
+    if ((reply->action == USBCTL_DATA_OUT)
+        && ((setup->bmRequestType & USB_DIR_IN)
+            || (reply->size != setup->wLength))) {
+
+        reply->action = USBCTL_STALL;
+    }
+    if (reply->action == USBCTL_STALL) {
+
+        reply->event = USBCTL_EVENT_NONE;
+    }
+}
@@ -0,0 +1,167 @@
+/* ----------------------------------------------------------------------------
+ *         USB control requests
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Decodes the SETUP packets received on endpoint 0 and answers the standard
+** requests from the descriptor tables; class and vendor requests are passed
+** to the class handler. The module does not touch the hardware: each
+** request yields a reply (data to send, buffer to fill, status or stall)
+** and side effects for the device driver to apply, such as a new address or
+** configuration. Captured SETUP packets can therefore be replayed through
+** USBCTL_Request() away from the target.
+*/
+
+#ifndef USBCTL_H
+#define USBCTL_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// bmRequestType fields.
+#define USB_DIR_IN                  0x80
+#define USB_TYPE_MASK               0x60
+#define USB_TYPE_STANDARD           0x00
+#define USB_TYPE_CLASS              0x20
+#define USB_TYPE_VENDOR             0x40
+#define USB_RECIPIENT_MASK          0x1F
+#define USB_RECIPIENT_DEVICE        0x00
+#define USB_RECIPIENT_INTERFACE     0x01
+#define USB_RECIPIENT_ENDPOINT      0x02
+
+/// Standard requests.
+#define USB_GET_STATUS              0
+#define USB_CLEAR_FEATURE           1
+#define USB_SET_FEATURE             3
+#define USB_SET_ADDRESS             5
+#define USB_GET_DESCRIPTOR          6
+#define USB_GET_CONFIGURATION       8
+#define USB_SET_CONFIGURATION       9
+#define USB_GET_INTERFACE           10
+#define USB_SET_INTERFACE           11
+
+/// Descriptor types.
+#define USB_DESC_DEVICE             1
+#define USB_DESC_CONFIGURATION      2
+#define USB_DESC_STRING             3
+#define USB_DESC_INTERFACE          4
+#define USB_DESC_ENDPOINT           5
+#define USB_DESC_QUALIFIER          6
+#define USB_DESC_OTHER_SPEED        7
+#define USB_DESC_ASSOCIATION        11
+
+/// Features.
+#define USB_FEATURE_ENDPOINT_HALT   0
+#define USB_FEATURE_REMOTE_WAKEUP   1
+
+/// Reply to a request.
+#define USBCTL_STALL                0
+/// Status stage only.
+#define USBCTL_STATUS               1
+/// IN data stage from data.
+#define USBCTL_DATA_IN              2
+/// OUT data stage into data, then complete().
+#define USBCTL_DATA_OUT             3
+
+/// Side effects, applied by the device driver once the status stage is over
+/// (value holds the address, configuration or endpoint address).
+#define USBCTL_EVENT_NONE           0
+#define USBCTL_EVENT_SET_ADDRESS    1
+#define USBCTL_EVENT_CONFIGURE      2
+#define USBCTL_EVENT_HALT           3
+#define USBCTL_EVENT_UNHALT         4
+
+/// Buffer for the replies built on the fly (status, other-speed descriptor).
+#ifndef USBCTL_BUFFER_SIZE
+#define USBCTL_BUFFER_SIZE          128
+#endif
+
+/// Number of endpoint addresses tracked for the halt feature (1 to 15).
+#define USBCTL_NUM_ENDPOINTS        16
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// SETUP packet.
+typedef struct {
+
+    unsigned char bmRequestType;
+    unsigned char bRequest;
+    unsigned short wValue;
+    unsigned short wIndex;
+    unsigned short wLength;
+
+} UsbSetup;
+
+/// Reply to a SETUP packet.
+typedef struct {
+
+    unsigned char action;
+    unsigned char event;
+    unsigned short value;
+    /// Data stage buffer and size (at most wLength).
+    void *data;
+    unsigned short size;
+    /// Called once the OUT data stage has been received.
+    void (*complete)(void);
+
+} UsbReply;
+
+/// Descriptor set of the device. Both speeds share one configuration value
+/// (1); each configuration descriptor starts with its wTotalLength.
+typedef struct {
+
+    const unsigned char *device;
+    const unsigned char *qualifier;
+    const unsigned char *fullSpeed;
+    const unsigned char *highSpeed;
+    const unsigned char * const *strings;
+    unsigned char numStrings;
+
+} UsbDescriptors;
+
+/// Class (and vendor) request handler: fills the reply, or leaves it at
+/// USBCTL_STALL.
+typedef void (*UsbClassHandler)(const UsbSetup *setup, UsbReply *reply);
+
+/// Control state of the device.
+typedef struct {
+
+    const UsbDescriptors *descriptors;
+    UsbClassHandler classHandler;
+    unsigned char highSpeed;
+    unsigned char address;
+    unsigned char configuration;
+    unsigned char remoteWakeup;
+    /// Halted endpoints, bit 2 * number + (IN ? 1 : 0).
+    unsigned int halted;
+    /// Halted endpoints that CLEAR_FEATURE leaves halted, same bits.
+    unsigned int wedged;
+    unsigned char buffer[USBCTL_BUFFER_SIZE];
+
+} UsbCtl;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void USBCTL_Initialize(UsbCtl *ctl,
+                              const UsbDescriptors *descriptors,
+                              UsbClassHandler classHandler);
+
+extern void USBCTL_Reset(UsbCtl *ctl, unsigned char highSpeed);
+
+extern void USBCTL_SetHalt(UsbCtl *ctl, unsigned char address,
+                           unsigned char halted);
+
+extern void USBCTL_SetWedge(UsbCtl *ctl, unsigned char address,
+                            unsigned char wedged);
+
+extern void USBCTL_ParseSetup(const unsigned char *packet, UsbSetup *setup);
+
+extern void USBCTL_Request(UsbCtl *ctl, const UsbSetup *setup, UsbReply *reply);
+
+#endif //#ifndef USBCTL_H
@@ -0,0 +1,929 @@
+/* ----------------------------------------------------------------------------
+ *         USB high-speed device driver
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "usbd.h"
+#include "evlog.h"
+#include "irq.h"
+#include "exceptions.h"
+#include "AT91SAM3U4.h"
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// UTMI PLL startup time, in units of 8 slow clock cycles.
+#define UPLL_COUNT              3
+
+/// Device interrupts always enabled.
+#define IEN_DEVICE              (AT91C_UDPHS_DET_SUSPD | AT91C_UDPHS_ENDRESET \
+                                 | AT91C_UDPHS_WAKE_UP | AT91C_UDPHS_ENDOFRSM \
+                                 | AT91C_UDPHS_EPT_INT_0)
+
+#define EPT_INT(number)         (AT91C_UDPHS_EPT_INT_0 << (number))
+#define DMA_INT(number)         (AT91C_UDPHS_DMA_INT_1 << ((number) - 1))
+
+#define EPT(number)             (&AT91C_BASE_UDPHS->UDPHS_EPT[number])
+
+/// FIFO window of an endpoint, accessed a byte at a time by the CPU.
+#define FIFO(number) \
+    ((volatile unsigned char *) AT91C_BASE_UDPHS_EPTFIFO + ((number) << 16))
+
+/// Control transfer states.
+#define EP0_IDLE                0
+#define EP0_DATA_IN             1
+#define EP0_DATA_OUT            2
+#define EP0_STATUS_IN           3
+#define EP0_STATUS_OUT          4
+
+//------------------------------------------------------------------------------
+//         Local types
+//------------------------------------------------------------------------------
+
+/// State of endpoints 1 to 6.
+typedef struct {
+
+    unsigned short maxPacket;
+    unsigned char in;
+    unsigned char banks;
+    unsigned char busy;
+    /// An IN transfer waits for a free bank to end with a zero-length packet.
+    unsigned char zlp;
+    /// The transfer runs a descriptor chain, never ended by a ZLP.
+    unsigned char chain;
+    unsigned char *buffer;
+    unsigned int remaining;
+    unsigned int transferred;
+    /// Size of the DMA buffer in progress.
+    unsigned int chunk;
+    UsbdCallback callback;
+    void *arg;
+
+} Endpoint;
+
+/// State of the control endpoint.
+typedef struct {
+
+    unsigned char state;
+    /// The IN data stage still has to end with a short packet.
+    unsigned char zlp;
+    unsigned char *data;
+    unsigned short remaining;
+    UsbReply reply;
+
+} ControlEndpoint;
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// DMA channels of endpoints 1 to 6 (UDPHS_DMA[0] of AT91S_UDPHS is unused).
+static const AT91PS_UDPHS_DMA dmaChannels[USBD_NUM_ENDPOINTS - 1] = {
+
+    AT91C_BASE_UDPHS_DMA_1, AT91C_BASE_UDPHS_DMA_2, AT91C_BASE_UDPHS_DMA_3,
+    AT91C_BASE_UDPHS_DMA_4, AT91C_BASE_UDPHS_DMA_5, AT91C_BASE_UDPHS_DMA_6
+};
+
+static Endpoint endpoints[USBD_NUM_ENDPOINTS];
+
+static ControlEndpoint ep0;
+
+static UsbCtl usbCtl;
+
+static UsbdConfigured configuredCallback;
+
+static void (*serviceHandler)(void);
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Ends the transfer of an endpoint and calls its callback.
+//------------------------------------------------------------------------------
+static void Complete(unsigned char number, unsigned char status)
+{
+    Endpoint *endpoint = &endpoints[number];
+    UsbdCallback callback = endpoint->callback;
+
+    endpoint->busy = 0;
+    endpoint->zlp = 0;
+    EPT(number)->UDPHS_EPTCTLDIS = AT91C_UDPHS_TX_COMPLT;
+    if (callback) {
+
+        callback(endpoint->arg, status, endpoint->transferred);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Programs the next DMA buffer of an endpoint. IN buffers validate their last
+/// packet, short or not; OUT buffers also end on a short packet.
+//------------------------------------------------------------------------------
+static void StartDma(unsigned char number)
+{
+    Endpoint *endpoint = &endpoints[number];
+    AT91PS_UDPHS_DMA dma = dmaChannels[number - 1];
+    unsigned int control;
+
+    endpoint->chunk = endpoint->remaining;
+    if (endpoint->chunk > USBD_MAX_DMA_BUFFER) {
+
+        endpoint->chunk = USBD_MAX_DMA_BUFFER;
+    }
+
+    if (endpoint->in) {
+
+        control = AT91C_UDPHS_END_B_EN;
+    }
+    else {
+
+        control = AT91C_UDPHS_END_TR_EN | AT91C_UDPHS_END_TR_IT;
+    }
+
+    dma->UDPHS_DMACONTROL = 0;
+    dma->UDPHS_DMASTATUS;
+    dma->UDPHS_DMANXTDSC = 0;
+    dma->UDPHS_DMAADDRESS = (unsigned int) endpoint->buffer;
+    dma->UDPHS_DMACONTROL = (endpoint->chunk << 16) | control
+                            | AT91C_UDPHS_END_BUFFIT | AT91C_UDPHS_CHANN_ENB;
+}
+
+//------------------------------------------------------------------------------
+/// Sends the zero-length packet that ends an IN transfer, as soon as a bank
+/// is free. Returns 1 if it has been sent.
+//------------------------------------------------------------------------------
+static unsigned char SendZlp(unsigned char number)
+{
+    AT91PS_UDPHS_EPT ept = EPT(number);
+    unsigned int busyBanks;
+
+    busyBanks = (ept->UDPHS_EPTSTA & AT91C_UDPHS_BUSY_BANK_STA) >> 18;
+    if (busyBanks >= endpoints[number].banks) {
+
+        // Retried on the next TX_COMPLT
+        ept->UDPHS_EPTCTLENB = AT91C_UDPHS_TX_COMPLT;
+        return 0;
+    }
+    ept->UDPHS_EPTSETSTA = AT91C_UDPHS_TX_PK_RDY;
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// DMA interrupt of endpoints 1 to 6: chains the next buffer or completes the
+/// transfer.
+//------------------------------------------------------------------------------
+static void DmaHandler(unsigned char number)
+{
+    Endpoint *endpoint = &endpoints[number];
+    unsigned int status = dmaChannels[number - 1]->UDPHS_DMASTATUS;
+    unsigned int moved;
+
+    if (!endpoint->busy || endpoint->zlp) {
+
+        return;
+    }
+
+    // BUFF_COUNT holds the bytes not moved, non-zero after a short packet
+    moved = endpoint->chunk - (status >> 16);
+    endpoint->buffer += moved;
+    endpoint->remaining -= moved;
+    endpoint->transferred += moved;
+
+    if ((status & AT91C_UDPHS_END_TR_ST) && !endpoint->in) {
+
+        Complete(number, USBD_STATUS_SUCCESS);
+    }
+    else if (endpoint->remaining) {
+
+        StartDma(number);
+    }
+    else if (endpoint->in && !endpoint->chain
+             && ((endpoint->transferred % endpoint->maxPacket) == 0)) {
+
+        // A transfer of whole packets is delimited by a zero-length packet
+        endpoint->zlp = 1;
+        if (SendZlp(number)) {
+
+            Complete(number, USBD_STATUS_SUCCESS);
+        }
+    }
+    else {
+
+        Complete(number, USBD_STATUS_SUCCESS);
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Endpoint interrupt of endpoints 1 to 6, only enabled while a zero-length
+/// packet waits for a free bank.
+//------------------------------------------------------------------------------
+static void EndpointHandler(unsigned char number)
+{
+    AT91PS_UDPHS_EPT ept = EPT(number);
+
+    if (ept->UDPHS_EPTSTA & AT91C_UDPHS_TX_COMPLT) {
+
+        ept->UDPHS_EPTCLRSTA = AT91C_UDPHS_TX_COMPLT;
+        if (endpoints[number].zlp && SendZlp(number)) {
+
+            Complete(number, USBD_STATUS_SUCCESS);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Aborts the transfer of an endpoint, if any.
+//------------------------------------------------------------------------------
+static void AbortTransfer(unsigned char number)
+{
+    Endpoint *endpoint = &endpoints[number];
+    AT91PS_UDPHS_DMA dma = dmaChannels[number - 1];
+    unsigned int status;
+
+    if (!endpoint->busy) {
+
+        return;
+    }
+
+    // Reading the status also clears a pending DMA interrupt
+    dma->UDPHS_DMACONTROL = 0;
+    status = dma->UDPHS_DMASTATUS;
+    if (endpoint->chain) {
+
+        // The position inside the chain is not tracked
+        endpoint->transferred = 0;
+    }
+    else if (!endpoint->zlp) {
+
+        endpoint->transferred += endpoint->chunk - (status >> 16);
+    }
+    Complete(number, USBD_STATUS_ABORTED);
+}
+
+//------------------------------------------------------------------------------
+/// Aborts the transfers and disables endpoints 1 to 6.
+//------------------------------------------------------------------------------
+static void ResetEndpoints(void)
+{
+    unsigned char number;
+
+    for (number = 1; number < USBD_NUM_ENDPOINTS; number++) {
+
+        AbortTransfer(number);
+        EPT(number)->UDPHS_EPTCTLDIS = AT91C_UDPHS_EPT_DISABL;
+        endpoints[number].maxPacket = 0;
+    }
+    AT91C_BASE_UDPHS->UDPHS_EPTRST = 0x7E;
+    AT91C_BASE_UDPHS->UDPHS_IEN = IEN_DEVICE;
+}
+
+//------------------------------------------------------------------------------
+/// Writes the next packet of the IN data stage.
+//------------------------------------------------------------------------------
+static void SendControlPacket(void)
+{
+    volatile unsigned char *fifo = FIFO(0);
+    unsigned short size = ep0.remaining;
+    unsigned short i;
+
+    if (size > USBD_EP0_SIZE) {
+
+        size = USBD_EP0_SIZE;
+    }
+    for (i = 0; i < size; i++) {
+
+        *fifo++ = *ep0.data++;
+    }
+    ep0.remaining -= size;
+    if (size < USBD_EP0_SIZE) {
+
+        ep0.zlp = 0;
+    }
+
+    EPT(0)->UDPHS_EPTSETSTA = AT91C_UDPHS_TX_PK_RDY;
+    EPT(0)->UDPHS_EPTCTLENB = AT91C_UDPHS_TX_COMPLT;
+}
+
+//------------------------------------------------------------------------------
+/// Starts the IN status stage.
+//------------------------------------------------------------------------------
+static void SendControlStatus(void)
+{
+    ep0.state = EP0_STATUS_IN;
+    EPT(0)->UDPHS_EPTSETSTA = AT91C_UDPHS_TX_PK_RDY;
+    EPT(0)->UDPHS_EPTCTLENB = AT91C_UDPHS_TX_COMPLT;
+}
+
+//------------------------------------------------------------------------------
+/// Applies the side effect of a request once its status stage is over.
+//------------------------------------------------------------------------------
+static void ApplyEvent(const UsbReply *reply)
+{
+    AT91PS_UDPHS udphs = AT91C_BASE_UDPHS;
+    unsigned char number = reply->value & 0xF;
+
+    switch (reply->event) {
+
+        case USBCTL_EVENT_SET_ADDRESS:
+            udphs->UDPHS_CTRL = (udphs->UDPHS_CTRL & ~AT91C_UDPHS_DEV_ADDR)
+                                | reply->value
+                                | (reply->value ? AT91C_UDPHS_FADDR_EN : 0);
+            break;
+
+        case USBCTL_EVENT_CONFIGURE:
+            ResetEndpoints();
+            if (configuredCallback) {
+
+                configuredCallback(reply->value);
+            }
+            break;
+
+        case USBCTL_EVENT_HALT:
+            if ((number < USBD_NUM_ENDPOINTS) && endpoints[number].maxPacket) {
+
+                EPT(number)->UDPHS_EPTSETSTA = AT91C_UDPHS_FRCESTALL;
+            }
+            break;
+
+        case USBCTL_EVENT_UNHALT:
+            if ((number < USBD_NUM_ENDPOINTS) && endpoints[number].maxPacket) {
+
+                EPT(number)->UDPHS_EPTCLRSTA = AT91C_UDPHS_FRCESTALL
+                                               | AT91C_UDPHS_TOGGLESQ;
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Decodes a SETUP packet and starts the data or status stage.
+//------------------------------------------------------------------------------
+static void HandleSetup(void)
+{
+    AT91PS_UDPHS_EPT ept = EPT(0);
+    volatile unsigned char *fifo = FIFO(0);
+    unsigned char packet[8];
+    UsbSetup setup;
+    unsigned char i;
+
+    for (i = 0; i < sizeof(packet); i++) {
+
+        packet[i] = *fifo++;
+    }
+    ept->UDPHS_EPTCLRSTA = AT91C_UDPHS_RX_SETUP;
+
+    // A SETUP packet cancels the control transfer in progress
+    ept->UDPHS_EPTCTLDIS = AT91C_UDPHS_TX_COMPLT;
+    ep0.state = EP0_IDLE;
+
+    USBCTL_ParseSetup(packet, &setup);
+    USBCTL_Request(&usbCtl, &setup, &ep0.reply);
+
+    switch (ep0.reply.action) {
+
+        case USBCTL_DATA_IN:
+            ep0.state = EP0_DATA_IN;
+            ep0.data = ep0.reply.data;
+            ep0.remaining = ep0.reply.size;
+            ep0.zlp = (ep0.reply.size < setup.wLength);
+            SendControlPacket();
+            break;
+
+        case USBCTL_DATA_OUT:
+            ep0.state = EP0_DATA_OUT;
+            ep0.data = ep0.reply.data;
+            ep0.remaining = ep0.reply.size;
+            break;
+
+        case USBCTL_STATUS:
+            SendControlStatus();
+            break;
+
+        default:
+            // Cleared by the hardware on the next SETUP packet
+            ept->UDPHS_EPTSETSTA = AT91C_UDPHS_FRCESTALL;
+            break;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Reads an OUT packet: data stage, or status stage of an IN transfer.
+//------------------------------------------------------------------------------
+static void HandleControlOut(void)
+{
+    AT91PS_UDPHS_EPT ept = EPT(0);
+    volatile unsigned char *fifo = FIFO(0);
+    unsigned short size = (ept->UDPHS_EPTSTA & AT91C_UDPHS_BYTE_COUNT) >> 20;
+    unsigned short i;
+
+    if (ep0.state != EP0_DATA_OUT) {
+
+        // Status stage of an IN transfer, or an unexpected packet
+        ept->UDPHS_EPTCLRSTA = AT91C_UDPHS_RX_BK_RDY;
+        ept->UDPHS_EPTCTLDIS = AT91C_UDPHS_TX_COMPLT;
+        ep0.state = EP0_IDLE;
+        return;
+    }
+
+    if (size > ep0.remaining) {
+
+        size = ep0.remaining;
+    }
+    for (i = 0; i < size; i++) {
+
+        *ep0.data++ = *fifo++;
+    }
+    ep0.remaining -= size;
+    ept->UDPHS_EPTCLRSTA = AT91C_UDPHS_RX_BK_RDY;
+
+    if ((ep0.remaining == 0) || (size < USBD_EP0_SIZE)) {
+
+        if (ep0.reply.complete) {
+
+            ep0.reply.complete();
+        }
+        SendControlStatus();
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Control endpoint interrupt.
+//------------------------------------------------------------------------------
+static void ControlHandler(void)
+{
+    AT91PS_UDPHS_EPT ept = EPT(0);
+    unsigned int status = ept->UDPHS_EPTSTA;
+
+    if (status & AT91C_UDPHS_RX_SETUP) {
+
+        HandleSetup();
+    }
+    else if ((status & AT91C_UDPHS_TX_COMPLT)
+             && (ept->UDPHS_EPTCTL & AT91C_UDPHS_TX_COMPLT)) {
+
+        ept->UDPHS_EPTCLRSTA = AT91C_UDPHS_TX_COMPLT;
+        if ((ep0.state == EP0_DATA_IN) && (ep0.remaining || ep0.zlp)) {
+
+            SendControlPacket();
+        }
+        else if (ep0.state == EP0_DATA_IN) {
+
+            ep0.state = EP0_STATUS_OUT;
+            ept->UDPHS_EPTCTLDIS = AT91C_UDPHS_TX_COMPLT;
+        }
+        else {
+
+            ept->UDPHS_EPTCTLDIS = AT91C_UDPHS_TX_COMPLT;
+            if (ep0.state == EP0_STATUS_IN) {
+
+                ApplyEvent(&ep0.reply);
+            }
+            ep0.state = EP0_IDLE;
+        }
+    }
+    else if (status & AT91C_UDPHS_RX_BK_RDY) {
+
+        HandleControlOut();
+    }
+}
+
+//------------------------------------------------------------------------------
+/// End of bus reset: back to the default state, at the negotiated speed.
+//------------------------------------------------------------------------------
+static void BusReset(void)
+{
+    AT91PS_UDPHS udphs = AT91C_BASE_UDPHS;
+    AT91PS_UDPHS_EPT ept = EPT(0);
+    unsigned char wasConfigured = usbCtl.configuration;
+
+    ResetEndpoints();
+    udphs->UDPHS_CTRL &= ~(AT91C_UDPHS_DEV_ADDR | AT91C_UDPHS_FADDR_EN);
+    USBCTL_Reset(&usbCtl, udphs->UDPHS_INTSTA & AT91C_UDPHS_SPEED);
+    EVLOG_Write(EVLOG_ID_USB_RESET, usbCtl.highSpeed);
+
+    udphs->UDPHS_EPTRST = 1;
+    ept->UDPHS_EPTCFG = AT91C_UDPHS_EPT_SIZE_64 | AT91C_UDPHS_EPT_TYPE_CTL_EPT
+                        | AT91C_UDPHS_BK_NUMBER_1;
+    ept->UDPHS_EPTCTLENB = AT91C_UDPHS_EPT_ENABL | AT91C_UDPHS_RX_SETUP
+                           | AT91C_UDPHS_RX_BK_RDY;
+    ep0.state = EP0_IDLE;
+
+    if (wasConfigured && configuredCallback) {
+
+        configuredCallback(0);
+    }
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Starts the UTMI PLL and the controller, detached from the bus.
+/// \param descriptors  Descriptor set of the device.
+/// \param classHandler  Handler of the class requests, or 0.
+/// \param configured  Called when the configuration changes, or 0.
+//------------------------------------------------------------------------------
+void USBD_Initialize(const UsbDescriptors *descriptors,
+                     UsbClassHandler classHandler,
+                     UsbdConfigured configured)
+{
+    AT91PS_UDPHS udphs = AT91C_BASE_UDPHS;
+
+    USBCTL_Initialize(&usbCtl, descriptors, classHandler);
+    configuredCallback = configured;
+
+    AT91C_BASE_PMC->PMC_UCKR = AT91C_CKGR_UPLLEN | (UPLL_COUNT << 20);
+    while (!(AT91C_BASE_PMC->PMC_SR & AT91C_PMC_LOCKU));
+    AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_UDPHS;
+
+    udphs->UDPHS_CTRL = AT91C_UDPHS_DETACH | AT91C_UDPHS_PULLD_DIS;
+    udphs->UDPHS_CTRL |= AT91C_UDPHS_EN_UDPHS;
+    udphs->UDPHS_IEN = IEN_DEVICE;
+    udphs->UDPHS_CLRINT = 0xFE;
+
+    IRQ_Enable(AT91C_ID_UDPHS);
+}
+
+//------------------------------------------------------------------------------
+/// Connects the pull-up: the host enumerates the device.
+//------------------------------------------------------------------------------
+void USBD_Connect(void)
+{
+    AT91C_BASE_UDPHS->UDPHS_CTRL &= ~(AT91C_UDPHS_DETACH | AT91C_UDPHS_PULLD_DIS);
+}
+
+//------------------------------------------------------------------------------
+/// Disconnects from the bus; pending transfers are aborted.
+//------------------------------------------------------------------------------
+void USBD_Disconnect(void)
+{
+    IrqState state = IRQ_EnterCritical();
+
+    AT91C_BASE_UDPHS->UDPHS_CTRL |= AT91C_UDPHS_DETACH | AT91C_UDPHS_PULLD_DIS;
+    ResetEndpoints();
+    USBCTL_Reset(&usbCtl, 0);
+    IRQ_ExitCritical(state);
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the last bus reset ended in high speed.
+//------------------------------------------------------------------------------
+unsigned char USBD_IsHighSpeed(void)
+{
+    return usbCtl.highSpeed;
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if the host has set a configuration.
+//------------------------------------------------------------------------------
+unsigned char USBD_IsConfigured(void)
+{
+    return usbCtl.configuration != 0;
+}
+
+//------------------------------------------------------------------------------
+/// Sets up one of endpoints 1 to 6, typically from the configured callback.
+/// The packets are validated by the hardware and moved by the DMA channel of
+/// the endpoint.
+/// Returns 1 on success; 0 if the parameters are invalid or the endpoint does
+/// not fit in the DPRAM.
+/// \param address  Endpoint address: number, plus USB_DIR_IN for IN.
+/// \param type  USBD_BULK, USBD_INTERRUPT or USBD_ISOCHRONOUS.
+/// \param maxPacket  Packet size, a power of 2 from 8 to 1024.
+/// \param banks  Number of banks (1 to 3); 2 or more for full throughput.
+//------------------------------------------------------------------------------
+unsigned char USBD_ConfigureEndpoint(unsigned char address,
+                                     unsigned char type,
+                                     unsigned short maxPacket,
+                                     unsigned char banks)
+{
+    unsigned char number = address & 0xF;
+    AT91PS_UDPHS_EPT ept;
+    unsigned int size;
+    unsigned int cfg;
+    IrqState state;
+
+    if ((number == 0) || (number >= USBD_NUM_ENDPOINTS)
+        || (type < USBD_ISOCHRONOUS) || (type > USBD_INTERRUPT)
+        || (banks == 0) || (banks > 3)
+        || (maxPacket < 8) || (maxPacket > 1024)
+        || (maxPacket & (maxPacket - 1))) {
+
+        return 0;
+    }
+
+    // Size code: 8 bytes << code
+    for (size = 0; (8u << size) < maxPacket; size++);
+
+    cfg = size | (type << 4) | (banks << 6);
+    if (address & USB_DIR_IN) {
+
+        cfg |= AT91C_UDPHS_EPT_DIR_IN;
+    }
+
+    state = IRQ_EnterCritical();
+    AbortTransfer(number);
+    ept = EPT(number);
+    ept->UDPHS_EPTCTLDIS = AT91C_UDPHS_EPT_DISABL;
+    AT91C_BASE_UDPHS->UDPHS_EPTRST = 1 << number;
+    ept->UDPHS_EPTCFG = cfg;
+    if (!(ept->UDPHS_EPTCFG & AT91C_UDPHS_EPT_MAPD)) {
+
+        IRQ_ExitCritical(state);
+        return 0;
+    }
+
+    endpoints[number].maxPacket = maxPacket;
+    endpoints[number].in = (address & USB_DIR_IN) != 0;
+    endpoints[number].banks = banks;
+    ept->UDPHS_EPTCLRSTA = AT91C_UDPHS_TOGGLESQ | AT91C_UDPHS_FRCESTALL;
+    ept->UDPHS_EPTCTLENB = AT91C_UDPHS_EPT_ENABL | AT91C_UDPHS_AUTO_VALID;
+    AT91C_BASE_UDPHS->UDPHS_IEN |= DMA_INT(number) | EPT_INT(number);
+    IRQ_ExitCritical(state);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Starts a transfer on one of endpoints 1 to 6. IN transfers whose size is a
+/// multiple of the packet size (0 included) end with a zero-length packet. OUT
+/// transfers end when size bytes or a short packet have been received; size
+/// should be a multiple of the packet size, since a packet that does not fit
+/// in the buffer is truncated.
+/// Returns 1 if the transfer has started; 0 if the endpoint is not configured
+/// or busy.
+/// \param number  Endpoint number.
+/// \param buffer  Data buffer, which must stay valid until the callback.
+/// \param size  Number of bytes.
+/// \param callback  Called at the end of the transfer, or 0.
+/// \param arg  Argument of the callback.
+//------------------------------------------------------------------------------
+unsigned char USBD_Transfer(unsigned char number,
+                            void *buffer,
+                            unsigned int size,
+                            UsbdCallback callback,
+                            void *arg)
+{
+    Endpoint *endpoint;
+    IrqState state;
+
+    if ((number == 0) || (number >= USBD_NUM_ENDPOINTS)) {
+
+        return 0;
+    }
+    endpoint = &endpoints[number];
+
+    state = IRQ_EnterCritical();
+    if ((endpoint->maxPacket == 0) || endpoint->busy
+        || ((size == 0) && !endpoint->in)) {
+
+        IRQ_ExitCritical(state);
+        return 0;
+    }
+
+    endpoint->busy = 1;
+    endpoint->chain = 0;
+    endpoint->buffer = buffer;
+    endpoint->remaining = size;
+    endpoint->transferred = 0;
+    endpoint->callback = callback;
+    endpoint->arg = arg;
+
+    if (size) {
+
+        StartDma(number);
+    }
+    else {
+
+        endpoint->zlp = 1;
+        if (SendZlp(number)) {
+
+            Complete(number, USBD_STATUS_SUCCESS);
+        }
+    }
+    IRQ_ExitCritical(state);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Starts an IN transfer made of several buffers, linked in a chain of DMA
+/// descriptors: the DMA moves from one buffer to the next without CPU help,
+/// and a packet may span two buffers. The callback is called once, at the
+/// end of the last buffer. No zero-length packet is sent.
+/// Returns 1 if the transfer has started; 0 if the endpoint is not an IN
+/// endpoint, is busy, or a buffer size is invalid.
+/// \param number  Endpoint number.
+/// \param descriptors  Descriptors whose buffer and size are set, 16-byte
+///                     aligned and in the DMABUF block like the buffers.
+/// \param count  Number of descriptors.
+/// \param validate  If 1, a short packet left at the end of the last buffer
+///                  is sent; otherwise it waits for the next transfer.
+/// \param callback  Called at the end of the transfer, or 0.
+/// \param arg  Argument of the callback.
+//------------------------------------------------------------------------------
+unsigned char USBD_TransferChain(unsigned char number,
+                                 UsbdDmaDescriptor *descriptors,
+                                 unsigned int count,
+                                 unsigned char validate,
+                                 UsbdCallback callback,
+                                 void *arg)
+{
+    Endpoint *endpoint;
+    AT91PS_UDPHS_DMA dma;
+    unsigned int total = 0;
+    unsigned int i;
+    IrqState state;
+
+    if ((number == 0) || (number >= USBD_NUM_ENDPOINTS) || (count == 0)) {
+
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+
+        if ((descriptors[i].size == 0)
+            || (descriptors[i].size > USBD_MAX_DMA_BUFFER)) {
+
+            return 0;
+        }
+        total += descriptors[i].size;
+        descriptors[i].control = (descriptors[i].size << 16)
+                                 | AT91C_UDPHS_CHANN_ENB;
+        if (i < count - 1) {
+
+            descriptors[i].next = &descriptors[i + 1];
+            descriptors[i].control |= AT91C_UDPHS_LDNXT_DSC;
+        }
+        else {
+
+            descriptors[i].next = 0;
+            descriptors[i].control |= AT91C_UDPHS_END_BUFFIT
+                                      | (validate ? AT91C_UDPHS_END_B_EN : 0);
+        }
+    }
+
+    endpoint = &endpoints[number];
+    dma = dmaChannels[number - 1];
+
+    state = IRQ_EnterCritical();
+    if ((endpoint->maxPacket == 0) || !endpoint->in || endpoint->busy) {
+
+        IRQ_ExitCritical(state);
+        return 0;
+    }
+
+    // Only the last buffer raises an interrupt: the ones before count as done
+    endpoint->busy = 1;
+    endpoint->chain = 1;
+    endpoint->buffer = descriptors[count - 1].buffer;
+    endpoint->chunk = descriptors[count - 1].size;
+    endpoint->remaining = endpoint->chunk;
+    endpoint->transferred = total - endpoint->chunk;
+    endpoint->callback = callback;
+    endpoint->arg = arg;
+
+    dma->UDPHS_DMACONTROL = 0;
+    dma->UDPHS_DMASTATUS;
+    dma->UDPHS_DMANXTDSC = (unsigned int) descriptors;
+    dma->UDPHS_DMACONTROL = AT91C_UDPHS_LDNXT_DSC;
+    IRQ_ExitCritical(state);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Aborts the transfer of an endpoint. Its callback is called with
+/// USBD_STATUS_ABORTED and the number of bytes already moved.
+//------------------------------------------------------------------------------
+void USBD_Abort(unsigned char number)
+{
+    IrqState state;
+
+    if ((number == 0) || (number >= USBD_NUM_ENDPOINTS)) {
+
+        return;
+    }
+    state = IRQ_EnterCritical();
+    AbortTransfer(number);
+    IRQ_ExitCritical(state);
+}
+
+//------------------------------------------------------------------------------
+/// Returns 1 if a transfer is in progress on the endpoint.
+//------------------------------------------------------------------------------
+unsigned char USBD_IsBusy(unsigned char number)
+{
+    return (number < USBD_NUM_ENDPOINTS) && endpoints[number].busy;
+}
+
+//------------------------------------------------------------------------------
+/// Halts one of endpoints 1 to 6: the host gets a STALL until it clears the
+/// halt with CLEAR_FEATURE. A transfer started on the endpoint afterwards
+/// waits for the halt to be cleared.
+/// \param address  Endpoint address: number, plus USB_DIR_IN for IN.
+//------------------------------------------------------------------------------
+void USBD_Halt(unsigned char address)
+{
+    unsigned char number = address & 0xF;
+    IrqState state;
+
+    if ((number == 0) || (number >= USBD_NUM_ENDPOINTS)
+        || !endpoints[number].maxPacket) {
+
+        return;
+    }
+    state = IRQ_EnterCritical();
+    EPT(number)->UDPHS_EPTSETSTA = AT91C_UDPHS_FRCESTALL;
+    USBCTL_SetHalt(&usbCtl, address, 1);
+    IRQ_ExitCritical(state);
+}
+
+//------------------------------------------------------------------------------
+/// Wedges one of endpoints 1 to 6: halts it like USBD_Halt(), but the host
+/// cannot clear the halt with CLEAR_FEATURE until the wedge is released, for
+/// instance by the class reset. Releasing the wedge keeps the halt.
+/// \param address  Endpoint address: number, plus USB_DIR_IN for IN.
+/// \param wedged  1 to wedge the endpoint, 0 to release it.
+//------------------------------------------------------------------------------
+void USBD_Wedge(unsigned char address, unsigned char wedged)
+{
+    unsigned char number = address & 0xF;
+    IrqState state;
+
+    if ((number == 0) || (number >= USBD_NUM_ENDPOINTS)
+        || !endpoints[number].maxPacket) {
+
+        return;
+    }
+    state = IRQ_EnterCritical();
+    if (wedged) {
+
+        EPT(number)->UDPHS_EPTSETSTA = AT91C_UDPHS_FRCESTALL;
+    }
+    USBCTL_SetWedge(&usbCtl, address, wedged);
+    IRQ_ExitCritical(state);
+}
+
+//------------------------------------------------------------------------------
+/// Installs a function called at the end of every UDPHS interrupt, after the
+/// transfer callbacks. Setting the interrupt pending with IRQ_SetPending()
+/// runs it in the context of the driver, which lets producers of any
+/// priority hand work over to it without a critical section.
+//------------------------------------------------------------------------------
+void USBD_SetServiceHandler(void (*handler)(void))
+{
+    serviceHandler = handler;
+}
+
+//------------------------------------------------------------------------------
+/// UDPHS interrupt.
+//------------------------------------------------------------------------------
+void UDPD_IrqHandler(void)
+{
+    AT91PS_UDPHS udphs = AT91C_BASE_UDPHS;
+    unsigned int status = udphs->UDPHS_INTSTA & udphs->UDPHS_IEN;
+    unsigned char number;
+
+    if (status & AT91C_UDPHS_ENDRESET) {
+
+        udphs->UDPHS_CLRINT = AT91C_UDPHS_ENDRESET;
+        BusReset();
+        status = 0;
+    }
+    if (status & (AT91C_UDPHS_DET_SUSPD | AT91C_UDPHS_WAKE_UP
+                  | AT91C_UDPHS_ENDOFRSM)) {
+
+        // Suspend and resume only matter to bus-powered designs
+        udphs->UDPHS_CLRINT = status & (AT91C_UDPHS_DET_SUSPD
+                                        | AT91C_UDPHS_WAKE_UP
+                                        | AT91C_UDPHS_ENDOFRSM);
+    }
+    if (status & AT91C_UDPHS_EPT_INT_0) {
+
+        ControlHandler();
+    }
+    for (number = 1; number < USBD_NUM_ENDPOINTS; number++) {
+
+        if (status & DMA_INT(number)) {
+
+            DmaHandler(number);
+        }
+        if (status & EPT_INT(number)) {
+
+            EndpointHandler(number);
+        }
+    }
+    if (serviceHandler) {
+
+        serviceHandler();
+    }
+}
@@ -0,0 +1,125 @@
+/* ----------------------------------------------------------------------------
+ *         USB high-speed device driver
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Device driver for the UDPHS controller. Endpoint 0 is handled by the CPU
+** through its FIFO: SETUP packets are decoded by usbctl.c and the driver
+** runs the data and status stages, then applies the side effects (address,
+** configuration, halt). Endpoints 1 to 6 are moved by the UDPHS DMA channel
+** of the same number: a transfer spans as many packets as needed, with the
+** packets validated by the controller itself (AUTO_VALID), so the CPU only
+** sees one interrupt per 64 KB at most. Transfer buffers are read and
+** written by the DMA, so they belong in the DMABUF block (sections.h).
+**
+** The controller connects in high speed (480 Mbit/s) when the host allows it
+** and falls back to full speed otherwise; the class picks its endpoint sizes
+** from USBD_IsHighSpeed() when the configuration is set.
+*/
+
+#ifndef USBD_H
+#define USBD_H
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "usbctl.h"
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Number of endpoints, control endpoint included.
+#define USBD_NUM_ENDPOINTS      7
+
+/// Size of the control endpoint.
+#define USBD_EP0_SIZE           64
+
+/// Endpoint types.
+#define USBD_ISOCHRONOUS        1
+#define USBD_BULK               2
+#define USBD_INTERRUPT          3
+
+/// Largest buffer of a single DMA descriptor.
+#define USBD_MAX_DMA_BUFFER     0xFE00
+
+/// Transfer status.
+#define USBD_STATUS_SUCCESS     0
+/// Cancelled by a bus reset, a new configuration or USBD_Abort().
+#define USBD_STATUS_ABORTED     1
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Called from the UDPHS interrupt at the end of a transfer, with its status
+/// and the number of bytes moved.
+typedef void (*UsbdCallback)(void *arg,
+                             unsigned char status,
+                             unsigned int transferred);
+
+/// Linked DMA descriptor of an endpoint, 16-byte aligned. The caller sets
+/// buffer and size; USBD_TransferChain() sets the other fields.
+typedef struct _UsbdDmaDescriptor {
+
+    /// Read by the DMA: next descriptor, buffer address, control.
+    struct _UsbdDmaDescriptor *next;
+    void *buffer;
+    unsigned int control;
+    /// Size of the buffer (1 to USBD_MAX_DMA_BUFFER bytes).
+    unsigned int size;
+
+} UsbdDmaDescriptor;
+
+/// Called from the UDPHS interrupt when the host sets a configuration (0 when
+/// the device is deconfigured or reset), before any transfer is accepted on
+/// the endpoints of that configuration.
+typedef void (*UsbdConfigured)(unsigned char configuration);
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void USBD_Initialize(const UsbDescriptors *descriptors,
+                            UsbClassHandler classHandler,
+                            UsbdConfigured configured);
+
+extern void USBD_Connect(void);
+
+extern void USBD_Disconnect(void);
+
+extern unsigned char USBD_IsHighSpeed(void);
+
+extern unsigned char USBD_IsConfigured(void);
+
+extern unsigned char USBD_ConfigureEndpoint(unsigned char address,
+                                            unsigned char type,
+                                            unsigned short maxPacket,
+                                            unsigned char banks);
+
+extern unsigned char USBD_Transfer(unsigned char number,
+                                   void *buffer,
+                                   unsigned int size,
+                                   UsbdCallback callback,
+                                   void *arg);
+
+extern unsigned char USBD_TransferChain(unsigned char number,
+                                        UsbdDmaDescriptor *descriptors,
+                                        unsigned int count,
+                                        unsigned char validate,
+                                        UsbdCallback callback,
+                                        void *arg);
+
+extern void USBD_Abort(unsigned char number);
+
+extern unsigned char USBD_IsBusy(unsigned char number);
+
+extern void USBD_Halt(unsigned char address);
+
+extern void USBD_Wedge(unsigned char address, unsigned char wedged);
+
+extern void USBD_SetServiceHandler(void (*handler)(void));
+
+#endif //#ifndef USBD_H
@@ -0,0 +1,295 @@
+/* ----------------------------------------------------------------------------
+ *         USB vendor bulk stream
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "ustream.h"
+#include "usbd.h"
+#include "evlog.h"
+#include "fastmem.h"
+#include "irq.h"
+#include "sections.h"
+#include "AT91SAM3U4.h"
+
+#if (USTREAM_RING_SIZE & (USTREAM_RING_SIZE - 1)) \
+    || (USTREAM_RING_SIZE < 0x400) || (USTREAM_RING_SIZE > 0x8000)
+#error "USTREAM_RING_SIZE must be a power of 2 from 1 KB to 32 KB"
+#endif
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// Position in the ring of a stream offset.
+#define RING_INDEX(offset)      ((offset) & (USTREAM_RING_SIZE - 1))
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+DMABUF static __no_init unsigned char ring[USTREAM_RING_SIZE];
+
+/// A chain covers the end of the ring and its beginning at most.
+#pragma data_alignment = 16
+DMABUF static __no_init UsbdDmaDescriptor descriptors[2];
+
+/// Stream offsets of the end of the committed data (written by the producer)
+/// and of the end of the data sent (written by the UDPHS interrupt). Their
+/// difference is the fill level, modulo 2^32.
+static volatile unsigned int head;
+static volatile unsigned int tail;
+
+/// Size of the chain in progress.
+static unsigned int inFlight;
+
+static volatile unsigned char busy;
+
+static volatile unsigned char flushRequested;
+
+/// Packet size of the endpoint; 0 while not configured.
+static volatile unsigned short packetSize;
+
+static UstreamStats ustreamStats;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// End of a chain: its space goes back to the producers.
+//------------------------------------------------------------------------------
+static void ChainDone(void *arg, unsigned char status, unsigned int transferred)
+{
+    tail += inFlight;
+    if (status == USBD_STATUS_SUCCESS) {
+
+        ustreamStats.sent += inFlight;
+    }
+    else {
+
+        ustreamStats.discarded += inFlight;
+    }
+    busy = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Starts a chain over the committed data if the endpoint is idle. Runs at the
+/// end of every UDPHS interrupt.
+//------------------------------------------------------------------------------
+static void Service(void)
+{
+    unsigned int size;
+    unsigned int first;
+    unsigned int index;
+    unsigned int count;
+    unsigned char flush;
+
+    if (busy || (packetSize == 0)) {
+
+        return;
+    }
+
+    // Cleared first so that a flush requested from now on is not lost
+    flush = flushRequested;
+    flushRequested = 0;
+
+    size = head - tail;
+    if (size > USTREAM_CHAIN_SIZE) {
+
+        size = USTREAM_CHAIN_SIZE;
+        if (flush) {
+
+            flushRequested = 1;
+            flush = 0;
+        }
+    }
+    if (!flush) {
+
+        // Whole packets only: a short one would end the host read early
+        size -= (tail + size) % packetSize;
+    }
+    if (size == 0) {
+
+        return;
+    }
+
+    index = RING_INDEX(tail);
+    first = USTREAM_RING_SIZE - index;
+    descriptors[0].buffer = &ring[index];
+    if (size > first) {
+
+        descriptors[0].size = first;
+        descriptors[1].buffer = ring;
+        descriptors[1].size = size - first;
+        count = 2;
+    }
+    else {
+
+        descriptors[0].size = size;
+        count = 1;
+    }
+
+    inFlight = size;
+    busy = 1;
+    if (!USBD_TransferChain(USTREAM_EP, descriptors, count, flush,
+                            ChainDone, 0)) {
+
+        busy = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Hands the committed data over to the UDPHS interrupt.
+//------------------------------------------------------------------------------
+static void Kick(void)
+{
+    IRQ_SetPending(AT91C_ID_UDPHS);
+}
+
+//------------------------------------------------------------------------------
+/// Counts data refused for lack of space.
+//------------------------------------------------------------------------------
+static void Overflow(unsigned int size)
+{
+    ustreamStats.overflows++;
+    ustreamStats.dropped += size;
+    EVLOG_Write(EVLOG_ID_USTREAM_LOST, size);
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Hooks the stream into the UDPHS interrupt. USBD_Initialize() must have been
+/// called.
+//------------------------------------------------------------------------------
+void USTREAM_Initialize(void)
+{
+    head = 0;
+    tail = 0;
+    USBD_SetServiceHandler(Service);
+}
+
+//------------------------------------------------------------------------------
+/// Sets up the endpoint when the device is configured, from the configured
+/// callback of the class that owns the descriptors. The data not sent yet is
+/// discarded, so the host starts from fresh samples.
+/// \param maxPacket  Packet size for the bus speed; 0 when deconfigured.
+//------------------------------------------------------------------------------
+void USTREAM_Configure(unsigned short maxPacket)
+{
+    unsigned int committed = head;
+
+    packetSize = 0;
+    if (!busy) {
+
+        ustreamStats.discarded += committed - tail;
+        tail = committed;
+    }
+    if (maxPacket
+        && USBD_ConfigureEndpoint(USB_DIR_IN | USTREAM_EP, USBD_BULK,
+                                  maxPacket, 3)) {
+
+        packetSize = maxPacket;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Returns contiguous space at the head of the ring, to be filled and then
+/// committed. Sizes that divide USTREAM_RING_SIZE never straddle its end.
+/// Returns 0 if there is not enough contiguous space; the loss is counted.
+/// \param size  Number of bytes to reserve.
+//------------------------------------------------------------------------------
+unsigned char * USTREAM_Reserve(unsigned int size)
+{
+    unsigned int index = RING_INDEX(head);
+
+    if ((size > USTREAM_GetFree()) || (index + size > USTREAM_RING_SIZE)) {
+
+        Overflow(size);
+        return 0;
+    }
+    return &ring[index];
+}
+
+//------------------------------------------------------------------------------
+/// Publishes data written at the head of the ring.
+/// \param size  Number of bytes, at most the size reserved.
+//------------------------------------------------------------------------------
+void USTREAM_Commit(unsigned int size)
+{
+    unsigned int fill;
+
+    head += size;
+    ustreamStats.committed += size;
+    fill = head - tail;
+    if (fill > ustreamStats.maxFill) {
+
+        ustreamStats.maxFill = fill;
+    }
+    Kick();
+}
+
+//------------------------------------------------------------------------------
+/// Copies data into the ring and commits it, all or nothing. Not above
+/// IRQ_CRITICAL_LEVEL: FASTMEM_Copy() takes critical sections.
+/// Returns 1 on success; 0 if the ring has not enough space (the loss is
+/// counted).
+/// \param data  Data to send.
+/// \param size  Number of bytes.
+//------------------------------------------------------------------------------
+unsigned char USTREAM_Write(const void *data, unsigned int size)
+{
+    unsigned int index = RING_INDEX(head);
+    unsigned int first = USTREAM_RING_SIZE - index;
+
+    if (size > USTREAM_GetFree()) {
+
+        Overflow(size);
+        return 0;
+    }
+
+    if (size > first) {
+
+        FASTMEM_Copy(&ring[index], data, first);
+        FASTMEM_Copy(ring, (const unsigned char *) data + first, size - first);
+    }
+    else {
+
+        FASTMEM_Copy(&ring[index], data, size);
+    }
+    USTREAM_Commit(size);
+
+    return 1;
+}
+
+//------------------------------------------------------------------------------
+/// Sends the data committed so far even if it ends with a short packet, for
+/// instance at the end of an acquisition.
+//------------------------------------------------------------------------------
+void USTREAM_Flush(void)
+{
+    flushRequested = 1;
+    Kick();
+}
+
+//------------------------------------------------------------------------------
+/// Returns the free space of the ring, in bytes.
+//------------------------------------------------------------------------------
+unsigned int USTREAM_GetFree(void)
+{
+    return USTREAM_RING_SIZE - (head - tail);
+}
+
+//------------------------------------------------------------------------------
+/// Returns the stream counters.
+//------------------------------------------------------------------------------
+const UstreamStats * USTREAM_GetStats(void)
+{
+    return &ustreamStats;
+}
@@ -0,0 +1,100 @@
+/* ----------------------------------------------------------------------------
+ *         USB vendor bulk stream
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** One-way stream from the firmware to the host on a vendor-specific bulk IN
+** endpoint. Producers (ADC or SSC capture, typically from their interrupt)
+** put data into a ring in the DMABUF block, either by reserving space and
+** filling it in place, possibly with their own PDC or HDMA, or by copying
+** with USTREAM_Write(). The committed data is sent straight out of the ring:
+** the UDPHS DMA runs a descriptor chain over it, two buffers when it wraps
+** around, so the bytes are never copied again.
+**
+** Only whole packets are sent, unless USTREAM_Flush() asks for the remainder.
+** The ring is never overwritten: when it is full, because the host does not
+** read fast enough or is not connected, producers are refused and the loss is
+** counted (backpressure is visible through USTREAM_GetFree()).
+**
+** Producers only write the head of the ring and set the UDPHS interrupt
+** pending; all the DMA work runs in that interrupt. So USTREAM_Reserve() and
+** USTREAM_Commit() can be called from any context, including interrupts above
+** IRQ_CRITICAL_LEVEL, as long as a single producer uses them at a time.
+** USTREAM_Write() copies with FASTMEM_Copy(), which takes critical sections:
+** call it from a thread or from an interrupt of IRQ_CRITICAL_LEVEL or lower.
+**
+** Throughput: the UDPHS interrupts once per chain, and the next chain starts
+** from that interrupt. A chain is USTREAM_CHAIN_SIZE bytes, half the ring,
+** so with the defaults there is one interrupt per 4 KB (8 high-speed
+** packets), and the producers have the other 4 KB to fill while a chain is
+** out. The bus limit for bulk transfers is 13 packets per microframe, about
+** 53 MB/s; at 20 MB/s a chain lasts some 200 us, which bounds the latency of
+** the UDPHS interrupt. Faster or burstier producers need a larger ring.
+*/
+
+#ifndef USTREAM_H
+#define USTREAM_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Bulk IN endpoint, triple-banked.
+#define USTREAM_EP              5
+
+/// Size of the ring: a power of 2 from 1 KB to 32 KB. It lives in the DMABUF
+/// block, next to the DBGU ring, within the budget set in the .icf file.
+#ifndef USTREAM_RING_SIZE
+#define USTREAM_RING_SIZE       0x2000
+#endif
+
+/// Largest DMA chain. The space of a chain is given back to the producers
+/// when it ends, so the rest of the ring keeps them going meanwhile.
+#ifndef USTREAM_CHAIN_SIZE
+#define USTREAM_CHAIN_SIZE      (USTREAM_RING_SIZE / 2)
+#endif
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Stream counters, in bytes unless stated otherwise.
+typedef struct {
+
+    /// Committed by the producers.
+    unsigned int committed;
+    /// Sent to the host.
+    unsigned int sent;
+    /// Reservations and writes refused for lack of space (count).
+    unsigned int overflows;
+    /// Refused by USTREAM_Reserve() and USTREAM_Write().
+    unsigned int dropped;
+    /// Discarded on disconnection or reconfiguration.
+    unsigned int discarded;
+    /// Highest fill level of the ring.
+    unsigned int maxFill;
+
+} UstreamStats;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void USTREAM_Initialize(void);
+
+extern void USTREAM_Configure(unsigned short maxPacket);
+
+extern unsigned char * USTREAM_Reserve(unsigned int size);
+
+extern void USTREAM_Commit(unsigned int size);
+
+extern unsigned char USTREAM_Write(const void *data, unsigned int size);
+
+extern void USTREAM_Flush(void);
+
+extern unsigned int USTREAM_GetFree(void);
+
+extern const UstreamStats * USTREAM_GetStats(void);
+
+#endif //#ifndef USTREAM_H
@@ -0,0 +1,272 @@
+/* ----------------------------------------------------------------------------
+ *         Watchdog manager
+ * ----------------------------------------------------------------------------
+ */
+
+//------------------------------------------------------------------------------
+//         Headers
+//------------------------------------------------------------------------------
+
+#include "watchdog.h"
+#include "crc.h"
+#include "dbgu.h"
+#include "fault.h"
+#include "sections.h"
+#include "irq.h"
+#include "AT91SAM3U4.h"
+
+#include <intrinsics.h>
+
+//------------------------------------------------------------------------------
+//         Local definitions
+//------------------------------------------------------------------------------
+
+/// WDT counter clock: slow clock / 128.
+#define WDT_CLOCK_HZ            (32768 / 128)
+
+/// WDT_CR password.
+#define WDT_KEY                 (0xA5 << 24)
+
+//------------------------------------------------------------------------------
+//         Local variables
+//------------------------------------------------------------------------------
+
+/// Client table given to WDT_Initialize().
+static const WatchdogClient *clientTable;
+static unsigned int clientCount;
+
+/// Tick before which each client must check in again.
+static unsigned int deadlines[WDT_MAX_CLIENTS];
+
+/// Clients that have checked in since the last restart, bit i for client i.
+static volatile unsigned int checkedIn;
+
+/// All the clients, bit i for client i.
+static unsigned int allClients;
+
+/// Last tick seen by WDT_Supervise().
+static volatile unsigned int now;
+
+/// Tick of the last restart, and number of restarts.
+static unsigned int lastFeed;
+static unsigned int feeds;
+
+static NOINIT WatchdogRecord watchdogRecord;
+
+//------------------------------------------------------------------------------
+//         Local functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Returns the CRC of a record, its crc field excluded.
+//------------------------------------------------------------------------------
+static unsigned int RecordCrc(const WatchdogRecord *record)
+{
+    return CRC_Compute32(0, record,
+                         (unsigned int) &record->crc - (unsigned int) record);
+}
+
+//------------------------------------------------------------------------------
+/// Restarts the hardware watchdog.
+//------------------------------------------------------------------------------
+static void Feed(void)
+{
+    AT91C_BASE_WDTC->WDTC_WDCR = WDT_KEY | AT91C_WDTC_WDRSTT;
+    feeds++;
+}
+
+//------------------------------------------------------------------------------
+/// Saves the stall record and resets the core.
+//------------------------------------------------------------------------------
+static void Stall(unsigned int stalled, unsigned int tick)
+{
+    WatchdogRecord *record = &watchdogRecord;
+
+    record->magic = WDT_MAGIC;
+    record->stalled = stalled;
+    record->client = __CLZ(__RBIT(stalled));
+    record->tick = tick;
+    record->crc = RecordCrc(record);
+
+    FAULT_Reset();
+}
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+/// Registers the clients and starts the hardware watchdog with a timeout of
+/// WDT_TIMEOUT_MS. Every client gets a full budget from now on.
+/// \param clients  Client table (must stay valid).
+/// \param count  Number of entries, up to WDT_MAX_CLIENTS.
+//------------------------------------------------------------------------------
+void WDT_Initialize(const WatchdogClient *clients, unsigned int count)
+{
+    unsigned int wdv = WDT_TIMEOUT_MS * WDT_CLOCK_HZ / 1000;
+    unsigned int i;
+
+    if (count > WDT_MAX_CLIENTS) {
+
+        count = WDT_MAX_CLIENTS;
+    }
+    if (wdv > 0xFFF) {
+
+        wdv = 0xFFF;
+    }
+
+    clientTable = clients;
+    clientCount = count;
+    allClients = (count == WDT_MAX_CLIENTS) ? 0xFFFFFFFF : ((1u << count) - 1);
+    checkedIn = 0;
+    lastFeed = now;
+    for (i = 0; i < count; i++) {
+
+        deadlines[i] = now + clients[i].budget;
+    }
+
+    // Restart allowed at any time (WDD = WDV); halted while the core sleeps,
+    // so that tickless sleeps may be longer than the timeout
+    AT91C_BASE_WDTC->WDTC_WDMR = wdv
+                                 | (wdv << 16)
+                                 | AT91C_WDTC_WDRSTEN
+                                 | AT91C_WDTC_WDDBGHLT
+                                 | AT91C_WDTC_WDIDLEHLT;
+    Feed();
+}
+
+//------------------------------------------------------------------------------
+/// Stops the hardware watchdog, for applications that do not use it.
+//------------------------------------------------------------------------------
+void WDT_Disable(void)
+{
+    AT91C_BASE_WDTC->WDTC_WDMR = AT91C_WDTC_WDDIS;
+}
+
+//------------------------------------------------------------------------------
+/// Reports that a client is alive and gives it a new budget.
+/// \param index  Client index in the table given to WDT_Initialize().
+//------------------------------------------------------------------------------
+void WDT_CheckIn(unsigned int index)
+{
+    IrqState state;
+
+    if (index >= clientCount) {
+
+        return;
+    }
+
+    state = IRQ_EnterCritical();
+    deadlines[index] = now + clientTable[index].budget;
+    checkedIn |= 1u << index;
+    IRQ_ExitCritical(state);
+}
+
+//------------------------------------------------------------------------------
+/// Checks the client budgets and restarts the hardware watchdog when every
+/// client has checked in. Called by the scheduler on each tick (interrupt
+/// context); never returns if a client has stalled.
+/// \param tick  Current tick.
+//------------------------------------------------------------------------------
+void WDT_Supervise(unsigned int tick)
+{
+    unsigned int stalled = 0;
+    unsigned int i;
+
+    now = tick;
+    if (clientCount == 0) {
+
+        return;
+    }
+
+    for (i = 0; i < clientCount; i++) {
+
+        if ((int) (tick - deadlines[i]) > 0) {
+
+            stalled |= 1u << i;
+        }
+    }
+    if (stalled) {
+
+        Stall(stalled, tick);
+    }
+
+    if ((checkedIn == allClients) && ((tick - lastFeed) >= WDT_FEED_TICKS)) {
+
+        Feed();
+        lastFeed = tick;
+        checkedIn = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Returns the number of restarts of the hardware watchdog so far.
+//------------------------------------------------------------------------------
+unsigned int WDT_GetFeeds(void)
+{
+    return feeds;
+}
+
+//------------------------------------------------------------------------------
+/// Returns the stall record left by the last early warning, or 0 if there is
+/// none.
+//------------------------------------------------------------------------------
+const WatchdogRecord * WDT_GetRecord(void)
+{
+    if ((watchdogRecord.magic != WDT_MAGIC)
+        || (watchdogRecord.crc != RecordCrc(&watchdogRecord))) {
+
+        return 0;
+    }
+
+    return &watchdogRecord;
+}
+
+//------------------------------------------------------------------------------
+/// Discards the stall record.
+//------------------------------------------------------------------------------
+void WDT_Clear(void)
+{
+    watchdogRecord.magic = 0;
+}
+
+//------------------------------------------------------------------------------
+/// Prints the stall record on the DBGU, which must be configured, or a notice
+/// if the last reset came from a hardware watchdog underflow. The clients must
+/// have been registered (WDT_Initialize()) to be named; a client index out of
+/// their range is printed as a number.
+/// Returns 1 if something was printed; otherwise 0.
+//------------------------------------------------------------------------------
+unsigned char WDT_Report(void)
+{
+    const WatchdogRecord *record = WDT_GetRecord();
+
+    if (record) {
+
+        DBGU_PutString("\n-W- Watchdog: ");
+        if (record->client < clientCount) {
+
+            DBGU_PutString(clientTable[record->client].name);
+        }
+        else {
+
+            DBGU_PutString("client ");
+            DBGU_PutHex(record->client);
+        }
+        DBGU_PutString(" stalled, clients ");
+        DBGU_PutHex(record->stalled);
+        DBGU_PutString(" at tick ");
+        DBGU_PutHex(record->tick);
+        DBGU_PutString("\n");
+        return 1;
+    }
+
+    if ((AT91C_BASE_RSTC->RSTC_RSR & AT91C_RSTC_RSTTYP)
+        == AT91C_RSTC_RSTTYP_WATCHDOG) {
+
+        DBGU_PutString("\n-W- Watchdog reset\n");
+        return 1;
+    }
+
+    return 0;
+}
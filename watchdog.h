@@ -0,0 +1,100 @@
+/* ----------------------------------------------------------------------------
+ *         Watchdog manager
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+** Ties the single hardware watchdog (WDTC) to per-task check-ins. Each client
+** (typically a scheduler task) calls WDT_CheckIn() at least once per budget.
+** WDT_Supervise(), called on every scheduler tick, restarts the WDT only once
+** every client has checked in since the previous restart, and at most every
+** WDT_FEED_TICKS.
+**
+** A client missing its budget is the early warning: as the supervision runs
+** in the tick interrupt, it still runs while a task hangs. The stalled clients
+** are saved in a CRC-protected record in the NOINIT block and the core is
+** reset at once, well before the hardware watchdog would underflow.
+** WDT_Report() prints that record after the reset, once WDT_Initialize() has
+** registered the clients again. The hardware reset on
+** underflow stays as the last resort, when interrupts no longer run.
+**
+** The WDT mode register can only be written once after reset, so
+** WDT_Initialize() (or WDT_Disable()) must be called early and only once.
+*/
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+//------------------------------------------------------------------------------
+//         Definitions
+//------------------------------------------------------------------------------
+
+/// Hardware watchdog timeout in ms (at most 16000). Must exceed every client
+/// budget.
+#ifndef WDT_TIMEOUT_MS
+#define WDT_TIMEOUT_MS          4000
+#endif
+
+/// Minimum number of ticks between two restarts of the hardware watchdog.
+#ifndef WDT_FEED_TICKS
+#define WDT_FEED_TICKS          (WDT_TIMEOUT_MS / 4)
+#endif
+
+/// Maximum number of clients.
+#define WDT_MAX_CLIENTS         32
+
+/// WatchdogRecord.magic of a captured record.
+#define WDT_MAGIC               0x57D057A1
+
+//------------------------------------------------------------------------------
+//         Types
+//------------------------------------------------------------------------------
+
+/// Static description of a client.
+typedef struct {
+
+    /// Name shown in the stall report.
+    const char *name;
+    /// Maximum ticks between two check-ins. For a scheduler task, at least
+    /// its period plus its deadline.
+    unsigned int budget;
+
+} WatchdogClient;
+
+/// Stall record, kept across the reset.
+typedef struct {
+
+    unsigned int magic;
+    /// Clients that missed their budget, bit i for client i.
+    unsigned int stalled;
+    /// Index of the first stalled client. WDT_Report() looks its name up in
+    /// the table registered after the reset: no pointer survives the reset.
+    unsigned int client;
+    /// Tick at which the stall was detected.
+    unsigned int tick;
+    /// CRC-32 of the fields above.
+    unsigned int crc;
+
+} WatchdogRecord;
+
+//------------------------------------------------------------------------------
+//         Exported functions
+//------------------------------------------------------------------------------
+
+extern void WDT_Initialize(const WatchdogClient *clients, unsigned int count);
+
+extern void WDT_Disable(void);
+
+extern void WDT_CheckIn(unsigned int index);
+
+extern void WDT_Supervise(unsigned int tick);
+
+extern unsigned int WDT_GetFeeds(void);
+
+extern const WatchdogRecord * WDT_GetRecord(void);
+
+extern void WDT_Clear(void);
+
+extern unsigned char WDT_Report(void);
+
+#endif //#ifndef WATCHDOG_H